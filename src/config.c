@@ -15,20 +15,42 @@
 #define DEFAULT_LEFT        "left"
 #define DEFAULT_RIGHT       "right"
 #define DEFAULT_THROTTLE    "space"
+#define DEFAULT_SAVE_STATE  "f5"
+#define DEFAULT_LOAD_STATE  "f9"
+#define DEFAULT_REWIND      "backspace"
 #define DEFAULT_SYSTEM      "auto"
 #define DEFAULT_PREFERENCE  "cgb"
 #define DEFAULT_BORDER      "yes"
 #define DEFAULT_SCALING     "2"
 #define DEFAULT_PALETTE     "0"
 #define DEFAULT_SPEED       "100"
+#define DEFAULT_PACING      "video"
+#define DEFAULT_INPUT_POLL  "frame"
+#define DEFAULT_RUN_AHEAD   "0"
+#define DEFAULT_DETERMINISTIC "no"
+#define DEFAULT_REWIND_BUFFER "32"
+#define DEFAULT_REWIND_INTERVAL "10"
+#define DEFAULT_LINK        "none"
+#define DEFAULT_LINK_SOCKET "/tmp/tinygb-link.sock"
+#define DEFAULT_LINK_WINDOW "4096"
+#define DEFAULT_LINK_ROM    ""
+#define DEFAULT_BOOT_CACHE  "no"
+#define DEFAULT_BOOT_MARK   "f6"
 
 config_file_t config_file;
 
-int throttle_lo, throttle_hi;
 int target_speed;
-int config_system;
-int config_preference;
-int config_border;
+__thread int config_system;
+__thread int config_preference;
+__thread int config_border;
+int config_pacing;
+__thread int config_input_poll;
+__thread int config_run_ahead;
+__thread int config_deterministic;
+__thread int config_rewind_buffer, config_rewind_interval;
+int config_link, config_link_window;
+char *config_link_socket, *config_link_rom;
+int config_boot_cache;
 
 static FILE *file;
 
@@ -46,6 +68,9 @@ static void load_defaults() {
     config_file.right = DEFAULT_RIGHT;
 
     config_file.throttle = DEFAULT_THROTTLE;
+    config_file.save_state = DEFAULT_SAVE_STATE;
+    config_file.load_state = DEFAULT_LOAD_STATE;
+    config_file.rewind = DEFAULT_REWIND;
 
     config_file.system = DEFAULT_SYSTEM;
     config_file.preference = DEFAULT_PREFERENCE;
@@ -53,11 +78,21 @@ static void load_defaults() {
     config_file.scaling = DEFAULT_SCALING;
     config_file.palette = DEFAULT_PALETTE;
     config_file.speed = DEFAULT_SPEED;
+    config_file.pacing = DEFAULT_PACING;
+    config_file.input_poll = DEFAULT_INPUT_POLL;
+    config_file.run_ahead = DEFAULT_RUN_AHEAD;
+    config_file.deterministic = DEFAULT_DETERMINISTIC;
+    config_file.rewind_buffer = DEFAULT_REWIND_BUFFER;
+    config_file.rewind_interval = DEFAULT_REWIND_INTERVAL;
+    config_file.link = DEFAULT_LINK;
+    config_file.link_socket = DEFAULT_LINK_SOCKET;
+    config_file.link_window = DEFAULT_LINK_WINDOW;
+    config_file.link_rom = DEFAULT_LINK_ROM;
+    config_file.boot_cache = DEFAULT_BOOT_CACHE;
+    config_file.boot_mark = DEFAULT_BOOT_MARK;
 
     scaling = 2;
     monochrome_palette = 0;
-    throttle_lo = 98;
-    throttle_hi = 102;
 }
 
 static void lowercase(char *str) {
@@ -78,7 +113,8 @@ char *get_property(char *property) {
     while(fgets(line, 199, file)) {
         lowercase(line);
 
-        if(!memcmp(line, property, len)) {
+        // the name has to be followed by '=' so that e.g. "speed" doesn't match "speedup"
+        if(!memcmp(line, property, len) && (line[len] == '=' || line[len] == ' ')) {
             // found property
             int i = len;
             while(line[i] != '=' && line[i] != '\n' && line[i] != '\r') i++;
@@ -131,12 +167,27 @@ void open_config() {
         config_file.left = get_property("left");
         config_file.right = get_property("right");
         config_file.throttle = get_property("throttle");
+        config_file.save_state = get_property("save_state");
+        config_file.load_state = get_property("load_state");
+        config_file.rewind = get_property("rewind");
         config_file.system = get_property("system");
         config_file.preference = get_property("preference");
         config_file.border = get_property("border");
         config_file.scaling = get_property("scaling");
         config_file.palette = get_property("palette");
         config_file.speed = get_property("speed");
+        config_file.pacing = get_property("pacing");
+        config_file.input_poll = get_property("input_poll");
+        config_file.run_ahead = get_property("run_ahead");
+        config_file.deterministic = get_property("deterministic");
+        config_file.rewind_buffer = get_property("rewind_buffer");
+        config_file.rewind_interval = get_property("rewind_interval");
+        config_file.link = get_property("link");
+        config_file.link_socket = get_property("link_socket");
+        config_file.link_window = get_property("link_window");
+        config_file.link_rom = get_property("link_rom");
+        config_file.boot_cache = get_property("boot_cache");
+        config_file.boot_mark = get_property("boot_mark");
 
         fclose(file);
     }
@@ -155,6 +206,49 @@ void open_config() {
     else if(!strcmp(config_file.border, "no")) config_border = 0;
     else config_border = 1;     // default
 
+    if(!strcmp(config_file.deterministic, "yes")) config_deterministic = 1;
+    else config_deterministic = 0;  // default
+
+    if(!strcmp(config_file.pacing, "video")) config_pacing = PACING_VIDEO;
+    else if(!strcmp(config_file.pacing, "audio")) config_pacing = PACING_AUDIO;
+    else config_pacing = PACING_VIDEO;  // default
+
+    if(!strcmp(config_file.input_poll, "vblank")) config_input_poll = POLL_VBLANK;
+    else if(!strcmp(config_file.input_poll, "scanline")) config_input_poll = POLL_SCANLINE;
+    else config_input_poll = POLL_FRAME;    // default
+
+    config_run_ahead = atoi(config_file.run_ahead);
+    if(config_run_ahead < 0 || config_run_ahead > 3) {
+        write_log("[config] run-ahead must be between 0-3 frames, disabling it\n");
+        config_run_ahead = 0;
+    }
+
+    if(!config_file.rewind_buffer[0]) config_file.rewind_buffer = DEFAULT_REWIND_BUFFER;
+    config_rewind_buffer = atoi(config_file.rewind_buffer);
+    if(config_rewind_buffer < 0 || config_rewind_buffer > 1024) {
+        write_log("[config] rewind buffer must be between 0-1024 MiB, defaulting to %s MiB\n", DEFAULT_REWIND_BUFFER);
+        config_rewind_buffer = atoi(DEFAULT_REWIND_BUFFER);
+    }
+
+    config_rewind_interval = atoi(config_file.rewind_interval);
+    if(config_rewind_interval < 1) config_rewind_interval = atoi(DEFAULT_REWIND_INTERVAL);
+
+    if(!strcmp(config_file.link, "server")) config_link = LINK_SERVER;
+    else if(!strcmp(config_file.link, "client")) config_link = LINK_CLIENT;
+    else if(!strcmp(config_file.link, "local")) config_link = LINK_LOCAL;
+    else config_link = LINK_NONE;   // default
+
+    config_link_socket = config_file.link_socket;
+    if(!config_link_socket[0]) config_link_socket = DEFAULT_LINK_SOCKET;
+
+    config_link_rom = config_file.link_rom;     // empty runs the same ROM twice
+
+    config_link_window = atoi(config_file.link_window);
+    if(config_link_window < 16) config_link_window = atoi(DEFAULT_LINK_WINDOW);
+
+    if(!strcmp(config_file.boot_cache, "yes")) config_boot_cache = 1;
+    else config_boot_cache = 0;     // default
+
     scaling = atoi(config_file.scaling);
     if(!scaling) scaling = 2;   // default
 
@@ -166,7 +260,4 @@ void open_config() {
         write_log("[config] target emulation speed must be between 10-500%%, defaulting to 100%%\n");
         target_speed = 100;
     }
-
-    throttle_lo = target_speed-SPEED_ALLOWANCE;
-    throttle_hi = target_speed+SPEED_ALLOWANCE;
 }
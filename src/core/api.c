@@ -0,0 +1,148 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+#include <libtinygb.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Library interface
+
+/*
+
+ The core never talks to a window, a sound device or the keyboard itself.
+ Whatever it needs from the host goes through the callbacks below, which the
+ SDL frontend fills in with its own functions and an embedder may leave
+ empty. An instance created through gb_create() is headless: the frame is
+ rendered into its framebuffer but nothing is drawn or played, and input
+ only comes from gb_set_input().
+
+ */
+
+gb_callbacks_t callbacks;
+
+void gb_set_callbacks(const gb_callbacks_t *new_callbacks) {
+    if(new_callbacks) callbacks = *new_callbacks;
+    else memset(&callbacks, 0, sizeof(gb_callbacks_t));
+}
+
+void update_window(uint32_t *framebuffer) {
+    if(callbacks.update_window) callbacks.update_window(framebuffer);
+}
+
+void update_border(uint32_t *border) {
+    if(callbacks.update_border) callbacks.update_border(border);
+}
+
+void resize_sgb_window() {
+    if(callbacks.resize_sgb_window) callbacks.resize_sgb_window();
+}
+
+void poll_input() {
+    if(callbacks.poll_input) callbacks.poll_input();
+}
+
+gb_t *gb_create(const void *rom_data, size_t size, const gb_config_t *config) {
+    if(gb) {
+        write_log("[api] this thread already runs an instance\n");
+        return NULL;
+    }
+
+    if(size < 0x8000) {
+        write_log("[api] a ROM is at least 32 KiB\n");
+        return NULL;
+    }
+
+    config_system = config ? config->system : SYSTEM_AUTO;
+    config_preference = (config && config->prefer_gb) ? PREFER_GB : PREFER_CGB;
+    config_border = config ? config->border : 0;
+    config_deterministic = config ? config->deterministic : 0;
+    config_input_poll = POLL_FRAME;
+
+    headless = 1;
+    rom = (void *)rom_data;
+    rom_size = size;
+    rom_filename = NULL;
+
+    ex_ram_filename = NULL;
+    if(config && config->save_file) {
+        ex_ram_filename = strdup(config->save_file);
+        if(!ex_ram_filename) die(-1, "[api] unable to allocate memory for filename\n");
+    }
+
+    // the movie sets up the machine it was recorded on
+    if(config && config->movie) movie_open((char *)config->movie, MOVIE_PLAY);
+    if(config && config->record_hashes) hashes_open((char *)config->record_hashes, HASHES_RECORD);
+    else if(config && config->check_hashes) hashes_open((char *)config->check_hashes, HASHES_CHECK);
+
+    memory_start();
+    cpu_start();
+    display_start();
+    timer_start();
+    sound_start();
+    serial_start();
+    movie_start();
+    hashes_start();
+
+    return gb;
+}
+
+// every other call only works on the instance of the calling thread
+static int is_ours(gb_t *instance) {
+    if(instance && instance == gb) return 1;
+
+    write_log("[api] %p isn't the instance of this thread\n", (void *)instance);
+    return 0;
+}
+
+void gb_destroy(gb_t *instance) {
+    if(!instance || instance != gb) return;
+
+    movie_stop();
+    hashes_stop();
+    battery_stop();
+    free(gb);
+    gb = NULL;
+
+    unload_rom();
+    free(ex_ram_filename);
+    ex_ram_filename = NULL;
+}
+
+int gb_run_frame(gb_t *instance) {
+    if(!is_ours(instance)) return -1;
+    if(!movie_frame()) return 0;
+
+    cpu_run_frame();
+    hashes_frame();
+    return 1;
+}
+
+void gb_set_input(gb_t *instance, uint8_t keys) {
+    if(is_ours(instance)) joypad_set(keys);
+}
+
+const uint32_t *gb_framebuffer(gb_t *instance) {
+    return is_ours(instance) ? gb->framebuffer : NULL;
+}
+
+size_t gb_state_size(gb_t *instance) {
+    return is_ours(instance) ? savestate_size() : 0;
+}
+
+int gb_save_state(gb_t *instance, void *buffer, size_t size) {
+    if(!is_ours(instance) || size < savestate_size()) return -1;
+
+    savestate_write(buffer);
+    return 0;
+}
+
+int gb_load_state(gb_t *instance, const void *buffer, size_t size) {
+    return is_ours(instance) ? savestate_read(buffer, size) : -1;
+}
+
+uint64_t gb_state_hash(gb_t *instance) {
+    return is_ours(instance) ? state_hash() : 0;
+}
@@ -0,0 +1,321 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//#define BATTERY_LOG
+
+// Battery-backed cart RAM writer
+
+/*
+
+ Games disable cart RAM after every save, and some (Pokemon) do so many times
+ in a row and during normal play, so the .mbc file is never written on the
+ emulation thread. battery_save() hands the 8 KiB banks that changed to a
+ writer thread, and requests that arrive while the writer is busy are
+ coalesced into a single write.
+
+ Whenever possible the .mbc file is mapped with a shared mmap() and used as
+ the cart RAM directly, so writes to 0xA000-0xBFFF land in the page cache
+ without any syscall and the writer only has to msync() the dirty banks.
+
+ If the file can't be mapped, the cart RAM stays in the state arena and the
+ old copy-in/copy-out path is used: battery_save() copies the dirty banks
+ into a shadow copy of the file, which the writer writes to <rom>.mbc.tmp,
+ fsync()s and renames over <rom>.mbc, so an interrupted write leaves the
+ previous save intact instead of a truncated file.
+
+ Cartridges with an MBC3 real-time clock get the clock registers and a wall
+ clock timestamp appended after the cart RAM (RTC_SAVE_SIZE bytes), written
+ whenever the cart RAM is saved.
+
+ */
+
+typedef struct {
+    pthread_t writer_thread;
+    pthread_mutex_t writer_lock;
+    pthread_cond_t writer_cond;
+
+    char *filename, *temp_filename;
+    uint8_t *mapped_ram;        // the mmap()ed .mbc file, or NULL when copying
+    uint8_t *shadow_ram;        // what the .mbc file should contain
+    uint8_t *writer_ram;        // private copy the writer thread writes from
+    int battery_size;           // size of the .mbc file
+    int ram_size;               // cart RAM at the start of the file
+    int save_pending;
+    uint32_t pending_banks;     // dirty banks to msync() in mapped mode
+    int writer_running;
+} battery_t;
+
+// every emulator thread has its own cartridge, and its writer only ever sees
+// the battery_t it was started with
+static __thread battery_t *battery = NULL;
+
+static int write_all(int fd, uint8_t *data, int size) {
+    while(size > 0) {
+        ssize_t count = write(fd, data, size);
+        if(count <= 0) return -1;
+
+        data += count;
+        size -= count;
+    }
+
+    return 0;
+}
+
+static void write_battery_file(battery_t *b, uint8_t *data, int size) {
+    int fd = open(b->temp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        write_log("[battery] unable to open %s for writing\n", b->temp_filename);
+        return;
+    }
+
+    if(write_all(fd, data, size) || fsync(fd)) {
+        write_log("[battery] unable to write to file %s\n", b->temp_filename);
+        close(fd);
+        remove(b->temp_filename);
+        return;
+    }
+
+    close(fd);
+
+    if(rename(b->temp_filename, b->filename)) {
+        write_log("[battery] unable to rename %s to %s\n", b->temp_filename, b->filename);
+        remove(b->temp_filename);
+        return;
+    }
+
+    write_log("[battery] wrote RAM file to %s\n", b->filename);
+}
+
+static void sync_mapped_banks(battery_t *b, uint32_t banks) {
+    for(int bank = 0; bank * 8192 < b->battery_size; bank++) {
+        if(!(banks & (1 << bank))) continue;
+
+        int offset = bank * 8192;
+        int size = b->battery_size - offset;
+        if(size > 8192) size = 8192;
+
+        if(msync(b->mapped_ram + offset, size, MS_SYNC)) {
+            write_log("[battery] unable to sync bank %d of %s\n", bank, b->filename);
+        }
+    }
+
+#ifdef BATTERY_LOG
+    write_log("[battery] synced dirty banks 0x%04X of %s\n", banks, b->filename);
+#endif
+}
+
+static void *battery_writer(void *arg) {
+    battery_t *b = arg;
+
+    pthread_mutex_lock(&b->writer_lock);
+
+    while(1) {
+        while(!b->save_pending && b->writer_running) pthread_cond_wait(&b->writer_cond, &b->writer_lock);
+        if(!b->save_pending) break;    // stopped with nothing left to write
+
+        b->save_pending = 0;
+
+        if(b->mapped_ram) {
+            uint32_t banks = b->pending_banks;
+            b->pending_banks = 0;
+
+            pthread_mutex_unlock(&b->writer_lock);
+            sync_mapped_banks(b, banks);
+            pthread_mutex_lock(&b->writer_lock);
+        } else {
+            memcpy(b->writer_ram, b->shadow_ram, b->battery_size);
+
+            // the emulation thread can queue the next save while this one is written
+            pthread_mutex_unlock(&b->writer_lock);
+            write_battery_file(b, b->writer_ram, b->battery_size);
+            pthread_mutex_lock(&b->writer_lock);
+        }
+    }
+
+    pthread_mutex_unlock(&b->writer_lock);
+    return NULL;
+}
+
+// maps the .mbc file over the cart RAM; returns zero on success
+static int map_battery_file(int *complete) {
+    int fd = open(ex_ram_filename, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) return -1;
+
+    struct stat st;
+    if(fstat(fd, &st) || (st.st_size < battery->battery_size && ftruncate(fd, battery->battery_size))) {
+        close(fd);
+        return -1;
+    }
+
+    void *mapping = mmap(NULL, battery->battery_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);      // the mapping keeps the file open
+    if(mapping == MAP_FAILED) return -1;
+
+    *complete = st.st_size >= battery->battery_size;
+
+    battery->mapped_ram = mapping;
+    if(battery->ram_size) {
+        gb->ex_ram = battery->mapped_ram;
+        gb->ex_ram_mapped = 1;
+        mbc_update_banks();
+    }
+
+    return 0;
+}
+
+// reads the .mbc file into the shadow copy; returns the number of bytes read
+static int load_battery_file() {
+    FILE *file = fopen(ex_ram_filename, "r");
+    if(!file) {
+        write_log("[battery] unable to open %s for reading, assuming no RAM file\n", ex_ram_filename);
+        return 0;
+    }
+
+    int size = fread(battery->shadow_ram, 1, battery->battery_size, file);
+    if(!size) {
+        write_log("[battery] unable to read from file %s, assuming no RAM file\n", ex_ram_filename);
+    }
+
+    fclose(file);
+    return size;
+}
+
+void battery_start() {
+    int complete;
+
+    battery = state_alloc(sizeof(battery_t), "battery writer");
+    pthread_mutex_init(&battery->writer_lock, NULL);
+    pthread_cond_init(&battery->writer_cond, NULL);
+    battery->filename = ex_ram_filename;
+
+    battery->ram_size = gb->ex_ram_size;
+    battery->battery_size = battery->ram_size;
+    if(gb->mbc3.has_rtc) battery->battery_size += RTC_SAVE_SIZE;
+
+    if(!battery->battery_size) return;
+
+    if(config_deterministic || !ex_ram_filename) {
+        // cart RAM starts out zeroed like the rest of the machine
+        if(ex_ram_filename) write_log("[battery] deterministic mode, %s is neither read nor written\n", ex_ram_filename);
+        else write_log("[battery] no save file, cart RAM is kept in memory\n");
+        battery->battery_size = 0;
+        if(gb->mbc3.has_rtc) rtc_load(NULL);
+        return;
+    }
+
+    if(!map_battery_file(&complete)) {
+        write_log("[battery] mapped %s as cart RAM\n", ex_ram_filename);
+    } else {
+        write_log("[battery] unable to map %s, falling back to copying cart RAM\n", ex_ram_filename);
+
+        battery->temp_filename = calloc(strlen(ex_ram_filename) + 5, 1);
+        if(!battery->temp_filename) {
+            die(-1, "[battery] unable to allocate memory for filename\n");
+        }
+
+        strcpy(battery->temp_filename, ex_ram_filename);
+        strcpy(battery->temp_filename+strlen(ex_ram_filename), ".tmp");
+
+        battery->shadow_ram = state_alloc(battery->battery_size, "battery shadow RAM");
+        battery->writer_ram = state_alloc(battery->battery_size, "battery writer RAM");
+
+        complete = load_battery_file() >= battery->battery_size;
+        if(battery->ram_size) memcpy(gb->ex_ram, battery->shadow_ram, battery->ram_size);
+    }
+
+    // a file without the clock appended (or from before this cart had one)
+    // seeds the clock from the wall clock instead
+    if(gb->mbc3.has_rtc) {
+        uint8_t *file = battery->mapped_ram ? battery->mapped_ram : battery->shadow_ram;
+        rtc_load(complete ? file + battery->ram_size : NULL);
+    }
+
+    battery->writer_running = 1;
+    if(pthread_create(&battery->writer_thread, NULL, battery_writer, battery)) {
+        die(-1, "[battery] unable to start battery writer thread\n");
+    }
+
+    write_log("[battery] started battery writer thread\n");
+}
+
+// called from the emulation thread whenever the game disables cart RAM
+void battery_save() {
+    if(!battery || !battery->battery_size || running_ahead) return;
+    if(!gb->ex_ram_dirty && !gb->mbc3.has_rtc) return;
+
+    pthread_mutex_lock(&battery->writer_lock);
+
+    if(gb->mbc3.has_rtc) {
+        uint8_t *file = battery->mapped_ram ? battery->mapped_ram : battery->shadow_ram;
+        rtc_save(file + battery->ram_size);
+        gb->ex_ram_dirty |= 1 << (battery->ram_size / 8192);
+    }
+
+    if(battery->mapped_ram) {
+        // the data is already in the page cache, it only needs to reach the disk
+        battery->pending_banks |= gb->ex_ram_dirty;
+        gb->ex_ram_dirty = 0;
+        battery->save_pending = 1;
+
+        pthread_cond_signal(&battery->writer_cond);
+        pthread_mutex_unlock(&battery->writer_lock);
+        return;
+    }
+
+    for(int bank = 0; bank * 8192 < battery->ram_size; bank++) {
+        if(!(gb->ex_ram_dirty & (1 << bank))) continue;
+
+        int offset = bank * 8192;
+        int size = battery->ram_size - offset;
+        if(size > 8192) size = 8192;
+
+#ifdef BATTERY_LOG
+        write_log("[battery] bank %d is dirty\n", bank);
+#endif
+
+        memcpy(battery->shadow_ram + offset, gb->ex_ram + offset, size);
+    }
+
+    // only forget about modifications once they've been handed to the writer
+    gb->ex_ram_dirty = 0;
+    battery->save_pending = 1;
+
+    pthread_cond_signal(&battery->writer_cond);
+    pthread_mutex_unlock(&battery->writer_lock);
+}
+
+// flushes anything still pending and waits for the writer to finish
+void battery_stop() {
+    if(!battery) return;
+
+    if(battery->writer_running) {
+        battery_save();
+
+        pthread_mutex_lock(&battery->writer_lock);
+        battery->writer_running = 0;
+        pthread_cond_signal(&battery->writer_cond);
+        pthread_mutex_unlock(&battery->writer_lock);
+
+        pthread_join(battery->writer_thread, NULL);
+
+        if(battery->mapped_ram) munmap(battery->mapped_ram, battery->battery_size);
+    }
+
+    free(battery->temp_filename);
+    free(battery->shadow_ram);
+    free(battery->writer_ram);
+    free(battery);
+    battery = NULL;
+}
@@ -0,0 +1,233 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+//#define BOOTCACHE_LOG
+
+// Boot cache
+
+/*
+
+ Most sessions start by sitting through the same splash screens up to the
+ title screen. With boot_cache=yes, the first run of a ROM records a
+ savestate at the title screen, and later runs resume from it right away.
+
+ Where the title screen is, is up to the player: the state is recorded at the
+ first game key they press, as it was at the start of that frame, before the
+ key reached the game. Pressing the boot mark key (F6) records the current
+ state instead, at any time, replacing what was recorded before.
+
+ The cache is <rom>.boot, a header followed by a savestate (see savestate.c).
+ It is only used when the ROM, the save file and the settings that shape the
+ machine are all the same as when it was recorded: the header has the hash
+ of the ROM, the hash of the cart RAM in the .mbc file as it was at launch,
+ and the settings. A game that writes to its save before the point it was
+ recorded at isn't cached at all, because the state would no longer match
+ the file. The clock that MBC3 carts append to the file is left out of the
+ hash, because it is rewritten on every exit; after resuming, the clock is
+ the one loaded from the file, so the real time that passed still counts.
+
+ Movies, netplay and the link cable start the machine from power on, so the
+ cache is left alone with those, and so are headless runs.
+
+ */
+
+#define BOOTCACHE_MAGIC     "TGBBOOT "
+#define BOOTCACHE_VERSION   1
+
+#define BOOTCACHE_OFF       0
+#define BOOTCACHE_ARMED     1   // waiting for the first key press
+#define BOOTCACHE_DONE      2   // recorded or resumed, only the mark key records
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t rom_hash;
+    uint64_t save_hash;         // of the cart RAM in the .mbc file at launch, zero without one
+    uint64_t ex_ram_hash;       // of cart RAM at launch
+    int32_t system, preference, border, deterministic;
+} bootcache_header_t;
+
+static __thread int bootcache_mode = BOOTCACHE_OFF;
+static __thread char *bootcache_filename;
+static __thread bootcache_header_t key;
+static __thread uint8_t *pending;      // the state at the start of the current frame
+
+static int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// only the cart RAM part of the file, without the clock after it
+static uint64_t hash_save_file() {
+    if(!ex_ram_filename) return 0;
+
+    FILE *file = fopen(ex_ram_filename, "rb");
+    if(!file) return 0;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+    if(size > gb->ex_ram_size) size = gb->ex_ram_size;
+
+    uint64_t hash = 0;
+    uint8_t *data = malloc(size > 0 ? size : 1);
+    if(data && size > 0 && fread(data, size, 1, file) == 1) hash = hash_fast(data, size);
+
+    free(data);
+    fclose(file);
+    return hash;
+}
+
+static uint64_t hash_ex_ram() {
+    return gb->ex_ram_size ? hash_fast(gb->ex_ram, gb->ex_ram_size) : 0;
+}
+
+static void write_cache(const void *state) {
+    bootcache_mode = BOOTCACHE_DONE;
+
+    if(hash_ex_ram() != key.ex_ram_hash) {
+        write_log("[bootcache] the game wrote to its save since it started, not caching this point\n");
+        return;
+    }
+
+    size_t size = savestate_size();
+
+    FILE *file = fopen(bootcache_filename, "wb");
+    if(!file || fwrite(&key, sizeof(bootcache_header_t), 1, file) != 1 || fwrite(state, size, 1, file) != 1) {
+        write_log("[bootcache] unable to write to %s\n", bootcache_filename);
+        if(file) fclose(file);
+        return;
+    }
+
+    fclose(file);
+    write_log("[bootcache] recorded %d KiB at %.1f seconds to %s\n", (int)(size / 1024), (double)gb->total_cycles / GB_CPU_SPEED, bootcache_filename);
+}
+
+// resumes from the cache if it matches; returns zero if it did
+static int read_cache() {
+    int64_t start = now_us();
+    uint8_t rtc[5], rtc_latched[5];
+
+    FILE *file = fopen(bootcache_filename, "rb");
+    if(!file) return -1;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+
+    bootcache_header_t header;
+    if(size < (long)sizeof(bootcache_header_t) || fread(&header, sizeof(bootcache_header_t), 1, file) != 1) {
+        fclose(file);
+        return -1;
+    }
+
+    if(memcmp(&header, &key, sizeof(bootcache_header_t))) {
+        write_log("[bootcache] %s is for a different ROM, save file or settings, recording it again\n", bootcache_filename);
+        fclose(file);
+        return -1;
+    }
+
+    size -= header.header_size;
+    uint8_t *state = malloc(size > 0 ? size : 1);
+    int status = -1;
+
+    // the clock as rtc_load() brought it up to date from the save file
+    memcpy(rtc, gb->mbc3.rtc, 5);
+    memcpy(rtc_latched, gb->mbc3.rtc_latched, 5);
+
+    fseek(file, header.header_size, SEEK_SET);
+    if(state && size > 0 && fread(state, size, 1, file) == 1) status = savestate_read(state, size);
+
+    free(state);
+    fclose(file);
+
+    // the state has the clock of when it was recorded, which would turn the
+    // game's time back; in deterministic mode the clock only counts emulated
+    // time, so the recorded one is right
+    if(!status && gb->mbc3.has_rtc && !config_deterministic) {
+        memcpy(gb->mbc3.rtc, rtc, 5);
+        memcpy(gb->mbc3.rtc_latched, rtc_latched, 5);
+        gb->mbc3.rtc_last_cycles = gb->total_cycles;
+        gb->mbc3.rtc_subsecond = 0;
+    }
+
+    if(!status) {
+        write_log("[bootcache] resumed at %.1f seconds from %s in %d us\n", (double)gb->total_cycles / GB_CPU_SPEED,
+            bootcache_filename, (int)(now_us() - start));
+    }
+
+    return status;
+}
+
+// called once the machine is running
+void boot_cache_start() {
+    if(!config_boot_cache) return;
+
+    if(headless || movie_mode != MOVIE_NONE || netplay_player || config_link != LINK_NONE) {
+        write_log("[bootcache] the boot cache isn't used with movies, netplay or the link cable\n");
+        return;
+    }
+
+    bootcache_filename = calloc(strlen(rom_filename) + 6, 1);
+    pending = malloc(savestate_size());
+    if(!bootcache_filename || !pending) {
+        write_log("[bootcache] unable to allocate memory, disabling the boot cache\n");
+        return;
+    }
+
+    strcpy(bootcache_filename, rom_filename);
+    strcat(bootcache_filename, ".boot");
+
+    memset(&key, 0, sizeof(bootcache_header_t));
+    memcpy(key.magic, BOOTCACHE_MAGIC, 8);
+    key.version = BOOTCACHE_VERSION;
+    key.header_size = sizeof(bootcache_header_t);
+    key.rom_hash = rom_hash();
+    key.save_hash = hash_save_file();
+    key.ex_ram_hash = hash_ex_ram();
+    key.system = config_system;
+    key.preference = config_preference;
+    key.border = config_border;
+    key.deterministic = config_deterministic;
+
+    if(!read_cache()) {
+        bootcache_mode = BOOTCACHE_DONE;
+        return;
+    }
+
+    bootcache_mode = BOOTCACHE_ARMED;
+    write_log("[bootcache] recording %s at the first key press\n", bootcache_filename);
+}
+
+// called between frames, before host input is polled
+void boot_cache_frame() {
+    if(bootcache_mode == BOOTCACHE_ARMED) savestate_write(pending);
+}
+
+// the host saw the player press a game key
+void boot_cache_input() {
+    if(bootcache_mode != BOOTCACHE_ARMED) return;
+
+#ifdef BOOTCACHE_LOG
+    write_log("[bootcache] first key press at cycle %llu\n", (unsigned long long)gb->total_cycles);
+#endif
+
+    write_cache(pending);
+}
+
+// the player marked the current point; called between frames
+void boot_cache_mark() {
+    if(bootcache_mode == BOOTCACHE_OFF) return;
+
+    savestate_write(pending);
+    write_cache(pending);
+}
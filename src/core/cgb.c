@@ -4,20 +4,18 @@
 
 #include <tinygb.h>
 #include <ioports.h>
+#include <state.h>
 
 //#define CGB_LOG
 
 /* Misc Color Gameboy functions that dont fit anywhere else */
 
-int is_double_speed = 0;
-int prepare_speed_switch = 0;
-
 uint8_t cgb_read(uint16_t addr) {
     switch(addr) {
     case KEY1:
-        return (is_double_speed & 1) << 7;
+        return (gb->is_double_speed & 1) << 7;
     case SVBK:
-        return work_ram_bank;
+        return gb->work_ram_bank;
     default:
         die(-1, "undefined read from IO port 0x%04X\n", addr);
         return 0xFF;
@@ -27,20 +25,27 @@ uint8_t cgb_read(uint16_t addr) {
 void cgb_write(uint16_t addr, uint8_t byte) {
     switch(addr) {
     case KEY1:
-        if(byte & 0x01) prepare_speed_switch = 1;
+        if(byte & 0x01) gb->prepare_speed_switch = 1;
         else write_log("[cgb] undefined write to KEY1 register value 0x%02X without attempting a speed switch\n");
         break;
     case RP:
         write_log("[cgb] unimplemented write to RP register value 0x%02X\n", byte);
         break;
     case SVBK:
+        if(!gb->is_cgb) {
+            // WRAM is only 2 banks on the original GB
+            write_log("[cgb] undefined write to SVBK register value 0x%02X in non-CGB mode, ignoring...\n", byte);
+            break;
+        }
+
         byte &= 7;
         if(!byte) byte++;
 #ifdef CGB_LOG
         write_log("[cgb] selecting WRAM bank %d\n", byte);
 #endif
 
-        work_ram_bank = byte;
+        gb->work_ram_bank = byte;
+        gb->wram_bank_ptr = gb->wram + (byte * 4096);
         break;
     default:
         die(-1, "undefined write to IO port 0x%04X value 0x%02X\n", addr, byte);
@@ -5,14 +5,14 @@
 #include <tinygb.h>
 #include <stdlib.h>
 #include <ioports.h>
+#include <state.h>
 
 //#define INT_LOG
 //#define DISASM
-//#define THROTTLE_LOG
 
 int throttle_enabled = 1;
 
-#define disasm_log  write_log("[disasm] %16d %04X ", total_cycles, cpu.pc); write_log
+#define disasm_log  write_log("[disasm] %16llu %04X ", (unsigned long long)gb->total_cycles, gb->cpu.pc); write_log
 
 #define REG_A       7
 #define REG_B       0
@@ -35,15 +35,9 @@ const char *registers16[] = {
     "bc", "de", "hl", "sp"
 };
 
-cpu_t cpu;
-int cycles = 0;
-int total_cycles = 0;
 void (*opcodes[256])();
 void (*ex_opcodes[256])();
-int cpu_speed;
-int cycles_per_throttle;
-
-int throttle_time = THROTTLE_THRESHOLD;
+__thread int cpu_speed;
 
 /*void count_cycles(int n) {
     n++;    // all cpu cycles are practically always one cycle longer
@@ -71,27 +65,22 @@ void count_cycles(int n) {
     n++;
     //n <<= 1;
 
-    timing.last_instruction_cycles = n;
-    total_cycles += n;
-    cycles += n;
-    timing.current_cycles += n;
+    gb->timing.last_instruction_cycles = n;
+    gb->total_cycles += n;
+    gb->timing.current_cycles += n;
 
-    if(throttle_enabled && cycles >= cycles_per_throttle) {
-        if(throttle_time) delay(throttle_time);
-        cycles = 0;
-    }
+    if(gb->total_cycles >= gb->next_event) run_events();
 }
 
 void cpu_log() {
     write_log("[cpu] DUMPING CPU STATE:\n");
 
-    if(is_double_speed) write_log(" [*] CPU is in double speed mode\n");
+    if(gb->is_double_speed) write_log(" [*] CPU is in double speed mode\n");
     else write_log(" [*] CPU is in standard speed mode\n");
     
-    if(throttle_enabled) write_log(" [*] CPU throttles for %d ms every %d cycles\n", throttle_time, cycles_per_throttle);
 
-    write_log(" [*] AF = 0x%04X   BC = 0x%04X   DE = 0x%04X\n", cpu.af, cpu.bc, cpu.de);
-    write_log(" [*] HL = 0x%04X   SP = 0x%04X   PC = 0x%04X\n", cpu.hl, cpu.sp, cpu.pc);
+    write_log(" [*] AF = 0x%04X   BC = 0x%04X   DE = 0x%04X\n", gb->cpu.af, gb->cpu.bc, gb->cpu.de);
+    write_log(" [*] HL = 0x%04X   SP = 0x%04X   PC = 0x%04X\n", gb->cpu.hl, gb->cpu.sp, gb->cpu.pc);
     //write_log(" executed total cycles = %d\n", total_cycles);
     //write_log(" time until next CPU throttle = %lf ms\n", THROTTLE_THRESHOLD - cycles_time);
 }
@@ -103,22 +92,24 @@ void dump_cpu() {
 
 void cpu_start() {
     // initial cpu state
-    cpu.af = 0x01B0;
-    cpu.bc = 0x0013;
-    cpu.de = 0x00D8;
-    cpu.hl = 0x014D;
-    cpu.sp = 0xFFFE;
-    cpu.pc = 0x0100;    // skip the fixed rom and just exec the cartridge
-    cpu.ime = 0;
+    gb->cpu.af = 0x01B0;
+    gb->cpu.bc = 0x0013;
+    gb->cpu.de = 0x00D8;
+    gb->cpu.hl = 0x014D;
+    gb->cpu.sp = 0xFFFE;
+    gb->cpu.pc = 0x0100;    // skip the fixed rom and just exec the cartridge
+    gb->cpu.ime = 0;
 
-    if(is_cgb) cpu.af = 0x11B0;     // A = 0x11
+    if(gb->is_cgb) gb->cpu.af = 0x11B0;     // A = 0x11
 
     // the reason to go for SGB2 and not SGB is because all the timings on the
     // SGB are 2.4% faster, but this issue was fixed in the SGB2
-    if(is_sgb) cpu.af = 0xFFB0;     // A = 0xFF - emulate the SGB2 not SGB
+    if(gb->is_sgb) gb->cpu.af = 0xFFB0;     // A = 0xFF - emulate the SGB2 not SGB
+
+    gb->io_if = 0;
+    gb->io_ie = 0;
 
-    io_if = 0;
-    io_ie = 0;
+    scheduler_start();
 
     // FIX: turns out this is incorrect and the CGB actually supports a double
     // speed function, but it is not turned on by default; it always starts at
@@ -133,69 +124,79 @@ void cpu_start() {
 
     write_log("[cpu] started with speed %lf MHz\n", (double)cpu_speed/1000000);
 
-    //cycles_per_throttle = (cpu_speed * THROTTLE_THRESHOLD)/700;
-    cycles_per_throttle = (cpu_speed / THROTTLE_THRESHOLD) * 4;
-    write_log("[cpu] throttling every %d cycles\n", cycles_per_throttle);
-
     // determine values that will be used to keep track of timing
-    timing.current_cycles = 0;
-    timing.cpu_cycles_ms = cpu_speed / 1000;
-    timing.cpu_cycles_vline = (int)((double)timing.cpu_cycles_ms * REFRESH_TIME_LINE);
+    gb->timing.current_cycles = 0;
+    gb->timing.cpu_cycles_ms = cpu_speed / 1000;
+    gb->timing.cpu_cycles_vline = (int)((double)gb->timing.cpu_cycles_ms * REFRESH_TIME_LINE);
 
-    write_log("[cpu] cycles per ms = %d\n", timing.cpu_cycles_ms);
-    timing.main_cycles = 70224/3;// * 2; // * (frameskip+1);
-    write_log("[cpu] main loop runs %d times before checking for events\n", timing.main_cycles);
+    write_log("[cpu] cycles per ms = %d\n", gb->timing.cpu_cycles_ms);
+    gb->timing.main_cycles = 70224;     // one frame, the pacer runs in between
+    write_log("[cpu] main loop runs %d times before checking for events\n", gb->timing.main_cycles);
     //write_log("[cpu] cycles per v-line refresh = %d\n", timing.cpu_cycles_vline);
 }
 
 inline void push(uint16_t word) {
-    cpu.sp--;
-    write_byte(cpu.sp, (uint8_t)(word >> 8));
-    cpu.sp--;
-    write_byte(cpu.sp, (uint8_t)word & 0xFF);
+    gb->cpu.sp--;
+    write_byte(gb->cpu.sp, (uint8_t)(word >> 8));
+    gb->cpu.sp--;
+    write_byte(gb->cpu.sp, (uint8_t)word & 0xFF);
 }
 
 inline uint16_t pop() {
     uint16_t val;
-    val = read_byte(cpu.sp);
-    cpu.sp++;
-    val |= read_byte(cpu.sp) << 8;
-    cpu.sp++;
+    val = read_byte(gb->cpu.sp);
+    gb->cpu.sp++;
+    val |= read_byte(gb->cpu.sp) << 8;
+    gb->cpu.sp++;
 
     return val;
 }
 
 void cpu_cycle() {
     // handle interrupts
-    uint8_t queued_ints = io_if & io_ie;
-    if(cpu.ime && queued_ints) {
+    uint8_t queued_ints = gb->io_if & gb->io_ie;
+    if(gb->cpu.ime && queued_ints) {
         for(int i = 0; i <= 4; i++) {
             if(queued_ints & (1 << i)) {
                 // disable interrupts and call handler
-                io_if &= ~(1 << i);     // mark as handled
+                gb->io_if &= ~(1 << i);     // mark as handled
 
 #ifdef INT_LOG
                 disasm_log("<HANDLING INTERRUPT 0x%02X>\n", (i << 3) + 0x40);
 #endif
 
-                cpu.ime = 0;
-                push(cpu.pc);
-                cpu.pc = (i << 3) + 0x40;
+                gb->cpu.ime = 0;
+                push(gb->cpu.pc);
+                gb->cpu.pc = (i << 3) + 0x40;
                 break;
             }
         }
     }
 
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
 
     if(!opcodes[opcode]) {
-        write_log("undefined opcode %02X %02X %02X, dumping CPU state...\n", opcode, read_byte(cpu.pc+1), read_byte(cpu.pc+2));
+        write_log("undefined opcode %02X %02X %02X, dumping CPU state...\n", opcode, read_byte(gb->cpu.pc+1), read_byte(gb->cpu.pc+2));
         dump_cpu();
     } else {
         opcodes[opcode]();
     }
 }
 
+// emulates the current frame up to cycle end of it
+void cpu_run_until(int end) {
+    while(gb->timing.current_cycles < end) {
+        cpu_cycle();
+        display_cycle();
+    }
+}
+
+// emulates one frame of the main loop
+void cpu_run_frame() {
+    gb->timing.current_cycles = 0;
+    cpu_run_until(gb->timing.main_cycles);
+}
+
 /*inline void write_reg8(int reg, uint8_t r) {
     switch(reg) {
     case REG_A:
@@ -235,28 +236,28 @@ void cpu_cycle() {
 static inline void write_reg8(int reg, uint8_t val) {
     switch(reg) {
     case REG_A:
-        cpu.a = val;
+        gb->cpu.a = val;
         break;
     case REG_B:
-        cpu.b = val;
+        gb->cpu.b = val;
         break;
     case REG_C:
-        cpu.c = val;
+        gb->cpu.c = val;
         break;
     case REG_D:
-        cpu.d = val;
+        gb->cpu.d = val;
         break;
     case REG_E:
-        cpu.e = val;
+        gb->cpu.e = val;
         break;
     case REG_H:
-        cpu.h = val;
+        gb->cpu.h = val;
         break;
     case REG_L:
-        cpu.l = val;
+        gb->cpu.l = val;
         break;
     default:
-        write_log("undefined opcode %02X %02X %02X, dumping CPU state...\n", read_byte(cpu.pc), read_byte(cpu.pc+1), read_byte(cpu.pc+2));
+        write_log("undefined opcode %02X %02X %02X, dumping CPU state...\n", read_byte(gb->cpu.pc), read_byte(gb->cpu.pc+1), read_byte(gb->cpu.pc+2));
         return dump_cpu();
     }
 }
@@ -297,21 +298,21 @@ static inline void write_reg8(int reg, uint8_t val) {
 static inline uint8_t read_reg8(int reg) {
     switch(reg) {
     case REG_A:
-        return cpu.a;
+        return gb->cpu.a;
     case REG_B:
-        return cpu.b;
+        return gb->cpu.b;
     case REG_C:
-        return cpu.c;
+        return gb->cpu.c;
     case REG_D:
-        return cpu.d;
+        return gb->cpu.d;
     case REG_E:
-        return cpu.e;
+        return gb->cpu.e;
     case REG_H:
-        return cpu.h;
+        return gb->cpu.h;
     case REG_L:
-        return cpu.l;
+        return gb->cpu.l;
     default:
-        write_log("undefined opcode %02X %02X %02X, dumping CPU state...\n", read_byte(cpu.pc), read_byte(cpu.pc+1), read_byte(cpu.pc+2));
+        write_log("undefined opcode %02X %02X %02X, dumping CPU state...\n", read_byte(gb->cpu.pc), read_byte(gb->cpu.pc+1), read_byte(gb->cpu.pc+2));
         dump_cpu();
         return 0xFF;    // unreachable anyway
     }
@@ -320,19 +321,19 @@ static inline uint8_t read_reg8(int reg) {
 static inline void write_reg16(int reg, uint16_t r) {
     switch(reg) {
     case REG_BC:
-        cpu.bc = r;
+        gb->cpu.bc = r;
         break;
     case REG_DE:
-        cpu.de = r;
+        gb->cpu.de = r;
         break;
     case REG_HL:
-        cpu.hl = r;
+        gb->cpu.hl = r;
         break;
     case REG_SP:
-        cpu.sp = r;
+        gb->cpu.sp = r;
         break;
     default:
-        write_log("undefined opcode %02X %02X %02X, dumping CPU state...\n", read_byte(cpu.pc), read_byte(cpu.pc+1), read_byte(cpu.pc+2));
+        write_log("undefined opcode %02X %02X %02X, dumping CPU state...\n", read_byte(gb->cpu.pc), read_byte(gb->cpu.pc+1), read_byte(gb->cpu.pc+2));
         return dump_cpu();
     }
 }
@@ -340,15 +341,15 @@ static inline void write_reg16(int reg, uint16_t r) {
 static inline uint16_t read_reg16(int reg) {
     switch(reg) {
     case REG_BC:
-        return cpu.bc;
+        return gb->cpu.bc;
     case REG_DE:
-        return cpu.de;
+        return gb->cpu.de;
     case REG_HL:
-        return cpu.hl;
+        return gb->cpu.hl;
     case REG_SP:
-        return cpu.sp;
+        return gb->cpu.sp;
     default:
-        write_log("undefined opcode %02X %02X %02X, dumping CPU state...\n", read_byte(cpu.pc), read_byte(cpu.pc+1), read_byte(cpu.pc+2));
+        write_log("undefined opcode %02X %02X %02X, dumping CPU state...\n", read_byte(gb->cpu.pc), read_byte(gb->cpu.pc+1), read_byte(gb->cpu.pc+2));
         dump_cpu();
         return 0xFFFF;    // unreachable
     }
@@ -363,24 +364,24 @@ void nop() {
     disasm_log("nop\n");
 #endif
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
 void jp_nn() {
-    uint16_t new_pc = read_word(cpu.pc+1);
+    uint16_t new_pc = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("jp 0x%04X\n", new_pc);
 #endif
 
-    cpu.pc = new_pc;
+    gb->cpu.pc = new_pc;
     count_cycles(4);
 }
 
 void ld_r_r() {
     // 0b01xxxyyy
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int x = (opcode >> 3) & 7;
     int y = opcode & 7;
 
@@ -391,12 +392,12 @@ void ld_r_r() {
     uint8_t src = read_reg8(y);
     write_reg8(x, src);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
 void sbc_a_r() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = opcode & 7;
 
 #ifdef DISASM
@@ -408,27 +409,27 @@ void sbc_a_r() {
     r = read_reg8(reg);
 
     a -= r;
-    if(cpu.af & FLAG_CY) a--;
+    if(gb->cpu.af & FLAG_CY) a--;
 
-    cpu.af |= FLAG_N;
+    gb->cpu.af |= FLAG_N;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if(a > read_reg8(REG_A)) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(a > read_reg8(REG_A)) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
-    if((a & 0x0F) < (read_reg8(REG_A) & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((a & 0x0F) < (read_reg8(REG_A) & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
     write_reg8(REG_A, a);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
 void sub_r() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = opcode & 7;
 
 #ifdef DISASM
@@ -441,25 +442,25 @@ void sub_r() {
 
     a -= r;
 
-    cpu.af |= FLAG_N;
+    gb->cpu.af |= FLAG_N;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if(a > read_reg8(REG_A)) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(a > read_reg8(REG_A)) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
-    if((a & 0x10) == (read_reg8(REG_A) & 0x10)) cpu.af &= (~FLAG_H);
-    else cpu.af |= FLAG_H; 
+    if((a & 0x10) == (read_reg8(REG_A) & 0x10)) gb->cpu.af &= (~FLAG_H);
+    else gb->cpu.af |= FLAG_H; 
 
     write_reg8(REG_A, a);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
 void dec_r() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
 
     int reg = (opcode >> 3) & 7;
 
@@ -473,24 +474,24 @@ void dec_r() {
     uint8_t old = r;
     r--;
 
-    cpu.af |= FLAG_N;
+    gb->cpu.af |= FLAG_N;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if((r & 0x10) == (old & 0x10)) cpu.af &= (~FLAG_H);
-    else cpu.af |= FLAG_H; 
+    if((r & 0x10) == (old & 0x10)) gb->cpu.af &= (~FLAG_H);
+    else gb->cpu.af |= FLAG_H; 
 
     write_reg8(reg, r);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
 void ld_r_xx() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = (opcode >> 3) & 7;
-    uint8_t val = read_byte(cpu.pc+1);
+    uint8_t val = read_byte(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("ld %s, 0x%02X\n", registers[reg], val);
@@ -498,12 +499,12 @@ void ld_r_xx() {
 
     write_reg8(reg, val);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void inc_r() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
 
     int reg = (opcode >> 3) & 7;
 
@@ -517,64 +518,64 @@ void inc_r() {
     uint8_t old = r;
     r++;
 
-    cpu.af &= (~FLAG_N);
+    gb->cpu.af &= (~FLAG_N);
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if((r & 0x0F) < (old & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((r & 0x0F) < (old & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
     write_reg8(reg, r);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
 void jr_e() {
-    uint8_t e = read_byte(cpu.pc+1);
+    uint8_t e = read_byte(gb->cpu.pc+1);
 
     if(e & 0x80) {
         uint8_t pe = ~e;
         pe++;
         #ifdef DISASM
-            disasm_log("jr 0x%02X (-%d) (0x%04X)\n", e, pe, (cpu.pc - pe) + 2);
+            disasm_log("jr 0x%02X (-%d) (0x%04X)\n", e, pe, (gb->cpu.pc - pe) + 2);
         #endif
 
-        cpu.pc += 2;
-        cpu.pc -= pe;
+        gb->cpu.pc += 2;
+        gb->cpu.pc -= pe;
     } else {
         #ifdef DISASM
-            disasm_log("jr 0x%02X (+%d) (0x%04X)\n", e, e, cpu.pc + 2 + e);
+            disasm_log("jr 0x%02X (+%d) (0x%04X)\n", e, e, gb->cpu.pc + 2 + e);
         #endif
 
-        cpu.pc += 2;
-        cpu.pc += e;
+        gb->cpu.pc += 2;
+        gb->cpu.pc += e;
     }
 
     count_cycles(3);
 }
 
 void ld_r_hl() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = (opcode >> 3) & 7;
 
 #ifdef DISASM
     disasm_log("ld %s, (hl)\n", registers[reg]);
 #endif
 
-    uint8_t val = read_byte(cpu.hl);
+    uint8_t val = read_byte(gb->cpu.hl);
 
     write_reg8(reg, val);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
 void ld_r_xxxx() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = (opcode >> 4) & 3;
-    uint16_t val = read_word(cpu.pc+1);
+    uint16_t val = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("ld %s, 0x%04X\n", registers16[reg], val);
@@ -582,7 +583,7 @@ void ld_r_xxxx() {
 
     write_reg16(reg, val);
 
-    cpu.pc += 3;
+    gb->cpu.pc += 3;
     count_cycles(3);
 }
 
@@ -593,9 +594,9 @@ void cpl() {
 
     write_reg8(REG_A, read_reg8(REG_A) ^ 0xFF);
 
-    cpu.af |= FLAG_N | FLAG_H;
+    gb->cpu.af |= FLAG_N | FLAG_H;
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
@@ -605,14 +606,14 @@ void ld_bc_a() {
 #endif
 
     uint8_t a = read_reg8(REG_A);
-    write_byte(cpu.bc, a);
+    write_byte(gb->cpu.bc, a);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
 void inc_r16() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = (opcode >> 4) & 3;
 
 #ifdef DISASM
@@ -623,12 +624,12 @@ void inc_r16() {
     val++;
     write_reg16(reg, val);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
 void xor_r() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = opcode & 7;
 
 #ifdef DISASM
@@ -640,14 +641,14 @@ void xor_r() {
 
     a ^= val;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
 
     write_reg8(REG_A, a);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
@@ -658,46 +659,46 @@ void ldd_hl_a() {
 
     uint8_t a = read_reg8(REG_A);
 
-    write_byte(cpu.hl, a);
-    cpu.hl--;
+    write_byte(gb->cpu.hl, a);
+    gb->cpu.hl--;
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
 void jr_nz() {
-    uint8_t e = read_byte(cpu.pc+1);
+    uint8_t e = read_byte(gb->cpu.pc+1);
 
     if(e & 0x80) {
         uint8_t pe = ~e;
         pe++;
         #ifdef DISASM
-            disasm_log("jr nz 0x%02X (-%d) (0x%04X)\n", e, pe, (cpu.pc - pe) + 2);
+            disasm_log("jr nz 0x%02X (-%d) (0x%04X)\n", e, pe, (gb->cpu.pc - pe) + 2);
         #endif
 
-        cpu.pc += 2;
+        gb->cpu.pc += 2;
 
-        if(cpu.af & FLAG_ZF) {
+        if(gb->cpu.af & FLAG_ZF) {
             // ZF is set; condition false
             count_cycles(2);
         } else {
             // ZF not set; condition true
-            cpu.pc -= pe;
+            gb->cpu.pc -= pe;
             count_cycles(3);
         }
     } else {
         #ifdef DISASM
-            disasm_log("jr nz 0x%02X (+%d) (0x%04X)\n", e, e, cpu.pc + 2 + e);
+            disasm_log("jr nz 0x%02X (+%d) (0x%04X)\n", e, e, gb->cpu.pc + 2 + e);
         #endif
 
-        cpu.pc += 2;
+        gb->cpu.pc += 2;
 
-        if(cpu.af & FLAG_ZF) {
+        if(gb->cpu.af & FLAG_ZF) {
             // ZF is set; condition false
             count_cycles(2);
         } else {
             // ZF not set; condition true
-            cpu.pc += e;
+            gb->cpu.pc += e;
             count_cycles(3);
         }
     }
@@ -708,13 +709,13 @@ void di() {
     disasm_log("di\n");
 #endif
 
-    cpu.ime = 0;
-    cpu.pc++;
+    gb->cpu.ime = 0;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
 void ldh_a8_a() {
-    uint8_t a8 = read_byte(cpu.pc+1);
+    uint8_t a8 = read_byte(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("ldh (0x%02X), a\n", a8);
@@ -723,12 +724,12 @@ void ldh_a8_a() {
     uint16_t addr = 0xFF00 + a8;
     write_byte(addr, read_reg8(REG_A));
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(3);
 }
 
 void cp_xx() {
-    uint8_t val = read_byte(cpu.pc+1);
+    uint8_t val = read_byte(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("cp 0x%02X\n", val);
@@ -738,73 +739,73 @@ void cp_xx() {
 
     a -= val;
 
-    cpu.af |= FLAG_N;
+    gb->cpu.af |= FLAG_N;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if(a > read_reg8(REG_A)) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(a > read_reg8(REG_A)) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
-    if((a & 0x0F) < (read_reg8(REG_A) & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((a & 0x0F) < (read_reg8(REG_A) & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void jr_z() {
-    uint8_t e = read_byte(cpu.pc+1);
+    uint8_t e = read_byte(gb->cpu.pc+1);
 
     if(e & 0x80) {
         uint8_t pe = ~e;
         pe++;
         #ifdef DISASM
-            disasm_log("jr z 0x%02X (-%d) (0x%04X)\n", e, pe, (cpu.pc - pe) + 2);
+            disasm_log("jr z 0x%02X (-%d) (0x%04X)\n", e, pe, (gb->cpu.pc - pe) + 2);
         #endif
 
-        cpu.pc += 2;
+        gb->cpu.pc += 2;
 
-        if(!(cpu.af & FLAG_ZF)) {
+        if(!(gb->cpu.af & FLAG_ZF)) {
             // ZF is false; condition false
             count_cycles(2);
         } else {
             // ZF is set; condition true
-            cpu.pc -= pe;
+            gb->cpu.pc -= pe;
             count_cycles(3);
         }
     } else {
         #ifdef DISASM
-            disasm_log("jr z 0x%02X (+%d) (0x%04X)\n", e, e, cpu.pc + 2 + e);
+            disasm_log("jr z 0x%02X (+%d) (0x%04X)\n", e, e, gb->cpu.pc + 2 + e);
         #endif
 
-        cpu.pc += 2;
+        gb->cpu.pc += 2;
 
-        if(!(cpu.af & FLAG_ZF)) {
+        if(!(gb->cpu.af & FLAG_ZF)) {
             // ZF is false; condition false
             count_cycles(2);
         } else {
             // ZF is set; condition true
-            cpu.pc += e;
+            gb->cpu.pc += e;
             count_cycles(3);
         }
     }
 }
 
 void ld_a16_a() {
-    uint16_t addr = read_word(cpu.pc+1);
+    uint16_t addr = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("ld (0x%04X), a\n", addr);
 #endif
 
     write_byte(addr, read_reg8(REG_A));
-    cpu.pc += 3;
+    gb->cpu.pc += 3;
     count_cycles(4);
 }
 
 void ldh_a_a8() {
-    uint8_t a8 = read_byte(cpu.pc+1);
+    uint8_t a8 = read_byte(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("ldh a, (0x%02X)\n", a8);
@@ -813,25 +814,25 @@ void ldh_a_a8() {
     uint16_t addr = 0xFF00 + a8;
     write_reg8(REG_A, read_byte(addr));
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(3);
 }
 
 void call_a16() {
-    uint16_t a16 = read_word(cpu.pc+1);
+    uint16_t a16 = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("call 0x%04X\n", a16);
 #endif
 
-    push(cpu.pc+3);
-    cpu.pc = a16;
+    push(gb->cpu.pc+3);
+    gb->cpu.pc = a16;
 
     count_cycles(6);
 }
 
 void and_n() {
-    uint8_t n = read_byte(cpu.pc+1);
+    uint8_t n = read_byte(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("and 0x%02X\n", n);
@@ -841,13 +842,13 @@ void and_n() {
     a &= n;
     write_reg8(REG_A, a);
 
-    cpu.af &= ~(FLAG_N | FLAG_CY);
-    cpu.af |= FLAG_H;
+    gb->cpu.af &= ~(FLAG_N | FLAG_CY);
+    gb->cpu.af |= FLAG_H;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
@@ -856,25 +857,25 @@ void ret() {
     disasm_log("ret\n");
 #endif
 
-    cpu.pc = pop();
+    gb->cpu.pc = pop();
     count_cycles(4);
 }
 
 void ld_hl_n() {
-    uint8_t n = read_byte(cpu.pc+1);
+    uint8_t n = read_byte(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("ld (hl), 0x%02X\n", n);
 #endif
 
-    write_byte(cpu.hl, n);
+    write_byte(gb->cpu.hl, n);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(3);
 }
 
 void dec_r16() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = (opcode >> 4) & 3;
 
 #ifdef DISASM
@@ -885,12 +886,12 @@ void dec_r16() {
     val--;
     write_reg16(reg, val);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
 void or_r() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
 
     int reg = opcode & 7;
 
@@ -904,17 +905,17 @@ void or_r() {
     a |= r;
     write_reg8(REG_A, a);
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
 void push_r16() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = (opcode >> 4) & 3;
 
 #ifdef DISASM
@@ -922,7 +923,7 @@ void push_r16() {
 #endif
 
     push(read_reg16(reg));
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(4);
 }
 
@@ -931,13 +932,13 @@ void push_af() {
     disasm_log("push af\n");
 #endif
 
-    push(cpu.af);
-    cpu.pc++;
+    push(gb->cpu.af);
+    gb->cpu.pc++;
     count_cycles(4);
 }
 
 void pop_r16() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = (opcode >> 4) & 3;
 
 #ifdef DISASM
@@ -945,7 +946,7 @@ void pop_r16() {
 #endif
 
     write_reg16(reg, pop());
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(3);
 }
 
@@ -954,8 +955,8 @@ void pop_af() {
     disasm_log("pop af\n");
 #endif
 
-    cpu.af = pop();
-    cpu.pc++;
+    gb->cpu.af = pop();
+    gb->cpu.pc++;
     count_cycles(3);
 }
 
@@ -966,10 +967,10 @@ void ldi_hl_a() {
 
     uint8_t a = read_reg8(REG_A);
 
-    write_byte(cpu.hl, a);
-    cpu.hl++;
+    write_byte(gb->cpu.hl, a);
+    gb->cpu.hl++;
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -978,10 +979,10 @@ void ldi_a_hl() {
     disasm_log("ldi a, (hl)\n");
 #endif
 
-    write_reg8(REG_A, read_byte(cpu.hl));
+    write_reg8(REG_A, read_byte(gb->cpu.hl));
 
-    cpu.hl++;
-    cpu.pc++;
+    gb->cpu.hl++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -990,10 +991,10 @@ void ldd_a_hl() {
     disasm_log("ldd a, (hl)\n");
 #endif
 
-    write_reg8(REG_A, read_byte(cpu.hl));
+    write_reg8(REG_A, read_byte(gb->cpu.hl));
 
-    cpu.hl--;
-    cpu.pc++;
+    gb->cpu.hl--;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -1005,7 +1006,7 @@ void ldh_c_a() {
     uint16_t addr = 0xFF00 + read_reg8(REG_C);
     write_byte(addr, read_reg8(REG_A));
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -1017,7 +1018,7 @@ void ldh_a_c() {
     uint16_t addr = 0xFF00 + read_reg8(REG_C);
     write_reg8(REG_A, read_byte(addr));
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -1026,13 +1027,13 @@ void ei() {
     disasm_log("ei\n");
 #endif
 
-    cpu.ime = 1;
-    cpu.pc++;
+    gb->cpu.ime = 1;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
 void and_r() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = opcode & 7;
 
 #ifdef DISASM
@@ -1044,15 +1045,15 @@ void and_r() {
 
     a &= val;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_CY);
-    cpu.af |= FLAG_H;
+    gb->cpu.af &= ~(FLAG_N | FLAG_CY);
+    gb->cpu.af |= FLAG_H;
 
     write_reg8(REG_A, a);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
@@ -1061,13 +1062,13 @@ void ret_nz() {
     disasm_log("ret nz\n");
 #endif
 
-    if(cpu.af & FLAG_ZF) {
+    if(gb->cpu.af & FLAG_ZF) {
         // ZF set; condition false
-        cpu.pc++;
+        gb->cpu.pc++;
         count_cycles(2);
     } else {
         // ZF clear; condition true
-        cpu.pc = pop();
+        gb->cpu.pc = pop();
         count_cycles(5);
     }
 }
@@ -1077,19 +1078,19 @@ void ret_z() {
     disasm_log("ret z\n");
 #endif
 
-    if(cpu.af & FLAG_ZF) {
+    if(gb->cpu.af & FLAG_ZF) {
         // ZF set; condition true
-        cpu.pc = pop();
+        gb->cpu.pc = pop();
         count_cycles(5);
     } else {
         // ZF clear; condition false
-        cpu.pc++;
+        gb->cpu.pc++;
         count_cycles(2);
     }
 }
 
 void ld_a_a16() {
-    uint16_t addr = read_word(cpu.pc+1);
+    uint16_t addr = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("ld a, (0x%04X)\n", addr);
@@ -1097,7 +1098,7 @@ void ld_a_a16() {
 
     write_reg8(REG_A, read_byte(addr));
 
-    cpu.pc += 3;
+    gb->cpu.pc += 3;
     count_cycles(4);
 }
 
@@ -1106,21 +1107,21 @@ void inc_hl() {
     disasm_log("inc (hl)\n");
 #endif
 
-    uint8_t n = read_byte(cpu.hl);
+    uint8_t n = read_byte(gb->cpu.hl);
     uint8_t old = n;
     n++;
 
-    cpu.af &= (~FLAG_N);
+    gb->cpu.af &= (~FLAG_N);
 
-    if(!n) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!n) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if((n & 0x0F) < (old & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((n & 0x0F) < (old & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
-    write_byte(cpu.hl, n);
+    write_byte(gb->cpu.hl, n);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(3);
 }
 
@@ -1129,13 +1130,13 @@ void reti() {
     disasm_log("reti\n");
 #endif
 
-    cpu.ime = 1;
-    cpu.pc = pop();
+    gb->cpu.ime = 1;
+    gb->cpu.pc = pop();
     count_cycles(4);
 }
 
 void rst() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     uint8_t n = (opcode >> 3) & 7;
 
     uint8_t addr = n << 3;
@@ -1144,14 +1145,14 @@ void rst() {
     disasm_log("rst 0x%02X\n", addr);
 #endif
 
-    push(cpu.pc+1);
-    cpu.pc = addr;
+    push(gb->cpu.pc+1);
+    gb->cpu.pc = addr;
 
     count_cycles(4);
 }
 
 void add_r() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = opcode & 7;
 
 #ifdef DISASM
@@ -1162,25 +1163,25 @@ void add_r() {
     uint8_t r = read_reg8(reg);
     uint8_t new = a + r;
 
-    cpu.af &= (~FLAG_N);
+    gb->cpu.af &= (~FLAG_N);
 
-    if(!new) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!new) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if((new & 0x0F) < (a & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((new & 0x0F) < (a & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
-    if(new < a) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(new < a) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     write_reg8(REG_A, new);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
 void add_hl_r16() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = (opcode >> 4) & 3;
 
 #ifdef DISASM
@@ -1191,20 +1192,20 @@ void add_hl_r16() {
     uint16_t rr = read_reg16(reg);
     uint16_t new = hl + rr;
 
-    cpu.af &= ~(FLAG_N);
+    gb->cpu.af &= ~(FLAG_N);
 
     // flags are set according to higher byte
     uint8_t hi_new = (new >> 8) & 0xFF;
     uint8_t hi_old = (hl >> 8) & 0xFF;
 
-    if(hi_new < hi_old) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(hi_new < hi_old) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
-    if((hi_new & 0x0F) < (hi_old & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((hi_new & 0x0F) < (hi_old & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
     write_reg16(REG_HL, new);
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -1213,7 +1214,7 @@ void jp_hl() {
     disasm_log("jp hl\n");
 #endif
 
-    cpu.pc = cpu.hl;
+    gb->cpu.pc = gb->cpu.hl;
     count_cycles(1);
 }
 
@@ -1223,9 +1224,9 @@ void ld_de_a() {
 #endif
 
     uint8_t a = read_reg8(REG_A);
-    write_byte(cpu.de, a);
+    write_byte(gb->cpu.de, a);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -1234,9 +1235,9 @@ void ld_a_bc() {
     disasm_log("ld a, (bc)\n");
 #endif
 
-    write_reg8(REG_A, read_byte(cpu.bc));
+    write_reg8(REG_A, read_byte(gb->cpu.bc));
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -1245,26 +1246,26 @@ void ld_a_de() {
     disasm_log("ld a, (de)\n");
 #endif
 
-    write_reg8(REG_A, read_byte(cpu.de));
+    write_reg8(REG_A, read_byte(gb->cpu.de));
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
 void jp_z_a16() {
-    uint16_t new_pc = read_word(cpu.pc+1);
+    uint16_t new_pc = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("jp z 0x%04X\n", new_pc);
 #endif
 
-    if(cpu.af & FLAG_ZF) {
+    if(gb->cpu.af & FLAG_ZF) {
         // ZF set, condition true
-        cpu.pc = new_pc;
+        gb->cpu.pc = new_pc;
         count_cycles(4);
     } else {
         // ZF clear, condition false
-        cpu.pc += 3;
+        gb->cpu.pc += 3;
         count_cycles(3);
     }
 }
@@ -1274,58 +1275,58 @@ void dec_hl() {
     disasm_log("dec (hl)\n");
 #endif
 
-    uint8_t n = read_byte(cpu.hl);
+    uint8_t n = read_byte(gb->cpu.hl);
     uint8_t old = n;
     n--;
 
-    cpu.af |= FLAG_N;
+    gb->cpu.af |= FLAG_N;
 
-    if(!n) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!n) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if((n & 0x10) == (old & 0x10)) cpu.af &= (~FLAG_H);
-    else cpu.af |= FLAG_H; 
+    if((n & 0x10) == (old & 0x10)) gb->cpu.af &= (~FLAG_H);
+    else gb->cpu.af |= FLAG_H; 
 
-    write_byte(cpu.hl, n);
+    write_byte(gb->cpu.hl, n);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(3);
 }
 
 void ld_hl_r() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = opcode & 7;
 
 #ifdef DISASM
     disasm_log("ld (hl), %s\n", registers[reg]);
 #endif
 
-    write_byte(cpu.hl, read_reg8(reg));
+    write_byte(gb->cpu.hl, read_reg8(reg));
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
 void jp_nz_a16() {
-    uint16_t new_pc = read_word(cpu.pc+1);
+    uint16_t new_pc = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("jp nz 0x%04X\n", new_pc);
 #endif
 
-    if(!(cpu.af & FLAG_ZF)) {
+    if(!(gb->cpu.af & FLAG_ZF)) {
         // ZF clear, condition true
-        cpu.pc = new_pc;
+        gb->cpu.pc = new_pc;
         count_cycles(4);
     } else {
         // ZF set, condition false
-        cpu.pc += 3;
+        gb->cpu.pc += 3;
         count_cycles(3);
     }
 }
 
 void add_d8() {
-    uint8_t d8 = read_byte(cpu.pc+1);
+    uint8_t d8 = read_byte(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("add 0x%02X\n", d8);
@@ -1334,25 +1335,25 @@ void add_d8() {
     uint8_t a = read_reg8(REG_A);
     uint8_t new = a + d8;
 
-    cpu.af &= (~FLAG_N);
+    gb->cpu.af &= (~FLAG_N);
 
-    if(!new) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!new) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if((new & 0x0F) < (a & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((new & 0x0F) < (a & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
-    if(new < a) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(new < a) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     write_reg8(REG_A, new);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void xor_d8() {
-    uint8_t d8 = read_byte(cpu.pc+1);
+    uint8_t d8 = read_byte(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("xor 0x%02X\n", d8);
@@ -1360,88 +1361,88 @@ void xor_d8() {
 
     uint8_t a = read_reg8(REG_A);
     a ^= d8;
-    cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
     write_reg8(REG_A, a);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void jr_nc() {
-    uint8_t e = read_byte(cpu.pc+1);
+    uint8_t e = read_byte(gb->cpu.pc+1);
 
     if(e & 0x80) {
         uint8_t pe = ~e;
         pe++;
         #ifdef DISASM
-            disasm_log("jr nc 0x%02X (-%d) (0x%04X)\n", e, pe, (cpu.pc - pe) + 2);
+            disasm_log("jr nc 0x%02X (-%d) (0x%04X)\n", e, pe, (gb->cpu.pc - pe) + 2);
         #endif
 
-        cpu.pc += 2;
+        gb->cpu.pc += 2;
 
-        if(cpu.af & FLAG_CY) {
+        if(gb->cpu.af & FLAG_CY) {
             // C is set; condition false
             count_cycles(2);
         } else {
             // C not set; condition true
-            cpu.pc -= pe;
+            gb->cpu.pc -= pe;
             count_cycles(3);
         }
     } else {
         #ifdef DISASM
-            disasm_log("jr nc 0x%02X (+%d) (0x%04X)\n", e, e, cpu.pc + 2 + e);
+            disasm_log("jr nc 0x%02X (+%d) (0x%04X)\n", e, e, gb->cpu.pc + 2 + e);
         #endif
 
-        cpu.pc += 2;
+        gb->cpu.pc += 2;
 
-        if(cpu.af & FLAG_CY) {
+        if(gb->cpu.af & FLAG_CY) {
             // C is set; condition false
             count_cycles(2);
         } else {
             // C not set; condition true
-            cpu.pc += e;
+            gb->cpu.pc += e;
             count_cycles(3);
         }
     }
 }
 
 void jr_c() {
-    uint8_t e = read_byte(cpu.pc+1);
+    uint8_t e = read_byte(gb->cpu.pc+1);
 
     if(e & 0x80) {
         uint8_t pe = ~e;
         pe++;
         #ifdef DISASM
-            disasm_log("jr c 0x%02X (-%d) (0x%04X)\n", e, pe, (cpu.pc - pe) + 2);
+            disasm_log("jr c 0x%02X (-%d) (0x%04X)\n", e, pe, (gb->cpu.pc - pe) + 2);
         #endif
 
-        cpu.pc += 2;
+        gb->cpu.pc += 2;
 
-        if(!(cpu.af & FLAG_CY)) {
+        if(!(gb->cpu.af & FLAG_CY)) {
             // C is false; condition false
             count_cycles(2);
         } else {
             // C is set; condition true
-            cpu.pc -= pe;
+            gb->cpu.pc -= pe;
             count_cycles(3);
         }
     } else {
         #ifdef DISASM
-            disasm_log("jr c 0x%02X (+%d) (0x%04X)\n", e, e, cpu.pc + 2 + e);
+            disasm_log("jr c 0x%02X (+%d) (0x%04X)\n", e, e, gb->cpu.pc + 2 + e);
         #endif
 
-        cpu.pc += 2;
+        gb->cpu.pc += 2;
 
-        if(!(cpu.af & FLAG_CY)) {
+        if(!(gb->cpu.af & FLAG_CY)) {
             // C is false; condition false
             count_cycles(2);
         } else {
             // C is set; condition true
-            cpu.pc += e;
+            gb->cpu.pc += e;
             count_cycles(3);
         }
     }
@@ -1453,17 +1454,17 @@ void or_hl() {
 #endif
 
     uint8_t a = read_reg8(REG_A);
-    uint8_t r = read_byte(cpu.hl);
+    uint8_t r = read_byte(gb->cpu.hl);
 
     a |= r;
     write_reg8(REG_A, a);
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -1510,39 +1511,39 @@ void or_hl() {
 }*/
 
 void ld_hl_sp_s() {
-    uint8_t e = read_byte(cpu.pc+1);
+    uint8_t e = read_byte(gb->cpu.pc+1);
     uint16_t ew = e;
     if(ew & 0x80) ew |= 0xFF00;
 
     uint8_t lo_new, lo_old;
 
-    lo_old = cpu.hl & 0xFF;
+    lo_old = gb->cpu.hl & 0xFF;
 
 #ifdef DISASM
     disasm_log("ld hl, sp+0x%04X\n", ew);
 #endif
 
-    uint16_t new = cpu.sp + ew;
+    uint16_t new = gb->cpu.sp + ew;
     lo_new = new & 0xFF;
 
     // flags are set according to lower byte
     lo_new = new & 0xFF;
 
-    if(lo_new < lo_old) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(lo_new < lo_old) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
-    if((lo_new & 0x0F) < (lo_old & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((lo_new & 0x0F) < (lo_old & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
-    cpu.af &= ~(FLAG_ZF | FLAG_N);
+    gb->cpu.af &= ~(FLAG_ZF | FLAG_N);
 
     write_reg16(REG_HL, new);
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(3);
 }
 
 void add_sp_s() {
-    uint8_t e = read_byte(cpu.pc+1);
+    uint8_t e = read_byte(gb->cpu.pc+1);
     uint16_t ew = e;
     if(ew & 0x80) ew |= 0xFF00;
 
@@ -1553,27 +1554,27 @@ void add_sp_s() {
     disasm_log("add sp, 0x%04X\n", ew);
 #endif
 
-    lo_old = cpu.sp & 0xFF;
-    new = cpu.sp + ew;
+    lo_old = gb->cpu.sp & 0xFF;
+    new = gb->cpu.sp + ew;
 
     // flags are set according to lower byte
     lo_new = new & 0xFF;
 
-    if(lo_new < lo_old) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(lo_new < lo_old) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
-    if((lo_new & 0x0F) < (lo_old & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((lo_new & 0x0F) < (lo_old & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
-    cpu.af &= ~(FLAG_ZF | FLAG_N);
+    gb->cpu.af &= ~(FLAG_ZF | FLAG_N);
 
     write_reg16(REG_SP, new);
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(3);
 }
 
 void cp_r() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = opcode & 7;
 
 #ifdef DISASM
@@ -1585,23 +1586,23 @@ void cp_r() {
 
     a -= val;
 
-    cpu.af |= FLAG_N;
+    gb->cpu.af |= FLAG_N;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if(a > read_reg8(REG_A)) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(a > read_reg8(REG_A)) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
-    if((a & 0x0F) < (read_reg8(REG_A) & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((a & 0x0F) < (read_reg8(REG_A) & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
 void or_d8() {
-    uint8_t d8 = read_byte(cpu.pc+1);
+    uint8_t d8 = read_byte(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("or 0x%02X\n", d8);
@@ -1609,38 +1610,38 @@ void or_d8() {
 
     uint8_t a = read_reg8(REG_A);
     a |= d8;
-    cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
     write_reg8(REG_A, a);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void call_nz() {
-    uint16_t new_pc = read_word(cpu.pc+1);
+    uint16_t new_pc = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("call nz 0x%04X\n", new_pc);
 #endif
 
-    if(cpu.af & FLAG_ZF) {
+    if(gb->cpu.af & FLAG_ZF) {
         // ZF set, condition false
-        cpu.pc += 3;
+        gb->cpu.pc += 3;
         count_cycles(3);
     } else {
         // ZF clear, condition true
-        push(cpu.pc+3);
-        cpu.pc = new_pc;
+        push(gb->cpu.pc+3);
+        gb->cpu.pc = new_pc;
         count_cycles(6);
     }
 }
 
 void adc_r() {
-    uint8_t opcode = read_byte(cpu.pc);
+    uint8_t opcode = read_byte(gb->cpu.pc);
     int reg = opcode & 7;
 
 #ifdef DISASM
@@ -1651,22 +1652,22 @@ void adc_r() {
     uint8_t r = read_reg8(reg);
     uint8_t new = a + r;
 
-    if(cpu.af & FLAG_CY) new++;
+    if(gb->cpu.af & FLAG_CY) new++;
 
-    cpu.af &= (~FLAG_N);
+    gb->cpu.af &= (~FLAG_N);
 
-    if(!new) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!new) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if((new & 0x0F) < (a & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((new & 0x0F) < (a & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
-    if(new < a) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(new < a) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     write_reg8(REG_A, new);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
@@ -1676,23 +1677,23 @@ void add_hl() {
 #endif
 
     uint8_t a = read_reg8(REG_A);
-    uint8_t r = read_byte(cpu.hl);
+    uint8_t r = read_byte(gb->cpu.hl);
     uint8_t new = a + r;
 
-    cpu.af &= (~FLAG_N);
+    gb->cpu.af &= (~FLAG_N);
 
-    if(!new) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!new) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if((new & 0x0F) < (a & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((new & 0x0F) < (a & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
-    if(new < a) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(new < a) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     write_reg8(REG_A, new);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -1701,23 +1702,23 @@ void cp_hl() {
     disasm_log("cp (hl)\n");
 #endif
 
-    uint8_t val = read_byte(cpu.hl);
+    uint8_t val = read_byte(gb->cpu.hl);
     uint8_t a = read_reg8(REG_A);
 
     a -= val;
 
-    cpu.af |= FLAG_N;
+    gb->cpu.af |= FLAG_N;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if(a > read_reg8(REG_A)) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(a > read_reg8(REG_A)) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
-    if((a & 0x0F) < (read_reg8(REG_A) & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((a & 0x0F) < (read_reg8(REG_A) & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -1726,7 +1727,7 @@ void halt() {
     disasm_log("halt\n");
 #endif
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
@@ -1736,25 +1737,25 @@ void rra() {
 #endif
 
     uint8_t old_cy;
-    if(cpu.af & FLAG_CY) old_cy = 0x80;
+    if(gb->cpu.af & FLAG_CY) old_cy = 0x80;
     else old_cy = 0x00;
 
-    cpu.af &= ~(FLAG_ZF | FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_ZF | FLAG_N | FLAG_H);
 
     uint8_t a = read_reg8(REG_A);
-    if(a & 0x01) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(a & 0x01) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     a >>= 1;
     a |= old_cy;
 
     write_reg8(REG_A, a);
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
 void sub_d8() {
-    uint8_t d8 = read_byte(cpu.pc+1);
+    uint8_t d8 = read_byte(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("sub 0x%02X\n", d8);
@@ -1763,23 +1764,23 @@ void sub_d8() {
     uint8_t a = read_reg8(REG_A);
     a -= d8;
 
-    cpu.af |= FLAG_N;
+    gb->cpu.af |= FLAG_N;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if(a > read_reg8(REG_A)) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(a > read_reg8(REG_A)) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     //if((a & 0x0F) < (read_reg8(REG_A) & 0x0F)) cpu.af |= FLAG_H;
     //else cpu.af &= (~FLAG_H);
 
-    if((a & 0x10) == (read_reg8(REG_A) & 0x10)) cpu.af &= (~FLAG_H);
-    else cpu.af |= FLAG_H; 
+    if((a & 0x10) == (read_reg8(REG_A) & 0x10)) gb->cpu.af &= (~FLAG_H);
+    else gb->cpu.af |= FLAG_H; 
 
     write_reg8(REG_A, a);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
@@ -1789,20 +1790,20 @@ void rlca() {
 #endif
 
     uint8_t a = read_reg8(REG_A);
-    if(a & 0x80) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(a & 0x80) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     a <<= 1;
-    if(cpu.af & FLAG_CY) a |= 0x01;
+    if(gb->cpu.af & FLAG_CY) a |= 0x01;
 
     write_reg8(REG_A, a);
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
@@ -1813,24 +1814,24 @@ void sub_hl() {
 
     uint8_t a = read_reg8(REG_A);
     uint8_t r;
-    r = read_byte(cpu.hl);
+    r = read_byte(gb->cpu.hl);
 
     a -= r;
 
-    cpu.af |= FLAG_N;
+    gb->cpu.af |= FLAG_N;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if(a > read_reg8(REG_A)) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(a > read_reg8(REG_A)) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
-    if((a & 0x10) == (read_reg8(REG_A) & 0x10)) cpu.af &= (~FLAG_H);
-    else cpu.af |= FLAG_H; 
+    if((a & 0x10) == (read_reg8(REG_A) & 0x10)) gb->cpu.af &= (~FLAG_H);
+    else gb->cpu.af |= FLAG_H; 
 
     write_reg8(REG_A, a);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -1842,30 +1843,30 @@ void daa() {
     uint8_t a = read_reg8(REG_A);
     uint8_t correction = 0;
 
-    if((cpu.af & FLAG_H) || ((a & 0x0F) > 0x09))
+    if((gb->cpu.af & FLAG_H) || ((a & 0x0F) > 0x09))
         correction |= 0x06;
 
-    if((cpu.af & FLAG_CY) || (((a >> 4) & 0x0F) > 0x09)) {
+    if((gb->cpu.af & FLAG_CY) || (((a >> 4) & 0x0F) > 0x09)) {
         correction |= 0x60;
-        cpu.af |= FLAG_CY;
+        gb->cpu.af |= FLAG_CY;
     } else {
-        cpu.af &= (~FLAG_CY);
+        gb->cpu.af &= (~FLAG_CY);
     }
 
     //write_log("DAA instruction: A = 0x%02X, correction = %c0x%02X, result = 0x", a, cpu.af & FLAG_N ? '-' : '+', correction);
 
-    if(cpu.af & FLAG_N) a -= correction;
+    if(gb->cpu.af & FLAG_N) a -= correction;
     else a += correction;
 
     //write_log("%02X\n", a);
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= (~FLAG_H);
+    gb->cpu.af &= (~FLAG_H);
 
     write_reg8(REG_A, a);
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
@@ -1875,25 +1876,25 @@ void adc_hl() {
 #endif
 
     uint8_t a = read_reg8(REG_A);
-    uint8_t r = read_byte(cpu.hl);
+    uint8_t r = read_byte(gb->cpu.hl);
     uint8_t new = a + r;
 
-    if(cpu.af & FLAG_CY) new++;
+    if(gb->cpu.af & FLAG_CY) new++;
 
-    cpu.af &= (~FLAG_N);
+    gb->cpu.af &= (~FLAG_N);
 
-    if(!new) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!new) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if((new & 0x0F) < (a & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((new & 0x0F) < (a & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
-    if(new < a) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(new < a) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     write_reg8(REG_A, new);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -1902,13 +1903,13 @@ void ret_nc() {
     disasm_log("ret nc\n");
 #endif
 
-    if(cpu.af & FLAG_CY) {
+    if(gb->cpu.af & FLAG_CY) {
         // C set; condition false
-        cpu.pc++;
+        gb->cpu.pc++;
         count_cycles(2);
     } else {
         // C clear; condition true
-        cpu.pc = pop();
+        gb->cpu.pc = pop();
         count_cycles(5);
     }
 }
@@ -1918,32 +1919,32 @@ void ret_c() {
     disasm_log("ret c\n");
 #endif
 
-    if(cpu.af & FLAG_CY) {
+    if(gb->cpu.af & FLAG_CY) {
         // C set; condition true
-        cpu.pc = pop();
+        gb->cpu.pc = pop();
         count_cycles(5);
     } else {
         // C clear; condition false
-        cpu.pc++;
+        gb->cpu.pc++;
         count_cycles(2);
     }
 }
 
 void call_z() {
-    uint16_t new_pc = read_word(cpu.pc+1);
+    uint16_t new_pc = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("call z 0x%04X\n", new_pc);
 #endif
 
-    if(!(cpu.af & FLAG_ZF)) {
+    if(!(gb->cpu.af & FLAG_ZF)) {
         // ZF clear, condition false
-        cpu.pc += 3;
+        gb->cpu.pc += 3;
         count_cycles(3);
     } else {
         // ZF set, condition true
-        push(cpu.pc+3);
-        cpu.pc = new_pc;
+        push(gb->cpu.pc+3);
+        gb->cpu.pc = new_pc;
         count_cycles(6);
     }
 }
@@ -1953,8 +1954,8 @@ void ld_sp_hl() {
     disasm_log("ld sp, hl\n");
 #endif
 
-    cpu.sp = cpu.hl;
-    cpu.pc++;
+    gb->cpu.sp = gb->cpu.hl;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -1963,10 +1964,10 @@ void scf() {
     disasm_log("scf\n");
 #endif
 
-    cpu.af |= FLAG_CY;
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af |= FLAG_CY;
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
@@ -1975,47 +1976,47 @@ void ccf() {
     disasm_log("ccf\n");
 #endif
 
-    if(cpu.af & FLAG_CY) cpu.af &= (~FLAG_CY);
-    else cpu.af |= FLAG_CY;
+    if(gb->cpu.af & FLAG_CY) gb->cpu.af &= (~FLAG_CY);
+    else gb->cpu.af |= FLAG_CY;
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
 void jp_c_a16() {
-    uint16_t new_pc = read_word(cpu.pc+1);
+    uint16_t new_pc = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("jp c 0x%04X\n", new_pc);
 #endif
 
-    if(cpu.af & FLAG_CY) {
+    if(gb->cpu.af & FLAG_CY) {
         // C set, condition true
-        cpu.pc = new_pc;
+        gb->cpu.pc = new_pc;
         count_cycles(4);
     } else {
         // C clear, condition false
-        cpu.pc += 3;
+        gb->cpu.pc += 3;
         count_cycles(3);
     }
 }
 
 void jp_nc_a16() {
-    uint16_t new_pc = read_word(cpu.pc+1);
+    uint16_t new_pc = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("jp nc 0x%04X\n", new_pc);
 #endif
 
-    if(!(cpu.af & FLAG_CY)) {
+    if(!(gb->cpu.af & FLAG_CY)) {
         // C clear, condition true
-        cpu.pc = new_pc;
+        gb->cpu.pc = new_pc;
         count_cycles(4);
     } else {
         // C set, condition false
-        cpu.pc += 3;
+        gb->cpu.pc += 3;
         count_cycles(3);
     }
 }
@@ -2026,20 +2027,20 @@ void rrca() {
 #endif
 
     uint8_t r = read_reg8(REG_A);
-    if(r & 0x01) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(r & 0x01) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r >>= 1;
 
-    if(cpu.af & FLAG_CY) r |= 0x80;
+    if(gb->cpu.af & FLAG_CY) r |= 0x80;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
     write_reg8(REG_A, r);
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
@@ -2048,25 +2049,25 @@ void and_hl() {
     disasm_log("and (hl)\n");
 #endif
 
-    uint8_t val = read_byte(cpu.hl);
+    uint8_t val = read_byte(gb->cpu.hl);
     uint8_t a = read_reg8(REG_A);
 
     a &= val;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_CY);
-    cpu.af |= FLAG_H;
+    gb->cpu.af &= ~(FLAG_N | FLAG_CY);
+    gb->cpu.af |= FLAG_H;
 
     write_reg8(REG_A, a);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
 void sbc_a_a8() {
-    uint8_t r = read_byte(cpu.pc+1);
+    uint8_t r = read_byte(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("sbc a, 0x%02X\n", r);
@@ -2075,73 +2076,73 @@ void sbc_a_a8() {
     uint8_t a = read_reg8(REG_A);
 
     a -= r;
-    if(cpu.af & FLAG_CY) a--;
+    if(gb->cpu.af & FLAG_CY) a--;
 
-    cpu.af |= FLAG_N;
+    gb->cpu.af |= FLAG_N;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if(a > read_reg8(REG_A)) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(a > read_reg8(REG_A)) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
-    if((a & 0x0F) < (read_reg8(REG_A) & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((a & 0x0F) < (read_reg8(REG_A) & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
     write_reg8(REG_A, a);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void call_nc() {
-    uint16_t new_pc = read_word(cpu.pc+1);
+    uint16_t new_pc = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("call nc 0x%04X\n", new_pc);
 #endif
 
-    if(cpu.af & FLAG_CY) {
+    if(gb->cpu.af & FLAG_CY) {
         // C set, condition false
-        cpu.pc += 3;
+        gb->cpu.pc += 3;
         count_cycles(3);
     } else {
         // C clear, condition true
-        push(cpu.pc+3);
-        cpu.pc = new_pc;
+        push(gb->cpu.pc+3);
+        gb->cpu.pc = new_pc;
         count_cycles(6);
     }
 }
 
 void ld_a16_sp() {
-    uint16_t a16 = read_word(cpu.pc+1);
+    uint16_t a16 = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("ld (0x%04X), sp\n", a16);
 #endif
 
-    write_byte(a16, cpu.sp);
-    write_byte(a16+1, cpu.sp >> 8);
+    write_byte(a16, gb->cpu.sp);
+    write_byte(a16+1, gb->cpu.sp >> 8);
 
-    cpu.pc += 3;
+    gb->cpu.pc += 3;
     count_cycles(5);
 }
 
 void call_c() {
-    uint16_t new_pc = read_word(cpu.pc+1);
+    uint16_t new_pc = read_word(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("call c 0x%04X\n", new_pc);
 #endif
 
-    if(!(cpu.af & FLAG_CY)) {
+    if(!(gb->cpu.af & FLAG_CY)) {
         // C clear, condition false
-        cpu.pc += 3;
+        gb->cpu.pc += 3;
         count_cycles(3);
     } else {
         // C set, condition true
-        push(cpu.pc+3);
-        cpu.pc = new_pc;
+        push(gb->cpu.pc+3);
+        gb->cpu.pc = new_pc;
         count_cycles(6);
     }
 }
@@ -2153,22 +2154,22 @@ void rla() {
 
     uint8_t r = read_reg8(REG_A);
     uint8_t old_cy;
-    if(cpu.af & FLAG_CY) old_cy = 0x01;
+    if(gb->cpu.af & FLAG_CY) old_cy = 0x01;
     else old_cy = 0x00;
 
-    if(r & 0x80) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(r & 0x80) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r <<= 1;
     r |= old_cy;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
     write_reg8(REG_A, r);
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(1);
 }
 
@@ -2179,25 +2180,25 @@ void sbc_a_hl() {
 
     uint8_t a = read_reg8(REG_A);
     uint8_t r;
-    r = read_byte(cpu.hl);
+    r = read_byte(gb->cpu.hl);
 
     a -= r;
-    if(cpu.af & FLAG_CY) a--;
+    if(gb->cpu.af & FLAG_CY) a--;
 
-    cpu.af |= FLAG_N;
+    gb->cpu.af |= FLAG_N;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if(a > read_reg8(REG_A)) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(a > read_reg8(REG_A)) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
-    if((a & 0x0F) < (read_reg8(REG_A) & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((a & 0x0F) < (read_reg8(REG_A) & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
     write_reg8(REG_A, a);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
@@ -2206,24 +2207,24 @@ void xor_hl() {
     disasm_log("xor (hl)\n");
 #endif
 
-    uint8_t val = read_byte(cpu.hl);
+    uint8_t val = read_byte(gb->cpu.hl);
     uint8_t a = read_reg8(REG_A);
 
     a ^= val;
 
-    if(!a) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!a) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
 
     write_reg8(REG_A, a);
 
-    cpu.pc++;
+    gb->cpu.pc++;
     count_cycles(2);
 }
 
 void adc_d8() {
-    uint8_t d8 = read_byte(cpu.pc+1);
+    uint8_t d8 = read_byte(gb->cpu.pc+1);
 
 #ifdef DISASM
     disasm_log("adc 0x%02X\n", d8);
@@ -2231,22 +2232,22 @@ void adc_d8() {
 
     uint8_t a = read_reg8(REG_A);
     uint8_t new = a + d8;
-    if(cpu.af & FLAG_CY) new++;
+    if(gb->cpu.af & FLAG_CY) new++;
 
-    cpu.af &= (~FLAG_N);
+    gb->cpu.af &= (~FLAG_N);
 
-    if(!new) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!new) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    if((new & 0x0F) < (a & 0x0F)) cpu.af |= FLAG_H;
-    else cpu.af &= (~FLAG_H);
+    if((new & 0x0F) < (a & 0x0F)) gb->cpu.af |= FLAG_H;
+    else gb->cpu.af &= (~FLAG_H);
 
-    if(new < a) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(new < a) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     write_reg8(REG_A, new);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
@@ -2255,27 +2256,21 @@ void stop() {
     disasm_log("stop\n");
 #endif
 
-    if(is_cgb && prepare_speed_switch) {
-        prepare_speed_switch = 0;
+    if(gb->is_cgb && gb->prepare_speed_switch) {
+        gb->prepare_speed_switch = 0;
         
-        if(is_double_speed) {
+        if(gb->is_double_speed) {
             // return to standard speed
-            is_double_speed = 0;
+            timer_set_speed(0);
             write_log("[cpu] CPU switched to standard speed\n");
-
-            timing.cpu_cycles_div <<= 1;
-            timing.cpu_cycles_timer <<= 1;
         } else {
-            is_double_speed = 1;
+            timer_set_speed(1);
             write_log("[cpu] CPU switched to double speed\n");
-
-            timing.cpu_cycles_div >>= 1;
-            timing.cpu_cycles_timer >>= 1;
         }
     }
 
     count_cycles(2);
-    cpu.pc++;
+    gb->cpu.pc++;
 }
 
 /*
@@ -2285,10 +2280,10 @@ void stop() {
 
 // general handler for extended opcodes
 void ex_opcode() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
 
     if(!ex_opcodes[opcode]) {
-        write_log("undefined opcode %02X %02X %02X, dumping CPU state...\n", read_byte(cpu.pc), read_byte(cpu.pc+1), read_byte(cpu.pc+2));
+        write_log("undefined opcode %02X %02X %02X, dumping CPU state...\n", read_byte(gb->cpu.pc), read_byte(gb->cpu.pc+1), read_byte(gb->cpu.pc+2));
         dump_cpu();
     } else {
         ex_opcodes[opcode]();
@@ -2297,7 +2292,7 @@ void ex_opcode() {
 
 // individual 0xCB-prefixed instructions
 void res_n_r() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
 
     int reg = opcode & 7;
     int n = (opcode >> 3) & 7;
@@ -2310,12 +2305,12 @@ void res_n_r() {
     r &= ~(1 << n);
     write_reg8(reg, r);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void swap_r() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
 
     int reg = opcode & 7;
 
@@ -2332,59 +2327,59 @@ void swap_r() {
     uint8_t new_r = (lo << 4) | hi;
     write_reg8(reg, new_r);
 
-    if(!new_r) cpu.af |= FLAG_ZF;
-    cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
+    if(!new_r) gb->cpu.af |= FLAG_ZF;
+    gb->cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void sla_r() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
     int reg = opcode & 7;
 
 #ifdef DISASM
     disasm_log("sla %s\n", registers[reg]);
 #endif
 
-    cpu.af &= ~(FLAG_H | FLAG_N);
+    gb->cpu.af &= ~(FLAG_H | FLAG_N);
 
     uint8_t r = read_reg8(reg);
-    if(r & 0x80) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(r & 0x80) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r <<= 1;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
     write_reg8(reg, r);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void bit_n_hl() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
     int n = (opcode >> 3) & 7;
 
 #ifdef DISASM
     disasm_log("bit %d, (hl)\n", n);
 #endif
 
-    cpu.af &= (~FLAG_N);
-    cpu.af |= FLAG_H;
+    gb->cpu.af &= (~FLAG_N);
+    gb->cpu.af |= FLAG_H;
 
-    uint8_t byte = read_byte(cpu.hl);
-    if(byte & (1 << n)) cpu.af &= (~FLAG_ZF);
-    else cpu.af |= FLAG_ZF;
+    uint8_t byte = read_byte(gb->cpu.hl);
+    if(byte & (1 << n)) gb->cpu.af &= (~FLAG_ZF);
+    else gb->cpu.af |= FLAG_ZF;
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(3);
 }
 
 void bit_n_r() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
     int n = (opcode >> 3) & 7;
     int reg = opcode & 7;
 
@@ -2392,72 +2387,72 @@ void bit_n_r() {
     disasm_log("bit %d, %s\n", n, registers[reg]);
 #endif
 
-    cpu.af &= (~FLAG_N);
-    cpu.af |= FLAG_H;
+    gb->cpu.af &= (~FLAG_N);
+    gb->cpu.af |= FLAG_H;
 
     uint8_t byte = read_reg8(reg);
-    if(byte & (1 << n)) cpu.af &= (~FLAG_ZF);
-    else cpu.af |= FLAG_ZF;
+    if(byte & (1 << n)) gb->cpu.af &= (~FLAG_ZF);
+    else gb->cpu.af |= FLAG_ZF;
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void srl_r() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
     int reg = opcode & 7;
 
 #ifdef DISASM
     disasm_log("srl %s\n", registers[reg]);
 #endif
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
     uint8_t r = read_reg8(reg);
-    if(r & 0x01) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(r & 0x01) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r >>= 1;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
     write_reg8(reg, r);
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void rr_r() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
     int reg = opcode & 7;
 
 #ifdef DISASM
     disasm_log("rr %s\n", registers[reg]);
 #endif
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
     uint8_t old_cy;
-    if(cpu.af & FLAG_CY) old_cy = 0x80;
+    if(gb->cpu.af & FLAG_CY) old_cy = 0x80;
     else old_cy = 0x00;
 
     uint8_t r = read_reg8(reg);
-    if(r & 0x01) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(r & 0x01) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r >>= 1;
     r |= old_cy;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
     write_reg8(reg, r);
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void set_n_r() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
     int n = (opcode >> 3) & 7;
     int reg = opcode & 7;
 
@@ -2469,44 +2464,44 @@ void set_n_r() {
     val |= (1 << n);
     write_reg8(reg, val);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void set_n_hl() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
     int n = (opcode >> 3) & 7;
 
 #ifdef DISASM
     disasm_log("set %d, (hl)\n", n);
 #endif
 
-    uint8_t val = read_byte(cpu.hl);
+    uint8_t val = read_byte(gb->cpu.hl);
     val |= (1 << n);
-    write_byte(cpu.hl, val);
+    write_byte(gb->cpu.hl, val);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(4);
 }
 
 void res_n_hl() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
     int n = (opcode >> 3) & 7;
 
 #ifdef DISASM
     disasm_log("res %d, (hl)\n", n);
 #endif
 
-    uint8_t val = read_byte(cpu.hl);
+    uint8_t val = read_byte(gb->cpu.hl);
     val &= ~(1 << n);
-    write_byte(cpu.hl, val);
+    write_byte(gb->cpu.hl, val);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(4);
 }
 
 void rl_r() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
     int reg = opcode & 7;
 
 #ifdef DISASM
@@ -2515,27 +2510,27 @@ void rl_r() {
 
     uint8_t r = read_reg8(reg);
     uint8_t old_cy;
-    if(cpu.af & FLAG_CY) old_cy = 0x01;
+    if(gb->cpu.af & FLAG_CY) old_cy = 0x01;
     else old_cy = 0x00;
 
-    if(r & 0x80) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(r & 0x80) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r <<= 1;
     r |= old_cy;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
     write_reg8(reg, r);
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void sra_r() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
     int reg = opcode & 7;
 
 #ifdef DISASM
@@ -2547,23 +2542,23 @@ void sra_r() {
     if(r & 0x80) new_msb = 0x80;
     else new_msb = 0x00;
 
-    if(r & 0x01) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(r & 0x01) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r >>= 1;
     r |= new_msb;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
     write_reg8(reg, r);
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
 void rrc_r() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
     int reg = opcode & 7;
 
 #ifdef DISASM
@@ -2571,20 +2566,20 @@ void rrc_r() {
 #endif
 
     uint8_t r = read_reg8(reg);
-    if(r & 0x01) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(r & 0x01) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r >>= 1;
 
-    if(cpu.af & FLAG_CY) r |= 0x80;
+    if(gb->cpu.af & FLAG_CY) r |= 0x80;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
     write_reg8(reg, r);
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
@@ -2593,21 +2588,21 @@ void rrc_hl() {
     disasm_log("rrc (hl)\n");
 #endif
 
-    uint8_t r = read_byte(cpu.hl);
-    if(r & 0x01) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    uint8_t r = read_byte(gb->cpu.hl);
+    if(r & 0x01) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r >>= 1;
 
-    if(cpu.af & FLAG_CY) r |= 0x80;
+    if(gb->cpu.af & FLAG_CY) r |= 0x80;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
-    write_byte(cpu.hl, r);
-    cpu.pc += 2;
+    write_byte(gb->cpu.hl, r);
+    gb->cpu.pc += 2;
     count_cycles(4);
 }
 
@@ -2616,24 +2611,24 @@ void swap_hl() {
     disasm_log("swap (hl)\n");
 #endif
 
-    uint8_t r = read_byte(cpu.hl);
+    uint8_t r = read_byte(gb->cpu.hl);
 
     uint8_t lo, hi;
     lo = r & 0x0F;
     hi = (r >> 4) & 0x0F;
 
     uint8_t new_r = (lo << 4) | hi;
-    write_byte(cpu.hl, new_r);
+    write_byte(gb->cpu.hl, new_r);
 
-    if(!new_r) cpu.af |= FLAG_ZF;
-    cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
+    if(!new_r) gb->cpu.af |= FLAG_ZF;
+    gb->cpu.af &= ~(FLAG_N | FLAG_H | FLAG_CY);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(4);
 }
 
 void rlc_r() {
-    uint8_t opcode = read_byte(cpu.pc+1);
+    uint8_t opcode = read_byte(gb->cpu.pc+1);
     int reg = opcode & 7;
 
 #ifdef DISASM
@@ -2641,20 +2636,20 @@ void rlc_r() {
 #endif
 
     uint8_t r = read_reg8(reg);
-    if(r & 0x80) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(r & 0x80) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r <<= 1;
-    if(cpu.af & FLAG_CY) r |= 0x01;
+    if(gb->cpu.af & FLAG_CY) r |= 0x01;
 
     write_reg8(reg, r);
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(2);
 }
 
@@ -2663,21 +2658,21 @@ void rlc_hl() {
     disasm_log("rlc (hl)\n");
 #endif
 
-    uint8_t r = read_byte(cpu.hl);
-    if(r & 0x80) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    uint8_t r = read_byte(gb->cpu.hl);
+    if(r & 0x80) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r <<= 1;
-    if(cpu.af & FLAG_CY) r |= 0x01;
+    if(gb->cpu.af & FLAG_CY) r |= 0x01;
 
-    write_byte(cpu.hl, r);
+    write_byte(gb->cpu.hl, r);
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(4);
 }
 
@@ -2686,19 +2681,19 @@ void srl_hl() {
     disasm_log("srl (hl)\n");
 #endif
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
-    uint8_t r = read_byte(cpu.hl);
-    if(r & 0x01) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    uint8_t r = read_byte(gb->cpu.hl);
+    if(r & 0x01) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r >>= 1;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    write_byte(cpu.hl, r);
-    cpu.pc += 2;
+    write_byte(gb->cpu.hl, r);
+    gb->cpu.pc += 2;
     count_cycles(4);
 }
 
@@ -2707,24 +2702,24 @@ void rr_hl() {
     disasm_log("rr (hl)\n");
 #endif
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
     uint8_t old_cy;
-    if(cpu.af & FLAG_CY) old_cy = 0x80;
+    if(gb->cpu.af & FLAG_CY) old_cy = 0x80;
     else old_cy = 0x00;
 
-    uint8_t r = read_byte(cpu.hl);
-    if(r & 0x01) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    uint8_t r = read_byte(gb->cpu.hl);
+    if(r & 0x01) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r >>= 1;
     r |= old_cy;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    write_byte(cpu.hl, r);
-    cpu.pc += 2;
+    write_byte(gb->cpu.hl, r);
+    gb->cpu.pc += 2;
     count_cycles(4);
 }
 
@@ -2733,24 +2728,24 @@ void rl_hl() {
     disasm_log("rl (hl)\n");
 #endif
 
-    uint8_t r = read_byte(cpu.hl);
+    uint8_t r = read_byte(gb->cpu.hl);
     uint8_t old_cy;
-    if(cpu.af & FLAG_CY) old_cy = 0x01;
+    if(gb->cpu.af & FLAG_CY) old_cy = 0x01;
     else old_cy = 0x00;
 
-    if(r & 0x80) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(r & 0x80) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r <<= 1;
     r |= old_cy;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
 
-    write_byte(cpu.hl, r);
-    cpu.pc += 2;
+    write_byte(gb->cpu.hl, r);
+    gb->cpu.pc += 2;
     count_cycles(4);
 }
 
@@ -2759,20 +2754,20 @@ void sla_hl() {
     disasm_log("sla (hl)\n");
 #endif
 
-    cpu.af &= ~(FLAG_H | FLAG_N);
+    gb->cpu.af &= ~(FLAG_H | FLAG_N);
 
-    uint8_t r = read_byte(cpu.hl);
-    if(r & 0x80) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    uint8_t r = read_byte(gb->cpu.hl);
+    if(r & 0x80) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r <<= 1;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    write_byte(cpu.hl, r);
+    write_byte(gb->cpu.hl, r);
 
-    cpu.pc += 2;
+    gb->cpu.pc += 2;
     count_cycles(4);
 }
 
@@ -2781,23 +2776,23 @@ void sra_hl() {
     disasm_log("sra (hl)\n");
 #endif
 
-    uint8_t r = read_byte(cpu.hl);
+    uint8_t r = read_byte(gb->cpu.hl);
     uint8_t new_msb;
     if(r & 0x80) new_msb = 0x80;
     else new_msb = 0x00;
 
-    if(r & 0x01) cpu.af |= FLAG_CY;
-    else cpu.af &= (~FLAG_CY);
+    if(r & 0x01) gb->cpu.af |= FLAG_CY;
+    else gb->cpu.af &= (~FLAG_CY);
 
     r >>= 1;
     r |= new_msb;
 
-    if(!r) cpu.af |= FLAG_ZF;
-    else cpu.af &= (~FLAG_ZF);
+    if(!r) gb->cpu.af |= FLAG_ZF;
+    else gb->cpu.af &= (~FLAG_ZF);
 
-    cpu.af &= ~(FLAG_N | FLAG_H);
-    write_byte(cpu.hl, r);
-    cpu.pc += 2;
+    gb->cpu.af &= ~(FLAG_N | FLAG_H);
+    write_byte(gb->cpu.hl, r);
+    gb->cpu.pc += 2;
     count_cycles(4);
 }
 
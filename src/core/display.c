@@ -4,6 +4,7 @@
 
 #include <tinygb.h>
 #include <ioports.h>
+#include <state.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -31,26 +32,13 @@ Notes to self regarding how the display works:
 #define HDMA_GENERAL        0
 #define HDMA_HBLANK         1
 
-display_t display;
-int display_cycles = 0;
+__thread uint32_t *scaled_framebuffer;   // host-side, not part of the emulated state
 
-void *vram;
-uint32_t *framebuffer, *scaled_framebuffer, *temp_framebuffer;
-uint32_t *background_buffer;
-uint8_t oam[OAM_SIZE];
+__thread int scaled_w, scaled_h;
 
-int scaled_w, scaled_h;
+__thread int drawn_frames = 0;
 
-int framecount = 0;
-int hdma_active = 0;
-int hdma_type;
-
-static int line_rendered = 0;
-
-int hdma_hblank_next_line;
-int hdma_hblank_cycles = 0;
-
-int drawn_frames = 0;
+int scaling = 1, frameskip = 0;     // set from tinygb.ini by the frontend
 
 uint32_t bw_palette[4] = {
     0xC4CFA1, 0x8B956D, 0x4D533C, 0x1F1F1F
@@ -69,8 +57,6 @@ uint32_t preset_palettes[10][4] = {
     {0xFFFFFF, 0xAAAAAA, 0x555555, 0x000000},   // 9
 };
 
-uint32_t cgb_palette[4];
-
 int monochrome_palette;
 
 // dummy debug function
@@ -81,8 +67,8 @@ void cgb_dump_bgpd() {
 
     for(int i = 0; i < 8; i++) {
         for(int j = 0; j < 4; j++) {
-            color16 = display.bgpd[(i*8)+(j*2)];
-            color16 |= (display.bgpd[(i*8)+(j*2)+1] << 8);
+            color16 = gb->display.bgpd[(i*8)+(j*2)];
+            color16 |= (gb->display.bgpd[(i*8)+(j*2)+1] << 8);
 
             color32 = truecolor(color16);
             r = (color32 >> 16) & 0xFF;
@@ -101,8 +87,8 @@ void cgb_dump_obpd() {
 
     for(int i = 0; i < 8; i++) {
         for(int j = 0; j < 4; j++) {
-            color16 = display.obpd[(i*8)+(j*2)];
-            color16 |= (display.obpd[(i*8)+(j*2)+1] << 8);
+            color16 = gb->display.obpd[(i*8)+(j*2)];
+            color16 |= (gb->display.obpd[(i*8)+(j*2)+1] << 8);
 
             color32 = truecolor(color16);
             r = (color32 >> 16) & 0xFF;
@@ -140,55 +126,44 @@ void prev_palette() {
 }
 
 void display_start() {
-    memset(&display, 0, sizeof(display_t));
-    display.lcdc = 0x91;
-    display.scy = 0;
-    display.scx = 0;
-    display.ly = 0;
-    display.lyc = 0;
-    display.bgp = 0xFC;
-    display.obp0 = 0xFF;
-    display.obp1 = 0xFF;
-    display.wy = 0;
-    display.wx = 0;
+    memset(&gb->display, 0, sizeof(display_t));
+    gb->display.lcdc = 0x91;
+    gb->display.scy = 0;
+    gb->display.scx = 0;
+    gb->display.ly = 0;
+    gb->display.lyc = 0;
+    gb->display.bgp = 0xFC;
+    gb->display.obp0 = 0xFF;
+    gb->display.obp1 = 0xFF;
+    gb->display.wy = 0;
+    gb->display.wx = 0;
 
     load_bw_palette();
 
-    if(is_cgb) {
+    if(gb->is_cgb) {
         for(int i = 0; i < 32; i++) {
             // bg palette is initialized to white in CGB
-            display.bgpd[i*2] = 0xFF;
-            display.bgpd[(i*2)+1] = 0x7F;
+            gb->display.bgpd[i*2] = 0xFF;
+            gb->display.bgpd[(i*2)+1] = 0x7F;
         }
     }
 
     scaled_w = scaling*GB_WIDTH;
     scaled_h = scaling*GB_HEIGHT;
 
-    vram = calloc(1, 16384);    // 8 KB for original gb, 2x8 KB for CGB
-    if(!vram) {
-        die(-1, "unable to allocate memory for VRAM\n");
-    }
-
-    framebuffer = calloc(GB_WIDTH*GB_HEIGHT, 4);
-    temp_framebuffer = calloc(GB_WIDTH*GB_HEIGHT, 4);
-    background_buffer = calloc(256*256, 4);
-    if(scaling != 1) scaled_framebuffer = calloc(GB_WIDTH*GB_HEIGHT, 4*scaling*scaling*4);
-    else scaled_framebuffer = framebuffer;
-
-    if(!framebuffer || !scaled_framebuffer || !temp_framebuffer || !background_buffer) {
-        die(-1, "unable to allocate memory for framebuffer\n");
-    }
+    // VRAM and the unscaled framebuffers are part of the state arena
+    if(scaling != 1) scaled_framebuffer = state_alloc(scaled_w*scaled_h*4, "scaled framebuffer");
+    else scaled_framebuffer = gb->framebuffer;
 
     write_log("[display] initialized display\n");
 }
 
 void handle_general_hdma() {
-    uint16_t src = (display.hdma1 << 8) | (display.hdma2 & 0xF0);
-    uint16_t dst = ((display.hdma3 & 0x1F) << 8) | (display.hdma4 & 0xF0);
+    uint16_t src = (gb->display.hdma1 << 8) | (gb->display.hdma2 & 0xF0);
+    uint16_t dst = ((gb->display.hdma3 & 0x1F) << 8) | (gb->display.hdma4 & 0xF0);
     dst += 0x8000;
 
-    int count = (display.hdma5 + 1) << 4;
+    int count = (gb->display.hdma5 + 1) << 4;
 
 #ifdef DISPLAY_LOG
     write_log("[display] handle general HDMA transfer from 0x%04X to 0x%04X, %d bytes\n", src, dst, count);
@@ -198,16 +173,16 @@ void handle_general_hdma() {
         write_byte(dst+i, read_byte(src+i));
     }
 
-    display.hdma5 = 0xFF;
+    gb->display.hdma5 = 0xFF;
 }
 
 void handle_hblank_hdma() {
-    uint16_t src = (display.hdma1 << 8) | (display.hdma2 & 0xF0);
-    uint16_t dst = ((display.hdma3 & 0x1F) << 8) | (display.hdma4 & 0xF0);
+    uint16_t src = (gb->display.hdma1 << 8) | (gb->display.hdma2 & 0xF0);
+    uint16_t dst = ((gb->display.hdma3 & 0x1F) << 8) | (gb->display.hdma4 & 0xF0);
     dst += 0x8000; 
 
 #ifdef DISPLAY_LOG
-    write_log("[display] handle H-blank HDMA transfer from 0x%04X to 0x%04X, 16 bytes at LY=%d\n", src, dst, display.ly);
+    write_log("[display] handle H-blank HDMA transfer from 0x%04X to 0x%04X, 16 bytes at LY=%d\n", src, dst, gb->display.ly);
 #endif
 
     for(int i = 0; i < 16; i++) {
@@ -218,18 +193,18 @@ void handle_hblank_hdma() {
     dst += 16;
     dst -= 0x8000;
 
-    display.hdma1 = (src >> 8) & 0xFF;
-    display.hdma2 = src & 0xF0;
-    display.hdma3 = (dst >> 8) & 0x1F;
-    display.hdma4 = dst & 0xF0;
+    gb->display.hdma1 = (src >> 8) & 0xFF;
+    gb->display.hdma2 = src & 0xF0;
+    gb->display.hdma3 = (dst >> 8) & 0x1F;
+    gb->display.hdma4 = dst & 0xF0;
 
-    display.hdma5--;
-    if(display.hdma5 == 0x7F) {
+    gb->display.hdma5--;
+    if(gb->display.hdma5 == 0x7F) {
         // done
 #ifdef DISPLAY_LOG
         write_log("[display] completed H-blank transfer\n");
 #endif
-        display.hdma5 = 0xFF;
+        gb->display.hdma5 = 0xFF;
     }
 }
 
@@ -239,129 +214,130 @@ void display_write(uint16_t addr, uint8_t byte) {
 #ifdef DISPLAY_LOG
         write_log("[display] write to LCDC register value 0x%02X\n", byte);
 #endif
-        display.lcdc = byte;
+        gb->display.lcdc = byte;
         return;
     case STAT:
 #ifdef DISPLAY_LOG
         write_log("[display] write to STAT register value 0x%02X, ignoring lowest 3 bits\n", byte);
 #endif
         byte &= 0xF8;
-        display.stat &= 7;
-        display.stat |= byte;
+        gb->display.stat &= 7;
+        gb->display.stat |= byte;
         return;
     case SCX:
 #ifdef DISPLAY_LOG
         write_log("[display] write to SCX register value 0x%02X\n", byte);
 #endif
-        display.scx = byte;
+        gb->display.scx = byte;
         return;
     case SCY:
 #ifdef DISPLAY_LOG
         write_log("[display] write to SCY register value 0x%02X\n", byte);
 #endif
-        display.scy = byte;
+        gb->display.scy = byte;
         return;
     case LY:
 #ifdef DISPLAY_LOG
         write_log("[display] write to LY register, resetting...\n");
 #endif
-        display.ly = 0;
+        gb->display.ly = 0;
         return;
     case LYC:
 #ifdef DISPLAY_LOG
         write_log("[display] write to LYC register value 0x%02X\n", byte);
 #endif
-        display.lyc = byte;
+        gb->display.lyc = byte;
         return;
     case BGP:
 #ifdef DISPLAY_LOG
         write_log("[display] write to BGP register value 0x%02X\n", byte);
 #endif
-        display.bgp = byte;
+        gb->display.bgp = byte;
         return;
     case OBP0:
 #ifdef DISPLAY_LOG
         write_log("[display] write to OBP0 register value 0x%02X\n", byte);
 #endif
-        display.obp0 = byte;
+        gb->display.obp0 = byte;
         return;
     case OBP1:
 #ifdef DISPLAY_LOG
         write_log("[display] write to OBP1 register value 0x%02X\n", byte);
 #endif
-        display.obp1 = byte;
+        gb->display.obp1 = byte;
         return;
     case WX:
 #ifdef DISPLAY_LOG
         write_log("[display] write to WX register value 0x%02X\n", byte);
 #endif
-        display.wx = byte;
+        gb->display.wx = byte;
         return;
     case WY:
 #ifdef DISPLAY_LOG
         write_log("[display] write to WY register value 0x%02X\n", byte);
 #endif
-        display.wy = byte;
+        gb->display.wy = byte;
         return;
     case DMA:
 #ifdef DISPLAY_LOG
         write_log("[display] write to DMA register value 0x%02X\n", byte);
 #endif
-        display.dma = byte;
+        gb->display.dma = byte;
         return;
     case VBK:
-        if(is_cgb) {
+        if(gb->is_cgb) {
 #ifdef DISPLAY_LOG
             write_log("[display] write to VBK register value 0x%02X, ignoring upper 7 bits...\n", byte);
 #endif
 
             byte &= 1;  // only lowest bit matters
-            display.vbk = byte;
+            gb->display.vbk = byte;
+            gb->vram_bank_ptr = gb->vram + (8192 * byte);
         } else {
             //write_log("[display] write to VBK register value 0x%02X in non-CGB mode, ignoring...\n", byte);
         }
     case HDMA1:
-        if(is_cgb) {
+        if(gb->is_cgb) {
 #ifdef DISPLAY_LOG
             write_log("[display] write to HDMA1 register value 0x%02X\n", byte);
 #endif
-            display.hdma1 = byte;
+            gb->display.hdma1 = byte;
         } else {
             //write_log("[display] write to HDMA1 register value 0x%02X in non-CGB mode, ignoring...\n", byte);
         }
         return;
     case HDMA2:
-        if(is_cgb) {
+        if(gb->is_cgb) {
 #ifdef DISPLAY_LOG
             write_log("[display] write to HDMA2 register value 0x%02X\n", byte);
 #endif
-            display.hdma2 = byte;
+            gb->display.hdma2 = byte;
         } else {
             //write_log("[display] write to HDMA2 register value 0x%02X in non-CGB mode, ignoring...\n", byte);
         }
         return;
     case HDMA3:
-        if(is_cgb) {
+        if(gb->is_cgb) {
 #ifdef DISPLAY_LOG
             write_log("[display] write to HDMA3 register value 0x%02X\n", byte);
 #endif
-            display.hdma3 = byte;
+            gb->display.hdma3 = byte;
         } else {
             //write_log("[display] write to HDMA3 register value 0x%02X in non-CGB mode, ignoring...\n", byte);
         }
         return;
     case HDMA4:
-        if(is_cgb) {
+        if(gb->is_cgb) {
 #ifdef DISPLAY_LOG
             write_log("[display] write to HDMA4 register value 0x%02X\n", byte);
 #endif
-            display.hdma4 = byte;
+            gb->display.hdma4 = byte;
         } else {
             //write_log("[display] write to HDMA4 register value 0x%02X in non-CGB mode, ignoring...\n", byte);
         }
         return;
     case HDMA5:
-        if(is_cgb) {
+        if(gb->is_cgb) {
 #ifdef DISPLAY_LOG
             write_log("[display] write to HDMA5 register value 0x%02X\n", byte);
 #endif
@@ -369,22 +345,22 @@ void display_write(uint16_t addr, uint8_t byte) {
             if(byte & 0x80) {
                 // H-blank DMA
 #ifdef DISPLAY_LOG
-                write_log("[display] H-blank DMA %d bytes from 0x%02X%02X to VRAM 0x%02X%02X\n", ((byte & 0x7F) + 1)*16, display.hdma1, display.hdma2, (display.hdma3 & 0x1F) + 0x80, display.hdma4);
+                write_log("[display] H-blank DMA %d bytes from 0x%02X%02X to VRAM 0x%02X%02X\n", ((byte & 0x7F) + 1)*16, gb->display.hdma1, gb->display.hdma2, (gb->display.hdma3 & 0x1F) + 0x80, gb->display.hdma4);
 #endif
-                display.hdma5 = byte;   // display_cycle() will handle the rest from here
-                if(!(display.stat & 3)) {   // already in mode 0 (H-blank)
+                gb->display.hdma5 = byte;   // display_cycle() will handle the rest from here
+                if(!(gb->display.stat & 3)) {   // already in mode 0 (H-blank)
                     handle_hblank_hdma();
                 }
             } else {
                 // differentiate between general purpose DMA and cancelling H-blank DMA
-                if(display.hdma5 == 0xFF || !(display.hdma5 & 0x80)) {
-                    display.hdma5 = byte;
+                if(gb->display.hdma5 == 0xFF || !(gb->display.hdma5 & 0x80)) {
+                    gb->display.hdma5 = byte;
                     handle_general_hdma();
                 } else {
 #ifdef DISPLAY_LOG
                     write_log("[display] cancelled H-blank DMA transfer\n");
 #endif
-                    display.hdma5 &= 0x7F;
+                    gb->display.hdma5 &= 0x7F;
                 }
             }
 
@@ -393,42 +369,42 @@ void display_write(uint16_t addr, uint8_t byte) {
         }
         return;
     case BGPI:
-        if(!is_cgb) {
+        if(!gb->is_cgb) {
             //write_log("[display] write to BGPI register value 0x%02X in non-CGB mode, ignoring...\n", byte);
         } else {
-            display.bgpi = byte;
+            gb->display.bgpi = byte;
         }
         return;
     case OBPI:
-        if(!is_cgb) {
+        if(!gb->is_cgb) {
             //write_log("[display] write to OBPI register value 0x%02X in non-CGB mode, ignoring...\n", byte);
         } else {
-            display.obpi = byte;
+            gb->display.obpi = byte;
         }
         return;
     case BGPD:
-        if(!is_cgb) {
+        if(!gb->is_cgb) {
             //write_log("[display] write to BGPD register value 0x%02X in non-CGB mode, ignoring...\n", byte);
         } else {
-            int index = display.bgpi & 0x3F;
-            display.bgpd[index] = byte;
+            int index = gb->display.bgpi & 0x3F;
+            gb->display.bgpd[index] = byte;
 
-            if(display.bgpi & 0x80) {   // auto increment
+            if(gb->display.bgpi & 0x80) {   // auto increment
                 index++;
-                display.bgpi = (index & 0x3F) | 0x80;
+                gb->display.bgpi = (index & 0x3F) | 0x80;
             }
         }
         return;
     case OBPD:
-        if(!is_cgb) {
+        if(!gb->is_cgb) {
             //write_log("[display] write to OBPD register value 0x%02X in non-CGB mode, ignoring...\n", byte);
         } else {
-            int index = display.obpi & 0x3F;
-            display.obpd[index] = byte;
+            int index = gb->display.obpi & 0x3F;
+            gb->display.obpd[index] = byte;
 
-            if(display.obpi & 0x80) {   // auto increment
+            if(gb->display.obpi & 0x80) {   // auto increment
                 index++;
-                display.obpi = (index & 0x3F) | 0x80;
+                gb->display.obpi = (index & 0x3F) | 0x80;
             }
         }
         return;
@@ -441,53 +417,53 @@ void display_write(uint16_t addr, uint8_t byte) {
 uint8_t display_read(uint16_t addr) {
     switch(addr) {
     case LCDC:
-        return display.lcdc;
+        return gb->display.lcdc;
     case STAT:
-        return display.stat;
+        return gb->display.stat;
     case SCY:
-        return display.scy;
+        return gb->display.scy;
     case SCX:
-        return display.scx;
+        return gb->display.scx;
     case LY:
-        return display.ly;
+        return gb->display.ly;
     case LYC:
-        return display.lyc;
+        return gb->display.lyc;
     case DMA:
         write_log("[display] undefined read from write-only DMA register, returning ones\n");
         return 0xFF;
     case BGP:
-        return display.bgp;
+        return gb->display.bgp;
     case OBP0:
-        return display.obp0;
+        return gb->display.obp0;
     case OBP1:
-        return display.obp1;
+        return gb->display.obp1;
     case WX:
-        return display.wx;
+        return gb->display.wx;
     case WY:
-        return display.wy;
+        return gb->display.wy;
     case VBK:
-        if(is_cgb) {
-            return display.vbk;
+        if(gb->is_cgb) {
+            return gb->display.vbk;
         } else {
             //write_log("[display] undefined read from VBK in non-CGB mode, returning ones\n");
             return 0xFF;
         }
     case HDMA1:
-        if(is_cgb) return display.hdma1;
+        if(gb->is_cgb) return gb->display.hdma1;
         else return 0xFF;
     case HDMA2:
-        if(is_cgb) return display.hdma2;
+        if(gb->is_cgb) return gb->display.hdma2;
         else return 0xFF;
     case HDMA3:
-        if(is_cgb) return display.hdma3;
+        if(gb->is_cgb) return gb->display.hdma3;
         else return 0xFF;
     case HDMA4:
-        if(is_cgb) return display.hdma4;
+        if(gb->is_cgb) return gb->display.hdma4;
         else return 0xFF;
     case HDMA5:
-        if(is_cgb) {
-            if(display.hdma5 == 0xFF) return 0xFF;
-            else return display.hdma5 ^ 0x80;   // 0 = active, 1 = inactive, contrary to common sense 
+        if(gb->is_cgb) {
+            if(gb->display.hdma5 == 0xFF) return 0xFF;
+            else return gb->display.hdma5 ^ 0x80;   // 0 = active, 1 = inactive, contrary to common sense 
         }
         else return 0xFF;
     default:
@@ -509,11 +485,13 @@ void scale_xline(uint32_t *new, uint32_t *old, int scaled_width) {
 }
 
 void update_framebuffer() {
+    if(headless || hide_video) return;
+
     // scale up the buffer
     if(scaling != 1) {
         for(int y = 0; y < scaled_h; y++) {
             uint32_t *dst = scaled_framebuffer + (y * scaled_w);
-            uint32_t *src = framebuffer + ((y / scaling) * GB_WIDTH);
+            uint32_t *src = gb->framebuffer + ((y / scaling) * GB_WIDTH);
 
             scale_xline(dst, src, scaled_w);
         }
@@ -548,11 +526,11 @@ void cgb_bg_palette(int palette) {  // dump the palette into cgb_palette[]
     uint32_t color32;
 
     for(int i = 0; i < 4; i++) {
-        color16 = display.bgpd[(palette<<3)+(i<<1)] & 0xFF;
-        color16 |= (display.bgpd[(palette<<3)+(i<<1)+1] & 0xFF) << 8;
+        color16 = gb->display.bgpd[(palette<<3)+(i<<1)] & 0xFF;
+        color16 |= (gb->display.bgpd[(palette<<3)+(i<<1)+1] & 0xFF) << 8;
         color32 = truecolor(color16);
 
-        cgb_palette[i] = color32;
+        gb->cgb_palette[i] = color32;
     }
 }
 
@@ -561,11 +539,11 @@ void cgb_obj_palette(int palette) {  // dump the palette into cgb_palette[]
     uint32_t color32;
 
     for(int i = 0; i < 4; i++) {
-        color16 = display.obpd[(palette<<3)+(i<<1)] & 0xFF;
-        color16 |= (display.obpd[(palette<<3)+(i<<1)+1] & 0xFF) << 8;
+        color16 = gb->display.obpd[(palette<<3)+(i<<1)] & 0xFF;
+        color16 |= (gb->display.obpd[(palette<<3)+(i<<1)+1] & 0xFF) << 8;
         color32 = truecolor(color16);
 
-        cgb_palette[i] = color32;
+        gb->cgb_palette[i] = color32;
     }
 }
 
@@ -616,15 +594,15 @@ void plot_bg_tile(int is_window, int x, int y, uint8_t tile, uint8_t *tile_data,
     int visible_row;    // only draw one row, save 8x performance
 
     if(!is_window) {
-        if(display.scy >= 113) {    // 255 minus 143
+        if(gb->display.scy >= 113) {    // 255 minus 143
             // a wraparound will inevitably occur
-            int bg_line = display.scy + display.ly;
+            int bg_line = gb->display.scy + gb->display.ly;
 
             if(bg_line >= 256) {
                 // wrap occured
                 bg_line -= 256;
 
-                int wrapped_ly = display.ly - (256 - display.scy);
+                int wrapped_ly = gb->display.ly - (256 - gb->display.scy);
                 if(!((wrapped_ly) >= yp && (wrapped_ly) <= (yp+7))) {
                     return;
                 }
@@ -632,24 +610,24 @@ void plot_bg_tile(int is_window, int x, int y, uint8_t tile, uint8_t *tile_data,
                 visible_row = wrapped_ly - yp;
             } else {
                 // no wrap
-                if(!((display.ly+display.scy) >= yp && (display.ly+display.scy) <= (yp+7))) {
+                if(!((gb->display.ly+gb->display.scy) >= yp && (gb->display.ly+gb->display.scy) <= (yp+7))) {
                     return;   // save a fuckton of performance
                 }
 
-                visible_row = (display.ly+display.scy) - yp;
+                visible_row = (gb->display.ly+gb->display.scy) - yp;
             }
         } else {
-            if(!((display.ly+display.scy) >= yp && (display.ly+display.scy) <= (yp+7))) {
+            if(!((gb->display.ly+gb->display.scy) >= yp && (gb->display.ly+gb->display.scy) <= (yp+7))) {
                 return;   // save a fuckton of performance
             }
 
-            visible_row = (display.ly+display.scy) - yp;
+            visible_row = (gb->display.ly+gb->display.scy) - yp;
         }
     } else {
         if(xp >= GB_WIDTH || yp >= GB_HEIGHT) return;
-        if(!(display.ly >= (yp+display.wy) && display.ly <= (yp+display.wy+7))) return;
+        if(!(gb->display.ly >= (yp+gb->display.wy) && gb->display.ly <= (yp+gb->display.wy+7))) return;
 
-        visible_row = display.ly - (yp+display.wy);
+        visible_row = gb->display.ly - (yp+gb->display.wy);
     }
 
     //if(!is_window) {
@@ -672,7 +650,7 @@ void plot_bg_tile(int is_window, int x, int y, uint8_t tile, uint8_t *tile_data,
 
     int cgb_palette_number;
 
-    if(display.lcdc & 0x10) ptr = tile_data + (tile * 16);  // normal positive
+    if(gb->display.lcdc & 0x10) ptr = tile_data + (tile * 16);  // normal positive
     else {
         tile_data += 0x800;     // to 0x9000
 
@@ -688,12 +666,12 @@ void plot_bg_tile(int is_window, int x, int y, uint8_t tile, uint8_t *tile_data,
         }
     }
 
-    if(is_cgb && (cgb_flags & 0x08)) {
+    if(gb->is_cgb && (cgb_flags & 0x08)) {
         // tile is in bank 1
         ptr += 8192;
     }
 
-    if(is_cgb) {
+    if(gb->is_cgb) {
         cgb_palette_number = cgb_flags & 7;
         cgb_bg_palette(cgb_palette_number);
     }
@@ -724,14 +702,14 @@ void plot_bg_tile(int is_window, int x, int y, uint8_t tile, uint8_t *tile_data,
 
                 //printf("data for x/y %d/%d is %d\n", i, j, data);
 
-                if(!is_cgb) {
-                    color_index = (display.bgp >> (data * 2)) & 3;
+                if(!gb->is_cgb) {
+                    color_index = (gb->display.bgp >> (data * 2)) & 3;
                     color = bw_palette[color_index];
                 } else {
-                    color = cgb_palette[data];
+                    color = gb->cgb_palette[data];
                 }
 
-                background_buffer[(yp * 256) + xp] = color;
+                gb->background_buffer[(yp * 256) + xp] = color;
 
                 /*if(color != 0xFFFFFF) {
                     printf("h");
@@ -746,9 +724,9 @@ void plot_bg_tile(int is_window, int x, int y, uint8_t tile, uint8_t *tile_data,
         ptr += 2;
     }
 
-    if(is_cgb) {
-        if(cgb_flags & 0x20) hflip_tile(background_buffer, x << 3, y << 3);
-        if(cgb_flags & 0x40) vflip_tile(background_buffer, x << 3, y << 3);
+    if(gb->is_cgb) {
+        if(cgb_flags & 0x20) hflip_tile(gb->background_buffer, x << 3, y << 3);
+        if(cgb_flags & 0x40) vflip_tile(gb->background_buffer, x << 3, y << 3);
     }
 }
 
@@ -805,7 +783,7 @@ void plot_small_sprite(int n) {
         return;
     }*/
 
-    uint8_t *oam_data = oam + (n * 4);
+    uint8_t *oam_data = gb->oam_copy + (n * 4);
 
     uint8_t x, y, tile, flags;
     y = oam_data[0];
@@ -821,12 +799,12 @@ void plot_small_sprite(int n) {
     x -= 8;
     y -= 16;
 
-    if(!(display.ly >= y && display.ly <= y+8)) return;   // performance
+    if(!(gb->display.ly >= y && gb->display.ly <= y+8)) return;   // performance
 
     //write_log("[display] plotting tile %d at x/y %d/%d\n", tile, x, y);
 
     // 8x8 tiles
-    uint8_t *tile_data = vram + 0x0000;     // always starts at 0x8000, unlike bg/window
+    uint8_t *tile_data = gb->vram + 0x0000;     // always starts at 0x8000, unlike bg/window
     uint8_t *ptr = tile_data + (tile * 16);
 
     uint32_t sprite_colors[64];    // 8x8
@@ -834,12 +812,12 @@ void plot_small_sprite(int n) {
     int sprite_data_index = 0;
     int cgb_palette_number;
 
-    if(!is_cgb) {
+    if(!gb->is_cgb) {
         // get bg color zero for layering
-        bg_color_zero = bw_palette[display.bgp & 3];
+        bg_color_zero = bw_palette[gb->display.bgp & 3];
     } else {
         cgb_bg_palette(0);
-        bg_color_zero = cgb_palette[0];
+        bg_color_zero = gb->cgb_palette[0];
 
         // prepare cgb palette
         cgb_palette_number = flags & 7;
@@ -859,14 +837,14 @@ void plot_small_sprite(int n) {
 
             data = data_hi | data_lo;
 
-            if(!is_cgb) {
+            if(!gb->is_cgb) {
                 // monochrome palettes
-                if(flags & 0x10) color_index = (display.obp1 >> (data * 2)) & 3;    // palette 1
-                else color_index = (display.obp0 >> (data * 2)) & 3;    // palette 0
+                if(flags & 0x10) color_index = (gb->display.obp1 >> (data * 2)) & 3;    // palette 1
+                else color_index = (gb->display.obp0 >> (data * 2)) & 3;    // palette 0
                 color = bw_palette[color_index];
             } else {
                 // cgb palettes
-                color = cgb_palette[data];
+                color = gb->cgb_palette[data];
             }
 
             sprite_colors[sprite_data_index] = color;
@@ -890,12 +868,12 @@ void plot_small_sprite(int n) {
                 // sprite is behind bg colors 1-3, on top of bg color 0
 
                 // get bg color
-                bg_color = temp_framebuffer[((i + y) * GB_WIDTH) + (j + x)];
-                if((bg_color == bg_color_zero) && sprite_data[sprite_data_index]) temp_framebuffer[((i + y) * GB_WIDTH) + (j + x)] = sprite_colors[sprite_data_index];
+                bg_color = gb->temp_framebuffer[((i + y) * GB_WIDTH) + (j + x)];
+                if((bg_color == bg_color_zero) && sprite_data[sprite_data_index]) gb->temp_framebuffer[((i + y) * GB_WIDTH) + (j + x)] = sprite_colors[sprite_data_index];
             } else {
                 // sprite is on top of bg, normal scenario
                 // sprite color value zero means transparent, so only plot non-zero values
-                if(sprite_data[sprite_data_index]) temp_framebuffer[((i + y) * GB_WIDTH) + (j + x)] = sprite_colors[sprite_data_index];
+                if(sprite_data[sprite_data_index]) gb->temp_framebuffer[((i + y) * GB_WIDTH) + (j + x)] = sprite_colors[sprite_data_index];
             }
 
             sprite_data_index++;
@@ -906,12 +884,12 @@ void plot_small_sprite(int n) {
 }
 
 void render_line() {
-    uint32_t *src = temp_framebuffer + (display.ly * GB_WIDTH);
-    uint32_t *dst = framebuffer + (display.ly * GB_WIDTH);
+    uint32_t *src = gb->temp_framebuffer + (gb->display.ly * GB_WIDTH);
+    uint32_t *dst = gb->framebuffer + (gb->display.ly * GB_WIDTH);
 
-    if(is_sgb && sgb_screen_mask) {
+    if(gb->is_sgb && gb->sgb_screen_mask) {
         uint32_t sgb_blank_color;
-        switch(sgb_screen_mask) {
+        switch(gb->sgb_screen_mask) {
         case 1:         // freeze at current frame
             return;
         case 2:         // freeze black
@@ -930,24 +908,24 @@ void render_line() {
     }
 
     // renders a single horizontal line
-    copy_oam(oam);
+    copy_oam(gb->oam_copy);
 
     uint8_t *bg_win_tiles;
-    if(display.lcdc & 0x10) bg_win_tiles = vram + 0;    // 0x8000-0x8FFF
-    else bg_win_tiles = vram + 0x800;    // 0x8800-0x97FF
+    if(gb->display.lcdc & 0x10) bg_win_tiles = gb->vram + 0;    // 0x8000-0x8FFF
+    else bg_win_tiles = gb->vram + 0x800;    // 0x8800-0x97FF
 
     // test if background is enabled
-    if(display.lcdc & 0x01) {
+    if(gb->display.lcdc & 0x01) {
         uint8_t *bg_map;
         uint8_t *bg_cgb_flags;
-        if(display.lcdc & 0x08) bg_map = vram + 0x1C00;     // 0x9C00-0x9FFF
-        else bg_map = vram + 0x1800;     // 0x9800-0x9BFF
+        if(gb->display.lcdc & 0x08) bg_map = gb->vram + 0x1C00;     // 0x9C00-0x9FFF
+        else bg_map = gb->vram + 0x1800;     // 0x9800-0x9BFF
 
         bg_cgb_flags = bg_map + 8192;   // next bank
 
         for(int y = 0; y < 32; y++) {
             for(int x = 0; x < 32; x++) {
-                plot_bg_tile(0, x, y, *bg_map, bg_win_tiles, *bg_cgb_flags);
+                plot_bg_tile(0, x, y, *bg_map, bg_win_tiles, gb->is_cgb ? *bg_cgb_flags : 0);
                 bg_map++;
                 bg_cgb_flags++;
             }
@@ -956,15 +934,15 @@ void render_line() {
         // here the background has been drawn, copy the visible part of it
         //write_log("[display] rendering background, SCY = %d, SCX = %d, LY = %d\n", display.scy, display.scx, display.ly);
         int temp_index = 0;
-        unsigned int bg_index = display.scy * 256;
-        unsigned int bg_x = display.scx, bg_y = display.scy;
+        unsigned int bg_index = gb->display.scy * 256;
+        unsigned int bg_x = gb->display.scx, bg_y = gb->display.scy;
 
         for(int y = 0; y < GB_HEIGHT; y++) {
             if(bg_y > 255) {
                 bg_y = 0;
             }
 
-            bg_x = display.scx;
+            bg_x = gb->display.scx;
             bg_index = (bg_y * 256) + bg_x;
 
             for(int x = 0; x < GB_WIDTH; x++) {
@@ -974,7 +952,7 @@ void render_line() {
                 }
 
                 //temp_framebuffer[(y * GB_WIDTH) + x] = background_buffer[((y + display.scy) * 256) + (x + display.scx)];
-                temp_framebuffer[temp_index+x] = background_buffer[bg_index+x];
+                gb->temp_framebuffer[temp_index+x] = gb->background_buffer[bg_index+x];
 
                 bg_x++;
             }
@@ -986,24 +964,24 @@ void render_line() {
     } else {
         // no background, clear to white
         for(int i = 0; i < GB_WIDTH*GB_HEIGHT; i++) {
-            temp_framebuffer[i] = bw_palette[0];
+            gb->temp_framebuffer[i] = bw_palette[0];
         }
     }
 
     // window layer on top of the background
-    if(display.lcdc & 0x20) { // && display.wx >= 7 && display.wx <= 166 && display.wy <= 143) {
+    if(gb->display.lcdc & 0x20) { // && display.wx >= 7 && display.wx <= 166 && display.wy <= 143) {
         // window enabled
         uint8_t *win_map;
         uint8_t *win_cgb_flags;
-        if(display.lcdc & 0x40) win_map = vram + 0x1C00;    // 0x9C00-0x9FFF
-        else win_map = vram + 0x1800;   // 0x9800-0x9BFF
+        if(gb->display.lcdc & 0x40) win_map = gb->vram + 0x1C00;    // 0x9C00-0x9FFF
+        else win_map = gb->vram + 0x1800;   // 0x9800-0x9BFF
 
         win_cgb_flags = win_map + 8192;     // next bank
 
         // windows have the same format as backgrounds
         for(int y = 0; y < 32; y++) {
             for(int x = 0; x < 32; x++) {
-                plot_bg_tile(1, x, y, *win_map, bg_win_tiles, *win_cgb_flags);
+                plot_bg_tile(1, x, y, *win_map, bg_win_tiles, gb->is_cgb ? *win_cgb_flags : 0);
                 win_map++;
                 win_cgb_flags++;
             }
@@ -1011,16 +989,16 @@ void render_line() {
 
         // draw the window
         int wx;
-        if(display.wx <= 7) wx = 0;
-        else wx = display.wx - 7;
+        if(gb->display.wx <= 7) wx = 0;
+        else wx = gb->display.wx - 7;
 
-        int wy = display.wy;
+        int wy = gb->display.wy;
         int temp_index = (wy * GB_WIDTH) + (wx);
         int bg_index = 0;
 
         for(int y = 0; y < GB_HEIGHT - wy; y++) {
             for(int x = 0; x < GB_WIDTH - wx; x++) {
-                temp_framebuffer[temp_index + x] = background_buffer[bg_index + x];
+                gb->temp_framebuffer[temp_index + x] = gb->background_buffer[bg_index + x];
             }
 
             temp_index += GB_WIDTH;
@@ -1029,11 +1007,11 @@ void render_line() {
     }
 
     // object layer
-    if(display.lcdc & 0x02) {
+    if(gb->display.lcdc & 0x02) {
         // sprites are enabled
-        if(display.lcdc & 0x04) {
+        if(gb->display.lcdc & 0x04) {
             // 8x16 sprites
-            uint8_t *oam_data = oam;
+            uint8_t *oam_data = gb->oam_copy;
             uint8_t tile_store;
 
             for(int i = 0; i < 40; i++) {
@@ -1057,11 +1035,11 @@ void render_line() {
         }
     }
 
-    line_rendered = 1;
+    gb->line_rendered = 1;
 
     // done, copy the singular line we were at
-    if(using_sgb_palette) {
-        return sgb_recolor(dst, src, display.ly, bw_palette);
+    if(gb->using_sgb_palette) {
+        return sgb_recolor(dst, src, gb->display.ly, bw_palette);
     }
 
     for(int i = 0; i < GB_WIDTH; i++) {
@@ -1070,12 +1048,12 @@ void render_line() {
 }
 
 void display_cycle() {
-    if(!(display.lcdc & LCDC_ENABLE)) return;
-    display_cycles += timing.last_instruction_cycles;
+    if(!(gb->display.lcdc & LCDC_ENABLE)) return;
+    gb->display_cycles += gb->timing.last_instruction_cycles;
 
     // handle OAM DMA transfers if ongoing
-    if(display.dma) {
-        uint16_t dma_src = display.dma << 8;
+    if(gb->display.dma) {
+        uint16_t dma_src = gb->display.dma << 8;
 
 #ifdef DISPLAY_LOG
         //write_log("[display] DMA transfer from 0x%04X to sprite OAM region\n", dma_src);
@@ -1085,7 +1063,7 @@ void display_cycle() {
             write_byte(0xFE00+i, read_byte(dma_src+i));
         }
 
-        display.dma = 0;
+        gb->display.dma = 0;
     }
 
     // mode 2 = 0 -> 79
@@ -1093,82 +1071,84 @@ void display_cycle() {
     // mode 0 = 252 -> 455
 
     // mode 1 is a special case where it goes through all of these cycles 10 times
-    uint8_t mode = display.stat & 3;
+    uint8_t mode = gb->display.stat & 3;
 
     //write_log("[display] cycles = %d, mode = %d, LY = %d, STAT = 0x%02X\n", display_cycles, mode, display.ly, display.stat);
     if(mode == 1) {  // vblank is a special case
         //write_log("[display] in vblank, io_if = 0x%02X\n", io_if);
-        if(display_cycles >= 456) {
-            display_cycles -= 456;  // dont lose any cycles
+        if(gb->display_cycles >= 456) {
+            gb->display_cycles -= 456;  // dont lose any cycles
 
-            display.ly++;
-            line_rendered = 0;
-            if(display.ly >= 154) {
+            gb->display.ly++;
+            gb->line_rendered = 0;
+            if(gb->display.ly >= 154) {
                 // vblank is now over
-                display.stat &= 0xFC;
-                display.stat |= 2;      // enter mode 2
-                display.ly = 0;
+                gb->display.stat &= 0xFC;
+                gb->display.stat |= 2;      // enter mode 2
+                gb->display.ly = 0;
 
-                if(display.stat & 0x20) {
+                if(gb->display.stat & 0x20) {
                     send_interrupt(1);
                 }
             }
 
-            if(display.ly == display.lyc) {
+            if(!headless && !running_ahead && config_input_poll == POLL_SCANLINE) poll_input();
+
+            if(gb->display.ly == gb->display.lyc) {
                 // TODO: send STAT interrupt
-                display.stat |= 0x04;   // coincidence flag
-                if(display.stat & 0x40) {
+                gb->display.stat |= 0x04;   // coincidence flag
+                if(gb->display.stat & 0x40) {
                     //write_log("[display] sending STAT interrupt at LY=LYC=%d\n", display.ly);
                     send_interrupt(1);
                 }
             } else {
-                display.stat &= 0xFB;
+                gb->display.stat &= 0xFB;
             }
         }
     } else {
         // all other modes
-        if(display_cycles <= 79) {
+        if(gb->display_cycles <= 79) {
             // mode 2 -- reading OAM
-            display.stat &= 0xFC;
-            display.stat |= 2;
+            gb->display.stat &= 0xFC;
+            gb->display.stat |= 2;
 
-            if(mode != 2 && display.stat & 0x20) {
+            if(mode != 2 && gb->display.stat & 0x20) {
                 // just entered mode 2
                 //write_log("entered mode 2 on line %d\n", display.ly);
                 send_interrupt(1);
             }
-        } else if(display_cycles <= 251) {
+        } else if(gb->display_cycles <= 251) {
             // mode 3 -- reading OAM and VRAM
-            display.stat &= 0xFC;
-            display.stat |= 3;
+            gb->display.stat &= 0xFC;
+            gb->display.stat |= 3;
 
             // complete one line
-            if((framecount > frameskip) && !line_rendered) render_line();
-        } else if(display_cycles <= 455) {
+            if((gb->framecount > frameskip) && !gb->line_rendered && !hide_video) render_line();
+        } else if(gb->display_cycles <= 455) {
             // mode 0
-            display.stat &= 0xFC;
+            gb->display.stat &= 0xFC;
 
-            if(mode != 0 && display.stat & 0x08) {
+            if(mode != 0 && gb->display.stat & 0x08) {
                 // just entered mode 0
                 //die(-1, "entered mode 0 STAT\n");
                 send_interrupt(1);
 
                 // handle CGB HDMA transfer
-                if(is_cgb && display.hdma5 & 0x80 && display.hdma5 != 0xFF) {
+                if(gb->is_cgb && gb->display.hdma5 & 0x80 && gb->display.hdma5 != 0xFF) {
                     handle_hblank_hdma();
                 }
             }
 
-        } else if(display_cycles >= 456) {
+        } else if(gb->display_cycles >= 456) {
             // a horizontal line has been completed
-            display_cycles -= 456;  // dont lose any cycles
+            gb->display_cycles -= 456;  // dont lose any cycles
 
-            display.ly++;
-            line_rendered = 0;
-            if(display.ly >= 144) {
+            gb->display.ly++;
+            gb->line_rendered = 0;
+            if(gb->display.ly >= 144) {
                 // begin vblank (mode 1)
-                display.stat &= 0xFC;
-                display.stat |= 1;
+                gb->display.stat &= 0xFC;
+                gb->display.stat |= 1;
 
                 //write_log("[display] entering vblank state, STAT = 0x%02X\n", display.stat);
 
@@ -1176,31 +1156,35 @@ void display_cycle() {
 
                 // update the actual screen
                 update_framebuffer();
-                framecount++;
+                gb->framecount++;
+
+                if(!headless && !running_ahead && config_input_poll == POLL_VBLANK) poll_input();
             } else {
                 /* // return to mode zero       -- what?
                 display.stat &= 0xFC; */
 
                 // mode TWO not zero
-                display.stat &= 0xFC;
-                display.stat |= 2;
+                gb->display.stat &= 0xFC;
+                gb->display.stat |= 2;
 
-                if(mode != 2 && display.stat & 0x20) {
+                if(mode != 2 && gb->display.stat & 0x20) {
                     // just entered mode 2
                     //write_log("entered mode 2 on line %d\n", display.ly);
                     send_interrupt(1);
                 }
             }
 
-            if(display.ly == display.lyc) {
+            if(!headless && !running_ahead && config_input_poll == POLL_SCANLINE) poll_input();
+
+            if(gb->display.ly == gb->display.lyc) {
                 // TODO: send STAT interrupt
-                display.stat |= 0x04;   // coincidence flag
-                if(display.stat & 0x40) {
+                gb->display.stat |= 0x04;   // coincidence flag
+                if(gb->display.stat & 0x40) {
                     //write_log("[display] sending STAT interrupt at LY=LYC=%d\n", display.ly);
                     send_interrupt(1);
                 }
             } else {
-                display.stat &= 0xFB;
+                gb->display.stat &= 0xFB;
             }
         }
     }
@@ -1210,17 +1194,11 @@ void vram_write(uint16_t addr, uint8_t byte) {
     //write_log("[display] write to VRAM 0x%04X value 0x%02X\n", addr, byte);
     addr -= 0x8000;
 
-    uint8_t *ptr = (uint8_t *)vram + addr;
-    ptr += (8192 * display.vbk);    // for CGB banking
-
-    *ptr = byte;
+    gb->vram_bank_ptr[addr] = byte;
 }
 
 uint8_t vram_read(uint16_t addr) {
     addr -= 0x8000;
 
-    uint8_t *ptr = (uint8_t *)vram + addr;
-    ptr += (8192 * display.vbk);
-
-    return *ptr;
+    return gb->vram_bank_ptr[addr];
 }
\ No newline at end of file
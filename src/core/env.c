@@ -0,0 +1,315 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+#include <libtinygb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Environments
+
+/*
+
+ An environment runs many copies of one game side by side, e.g. for
+ automated play, and steps all of them by one frame per call. The copies are
+ split into contiguous slices, one per worker thread.
+
+ A thread can only run one instance through gb, but only because gb is
+ thread-local: each worker starts one instance the normal way, which is
+ never run and serves as the power-on state, and clones its arena once per
+ instance of its slice. Stepping a slice points gb at each clone in turn.
+ That's only sound because the clones are run like speculative run-ahead
+ frames (see runahead.c): with running_ahead set, nothing outside of the
+ arena is touched, so the clones can share the rest of the thread's state.
+ The price is that they have no sound, which nobody would listen to anyway.
+
+ The frames are converted as each instance finishes, by the thread that ran
+ it, straight into the caller's buffer, which gets all of them back to back.
+
+ */
+
+#define ENV_STEP            1
+#define ENV_QUIT            2
+
+typedef struct {
+    gb_env_t *env;
+    pthread_t thread;
+    int first, count;           // the slice of instances it runs
+    gb_t *power_on;             // the instance it started, never run
+    int failed;
+} env_worker_t;
+
+struct gb_env_t {
+    gb_env_config_t config;
+    gb_config_t machine;
+    const void *rom;
+    size_t rom_size;
+
+    gb_t **instances;
+    uint8_t *reset;             // one flag per instance, set by gb_env_reset()
+    int width, height;
+    size_t frame_size;
+
+    env_worker_t *workers;
+    int worker_count;
+
+    // the command all workers run next
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    unsigned int generation;
+    int command, busy;
+    const uint8_t *keys;
+    uint8_t *frames;
+};
+
+static int start_instances(env_worker_t *w) {
+    gb_env_t *env = w->env;
+
+    w->power_on = gb_create(env->rom, env->rom_size, &env->machine);
+    if(!w->power_on) return -1;
+
+    running_ahead = 1;
+
+    for(int i = 0; i < w->count; i++) {
+        env->instances[w->first + i] = state_clone();
+        if(!env->instances[w->first + i]) {
+            write_log("[env] unable to allocate memory for instances\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void stop_instances(env_worker_t *w) {
+    gb_env_t *env = w->env;
+
+    for(int i = 0; i < w->count; i++) {
+        free(env->instances[w->first + i]);
+    }
+
+    if(w->power_on) {
+        gb = w->power_on;
+        gb_destroy(w->power_on);
+    }
+}
+
+// averages each downsample x downsample block of the current frame
+static void write_frame(gb_env_t *env, uint8_t *dst) {
+    const uint32_t *src = gb->framebuffer;
+    int n = env->config.downsample;
+    int area = n * n;
+
+    if(n == 1 && !env->config.grayscale) {
+        memcpy(dst, src, env->frame_size);
+        return;
+    }
+
+    for(int y = 0; y < env->height; y++) {
+        for(int x = 0; x < env->width; x++) {
+            int r = 0, g = 0, b = 0;
+
+            for(int dy = 0; dy < n; dy++) {
+                const uint32_t *row = src + (((y * n) + dy) * GB_WIDTH) + (x * n);
+                for(int dx = 0; dx < n; dx++) {
+                    r += (row[dx] >> 16) & 0xFF;
+                    g += (row[dx] >> 8) & 0xFF;
+                    b += row[dx] & 0xFF;
+                }
+            }
+
+            r /= area;
+            g /= area;
+            b /= area;
+
+            if(env->config.grayscale) dst[(y * env->width) + x] = ((r * 77) + (g * 150) + (b * 29)) >> 8;
+            else ((uint32_t *)dst)[(y * env->width) + x] = (r << 16) | (g << 8) | b;
+        }
+    }
+}
+
+static void step_instances(env_worker_t *w) {
+    gb_env_t *env = w->env;
+
+    for(int i = w->first; i < w->first + w->count; i++) {
+        gb = env->instances[i];
+
+        if(env->reset[i]) {
+            state_copy(gb, w->power_on);
+            env->reset[i] = 0;
+        }
+
+        joypad_set(env->keys ? env->keys[i] : 0);
+        cpu_run_frame();
+
+        if(env->frames) write_frame(env, env->frames + (i * env->frame_size));
+    }
+
+    gb = w->power_on;
+}
+
+static void *env_worker_main(void *arg) {
+    env_worker_t *w = (env_worker_t *)arg;
+    gb_env_t *env = w->env;
+
+    int failed = start_instances(w);
+
+    pthread_mutex_lock(&env->lock);
+    w->failed = failed;
+    if(!--env->busy) pthread_cond_signal(&env->done);
+
+    unsigned int generation = env->generation;
+
+    for(;;) {
+        while(env->generation == generation) pthread_cond_wait(&env->work, &env->lock);
+        generation = env->generation;
+        int command = env->command;
+        pthread_mutex_unlock(&env->lock);
+
+        if(command == ENV_QUIT) break;
+        step_instances(w);
+
+        pthread_mutex_lock(&env->lock);
+        if(!--env->busy) pthread_cond_signal(&env->done);
+    }
+
+    stop_instances(w);
+    return NULL;
+}
+
+// runs a command on all workers and waits for them to finish it
+static void env_command(gb_env_t *env, int command) {
+    pthread_mutex_lock(&env->lock);
+
+    env->command = command;
+    env->busy = env->worker_count;
+    env->generation++;
+    pthread_cond_broadcast(&env->work);
+
+    if(command != ENV_QUIT) {
+        while(env->busy) pthread_cond_wait(&env->done, &env->lock);
+    }
+
+    pthread_mutex_unlock(&env->lock);
+}
+
+gb_env_t *gb_env_create(const void *rom_data, size_t size, const gb_config_t *config, const gb_env_config_t *env_config) {
+    if(!env_config || env_config->count <= 0) return NULL;
+
+    int downsample = env_config->downsample ? env_config->downsample : 1;
+    if(downsample < 0 || GB_WIDTH % downsample || GB_HEIGHT % downsample) {
+        write_log("[env] can't downsample by %d\n", downsample);
+        return NULL;
+    }
+
+    gb_env_t *env = calloc(1, sizeof(gb_env_t));
+    if(!env) return NULL;
+
+    env->config = *env_config;
+    env->config.downsample = downsample;
+    if(config) env->machine = *config;
+    env->machine.save_file = NULL;
+    env->machine.movie = NULL;
+    env->machine.record_hashes = NULL;
+    env->machine.check_hashes = NULL;
+    env->rom = rom_data;
+    env->rom_size = size;
+
+    env->width = GB_WIDTH / downsample;
+    env->height = GB_HEIGHT / downsample;
+    env->frame_size = env->width * env->height * (env->config.grayscale ? 1 : 4);
+
+    env->worker_count = env->config.threads > 0 ? env->config.threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if(env->worker_count <= 0) env->worker_count = 1;
+    if(env->worker_count > env->config.count) env->worker_count = env->config.count;
+
+    env->instances = calloc(env->config.count, sizeof(gb_t *));
+    env->reset = calloc(env->config.count, 1);
+    env->workers = calloc(env->worker_count, sizeof(env_worker_t));
+    if(!env->instances || !env->reset || !env->workers) {
+        free(env->instances);
+        free(env->reset);
+        free(env->workers);
+        free(env);
+        return NULL;
+    }
+
+    pthread_mutex_init(&env->lock, NULL);
+    pthread_cond_init(&env->work, NULL);
+    pthread_cond_init(&env->done, NULL);
+
+    // contiguous slices whose sizes differ by one at most
+    int workers = env->worker_count;
+    int failed = 0;
+    env->busy = workers;
+
+    for(int i = 0; i < workers; i++) {
+        env_worker_t *w = &env->workers[i];
+        w->env = env;
+        w->first = (env->config.count * i) / workers;
+        w->count = ((env->config.count * (i + 1)) / workers) - w->first;
+
+        if(pthread_create(&w->thread, NULL, env_worker_main, w)) {
+            write_log("[env] unable to start worker thread\n");
+
+            pthread_mutex_lock(&env->lock);
+            env->busy -= workers - i;
+            env->worker_count = i;
+            pthread_mutex_unlock(&env->lock);
+            failed = 1;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&env->lock);
+    while(env->busy) pthread_cond_wait(&env->done, &env->lock);
+    pthread_mutex_unlock(&env->lock);
+
+    for(int i = 0; i < env->worker_count; i++) {
+        if(env->workers[i].failed) failed = 1;
+    }
+
+    if(failed) {
+        gb_env_destroy(env);
+        return NULL;
+    }
+
+    write_log("[env] running %d instances on %d threads, %d bytes per frame\n", env->config.count, env->worker_count, (int)env->frame_size);
+    return env;
+}
+
+void gb_env_destroy(gb_env_t *env) {
+    if(!env) return;
+
+    env_command(env, ENV_QUIT);
+    for(int i = 0; i < env->worker_count; i++) {
+        pthread_join(env->workers[i].thread, NULL);
+    }
+
+    pthread_mutex_destroy(&env->lock);
+    pthread_cond_destroy(&env->work);
+    pthread_cond_destroy(&env->done);
+
+    free(env->instances);
+    free(env->reset);
+    free(env->workers);
+    free(env);
+}
+
+size_t gb_env_frame_size(gb_env_t *env) {
+    return env->frame_size;
+}
+
+void gb_env_step(gb_env_t *env, const uint8_t *keys, void *frames) {
+    env->keys = keys;
+    env->frames = (uint8_t *)frames;
+    env_command(env, ENV_STEP);
+}
+
+void gb_env_reset(gb_env_t *env, int index) {
+    if(index >= 0 && index < env->config.count) env->reset[index] = 1;
+}
@@ -0,0 +1,210 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+#include <stdio.h>
+#include <string.h>
+
+//#define HASHES_LOG
+
+// State hashes
+
+/*
+
+ To show that a change to the emulator doesn't change what it emulates, a
+ run can record a hash of the machine after every frame and a later run of
+ the same input can be checked against it. The machine is hashed in
+ regions, the chunks of a savestate (see savestate.c) plus the framebuffer,
+ so a check that fails can say which parts of the machine differ and from
+ which frame on, instead of only that the end results differ.
+
+ A hash file is recorded next to a movie, or next to any deterministic run
+ with a fixed number of frames; playing an older movie back while recording
+ hashes creates the reference for it. The file is a header with the ROM
+ hash and the tags of the regions, followed by one hash per region for
+ every frame. Frames are the main loop's 70224 cycle slices, like in movies.
+
+ Checking stops with an error at the first frame that differs, so the exit
+ code of a headless run says whether it matched.
+
+ The framebuffer only holds the frame that was emulated when every frame is
+ rendered: with run-ahead it holds a speculative frame, and with frameskip
+ an older one. In those runs FB is recorded as zero, which isn't a hash, and
+ a zero on either side matches anything, so such a run can still be checked
+ against one that rendered every frame, only without its pictures.
+
+ */
+
+#define HASHES_MAGIC        "TGBHASHS"
+#define HASHES_VERSION      2
+#define HASHES_NOT_HASHED   0       // a region that couldn't be hashed this run
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t rom_hash;
+    uint32_t region_count;
+    uint32_t reserved;
+    char tags[MAX_HASH_REGIONS][4];
+} hashes_header_t;
+
+static __thread int hashes_mode = HASHES_NONE;
+static __thread FILE *hashes_file;
+static __thread char *hashes_filename;
+static __thread hashes_header_t header;
+static __thread uint64_t hashes_frames, recorded_frames;
+
+// hashes the machine region by region; returns the number of regions
+int state_hash_regions(uint64_t *hashes, char (*tags)[4]) {
+    int count = savestate_hash_chunks(hashes, tags);
+
+    if(config_run_ahead || frameskip) hashes[count] = HASHES_NOT_HASHED;
+    else hashes[count] = hash_fast(gb->framebuffer, GB_WIDTH * GB_HEIGHT * 4);
+    memcpy(tags[count], "FB  ", 4);
+    return count + 1;
+}
+
+// the whole machine in one hash
+uint64_t state_hash() {
+    uint64_t hashes[MAX_HASH_REGIONS];
+    char tags[MAX_HASH_REGIONS][4];
+
+    int count = state_hash_regions(hashes, tags);
+    return hash_data(hashes, count * sizeof(uint64_t));
+}
+
+// opens a hash file for recording or checking; called after the ROM is
+// loaded
+void hashes_open(char *filename, int mode) {
+    hashes_filename = filename;
+    hashes_mode = mode;
+    hashes_frames = 0;
+
+    hashes_file = fopen(filename, mode == HASHES_RECORD ? "wb" : "rb");
+    if(!hashes_file) die(-1, "[hashes] unable to open %s\n", filename);
+
+    if(mode == HASHES_RECORD) return;
+
+    if(fread(&header, sizeof(hashes_header_t), 1, hashes_file) != 1 || memcmp(header.magic, HASHES_MAGIC, 8)) {
+        die(-1, "[hashes] %s is not a tinygb hash file\n", filename);
+    }
+
+    if(header.version != HASHES_VERSION) {
+        die(-1, "[hashes] %s is a version %d hash file, only version %d is supported\n", filename, header.version, HASHES_VERSION);
+    }
+
+    if(header.rom_hash != rom_hash()) {
+        die(-1, "[hashes] %s was recorded with a different ROM\n", filename);
+    }
+
+    if(!header.region_count || header.region_count > MAX_HASH_REGIONS) {
+        die(-1, "[hashes] %s is damaged\n", filename);
+    }
+
+    fseek(hashes_file, 0L, SEEK_END);
+    recorded_frames = (ftell(hashes_file) - header.header_size) / (header.region_count * sizeof(uint64_t));
+    fseek(hashes_file, header.header_size, SEEK_SET);
+}
+
+// called once the machine is running
+void hashes_start() {
+    uint64_t hashes[MAX_HASH_REGIONS];
+    char tags[MAX_HASH_REGIONS][4];
+
+    if(hashes_mode == HASHES_NONE) return;
+
+    int count = state_hash_regions(hashes, tags);
+
+    if(hashes_mode == HASHES_RECORD) {
+        memset(&header, 0, sizeof(hashes_header_t));
+        memcpy(header.magic, HASHES_MAGIC, 8);
+        header.version = HASHES_VERSION;
+        header.header_size = sizeof(hashes_header_t);
+        header.rom_hash = rom_hash();
+        header.region_count = count;
+        memcpy(header.tags, tags, count * 4);
+
+        if(fwrite(&header, sizeof(hashes_header_t), 1, hashes_file) != 1) {
+            die(-1, "[hashes] unable to write to %s\n", hashes_filename);
+        }
+
+        write_log("[hashes] recording %d regions per frame to %s\n", count, hashes_filename);
+    } else {
+        if(header.region_count != count || memcmp(header.tags, tags, count * 4)) {
+            die(-1, "[hashes] %s was recorded on a different model\n", hashes_filename);
+        }
+
+        write_log("[hashes] checking %d regions per frame against %s\n", count, hashes_filename);
+    }
+}
+
+// called after every frame
+void hashes_frame() {
+    uint64_t hashes[MAX_HASH_REGIONS], recorded[MAX_HASH_REGIONS];
+    char tags[MAX_HASH_REGIONS][4];
+
+    if(hashes_mode == HASHES_NONE) return;
+
+    int count = state_hash_regions(hashes, tags);
+
+    if(hashes_mode == HASHES_RECORD) {
+        if(fwrite(hashes, sizeof(uint64_t), count, hashes_file) != count) {
+            die(-1, "[hashes] unable to write to %s\n", hashes_filename);
+        }
+
+        hashes_frames++;
+        return;
+    }
+
+    if(hashes_frames >= recorded_frames || fread(recorded, sizeof(uint64_t), count, hashes_file) != count) {
+        hashes_stop();
+        return;
+    }
+
+    // which regions differ, e.g. "WRAM VRAM FB"
+    char differing[MAX_HASH_REGIONS * 5 + 1];
+    int length = 0;
+
+    for(int i = 0; i < count; i++) {
+        if(hashes[i] == recorded[i] || hashes[i] == HASHES_NOT_HASHED || recorded[i] == HASHES_NOT_HASHED) continue;
+
+        memcpy(differing + length, tags[i], 4);
+        length += 4;
+        while(length && differing[length - 1] == ' ') length--;
+        differing[length++] = ' ';
+    }
+
+    if(length) {
+        differing[length - 1] = 0;
+
+        fclose(hashes_file);
+        hashes_file = NULL;
+        hashes_mode = HASHES_NONE;
+        die(-1, "[hashes] frame %llu differs from %s in %s\n", (unsigned long long)hashes_frames, hashes_filename, differing);
+    }
+
+#ifdef HASHES_LOG
+    write_log("[hashes] frame %llu matches\n", (unsigned long long)hashes_frames);
+#endif
+
+    hashes_frames++;
+}
+
+void hashes_stop() {
+    if(!hashes_file) return;
+
+    if(hashes_mode == HASHES_RECORD) {
+        write_log("[hashes] recorded %llu frames to %s\n", (unsigned long long)hashes_frames, hashes_filename);
+    } else if(hashes_frames < recorded_frames) {
+        write_log("[hashes] only %llu of %llu recorded frames were checked against %s\n", (unsigned long long)hashes_frames, (unsigned long long)recorded_frames, hashes_filename);
+    } else {
+        write_log("[hashes] all %llu recorded frames match %s\n", (unsigned long long)recorded_frames, hashes_filename);
+    }
+
+    fclose(hashes_file);
+    hashes_file = NULL;
+    hashes_mode = HASHES_NONE;
+}
@@ -4,10 +4,9 @@
 
 #include <tinygb.h>
 #include <ioports.h>
+#include <state.h>
 
-uint8_t pressed_keys = 0;   // high 4 bits directions, low 4 bits buttons
-
-int selection = 0;  // 0 = buttons, 1 = directions
+//#define JOYPAD_LOG
 
 #define BUTTON_A        0x01
 #define BUTTON_B        0x02
@@ -18,17 +17,44 @@ int selection = 0;  // 0 = buttons, 1 = directions
 #define BUTTON_UP       0x40
 #define BUTTON_DOWN     0x80
 
+// Joypad input
+
+/*
+
+ The frontend doesn't change the pressed keys directly; it queues every key
+ change together with the master cycle it should take effect at, and the
+ queue is drained by EVENT_JOYPAD as emulation reaches those cycles. That
+ way a press and release that both happen between two polls of the host are
+ still seen by the game, in order and roughly as far apart as they were.
+
+ Like on hardware, the joypad interrupt is raised whenever one of the four
+ input lines of the selected group goes from high to low, whether because a
+ key was pressed or because a group with a pressed key was selected.
+
+ */
+
+// the input lines as the game sees them, active low
+static uint8_t joypad_lines() {
+    if(gb->selection == 1) return (~(gb->pressed_keys >> 4)) & 0x0F;
+    else if(gb->selection == 0) return (~gb->pressed_keys) & 0x0F;
+    else return 0x0F;
+}
+
+static void check_interrupt(uint8_t old_lines) {
+    if(old_lines & ~joypad_lines() & 0x0F) send_interrupt(4);
+}
+
 uint8_t joypad_read(uint16_t addr) {
-    if(is_sgb && sgb_interfere) return sgb_read();
+    if(gb->is_sgb && gb->sgb_interfere) return sgb_read();
     uint8_t val;
 
-    if(selection == 1) {
+    if(gb->selection == 1) {
         // directions
-        val = (~(pressed_keys >> 4)) & 0x0F;
+        val = (~(gb->pressed_keys >> 4)) & 0x0F;
         //write_log("[joypad] directions return value 0x%02X\n", val);
-    } else if(selection == 0) {
+    } else if(gb->selection == 0) {
         // buttons
-        val = (~pressed_keys) & 0x0F;
+        val = (~gb->pressed_keys) & 0x0F;
         //write_log("[joypad] buttons return value 0x%02X\n", val);
     } else {
         val = 0x0F;
@@ -48,33 +74,37 @@ void joypad_write(uint16_t addr, uint8_t byte) {
         }
     }*/
 
-    if(is_sgb) {
-        if(sgb_transferring || sgb_interfere) return sgb_write(byte);
+    if(gb->is_sgb) {
+        if(gb->sgb_transferring || gb->sgb_interfere) return sgb_write(byte);
 
         if(!(byte & 0x20) && !(byte & 0x10)) {
             return sgb_write(byte);
         }
     }
 
+    uint8_t old_lines = joypad_lines();
+
     byte = ~byte;
     byte &= 0x30;
 
     if(byte == 0x30 || !byte) {
-        selection = 2;
+        gb->selection = 2;
         return;
     }
 
     if(byte & 0x20) {
         // button keys
-        selection = 0;
+        gb->selection = 0;
     } else if(byte & 0x10) {
         // direction
-        selection = 1;
+        gb->selection = 1;
         //write_log("[joypad] write value 0x%02X, selecting directions\n", (~byte) & 0xFF);
     } else {
         // undefined so we'll return ones
-        selection = 2;
+        gb->selection = 2;
     }
+
+    check_interrupt(old_lines);
 }
 
 void joypad_handle(int is_down, int key) {
@@ -109,9 +139,74 @@ void joypad_handle(int is_down, int key) {
         val = 0xFF;     // unreachable
     }
 
+    uint8_t old_lines = joypad_lines();
+
     if(is_down) {
-        pressed_keys |= val;
+        gb->pressed_keys |= val;
     } else {
-        pressed_keys &= ~val;
+        gb->pressed_keys &= ~val;
+    }
+
+    check_interrupt(old_lines);
+}
+
+// sets all eight keys from a mask of BUTTON_* bits, e.g. from a movie
+void joypad_set(uint8_t keys) {
+    static const int joypad_keys[8] = {
+        JOYPAD_A, JOYPAD_B, JOYPAD_SELECT, JOYPAD_START,
+        JOYPAD_RIGHT, JOYPAD_LEFT, JOYPAD_UP, JOYPAD_DOWN
+    };
+
+    uint8_t changed = keys ^ gb->pressed_keys;
+
+    for(int i = 0; i < 8; i++) {
+        if(changed & (1 << i)) joypad_handle(keys & (1 << i), joypad_keys[i]);
+    }
+}
+
+// queues a key change for the given master cycle; changes have to be queued
+// in order, and one that is already due is applied right away
+void joypad_queue(uint64_t cycle, int is_down, int key) {
+    if(cycle < gb->total_cycles) cycle = gb->total_cycles;
+
+    if(gb->input_head != gb->input_tail) {
+        input_event_t *last = &gb->input_queue[(gb->input_head - 1) & (INPUT_QUEUE_SIZE - 1)];
+        if(cycle < last->cycle) cycle = last->cycle;
+    }
+
+    if(gb->input_head - gb->input_tail >= INPUT_QUEUE_SIZE) {
+        // full; apply the oldest change early rather than lose it
+        input_event_t *oldest = &gb->input_queue[gb->input_tail & (INPUT_QUEUE_SIZE - 1)];
+        joypad_handle(oldest->is_down, oldest->key);
+        gb->input_tail++;
+    }
+
+    input_event_t *event = &gb->input_queue[gb->input_head & (INPUT_QUEUE_SIZE - 1)];
+    event->cycle = cycle;
+    event->is_down = is_down;
+    event->key = key;
+    gb->input_head++;
+
+#ifdef JOYPAD_LOG
+    write_log("[joypad] queued key %d %s at cycle %llu\n", key, is_down ? "down" : "up", (unsigned long long)cycle);
+#endif
+
+    joypad_event();
+}
+
+// EVENT_JOYPAD: applies every queued key change that is due
+void joypad_event() {
+    while(gb->input_head != gb->input_tail) {
+        input_event_t *event = &gb->input_queue[gb->input_tail & (INPUT_QUEUE_SIZE - 1)];
+
+        if(event->cycle > gb->total_cycles) {
+            schedule_event(EVENT_JOYPAD, event->cycle);
+            return;
+        }
+
+        joypad_handle(event->is_down, event->key);
+        gb->input_tail++;
     }
+
+    cancel_event(EVENT_JOYPAD);
 }
\ No newline at end of file
@@ -0,0 +1,345 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//#define LINK_LOG
+
+// Link cable transport
+
+/*
+
+ Carries the fixed-size messages of the link protocol (see serial.c) between
+ two tinygb processes over a Unix domain socket. The server listens on the
+ socket path from tinygb.ini and the client keeps trying to connect to it, so
+ the two can be started in any order. Neither side ever blocks waiting for
+ the other to show up; until a peer is connected, the cable is unplugged.
+
+ With link=local, the peer is a second, headless instance of the emulator on
+ its own thread instead. Every thread has its own machine state (gb is
+ thread-local), and the messages go through a pair of single-producer
+ single-consumer rings, so handing one over is an atomic store. A thread that
+ has to wait for its peer yields and then naps for a few microseconds rather
+ than spinning on a core the other instance might need.
+
+ */
+
+#define LOCAL_RING_SIZE     256     // messages, must be a power of two
+#define LOCAL_NAP_NS        20000
+#define LOCAL_YIELDS        64
+
+typedef struct {
+    link_msg_t msgs[LOCAL_RING_SIZE];
+    atomic_uint head, tail;
+} local_ring_t;
+
+static __thread int listen_fd = -1;
+static __thread int link_fd = -1;
+static struct sockaddr_un address;
+
+static __thread uint8_t recv_buffer[sizeof(link_msg_t) * 64];
+static __thread int recv_count = 0;
+
+// local link: local_rings[n] carries messages to instance n
+static local_ring_t local_rings[2];
+static __thread int local_instance = 0;
+static atomic_int local_closed;
+static pthread_t local_thread;
+static int local_running = 0;
+static char *local_rom_filename, *first_rom_filename;
+static int local_system, local_preference;
+
+static void *local_instance_main(void *arg);
+
+static void local_wait(int *waits) {
+    if(++*waits < LOCAL_YIELDS) {
+        sched_yield();
+    } else {
+        struct timespec ts = { 0, LOCAL_NAP_NS };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void local_send(link_msg_t *msg) {
+    local_ring_t *ring = &local_rings[!local_instance];
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    int waits = 0;
+
+    // the window keeps only a handful of messages in flight, so this is rare
+    while(head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOCAL_RING_SIZE) {
+        if(atomic_load(&local_closed)) return;
+        local_wait(&waits);
+    }
+
+    ring->msgs[head & (LOCAL_RING_SIZE - 1)] = *msg;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static int local_recv(link_msg_t *msg, int timeout) {
+    local_ring_t *ring = &local_rings[local_instance];
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    int waits = 0;
+
+    while(atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+        if(atomic_load(&local_closed)) return -1;
+        if(!timeout) return 0;
+        local_wait(&waits);
+    }
+
+    *msg = ring->msgs[tail & (LOCAL_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+// starts the second instance of a local link session
+static void local_start() {
+    first_rom_filename = rom_filename;
+    local_rom_filename = config_link_rom[0] ? config_link_rom : rom_filename;
+
+    // the settings that shape a machine are per thread
+    local_system = config_system;
+    local_preference = config_preference;
+
+    if(pthread_create(&local_thread, NULL, local_instance_main, NULL)) {
+        write_log("[link] unable to start the local instance, link cable is disabled\n");
+        atomic_store(&local_closed, 1);
+        return;
+    }
+
+    local_running = 1;
+    write_log("[link] started a local instance running %s\n", local_rom_filename);
+}
+
+// the second instance; it has no window, no sound and no pacer of its own,
+// the sync window keeps it in step with the first one
+static void *local_instance_main(void *arg) {
+    local_instance = 1;
+    headless = 1;
+    rom_filename = local_rom_filename;
+    config_system = local_system;
+    config_preference = local_preference;
+
+    // both instances running the same game can't share a save file
+    if(!strcmp(rom_filename, first_rom_filename)) {
+        ex_ram_filename = calloc(strlen(rom_filename) + 7, 1);
+        if(!ex_ram_filename) die(-1, "[link] unable to allocate memory for filename\n");
+
+        strcpy(ex_ram_filename, rom_filename);
+        strcat(ex_ram_filename, ".2.mbc");
+    }
+
+    if(load_rom(rom_filename)) die(-1, "[link] unable to load %s for the local instance\n", rom_filename);
+
+    memory_start();
+    cpu_start();
+    display_start();
+    timer_start();
+    sound_start();
+    serial_start();
+
+    while(!atomic_load(&local_closed)) cpu_run_frame();
+
+    link_local_exit();
+    return NULL;
+}
+
+int link_local_thread() {
+    return local_instance == 1;
+}
+
+// ends the local instance from its own thread, leaving the first one unplugged
+void link_local_exit() {
+    write_log("[link] local instance is quitting\n");
+    atomic_store(&local_closed, 1);
+
+    battery_stop();
+    free(gb);
+    gb = NULL;
+    unload_rom();
+
+    pthread_exit(NULL);
+}
+
+void link_start() {
+    if(config_link == LINK_NONE) return;
+
+    if(config_link == LINK_LOCAL) {
+        if(!local_instance) local_start();
+        return;
+    }
+
+    // a peer that goes away shouldn't take this process with it
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, config_link_socket, sizeof(address.sun_path) - 1);
+
+    if(config_link == LINK_SERVER) {
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(listen_fd < 0) {
+            write_log("[link] unable to create socket, link cable is disabled\n");
+            return;
+        }
+
+        unlink(config_link_socket);     // left behind by an earlier server
+        if(bind(listen_fd, (struct sockaddr *)&address, sizeof(struct sockaddr_un)) || listen(listen_fd, 1)) {
+            write_log("[link] unable to listen on %s, link cable is disabled\n", config_link_socket);
+            close(listen_fd);
+            listen_fd = -1;
+            return;
+        }
+
+        fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+        write_log("[link] waiting for a peer on %s\n", config_link_socket);
+    } else {
+        write_log("[link] connecting to a peer on %s\n", config_link_socket);
+    }
+}
+
+static void connected(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+
+    link_fd = fd;
+    recv_count = 0;
+    write_log("[link] peer connected on %s\n", config_link_socket);
+}
+
+// polls for a peer without blocking; returns one once connected
+int link_connect() {
+    if(config_link == LINK_LOCAL) return !atomic_load(&local_closed);
+    if(link_fd >= 0) return 1;
+
+    if(config_link == LINK_SERVER) {
+        if(listen_fd < 0) return 0;
+
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0) return 0;
+
+        connected(fd);
+        return 1;
+    } else if(config_link == LINK_CLIENT) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0) return 0;
+
+        if(connect(fd, (struct sockaddr *)&address, sizeof(struct sockaddr_un))) {
+            close(fd);
+            return 0;
+        }
+
+        connected(fd);
+        return 1;
+    }
+
+    return 0;
+}
+
+int link_connected() {
+    if(config_link == LINK_LOCAL) return !atomic_load(&local_closed);
+    return link_fd >= 0;
+}
+
+static void disconnected() {
+    write_log("[link] peer disconnected\n");
+    close(link_fd);
+    link_fd = -1;
+}
+
+void link_send(link_msg_t *msg) {
+    if(config_link == LINK_LOCAL) {
+        local_send(msg);
+        return;
+    }
+
+    if(link_fd < 0) return;
+
+#ifdef LINK_LOG
+    write_log("[link] send type %d data 0x%02X cycle %llu when %llu\n", msg->type, msg->data,
+        (unsigned long long)msg->cycle, (unsigned long long)msg->when);
+#endif
+
+    uint8_t *data = (uint8_t *)msg;
+    int size = sizeof(link_msg_t);
+
+    while(size > 0) {
+        ssize_t count = write(link_fd, data, size);
+        if(count < 0 && errno == EINTR) continue;
+        if(count <= 0) {
+            disconnected();
+            return;
+        }
+
+        data += count;
+        size -= count;
+    }
+}
+
+// receives one message, waiting up to timeout ms for it (-1 waits forever);
+// returns one if a message was received, zero if not and -1 if the peer is gone
+int link_recv(link_msg_t *msg, int timeout) {
+    if(config_link == LINK_LOCAL) return local_recv(msg, timeout);
+    if(link_fd < 0) return -1;
+
+    while(recv_count < sizeof(link_msg_t)) {
+        struct pollfd pfd;
+        pfd.fd = link_fd;
+        pfd.events = POLLIN;
+
+        int ready = poll(&pfd, 1, timeout);
+        if(ready < 0 && errno == EINTR) continue;
+        if(ready <= 0) return ready < 0 ? -1 : 0;
+
+        ssize_t count = read(link_fd, recv_buffer + recv_count, sizeof(recv_buffer) - recv_count);
+        if(count < 0 && errno == EINTR) continue;
+        if(count <= 0) {
+            disconnected();
+            return -1;
+        }
+
+        recv_count += count;
+    }
+
+    memcpy(msg, recv_buffer, sizeof(link_msg_t));
+    recv_count -= sizeof(link_msg_t);
+    memmove(recv_buffer, recv_buffer + sizeof(link_msg_t), recv_count);
+
+#ifdef LINK_LOG
+    write_log("[link] recv type %d data 0x%02X cycle %llu when %llu\n", msg->type, msg->data,
+        (unsigned long long)msg->cycle, (unsigned long long)msg->when);
+#endif
+
+    return 1;
+}
+
+void link_stop() {
+    if(local_running && !local_instance) {
+        // wakes the local instance up if it's waiting for us
+        atomic_store(&local_closed, 1);
+        pthread_join(local_thread, NULL);
+        local_running = 0;
+    }
+
+    if(link_fd >= 0) close(link_fd);
+    if(listen_fd >= 0) {
+        close(listen_fd);
+        unlink(config_link_socket);
+    }
+
+    link_fd = listen_fd = -1;
+}
@@ -4,6 +4,7 @@
 
 #include <tinygb.h>
 #include <ioports.h>
+#include <state.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -47,6 +48,12 @@
         Bit 6   halt flag (0 = running, 1 = clock stopped)
         Bit 7   day counter carry bit (1 = overflown)
 
+ - The clock counts emulated time, not wall clock time: it is advanced from
+   the master cycle clock, so it runs faster in fast-forward and stops while
+   the emulator is paused. It is seeded from the wall clock the first time a
+   game runs and the time spent with the emulator closed is added when the
+   .mbc file is loaded.
+
  MBC5: (ROM up to 8 MiB and RAM up to 128 KiB)
  - Memory regions:
   - 0xA000-0xBFFF   up to 16 banks of 8 KiB RAM
@@ -63,174 +70,296 @@
 
  */
 
-mbc1_t mbc1;
-mbc3_t mbc3;
-mbc5_t mbc5;
-
-uint8_t *ex_ram;    // pointer to cart RAM
-int ex_ram_size;
-char *ex_ram_filename;
-int ex_ram_modified = 0;
-
-int ex_ram_size_banks;
-int rom_size_banks;
-
-void mbc_start(void *cart_ram) {
-    ex_ram_filename = calloc(strlen(rom_filename) + 5, 1);
-    if(!ex_ram_filename) {
-        write_log("[mbc] unable to allocate memory for filename\n");
-        die(-1, "");
-    }
-
-    strcpy(ex_ram_filename, rom_filename);
-    strcpy(ex_ram_filename+strlen(rom_filename), ".mbc");
-
-    ex_ram = (uint8_t *)cart_ram;
+__thread char *ex_ram_filename;
 
+int mbc_ram_size() {
     uint8_t *rom_bytes = (uint8_t *)rom;
+    int size;
+
     switch(rom_bytes[0x149]) {
     case 0:
-        ex_ram_size = 0;
+        size = 0;
         break;
     case 1:
-        ex_ram_size = 2048;     // bytes
+        size = 2048;     // bytes
         break;
     case 2:
-        ex_ram_size = 8192;     // bytes
+        size = 8192;     // bytes
         break;
     case 3:
-        ex_ram_size = 32768;
+        size = 32768;
         break;
     case 4:
-        ex_ram_size = 131072;   // 128 KiB for MBC5
+        size = 131072;   // 128 KiB for MBC5
+        break;
+    case 5:
+        size = 65536;
         break;
     default:
         write_log("[mbc] undefined RAM size value 0x%02X, assuming 128 KiB RAM\n", rom_bytes[0x149]);
-        ex_ram_size = 131072;   // biggest possible value to stay on the safest size
+        size = 131072;   // biggest possible value to stay on the safest size
+    }
+
+    return size;
+}
+
+void mbc_start() {
+    uint8_t *rom_bytes = (uint8_t *)rom;
+
+    // unless the platform already picked a save file, or has no file name
+    if(!ex_ram_filename && rom_filename) {
+        ex_ram_filename = calloc(strlen(rom_filename) + 5, 1);
+        if(!ex_ram_filename) {
+            write_log("[mbc] unable to allocate memory for filename\n");
+            die(-1, "");
+        }
+
+        strcpy(ex_ram_filename, rom_filename);
+        strcpy(ex_ram_filename+strlen(rom_filename), ".mbc");
     }
 
-    ex_ram_size_banks = ex_ram_size / 8192;
-    rom_size_banks = rom_size / 16384;
+    // arena_start() already sized the cart RAM from the header
+    gb->ex_ram_size_banks = gb->ex_ram_size / 8192;
+    gb->rom_size_banks = rom_size / 16384;
 
-    switch(mbc_type) {
+    switch(gb->mbc_type) {
     case 1:
-        mbc1.bank1 = 1;
-        mbc1.bank2 = 0;
-        mbc1.ram_enable = 0;
-        mbc1.mode = 0;
+        gb->mbc1.bank1 = 1;
+        gb->mbc1.bank2 = 0;
+        gb->mbc1.ram_enable = 0;
+        gb->mbc1.mode = 0;
         break;
     case 3:
-        mbc3.ram_rtc_bank = 0;
-        mbc3.rom_bank = 1;
-        mbc3.ram_rtc_enable = 0;
-        mbc3.ram_rtc_toggle = 0;    // RAM
+        gb->mbc3.has_rtc = (rom_bytes[0x147] == 0x0F || rom_bytes[0x147] == 0x10);
+        gb->mbc3.ram_rtc_bank = 0;
+        gb->mbc3.rom_bank = 1;
+        gb->mbc3.ram_rtc_enable = 0;
+        gb->mbc3.ram_rtc_toggle = 0;    // RAM
         break;
     case 5:
-        mbc5.ram_bank = 0;
-        mbc5.rom_bank = 1;
-        mbc5.ram_enable = 0;
+        gb->mbc5.ram_bank = 0;
+        gb->mbc5.rom_bank = 1;
+        gb->mbc5.ram_enable = 0;
         break;
     default:
-        write_log("[mbc] unimplemented MBC type %d\n", mbc_type);
+        write_log("[mbc] unimplemented MBC type %d\n", gb->mbc_type);
         die(-1, "");
     }
 
-    write_log("[mbc] MBC started with %d KiB of external RAM\n", ex_ram_size/1024);
-    if(ex_ram_size) {
-        write_log("[mbc] battery-backed RAM will read from and dumped to %s\n", ex_ram_filename);
+    // banks smaller than 8 KiB (i.e. 2 KiB carts) mirror across 0xA000-0xBFFF
+    if(gb->ex_ram_size) gb->ex_ram_mask = (gb->ex_ram_size < 8192 ? gb->ex_ram_size : 8192) - 1;
+    mbc_update_banks();
 
-        // read ram file
-        FILE *file = fopen(ex_ram_filename, "r");
-        if(!file) {
-            write_log("[mbc] unable to open %s for reading, assuming no RAM file\n", ex_ram_filename);
-            return;
-        }
+    write_log("[mbc] MBC started with %d KiB of external RAM\n", gb->ex_ram_size/1024);
+    write_log("[mbc] ROM size in banks is %d\n", gb->rom_size_banks);
 
-        if(!fread(ex_ram, 1, ex_ram_size, file)) {
-            write_log("[mbc] unable to read from file %s, assuming no RAM file\n", ex_ram_filename);
-            memset(ex_ram, 0, ex_ram_size);
-            fclose(file);
-            return;
+    if(!gb->ex_ram_size && !gb->mbc3.has_rtc) return;
+
+    write_log("[mbc] battery-backed RAM will read from and dumped to %s\n", ex_ram_filename);
+    battery_start();
+}
+
+// cart RAM is only as large as the header says, so out of range banks wrap
+// around instead of running past the end of the buffer
+static inline int ex_ram_offset(int bank, uint16_t addr) {
+    return ((bank * 8192) + (addr - 0xA000)) & (gb->ex_ram_size - 1);
+}
+
+// decodes the banking registers into the bank pointers kept in the hot part
+// of the state, so memory reads don't have to decode them on every access;
+// must be called whenever a banking register changes or a state is loaded
+void mbc_update_banks() {
+    uint8_t *rom_bytes = (uint8_t *)rom;
+    int rom_bank = 1, ram_bank = 0;
+
+    switch(gb->mbc_type) {
+    case 1:
+        if(gb->mbc1.mode) {
+            rom_bank = gb->mbc1.bank1 & 0x1F;
+            ram_bank = gb->mbc1.bank2 & 3;
+        } else {
+            rom_bank = ((gb->mbc1.bank2 << 5) & 3) | (gb->mbc1.bank1 & 0x1F);
         }
 
-        fclose(file);
+        if(rom_bank) rom_bank &= (gb->rom_size_banks-1);
+        else rom_bank++;
+        break;
+    case 3:
+        rom_bank = gb->mbc3.rom_bank & (gb->rom_size_banks-1);
+        if(gb->mbc3.ram_rtc_bank <= 3) ram_bank = gb->mbc3.ram_rtc_bank;
+        break;
+    case 5:
+        rom_bank = gb->mbc5.rom_bank & (gb->rom_size_banks-1);
+        ram_bank = gb->mbc5.ram_bank;
+        break;
+    default:
+        return;
     }
 
-    write_log("[mbc] ROM size in banks is %d\n", rom_size_banks);
+    gb->rom_bank_ptr = rom_bytes + (rom_bank * 16384);
+    if(gb->ex_ram_size) gb->ram_bank_ptr = gb->ex_ram + ex_ram_offset(ram_bank, 0xA000);
+}
+
+// MBC3 real-time clock
+static const uint8_t rtc_masks[5] = { 0x3F, 0x3F, 0x1F, 0xFF, 0xC1 };
+
+static inline int rtc_day() {
+    return ((gb->mbc3.rtc[RTC_DH] & 1) << 8) | gb->mbc3.rtc[RTC_DL];
 }
 
-void write_ramfile() {
-    if(!ex_ram_size || !ex_ram_modified) return;
+static void rtc_set_day(uint64_t day) {
+    if(day > 511) gb->mbc3.rtc[RTC_DH] |= 0x80;     // day counter carry
+    day &= 511;
+
+    gb->mbc3.rtc[RTC_DL] = day & 0xFF;
+    gb->mbc3.rtc[RTC_DH] = (gb->mbc3.rtc[RTC_DH] & 0xFE) | (day >> 8);
+}
+
+// one second on the real hardware: registers that were written with values
+// out of range count up to the width of the register and wrap without carry
+static void rtc_tick() {
+    uint8_t *rtc = gb->mbc3.rtc;
+
+    rtc[RTC_S] = (rtc[RTC_S] + 1) & 0x3F;
+    if(rtc[RTC_S] != 60) return;
+    rtc[RTC_S] = 0;
+
+    rtc[RTC_M] = (rtc[RTC_M] + 1) & 0x3F;
+    if(rtc[RTC_M] != 60) return;
+    rtc[RTC_M] = 0;
+
+    rtc[RTC_H] = (rtc[RTC_H] + 1) & 0x1F;
+    if(rtc[RTC_H] != 24) return;
+    rtc[RTC_H] = 0;
+
+    rtc_set_day(rtc_day() + 1);
+}
+
+static void rtc_advance(uint64_t seconds) {
+    uint8_t *rtc = gb->mbc3.rtc;
+
+    // out of range values fall back into range within 64 ticks
+    while(seconds && (rtc[RTC_S] >= 60 || rtc[RTC_M] >= 60 || rtc[RTC_H] >= 24)) {
+        rtc_tick();
+        seconds--;
+    }
 
-    remove(ex_ram_filename);
-    FILE *file = fopen(ex_ram_filename, "wb");
-    if(!file) {
-        write_log("[mbc] unable to open %s for writing\n", ex_ram_filename);
+    if(!seconds) return;
+
+    uint64_t total = rtc[RTC_S] + (rtc[RTC_M] * 60) + (rtc[RTC_H] * 3600) + seconds;
+    rtc[RTC_S] = total % 60;
+    total /= 60;
+    rtc[RTC_M] = total % 60;
+    total /= 60;
+    rtc[RTC_H] = total % 24;
+    total /= 24;
+
+    rtc_set_day(rtc_day() + total);
+}
+
+// brings the live registers up to date with the master clock
+static void rtc_update() {
+    uint64_t elapsed = gb->total_cycles - gb->mbc3.rtc_last_cycles;
+    gb->mbc3.rtc_last_cycles = gb->total_cycles;
+
+    if(gb->mbc3.rtc[RTC_DH] & 0x40) return;     // halted
+
+    elapsed += gb->mbc3.rtc_subsecond;
+    gb->mbc3.rtc_subsecond = elapsed % GB_CPU_SPEED;
+    rtc_advance(elapsed / GB_CPU_SPEED);
+}
+
+static uint64_t read_le(uint8_t *data, int size) {
+    uint64_t value = 0;
+    for(int i = size-1; i >= 0; i--) value = (value << 8) | data[i];
+    return value;
+}
+
+static void write_le(uint8_t *data, int size, uint64_t value) {
+    for(int i = 0; i < size; i++) {
+        data[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+// the saved clock is five 32-bit live registers, five 32-bit latched
+// registers and a 64-bit UNIX timestamp, all little endian
+void rtc_load(uint8_t *data) {
+    time_t now = time(NULL);
+    uint64_t saved_time = data ? read_le(data + 40, 8) : 0;
+
+    gb->mbc3.rtc_last_cycles = gb->total_cycles;
+    gb->mbc3.rtc_subsecond = 0;
+
+    if(config_deterministic) {
+        // every run starts at day zero and only counts emulated time
+        memset(gb->mbc3.rtc, 0, 5);
+        memset(gb->mbc3.rtc_latched, 0, 5);
+
+        write_log("[mbc] RTC starts at zero in deterministic mode\n");
         return;
     }
 
-    if(fwrite(ex_ram, 1, ex_ram_size, file) != ex_ram_size) {
-        write_log("[mbc] unable to write to file %s\n", ex_ram_filename);
-        fclose(file);
+    if(!saved_time) {
+        struct tm *timeinfo = localtime(&now);
+
+        gb->mbc3.rtc[RTC_S] = timeinfo->tm_sec == 60 ? 59 : timeinfo->tm_sec;
+        gb->mbc3.rtc[RTC_M] = timeinfo->tm_min;
+        gb->mbc3.rtc[RTC_H] = timeinfo->tm_hour;
+        gb->mbc3.rtc[RTC_DH] = 0;
+        rtc_set_day(timeinfo->tm_yday);
+        memcpy(gb->mbc3.rtc_latched, gb->mbc3.rtc, 5);
+
+        write_log("[mbc] RTC seeded from wall clock\n");
         return;
     }
 
-    fflush(file);
-    fclose(file);
-    write_log("[mbc] wrote RAM file to %s\n", ex_ram_filename);
+    for(int i = 0; i < 5; i++) {
+        gb->mbc3.rtc[i] = read_le(data + (i * 4), 4) & rtc_masks[i];
+        gb->mbc3.rtc_latched[i] = read_le(data + 20 + (i * 4), 4) & rtc_masks[i];
+    }
+
+    // catch up with the time that passed while the emulator was closed
+    if(!(gb->mbc3.rtc[RTC_DH] & 0x40) && (uint64_t)now > saved_time) {
+        rtc_advance((uint64_t)now - saved_time);
+    }
+
+    write_log("[mbc] RTC loaded, %d days %02d:%02d:%02d\n", rtc_day(), gb->mbc3.rtc[RTC_H], gb->mbc3.rtc[RTC_M], gb->mbc3.rtc[RTC_S]);
+}
+
+void rtc_save(uint8_t *data) {
+    rtc_update();
+
+    for(int i = 0; i < 5; i++) {
+        write_le(data + (i * 4), 4, gb->mbc3.rtc[i]);
+        write_le(data + 20 + (i * 4), 4, gb->mbc3.rtc_latched[i]);
+    }
+
+    write_le(data + 40, 8, config_deterministic ? 0 : (uint64_t)time(NULL));
 }
 
 // MBC3 functions here
 static inline uint8_t mbc3_read(uint16_t addr) {
-    uint8_t *rom_bytes = (uint8_t *)rom;
-    if(addr >= 0x4000 && addr <= 0x7FFF) {
-        addr -= 0x4000;
-        return rom_bytes[(mbc3.rom_bank * 16384) + addr];
-    } else if(addr >= 0xA000 && addr <= 0xBFFF) {
-        if(!mbc3.ram_rtc_enable) {
+    if(addr >= 0xA000 && addr <= 0xBFFF) {
+        if(!gb->mbc3.ram_rtc_enable) {
             write_log("[mbc] warning: attempt to read from address 0x%04X when external RAM/RTC is disabled, returning ones\n", addr);
             return 0xFF;
         }
 
-        if(mbc3.ram_rtc_bank <= 3) {
+        if(gb->mbc3.ram_rtc_bank <= 3) {
             // ram
-            return ex_ram[(mbc3.ram_rtc_bank * 8192) + (addr - 0xA000)];
-        } else if(mbc3.ram_rtc_bank >= 0x08 && mbc3.ram_rtc_bank <= 0x0C) {
-            // rtc
-            time_t rawtime;
-            struct tm *timeinfo;
-
-            time(&rawtime);
-            timeinfo = localtime(&rawtime);
-
-            uint8_t status;
-
-            switch(mbc3.ram_rtc_bank) {
-            case 0x08:
-                if(timeinfo->tm_sec == 60) return 59;
-                else return timeinfo->tm_sec;
-            case 0x09:
-                return timeinfo->tm_min;
-            case 0x0A:
-                return timeinfo->tm_hour;
-            case 0x0B:
-                // lower 8 bits
-                return timeinfo->tm_yday & 0xFF;
-            case 0x0C:
-                status = (timeinfo->tm_yday >> 8) & 1;  // highest bit
-                if(mbc3.halt) status |= 0x40;   // halt flag
-                return status;
-            default:
-                write_log("[mbc] undefined read from RTC/RAM bank 0x%02X address 0x%04X, returning ones\n", mbc3.ram_rtc_bank, addr);
-                return 0xFF;
-            }
+            if(!gb->ex_ram_size) return 0xFF;
+            return gb->ram_bank_ptr[(addr - 0xA000) & gb->ex_ram_mask];
+        } else if(gb->mbc3.ram_rtc_bank >= 0x08 && gb->mbc3.ram_rtc_bank <= 0x0C) {
+            // rtc, the latched copy only changes on a latch or a write
+            return gb->mbc3.rtc_latched[gb->mbc3.ram_rtc_bank - 0x08];
         } else {
             // undefined
-            write_log("[mbc] undefined read from RTC/RAM bank 0x%02X address 0x%04X, returning ones\n", mbc3.ram_rtc_bank, addr);
+            write_log("[mbc] undefined read from RTC/RAM bank 0x%02X address 0x%04X, returning ones\n", gb->mbc3.ram_rtc_bank, addr);
             return 0xFF;
         }
     } else {
-        write_log("[mbc] unimplemented read at address 0x%04X in MBC%d\n", addr, mbc_type);
+        write_log("[mbc] unimplemented read at address 0x%04X in MBC%d\n", addr, gb->mbc_type);
         die(-1, NULL);
         return 0xFF;    // unreachable
     }
@@ -245,7 +374,8 @@ static inline void mbc3_write(uint16_t addr, uint8_t byte) {
         write_log("[mbc] selecting ROM bank %d\n", byte);
         #endif
 
-        mbc3.rom_bank = byte;
+        gb->mbc3.rom_bank = byte;
+        mbc_update_banks();
     } else if(addr >= 0x4000 && addr <= 0x5FFF) {
         byte &= 0x0F;
 
@@ -259,44 +389,57 @@ static inline void mbc3_write(uint16_t addr, uint8_t byte) {
         }
         #endif
 
-        mbc3.ram_rtc_bank = byte;
+        gb->mbc3.ram_rtc_bank = byte;
+        mbc_update_banks();
     } else if(addr >= 0x0000 && addr <= 0x1FFF) {
         byte &= 0x0F;
         if(byte == 0x0A) {
-            mbc3.ram_rtc_enable = 1;
-            ex_ram_modified = 0;
+            gb->mbc3.ram_rtc_enable = 1;
             #ifdef MBC_LOG
             write_log("[mbc] enabled access to external RAM and RTC\n");
             #endif
         } else {
-            mbc3.ram_rtc_enable = 0;
+            gb->mbc3.ram_rtc_enable = 0;
             #ifdef MBC_LOG
             write_log("[mbc] disabled access to external RAM and RTC\n");
             #endif
 
             // dump the ram file here
-            write_ramfile();
+            battery_save();
         }
     } else if(addr >= 0xA000 && addr <= 0xBFFF) {
-        if(!mbc3.ram_rtc_enable) {
+        if(!gb->mbc3.ram_rtc_enable) {
             write_log("[mbc] warning: attempt to write to address 0x%04X value 0x%02X when external RAM/RTC is disabled\n", addr, byte);
             return;
         }
 
-        if(mbc3.ram_rtc_bank <= 3) {
+        if(gb->mbc3.ram_rtc_bank <= 3) {
             // ram
-            ex_ram[(mbc3.ram_rtc_bank * 8192) + (addr - 0xA000)] = byte;
-            ex_ram_modified = 1;
-        } else {
-            // rtc
-            //write_log("[mbc] TODO: implement writing to RTC registers (register 0x%02X value 0x%02X)\n", mbc3.ram_rtc_bank, byte);
-            return;     // ignore for now
+            if(!gb->ex_ram_size) return;
+            gb->ram_bank_ptr[(addr - 0xA000) & gb->ex_ram_mask] = byte;
+            gb->ex_ram_dirty |= 1 << ((gb->ram_bank_ptr - gb->ex_ram) >> 13);
+        } else if(gb->mbc3.ram_rtc_bank >= 0x08 && gb->mbc3.ram_rtc_bank <= 0x0C) {
+            // rtc, time counted so far belongs to the old value
+            int reg = gb->mbc3.ram_rtc_bank - 0x08;
+            rtc_update();
+
+            byte &= rtc_masks[reg];
+            gb->mbc3.rtc[reg] = byte;
+            gb->mbc3.rtc_latched[reg] = byte;
+
+            if(reg == RTC_S) gb->mbc3.rtc_subsecond = 0;    // writing seconds resets the divider
         }
     } else if(addr >= 0x6000 && addr <= 0x7FFF) {
-        mbc3.old_latch_data = mbc3.latch_data;
-        mbc3.latch_data = byte;
+        // writing zero and then one latches the clock
+        if(gb->mbc3.has_rtc && !gb->mbc3.latch_data && byte == 1) {
+            rtc_update();
+            memcpy(gb->mbc3.rtc_latched, gb->mbc3.rtc, 5);
+        }
+
+        gb->mbc3.old_latch_data = gb->mbc3.latch_data;
+        gb->mbc3.latch_data = byte;
     } else {
-        write_log("[mbc] unimplemented write at address 0x%04X value 0x%02X in MBC%d\n", addr, byte, mbc_type);
+        write_log("[mbc] unimplemented write at address 0x%04X value 0x%02X in MBC%d\n", addr, byte, gb->mbc_type);
         die(-1, NULL);
     }
 }
@@ -305,96 +448,58 @@ static inline void mbc3_write(uint16_t addr, uint8_t byte) {
 static inline void mbc1_write(uint16_t addr, uint8_t byte) {
     if(addr >= 0x2000 && addr <= 0x3FFF) {
         byte &= 0x1F;   // lower 5 bits
-        mbc1.bank1 = byte;
+        gb->mbc1.bank1 = byte;
+        mbc_update_banks();
     } else if(addr >= 0x4000 && addr <= 0x5FFF) {
         byte &= 3;      // 2 bits
-        mbc1.bank2 = byte;
+        gb->mbc1.bank2 = byte;
+        mbc_update_banks();
     } else if(addr >= 0x6000 && addr <= 0x7FFF) {
         byte &= 1;      // one bit
-        mbc1.mode = byte;
+        gb->mbc1.mode = byte;
+        mbc_update_banks();
     } else if(addr >= 0x0000 && addr <= 0x1FFF) {
         byte &= 0x0F;
         if(byte == 0x0A) {
-            mbc1.ram_enable = 1;
-            ex_ram_modified = 0;
+            gb->mbc1.ram_enable = 1;
             #ifdef MBC_LOG
             write_log("[mbc] enabled access to external RAM\n");
             #endif
         } else {
-            mbc1.ram_enable = 0;
+            gb->mbc1.ram_enable = 0;
             #ifdef MBC_LOG
             write_log("[mbc] disabled access to external RAM\n");
             #endif
 
-            write_ramfile();
+            battery_save();
         }
     } else if(addr >= 0xA000 && addr <= 0xBFFF) {
         // ram
-        if(!mbc1.ram_enable) {
+        if(!gb->mbc1.ram_enable) {
             write_log("[mbc] warning: attempt to write to address 0x%04X value 0x%02X when external RAM is disabled\n", addr, byte);
             return;
         }
 
-        int ram_bank;
-        if(mbc1.mode) ram_bank = mbc1.bank2 & 3;
-        else ram_bank = 0;
-
-        ex_ram[(ram_bank * 8192) + (addr - 0xA000)] = byte;
-        ex_ram_modified = 1;
+        if(!gb->ex_ram_size) return;
+        gb->ram_bank_ptr[(addr - 0xA000) & gb->ex_ram_mask] = byte;
+        gb->ex_ram_dirty |= 1 << ((gb->ram_bank_ptr - gb->ex_ram) >> 13);
     } else {
-        write_log("[mbc] unimplemented write at address 0x%04X value 0x%02X in MBC%d\n", addr, byte, mbc_type);
+        write_log("[mbc] unimplemented write at address 0x%04X value 0x%02X in MBC%d\n", addr, byte, gb->mbc_type);
         die(-1, NULL);
     }
 }
 
 static inline uint8_t mbc1_read(uint16_t addr) {
-    int rom_bank, ram_bank;
-    uint8_t *rom_bytes = (uint8_t *)rom;
-
-    if(addr >= 0x0000 && addr <= 0x3FFF) {
-        /*if(mbc1.mode) {
-            rom_bank = mbc1.bank2 << 5;
-        } else {
-            rom_bank = 0;
-        }*/
-
-        rom_bank = 0;
-
-        return rom_bytes[(rom_bank * 16384) + addr];
-    } else if(addr >= 0x4000 && addr <= 0x7FFF) {
-        //rom_bank = (mbc1.bank2 << 5) | mbc1.bank1;
-
-        if(mbc1.mode) {
-            rom_bank = mbc1.bank1 & 0x1F;
-        } else {
-            rom_bank = ((mbc1.bank2 << 5) & 3) | (mbc1.bank1 & 0x1F);
-        }
-
-        //rom_bank &= 
-
-        if(rom_bank) {
-            rom_bank &= (rom_size_banks-1);
-        } else {
-            rom_bank++;
-        }
-
-        //rom_bank &= (rom_size_banks-1);
-        //if(!rom_bank) rom_bank++;
-
-        addr -= 0x4000;
-        return rom_bytes[(rom_bank * 16384) + addr];
-    } else if(addr >= 0xA000 && addr <= 0xBFFF) {
-        if(!mbc1.ram_enable) {
+    if(addr >= 0xA000 && addr <= 0xBFFF) {
+        if(!gb->mbc1.ram_enable) {
             write_log("[mbc] warning: attempt to read from address 0x%04X when external RAM is disabled, returning ones\n", addr);
             return 0xFF;
         }
 
-        if(mbc1.mode) ram_bank = mbc1.bank2 & 3;
-        else ram_bank = 0;
-
-        return ex_ram[(ram_bank * 8192) + (addr - 0xA000)];
+        if(!gb->ex_ram_size) return 0xFF;
+        return gb->ram_bank_ptr[(addr - 0xA000) & gb->ex_ram_mask];
     } else {
-        write_log("[mbc] unimplemented read at address 0x%04X in MBC%d\n", addr, mbc_type);
+        write_log("[mbc] unimplemented read at address 0x%04X in MBC%d\n", addr, gb->mbc_type);
         die(-1, NULL);
         return 0xFF;
     }
@@ -404,73 +509,73 @@ static inline uint8_t mbc1_read(uint16_t addr) {
 // MBC5 functions here
 static inline void mbc5_write(uint16_t addr, uint8_t byte) {
     if(addr >= 0x2000 && addr <= 0x2FFF) {
-        mbc5.rom_bank &= 0x100;
-        mbc5.rom_bank |= byte;      // low 8 bits of ROM bank select
+        gb->mbc5.rom_bank &= 0x100;
+        gb->mbc5.rom_bank |= byte;      // low 8 bits of ROM bank select
+        mbc_update_banks();
 
         #ifdef MBC_LOG
-        write_log("[mbc] selecting ROM bank %d\n", mbc5.rom_bank);
+        write_log("[mbc] selecting ROM bank %d\n", gb->mbc5.rom_bank);
         #endif
     } else if(addr >= 0x3000 && addr <= 0x3FFF) {
-        mbc5.rom_bank &= 0xFF;
-        mbc5.rom_bank |= ((byte & 1) << 8);   // high bit of ROM bank select
+        gb->mbc5.rom_bank &= 0xFF;
+        gb->mbc5.rom_bank |= ((byte & 1) << 8);   // high bit of ROM bank select
+        mbc_update_banks();
 
         #ifdef MBC_LOG
-        write_log("[mbc] selecting ROM bank %d\n", mbc5.rom_bank);
+        write_log("[mbc] selecting ROM bank %d\n", gb->mbc5.rom_bank);
         #endif
     } else if(addr >= 0x4000 && addr <= 0x5FFF) {
         byte &= 0x0F;
-        mbc5.ram_bank = byte;
+        gb->mbc5.ram_bank = byte;
+        mbc_update_banks();
 
         #ifdef MBC_LOG
         write_log("[mbc] selecting RAM bank %d\n", byte);
         #endif
     } else if(addr >= 0x0000 && addr <= 0x1FFF) {
         if(byte == 0x0A) {
-            mbc5.ram_enable = 1;
-            ex_ram_modified = 0;
+            gb->mbc5.ram_enable = 1;
             #ifdef MBC_LOG
             write_log("[mbc] enabled access to external RAM\n");
             #endif
         } else {
-            mbc5.ram_enable = 0;
+            gb->mbc5.ram_enable = 0;
             #ifdef MBC_LOG
             write_log("[mbc] disabled access to external RAM\n");
             #endif
 
-            write_ramfile();
+            battery_save();
         }
     } else if(addr >= 0xA000 && addr <= 0xBFFF) {
-        if(!mbc5.ram_enable) {
+        if(!gb->mbc5.ram_enable) {
             write_log("[mbc] warning: attempt to write to address 0x%04X value 0x%02X when external RAM is disabled\n", addr, byte);
             return;
         }
 
-        ex_ram[(mbc5.ram_bank * 8192) + (addr - 0xA000)] = byte;
-        ex_ram_modified = 1;
+        if(!gb->ex_ram_size) return;
+        gb->ram_bank_ptr[(addr - 0xA000) & gb->ex_ram_mask] = byte;
+        gb->ex_ram_dirty |= 1 << ((gb->ram_bank_ptr - gb->ex_ram) >> 13);
     } else if(addr <= 0x6000 && addr <= 0x7FFF) {
         // i can't find any info on what this does but apparently pokemon yellow does this?
         write_log("[mbc] warning: undefined write at address 0x%04X value 0x%02X in MBC5, ignoring\n", addr, byte);
         return;
     } else {
-        write_log("[mbc] unimplemented write at address 0x%04X value 0x%02X in MBC%d\n", addr, byte, mbc_type);
+        write_log("[mbc] unimplemented write at address 0x%04X value 0x%02X in MBC%d\n", addr, byte, gb->mbc_type);
         die(-1, NULL);
     }
 }
 
 static inline uint8_t mbc5_read(uint16_t addr) {
-    uint8_t *rom_bytes = (uint8_t *)rom;
-    if(addr >= 0x4000 && addr <= 0x7FFF) {
-        addr -= 0x4000;
-        return rom_bytes[((mbc5.rom_bank & (rom_size_banks-1)) * 16384) + addr];
-    } else if(addr >= 0xA000 && addr <= 0xBFFF) {
-        if(!mbc5.ram_enable) {
+    if(addr >= 0xA000 && addr <= 0xBFFF) {
+        if(!gb->mbc5.ram_enable) {
             write_log("[mbc] warning: attempt to read from address 0x%04X when external RAM is disabled, returning ones\n", addr);
             return 0xFF;
         }
 
-        return ex_ram[(mbc5.ram_bank * 8192) + (addr - 0xA000)];
+        if(!gb->ex_ram_size) return 0xFF;
+        return gb->ram_bank_ptr[(addr - 0xA000) & gb->ex_ram_mask];
     } else {
-        write_log("[mbc] unimplemented read at address 0x%04X in MBC%d\n", addr, mbc_type);
+        write_log("[mbc] unimplemented read at address 0x%04X in MBC%d\n", addr, gb->mbc_type);
         die(-1, NULL);
         return 0xFF;
     }
@@ -478,7 +583,7 @@ static inline uint8_t mbc5_read(uint16_t addr) {
 
 // general fucntions called from memory.c
 uint8_t mbc_read(uint16_t addr) {
-    switch(mbc_type) {
+    switch(gb->mbc_type) {
     case 1:
         return mbc1_read(addr);
     case 3:
@@ -486,16 +591,16 @@ uint8_t mbc_read(uint16_t addr) {
     case 5:
         return mbc5_read(addr);
     default:
-        write_log("[mbc] unimplemented read at address 0x%04X in MBC%d\n", addr, mbc_type);
+        write_log("[mbc] unimplemented read at address 0x%04X in MBC%d\n", addr, gb->mbc_type);
         die(-1, NULL);
         return 0xFF;    // unreachable
     }
 }
 
 void mbc_write(uint16_t addr, uint8_t byte) {
-    switch(mbc_type) {
+    switch(gb->mbc_type) {
     case 0:
-        write_log("[mbc] undefined write to read-only region 0x%04X value 0x%02X in MBC%d, ignoring...\n", addr, byte, mbc_type);
+        write_log("[mbc] undefined write to read-only region 0x%04X value 0x%02X in MBC%d, ignoring...\n", addr, byte, gb->mbc_type);
         return;
     case 1:
         return mbc1_write(addr, byte);
@@ -504,7 +609,7 @@ void mbc_write(uint16_t addr, uint8_t byte) {
     case 5:
         return mbc5_write(addr, byte);
     default:
-        write_log("[mbc] unimplemented write at address 0x%04X value 0x%02X in MBC%d\n", addr, byte, mbc_type);
+        write_log("[mbc] unimplemented write at address 0x%04X value 0x%02X in MBC%d\n", addr, byte, gb->mbc_type);
         die(-1, NULL);
     }
 }
\ No newline at end of file
@@ -5,8 +5,15 @@
 #include <tinygb.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <ioports.h>
+#include <state.h>
 
 #define MEMORY_LOG
 
@@ -28,29 +35,138 @@
 
  */
 
-void *ram = NULL, *rom = NULL;
-char game_title[17];
+__thread void *rom = NULL;
+__thread long rom_size;
+__thread char *rom_filename = NULL;
+static __thread int rom_hashed = 0;
+static __thread uint64_t rom_hash_value;
+__thread size_t state_footprint = 0;
+__thread char game_title[17];
 
-uint8_t *cartridge_type, *cgb_compatibility;
+__thread uint8_t *cartridge_type, *cgb_compatibility;
 
-int mbc_type;
+void *state_alloc(size_t size, const char *name) {
+    void *ptr = calloc(1, size);
+    if(!ptr) {
+        die(-1, "unable to allocate memory for %s\n", name);
+    }
+
+    state_footprint += size;
+#ifdef MEMORY_LOG
+    write_log("[memory] allocated %d bytes for %s\n", (int)size, name);
+#endif
+    return ptr;
+}
+
+// ROMs are mapped read-only and shared by every instance in the process that
+// runs the same file, and through the page cache with other processes too
+typedef struct shared_rom_t {
+    dev_t dev;
+    ino_t ino;
+    void *data;
+    long size;
+    int refs;
+    struct shared_rom_t *next;
+} shared_rom_t;
+
+static shared_rom_t *shared_roms = NULL;
+static pthread_mutex_t shared_roms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// maps the ROM into memory; returns zero on success
+int load_rom(char *filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+
+    if(fd < 0 || fstat(fd, &st) || st.st_size <= 0) {
+        write_log("unable to open %s for reading\n", filename);
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&shared_roms_lock);
+
+    shared_rom_t *shared;
+    for(shared = shared_roms; shared; shared = shared->next) {
+        if(shared->dev == st.st_dev && shared->ino == st.st_ino) break;
+    }
+
+    if(shared) {
+        shared->refs++;
+        write_log("sharing rom from file %s, %d KiB\n", filename, (int)(shared->size/1024));
+    } else {
+        write_log("loading rom from file %s, %d KiB\n", filename, (int)(st.st_size/1024));
+
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        shared = calloc(1, sizeof(shared_rom_t));
+        if(data == MAP_FAILED || !shared) {
+            write_log("an error occured while mapping the rom file\n");
+            if(data != MAP_FAILED) munmap(data, st.st_size);
+            free(shared);
+            pthread_mutex_unlock(&shared_roms_lock);
+            close(fd);
+            return -1;
+        }
+
+        shared->dev = st.st_dev;
+        shared->ino = st.st_ino;
+        shared->data = data;
+        shared->size = st.st_size;
+        shared->refs = 1;
+        shared->next = shared_roms;
+        shared_roms = shared;
+    }
+
+    pthread_mutex_unlock(&shared_roms_lock);
+    close(fd);
+
+    rom = shared->data;
+    rom_size = shared->size;
+    return 0;
+}
+
+// drops this instance's reference to its ROM
+void unload_rom() {
+    if(!rom) return;
+
+    pthread_mutex_lock(&shared_roms_lock);
 
-#define WORK_RAM            (0)     // +0
-#define HIGH_RAM            (32768) // +32k assuming work RAM has a maximum of 8x4k banks
-#define CART_RAM            (HIGH_RAM+128)  // +128 because HRAM is exactly 127 bytes long but add one byte for alignment
-#define OAM                 (CART_RAM+1048576)  // +1 MB
+    for(shared_rom_t **link = &shared_roms; *link; link = &(*link)->next) {
+        shared_rom_t *shared = *link;
+        if(shared->data != rom) continue;
 
-int rom_bank = 1;
-int cart_ram_bank = 0;
-int work_ram_bank = 1;
-int is_cgb = 0, is_sgb = 0;
+        if(!--shared->refs) {
+            munmap(shared->data, shared->size);
+            *link = shared->next;
+            free(shared);
+        }
+
+        break;
+    }
+
+    pthread_mutex_unlock(&shared_roms_lock);
+    rom = NULL;
+    rom_hashed = 0;
+}
+
+// hashing a large ROM takes milliseconds, so it's only done once
+uint64_t rom_hash() {
+    if(!rom_hashed) {
+        rom_hash_value = hash_data(rom, rom_size);
+        rom_hashed = 1;
+    }
+
+    return rom_hash_value;
+}
+
+void report_footprint() {
+    write_log("[memory] emulator state is using %d KiB of memory in addition to the %d KiB ROM\n", (int)((state_footprint + 1023) / 1024), (int)(rom_size / 1024));
+}
 
 void memory_start() {
     // rom was already initialized in main.c
-    ram = calloc(1024, 1058);   // 1 MB is the maximum RAM size in MBC5 + 33 KB for WRAM + HRAM
-    if(!ram) {
-        die(1, "[memory] unable to allocate RAM\n");
-    }
+    // the machine state arena doesn't exist yet, so the header is parsed into
+    // locals first and the arena is sized from them
+    int is_cgb = 0, is_sgb = 0, mbc_type = 0;
 
     // copy the game's title
     memset(game_title, 0, 17);
@@ -91,7 +207,6 @@ void memory_start() {
             if(config_system == SYSTEM_AUTO || config_system == SYSTEM_SGB2) {
                 write_log("SGB2 functions will be enabled\n");
                 is_sgb = 1;
-                sgb_start();
             } else {
                 write_log("but SGB functions are disabled in config file\n");
                 is_sgb = 0;
@@ -137,22 +252,28 @@ void memory_start() {
         break;
     }
 
+    // only allocate what this cartridge and system can actually address
+    arena_start(is_cgb, is_sgb, mbc_type ? mbc_ram_size() : 0);
+
+    gb->is_cgb = is_cgb;
+    gb->is_sgb = is_sgb;
+    gb->mbc_type = mbc_type;
+
+    if(is_sgb) sgb_start();
+
+    // ROM bank 1 is always mapped at 0x4000-0x7FFF until an MBC says otherwise
+    gb->rom_bank_ptr = (uint8_t *)rom + 16384;
+
     if(!mbc_type) {
         write_log("[mbc] cartridge type is 0x%02X: no MBC\n", *cartridge_type);
     } else {
         write_log("[mbc] cartridge type is 0x%02X: MBC%d\n", *cartridge_type, mbc_type);
-        mbc_start(ram + CART_RAM);
+        mbc_start();
     }
 }
 
-static inline uint8_t read_wram(int bank, uint16_t addr) {
-    uint8_t *bytes = (uint8_t *)ram;
-    return bytes[(bank * 4096) + addr + WORK_RAM];
-}
-
 static inline uint8_t read_hram(uint16_t addr) {
-    uint8_t *bytes = (uint8_t *)ram;
-    return bytes[addr + HIGH_RAM];
+    return gb->hram[addr];
 }
 
 uint8_t read_io(uint16_t addr) {
@@ -182,6 +303,10 @@ uint8_t read_io(uint16_t addr) {
         return display_read(addr);
     case P1:
         return joypad_read(addr);
+    case SB:
+        return sb_read();
+    case SC:
+        return sc_read();
     case DIV:
     case TIMA:
     case TMA:
@@ -239,25 +364,23 @@ uint8_t read_io(uint16_t addr) {
 }
 
 static inline uint8_t read_oam(uint16_t addr) {
-    uint8_t *bytes = (uint8_t *)ram;
-    return bytes[OAM + addr];
+    return gb->oam[addr];
 }
 
 uint8_t read_byte(uint16_t addr) {
     uint8_t *rom_bytes = (uint8_t *)rom;
-    if(!mbc_type && addr <= 0x7FFF) {
-        return rom_bytes[addr];
-    } else if(addr <= 0x3FFF) {
-        if(mbc_type == 1) return mbc_read(addr);    // only MBC that allows banking at 0x0000-0x3FFF
+    if(addr <= 0x3FFF) {
         return rom_bytes[addr];
+    } else if(addr <= 0x7FFF) {
+        return gb->rom_bank_ptr[addr - 0x4000];     // kept up to date by the MBC
     } else if(addr >= 0xC000 && addr <= 0xCFFF) {
-        return read_wram(0, addr - 0xC000);
+        return gb->wram[addr - 0xC000];
     } else if(addr >= 0xD000 && addr <= 0xDFFF) {
-        return read_wram(work_ram_bank, addr - 0xD000);
+        return gb->wram_bank_ptr[addr - 0xD000];
     } else if(addr >= 0xE000 && addr <= 0xEFFF) {
-        return read_wram(0, addr - 0xE000); // echo bank 0
+        return gb->wram[addr - 0xE000]; // echo bank 0
     } else if(addr >= 0xF000 && addr <= 0xFDFF) {
-        return read_wram(work_ram_bank, addr - 0xF000); // echo bank n
+        return gb->wram_bank_ptr[addr - 0xF000]; // echo bank n
     } else if(addr >= 0xFF80 && addr <= 0xFFFE) {
         return read_hram(addr - 0xFF80);
     } else if(addr >= 0xFF00 && addr <= 0xFF7F) {
@@ -267,12 +390,12 @@ uint8_t read_byte(uint16_t addr) {
     } else if(addr >= 0x8000 && addr <= 0x9FFF) {
         return vram_read(addr);
     } else if(addr >= 0xFE00 && addr <= 0xFE9F) {
-        return read_oam(addr);
-    } else if(addr <= 0x7FFF || (addr >= 0xA000 && addr <= 0xBFFF)) {
+        return read_oam(addr - 0xFE00);
+    } else if(addr >= 0xA000 && addr <= 0xBFFF) {
         return mbc_read(addr);
     }
 
-    write_log("[memory] unimplemented read at address 0x%04X in MBC%d ROM\n", addr, mbc_type);
+    write_log("[memory] unimplemented read at address 0x%04X in MBC%d ROM\n", addr, gb->mbc_type);
     die(-1, NULL);
     return 0xFF;    // unreachable anyway
 }
@@ -281,14 +404,8 @@ inline uint16_t read_word(uint16_t addr) {
     return (uint16_t)(read_byte(addr) | ((uint16_t)read_byte(addr+1) << 8));
 }
 
-static inline void write_wram(int bank, uint16_t addr, uint8_t byte) {
-    uint8_t *bytes = (uint8_t *)ram;
-    bytes[(bank * 4096) + addr + WORK_RAM] = byte;
-}
-
 static inline void write_hram(uint16_t addr, uint8_t byte) {
-    uint8_t *bytes = (uint8_t *)ram;
-    bytes[addr + HIGH_RAM] = byte;
+    gb->hram[addr] = byte;
 }
 
 void write_io(uint16_t addr, uint8_t byte) {
@@ -378,8 +495,7 @@ void write_io(uint16_t addr, uint8_t byte) {
 }
 
 static inline void write_oam(uint16_t addr, uint8_t byte) {
-    uint8_t *bytes = (uint8_t *)ram;
-    bytes[OAM + addr] = byte;
+    gb->oam[addr] = byte;
 }
 
 void write_byte(uint16_t addr, uint8_t byte) {
@@ -388,13 +504,17 @@ void write_byte(uint16_t addr, uint8_t byte) {
 #endif*/
 
     if(addr >= 0xC000 && addr <= 0xCFFF) {
-        return write_wram(0, addr - 0xC000, byte);
+        gb->wram[addr - 0xC000] = byte;
+        return;
     } else if(addr >= 0xD000 && addr <= 0xDFFF) {
-        return write_wram(work_ram_bank, addr - 0xD000, byte);
+        gb->wram_bank_ptr[addr - 0xD000] = byte;
+        return;
     } else if(addr >= 0xE000 && addr <= 0xEFFF) {
-        return write_wram(0, addr - 0xE000, byte); // echo bank 0
+        gb->wram[addr - 0xE000] = byte; // echo bank 0
+        return;
     } else if(addr >= 0xF000 && addr <= 0xFDFF) {
-        return write_wram(work_ram_bank, addr - 0xF000, byte); // echo bank n
+        gb->wram_bank_ptr[addr - 0xF000] = byte; // echo bank n
+        return;
     } else if(addr >= 0xFF80 && addr <= 0xFFFE) {
         return write_hram(addr - 0xFF80, byte);
     } else if (addr >= 0xFF00 && addr <= 0xFF7F) {
@@ -412,10 +532,10 @@ void write_byte(uint16_t addr, uint8_t byte) {
         return mbc_write(addr, byte);
     }
 
-    write_log("[memory] unimplemented write at address 0x%04X value 0x%02X in MBC%d ROM\n", addr, byte, mbc_type);
+    write_log("[memory] unimplemented write at address 0x%04X value 0x%02X in MBC%d ROM\n", addr, byte, gb->mbc_type);
     die(-1, NULL);
 }
 
 inline void copy_oam(void *dst) {
-    memcpy(dst, ram+OAM, OAM_SIZE);
+    memcpy(dst, gb->oam, OAM_SIZE);
 }
\ No newline at end of file
@@ -0,0 +1,159 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+#include <stdio.h>
+#include <string.h>
+
+//#define MOVIE_LOG
+
+// Input movies
+
+/*
+
+ A movie is the state of the eight keys at the start of every frame, one byte
+ per frame, after a header that identifies what it was recorded on: the hash
+ of the ROM, the model that was emulated and the settings that decide the
+ model, and whether it was recorded in deterministic mode. Playing a movie
+ back restores those settings before the machine is started and sets the
+ keys through joypad_handle() at the same frame boundaries, so a game sees
+ exactly the same input as when it was recorded.
+
+ For that to hold, input has to change only at frame boundaries while
+ recording, so the frontend applies key changes as soon as it polls them and
+ only polls once per frame. Frames here are the main loop's 70224 cycle
+ slices, which run on whether the LCD is on or not.
+
+ The number of frames isn't stored; it's whatever follows the header, so a
+ recording that was cut short is still a valid movie.
+
+ */
+
+#define MOVIE_MAGIC         "TGBMOVIE"
+#define MOVIE_VERSION       1
+#define MOVIE_FLUSH_FRAMES  64      // a crash loses at most about a second
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t rom_hash;
+    uint32_t model;             // SYSTEM_GB, SYSTEM_SGB2 or SYSTEM_CGB
+    uint32_t frame_cycles;
+    int32_t system, preference, border;     // from tinygb.ini
+    uint32_t deterministic;
+} movie_header_t;
+
+__thread int movie_mode = MOVIE_NONE;
+
+static __thread FILE *movie_file;
+static __thread char *movie_filename;
+static __thread movie_header_t header;
+static __thread uint64_t movie_frames;
+
+// opens a movie for recording or playback; called after the ROM is loaded
+// but before the machine is started, so playback can set up the same model
+void movie_open(char *filename, int mode) {
+    movie_filename = filename;
+    movie_mode = mode;
+
+    if(mode == MOVIE_RECORD) {
+        movie_file = fopen(filename, "wb");
+        if(!movie_file) die(-1, "[movie] unable to open %s for writing\n", filename);
+
+        // key changes have to land on frame boundaries, see above
+        config_input_poll = POLL_FRAME;
+        return;
+    }
+
+    movie_file = fopen(filename, "rb");
+    if(!movie_file) die(-1, "[movie] unable to open %s for reading\n", filename);
+
+    if(fread(&header, sizeof(movie_header_t), 1, movie_file) != 1 || memcmp(header.magic, MOVIE_MAGIC, 8)) {
+        die(-1, "[movie] %s is not a tinygb movie\n", filename);
+    }
+
+    if(header.version != MOVIE_VERSION) {
+        die(-1, "[movie] %s is a version %d movie, only version %d is supported\n", filename, header.version, MOVIE_VERSION);
+    }
+
+    if(header.rom_hash != rom_hash()) {
+        die(-1, "[movie] %s was recorded with a different ROM\n", filename);
+    }
+
+    fseek(movie_file, 0L, SEEK_END);
+    movie_frames = ftell(movie_file) - header.header_size;
+    fseek(movie_file, header.header_size, SEEK_SET);
+
+    config_system = header.system;
+    config_preference = header.preference;
+    config_border = header.border;
+    if(header.deterministic) config_deterministic = 1;
+}
+
+// called once the machine is running
+void movie_start() {
+    if(movie_mode == MOVIE_RECORD) {
+        memset(&header, 0, sizeof(movie_header_t));
+        memcpy(header.magic, MOVIE_MAGIC, 8);
+        header.version = MOVIE_VERSION;
+        header.header_size = sizeof(movie_header_t);
+        header.rom_hash = rom_hash();
+        header.model = machine_model();
+        header.frame_cycles = gb->timing.main_cycles;
+        header.system = config_system;
+        header.preference = config_preference;
+        header.border = config_border;
+        header.deterministic = config_deterministic;
+
+        if(fwrite(&header, sizeof(movie_header_t), 1, movie_file) != 1) {
+            die(-1, "[movie] unable to write to %s\n", movie_filename);
+        }
+
+        fflush(movie_file);
+
+        write_log("[movie] recording input to %s\n", movie_filename);
+    } else if(movie_mode == MOVIE_PLAY) {
+        if(header.model != machine_model() || header.frame_cycles != gb->timing.main_cycles) {
+            die(-1, "[movie] %s was recorded on a different model\n", movie_filename);
+        }
+
+        write_log("[movie] playing back %llu frames from %s\n", (unsigned long long)movie_frames, movie_filename);
+    }
+}
+
+// called at the start of every frame; returns zero once playback is over
+int movie_frame() {
+    if(movie_mode == MOVIE_RECORD) {
+        fputc(gb->pressed_keys, movie_file);
+        if(!(++movie_frames % MOVIE_FLUSH_FRAMES)) fflush(movie_file);
+    } else if(movie_mode == MOVIE_PLAY) {
+        int keys = fgetc(movie_file);
+        if(keys == EOF) {
+            write_log("[movie] playback of %s is over\n", movie_filename);
+            return 0;
+        }
+
+#ifdef MOVIE_LOG
+        if(keys != gb->pressed_keys) write_log("[movie] keys 0x%02X at cycle %llu\n", keys, (unsigned long long)gb->total_cycles);
+#endif
+
+        joypad_set(keys);
+    }
+
+    return 1;
+}
+
+void movie_stop() {
+    if(!movie_file) return;
+
+    if(movie_mode == MOVIE_RECORD) {
+        write_log("[movie] recorded %llu frames to %s\n", (unsigned long long)movie_frames, movie_filename);
+    }
+
+    fclose(movie_file);
+    movie_file = NULL;
+    movie_mode = MOVIE_NONE;
+}
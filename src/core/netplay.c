@@ -0,0 +1,435 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+//#define NETPLAY_LOG
+
+// Rollback netplay
+
+/*
+
+ Two players on two hosts play a link cable game together. Instead of
+ running one machine per host and stretching the link cable across the
+ network, where every transfer would wait for a round trip, each host runs
+ both machines on one thread and only the players' keys go across. As long
+ as both hosts emulate the same frames with the same keys, the machines stay
+ the same on both sides.
+
+ The other player's keys for the frame about to be emulated haven't arrived
+ yet, so they are predicted to be the last ones that did, and the frame is
+ emulated right away. After every frame, both machines are snapshotted into
+ a ring (a memcpy of each arena, see state.c). When keys arrive that differ
+ from what was predicted for a frame, both machines go back to the snapshot
+ from before that frame and all frames since are emulated again with the
+ right keys, within one host frame. Like run-ahead (see runahead.c), those
+ frames make no sound and aren't rendered, and neither is the other player's
+ machine ever. A host never gets more than NETPLAY_FRAMES ahead of the keys
+ it has; it waits for the other host instead, which also keeps the two at
+ the same speed. Emulating a frame of both machines again takes about 1 ms,
+ so that bounds a rollback to about 4 ms, which is what fits in a 60 Hz
+ frame next to emulating and presenting the frame itself.
+
+ The machines are connected by a cable that only exists on this thread (see
+ serial.c): they run alternately in slices of one scanline, and a transfer
+ completes on both at once when the master's clock finishes it. That is a
+ little less exact than the real thing, but the same on both hosts.
+
+ Keys go over UDP. Every packet carries the sender's keys of its last
+ NETPLAY_KEYS frames, so a lost packet is made up for by the next one, and a
+ hash of both machines at the newest frame the sender has all keys for, so
+ the hosts notice if they ever drift apart. Both machines start from power
+ on in deterministic mode, without save files.
+
+ */
+
+#define NETPLAY_FRAMES      4       // how far a rollback can reach back
+#define NETPLAY_KEYS        32      // keys per packet
+#define NETPLAY_RING        64      // frames of keys and hashes, a power of two
+#define NETPLAY_SLICE       456     // cycles between switching machines
+#define NETPLAY_MAGIC       0x4E424754  // "TGBN"
+#define NETPLAY_NO_HASH     0xFFFFFFFF
+#define NETPLAY_RESEND_MS   16
+#define NETPLAY_CONNECT_MS  30000
+#define NETPLAY_TIMEOUT_MS  10000
+
+typedef struct {
+    uint32_t magic;
+    uint8_t player;
+    uint8_t reserved[3];
+    uint32_t frames;            // frames the sender has keys for, the last of keys[] is frames-1
+    uint32_t hash_frame;        // hash is of both machines before this frame
+    uint64_t hash;
+    uint64_t rom_hash;
+    uint8_t keys[NETPLAY_KEYS];
+} netplay_packet_t;
+
+__thread int netplay_player = 0;    // 1 or 2, or no netplay
+
+static __thread int sock_fd = -1;
+static __thread int local;          // index of this host's machine in machines[]
+static __thread gb_t *machines[2];  // player 1's and player 2's
+static __thread uint8_t *snapshots; // NETPLAY_FRAMES + 1 pairs of machines
+static __thread size_t snapshot_size;
+
+static __thread long frame;         // the next frame to be emulated
+static __thread long keyed;         // this player's keys are known for this many frames
+static __thread long confirmed;     // the other player's keys are known up to here
+static __thread long rollback_from; // the first frame emulated with wrong keys
+static __thread uint8_t local_keys[NETPLAY_RING], remote_keys[NETPLAY_RING], used_keys[NETPLAY_RING];
+static __thread uint64_t hashes[NETPLAY_RING];   // both machines before each frame
+static __thread long peer_hash_frame;
+static __thread uint64_t peer_hash;
+static __thread double last_heard;
+
+// statistics
+static __thread long rollbacks, rollback_frames, longest_rollback, checked_hashes, waits;
+static __thread double rollback_ms, longest_rollback_ms, snapshot_ms, wait_ms;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000.0) + (ts.tv_nsec / 1000000.0);
+}
+
+// gb is a machine of this thread, the other one is on the other end of the
+// cable; only the frames this host shows make sound
+static void use_machine(int index, int shown) {
+    gb = machines[index];
+    cable_peer = machines[!index];
+    running_ahead = (index != local) || !shown;
+    hide_video = (index != local) || !shown;
+}
+
+static inline uint8_t *snapshot_of(long f, int index) {
+    return snapshots + ((((f % (NETPLAY_FRAMES + 1)) * 2) + index) * snapshot_size);
+}
+
+// both machines before frame f
+static void take_snapshot(long f) {
+    uint64_t regions[MAX_HASH_REGIONS * 2];
+    char tags[MAX_HASH_REGIONS][4];
+    int count = 0;
+
+    double start = now_ms();
+
+    for(int i = 0; i < 2; i++) {
+        gb = machines[i];
+        state_snapshot(snapshot_of(f, i));
+        count += savestate_hash_chunks(regions + count, tags);
+    }
+
+    hashes[f & (NETPLAY_RING - 1)] = hash_data(regions, count * sizeof(uint64_t));
+    gb = machines[local];
+
+    snapshot_ms += now_ms() - start;
+}
+
+static void restore_snapshot(long f, int index) {
+    gb = machines[index];
+    state_restore(snapshot_of(f, index));
+    gb = machines[local];
+}
+
+static void run_frame(long f, int shown) {
+    uint8_t keys[2];
+
+    // the other player is predicted to keep holding the last keys that arrived
+    uint8_t remote = 0;
+    if(f <= confirmed) remote = remote_keys[f & (NETPLAY_RING - 1)];
+    else if(confirmed >= 0) remote = remote_keys[confirmed & (NETPLAY_RING - 1)];
+
+    used_keys[f & (NETPLAY_RING - 1)] = remote;
+    keys[local] = local_keys[f & (NETPLAY_RING - 1)];
+    keys[!local] = remote;
+
+    for(int i = 0; i < 2; i++) {
+        gb = machines[i];
+        joypad_set(keys[i]);
+        gb->timing.current_cycles = 0;
+    }
+
+    for(int end = NETPLAY_SLICE; ; end += NETPLAY_SLICE) {
+        int running = 0;
+
+        for(int i = 0; i < 2; i++) {
+            use_machine(i, shown);
+
+            cpu_run_until(end < gb->timing.main_cycles ? end : gb->timing.main_cycles);
+
+            if(gb->timing.current_cycles < gb->timing.main_cycles) running = 1;
+        }
+
+        if(!running) break;
+    }
+
+    use_machine(local, 1);
+}
+
+static void send_packet() {
+    netplay_packet_t packet;
+    memset(&packet, 0, sizeof(netplay_packet_t));
+
+    packet.magic = NETPLAY_MAGIC;
+    packet.player = netplay_player;
+    packet.frames = keyed;
+    packet.rom_hash = rom_hash();
+
+    for(int i = 0; i < NETPLAY_KEYS; i++) {
+        long f = keyed - NETPLAY_KEYS + i;
+        if(f >= 0) packet.keys[i] = local_keys[f & (NETPLAY_RING - 1)];
+    }
+
+    // the hashes after a wrong prediction are about to change
+    packet.hash_frame = NETPLAY_NO_HASH;
+    if(rollback_from > frame) {
+        packet.hash_frame = confirmed + 1 < frame ? confirmed + 1 : frame;
+        packet.hash = hashes[packet.hash_frame & (NETPLAY_RING - 1)];
+    }
+
+    // fails while the other host isn't up yet, which the next packet makes up for
+    send(sock_fd, &packet, sizeof(netplay_packet_t), 0);
+}
+
+static void receive_packets() {
+    netplay_packet_t packet;
+
+    while(recv(sock_fd, &packet, sizeof(netplay_packet_t), 0) == sizeof(netplay_packet_t)) {
+        if(packet.magic != NETPLAY_MAGIC || packet.player == netplay_player) continue;
+
+        if(packet.rom_hash != rom_hash()) {
+            die(-1, "[netplay] player %d is running a different ROM\n", packet.player);
+        }
+
+        last_heard = now_ms();
+
+        // every packet covers all keys since the last one that could arrive
+        for(int i = 0; i < NETPLAY_KEYS; i++) {
+            long f = (long)packet.frames - NETPLAY_KEYS + i;
+            if(f != confirmed + 1) continue;
+
+            remote_keys[f & (NETPLAY_RING - 1)] = packet.keys[i];
+            confirmed = f;
+
+            if(f < frame && f < rollback_from && used_keys[f & (NETPLAY_RING - 1)] != packet.keys[i]) {
+                rollback_from = f;
+            }
+        }
+
+        if(packet.hash_frame != NETPLAY_NO_HASH && (long)packet.hash_frame > peer_hash_frame) {
+            peer_hash_frame = packet.hash_frame;
+            peer_hash = packet.hash;
+        }
+    }
+}
+
+// waits for packets until the other player's keys are at most NETPLAY_FRAMES
+// behind or, with frames zero, until the other host has been heard from
+static void wait_for_peer(int frames) {
+    double start = now_ms(), last_sent = 0.0;
+    double timeout = frames ? NETPLAY_TIMEOUT_MS : NETPLAY_CONNECT_MS;
+
+    waits++;
+
+    while(frames ? frame - confirmed > frames : !last_heard) {
+        double now = now_ms();
+
+        if(now - (last_heard ? last_heard : start) > timeout) {
+            die(-1, "[netplay] player %d didn't answer for %d seconds\n", 3 - netplay_player, (int)(timeout / 1000));
+        }
+
+        if(now - last_sent >= NETPLAY_RESEND_MS) {
+            send_packet();
+            last_sent = now;
+        }
+
+        struct pollfd pfd = { .fd = sock_fd, .events = POLLIN };
+        poll(&pfd, 1, 1);
+        receive_packets();
+    }
+
+    wait_ms += now_ms() - start;
+}
+
+// goes back to the first frame that was emulated with wrong keys and
+// emulates everything since again
+static void roll_back() {
+    long from = rollback_from;
+    double start = now_ms();
+
+    rollback_from = LONG_MAX;
+
+    restore_snapshot(from, 0);
+    restore_snapshot(from, 1);
+
+    for(long f = from; f < frame; f++) {
+        run_frame(f, 0);
+        take_snapshot(f + 1);
+    }
+
+    // the frames emulated again made no sound, so the levels the synthesizer
+    // holds are still those of the frames that were thrown away
+    sound_resync();
+
+    double ms = now_ms() - start;
+    rollbacks++;
+    rollback_frames += frame - from;
+    rollback_ms += ms;
+
+    if(frame - from > longest_rollback || (frame - from == longest_rollback && ms > longest_rollback_ms)) {
+        longest_rollback = frame - from;
+        longest_rollback_ms = ms;
+    }
+
+#ifdef NETPLAY_LOG
+    write_log("[netplay] rolled back %ld frames to frame %ld in %.3f ms\n", frame - from, from, ms);
+#endif
+}
+
+// compares the other host's newest hash with ours, once ours is final too
+static void check_hash() {
+    long f = peer_hash_frame;
+
+    if(f < 0 || f > confirmed + 1 || f > frame || rollback_from <= frame) return;
+
+    peer_hash_frame = -1;
+    if(frame - f >= NETPLAY_RING) return;  // long gone
+
+    if(hashes[f & (NETPLAY_RING - 1)] != peer_hash) {
+        die(-1, "[netplay] the machines differ from player %d's at frame %ld; both need the same ROM and settings\n", 3 - netplay_player, f);
+    }
+
+    checked_hashes++;
+}
+
+// sets up the socket; called after the ROM is loaded, before the machine
+// is started
+void netplay_open(int player, int port, char *peer) {
+    netplay_player = player;
+
+    // the two hosts have to emulate exactly the same
+    config_deterministic = 1;
+    config_run_ahead = 0;
+    config_rewind_buffer = 0;
+
+    char *host = strdup(peer);
+    char *service = host ? strrchr(host, ':') : NULL;
+    if(!service) die(-1, "[netplay] the other player's address %s isn't host:port\n", peer);
+    *service++ = 0;
+
+    struct addrinfo hints, *address;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if(getaddrinfo(host, service, &hints, &address)) die(-1, "[netplay] unable to resolve %s\n", peer);
+    free(host);
+
+    struct sockaddr_in own;
+    memset(&own, 0, sizeof(struct sockaddr_in));
+    own.sin_family = AF_INET;
+    own.sin_addr.s_addr = htonl(INADDR_ANY);
+    own.sin_port = htons(port);
+
+    // connecting a UDP socket only filters what it receives to the peer
+    sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sock_fd < 0 || bind(sock_fd, (struct sockaddr *)&own, sizeof(struct sockaddr_in)) ||
+        connect(sock_fd, address->ai_addr, address->ai_addrlen)) {
+        die(-1, "[netplay] unable to use UDP port %d\n", port);
+    }
+
+    freeaddrinfo(address);
+    fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
+
+    write_log("[netplay] player %d on UDP port %d, the other player is at %s\n", player, port, peer);
+}
+
+// adds the other player's machine and waits for the other host; called once
+// the machine is running
+void netplay_start() {
+    if(!netplay_player) return;
+
+    local = netplay_player - 1;
+    machines[local] = gb;
+    machines[!local] = state_clone();
+    snapshot_size = state_size();
+    snapshots = malloc(snapshot_size * 2 * (NETPLAY_FRAMES + 1));
+
+    if(!machines[!local] || !snapshots) die(-1, "[netplay] unable to allocate memory for the second machine\n");
+
+    frame = keyed = 0;
+    confirmed = -1;
+    rollback_from = LONG_MAX;
+    peer_hash_frame = -1;
+    last_heard = 0.0;
+    take_snapshot(0);
+
+    write_log("[netplay] %d KiB per snapshot of both machines, waiting for player %d\n", (int)(snapshot_size * 2 / 1024), 3 - netplay_player);
+
+    wait_for_peer(0);
+    waits = 0;
+    wait_ms = 0.0;
+
+    use_machine(local, 1);
+    write_log("[netplay] player %d is here\n", 3 - netplay_player);
+}
+
+// emulates one frame of both machines with the keys the frontend gave this
+// host's machine
+void netplay_frame() {
+    uint8_t keys = gb->pressed_keys;
+    local_keys[frame & (NETPLAY_RING - 1)] = keys;
+    keyed = frame + 1;
+
+    receive_packets();
+    if(frame - confirmed > NETPLAY_FRAMES) wait_for_peer(NETPLAY_FRAMES);
+
+    if(rollback_from < frame) {
+        roll_back();
+    } else {
+        // take back the keys the frontend set, they go in with the frame
+        restore_snapshot(frame, local);
+    }
+
+    check_hash();
+    send_packet();
+
+    run_frame(frame, 1);
+    frame++;
+    take_snapshot(frame);
+}
+
+void netplay_stop() {
+    if(!netplay_player) return;
+
+    if(frame) {
+        write_log("[netplay] %ld frames, %ld rollbacks of %.1f frames on average, %.2f ms on average\n", frame, rollbacks,
+            rollbacks ? (double)rollback_frames / rollbacks : 0.0, rollbacks ? rollback_ms / rollbacks : 0.0);
+        write_log("[netplay] longest rollback %ld frames in %.2f ms, snapshotting and hashing take %.3f ms per frame\n", longest_rollback, longest_rollback_ms, snapshot_ms / (frame + rollback_frames + 1));
+        write_log("[netplay] waited for player %d %ld times for %.0f ms, %ld hashes matched\n", 3 - netplay_player, waits, wait_ms, checked_hashes);
+    }
+
+    // die() frees gb, whichever machine it is
+    if(gb == machines[local]) free(machines[!local]);
+    else free(machines[local]);
+
+    free(snapshots);
+    if(sock_fd >= 0) close(sock_fd);
+
+    cable_peer = NULL;
+    snapshots = NULL;
+    sock_fd = -1;
+    netplay_player = 0;
+}
@@ -0,0 +1,159 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+
+//#define PACER_LOG
+
+// Frame pacer
+
+/*
+
+ Wall clock time is derived from the master clock instead of from the number
+ of frames drawn, so pacing keeps working while the LCD is off. At the start
+ of pacing (and after every stall) the pacer records an anchor: a point on
+ CLOCK_MONOTONIC and the master cycle it corresponds to. After every emulated
+ frame, pacer_frame() works out when that cycle is due at the configured
+ speed, sleeps with clock_nanosleep() until shortly before then and spins for
+ the rest, so the frame time doesn't depend on the scheduler's timer slack.
+
+ If the emulator falls more than a few frames behind (a slow host, a window
+ being dragged, a debugger), the pacer re-anchors instead of running flat out
+ to catch up.
+
+ */
+
+#define NSEC_PER_SEC        1000000000LL
+#define SPIN_NS             250000      // spin for the last quarter millisecond
+#define MAX_LAG_FRAMES      4
+#define FRAME_CYCLES        70224
+
+static __thread int64_t anchor_ns;
+static __thread uint64_t anchor_cycles;
+static __thread int64_t last_frame_ns;
+
+// statistics for the current window
+static __thread int64_t window_ns;
+static __thread uint64_t window_cycles;
+static __thread int frames;
+static __thread double frame_sum, frame_sum_sq, frame_min, frame_max;
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
+}
+
+// wall time that a number of master cycles take at the configured speed
+static inline int64_t cycles_to_ns(uint64_t cycles) {
+    return (int64_t)(((double)cycles * NSEC_PER_SEC * 100) / ((double)GB_CPU_SPEED * target_speed));
+}
+
+static void reset_window(int64_t now) {
+    window_ns = now;
+    window_cycles = gb->total_cycles;
+    frames = 0;
+    frame_sum = frame_sum_sq = frame_max = 0.0;
+    frame_min = HUGE_VAL;
+}
+
+static void anchor(int64_t now) {
+    anchor_ns = now;
+    anchor_cycles = gb->total_cycles;
+}
+
+void pacer_start() {
+    int64_t now = now_ns();
+
+    anchor(now);
+    last_frame_ns = now;
+    reset_window(now);
+
+    write_log("[pacer] pacing to %d%% speed, %.3f ms per frame\n", target_speed, (double)cycles_to_ns(FRAME_CYCLES) / 1000000);
+}
+
+// the master clock jumped, e.g. because a savestate was loaded
+void pacer_resync() {
+    int64_t now = now_ns();
+
+    anchor(now);
+    reset_window(now);
+}
+
+static void sleep_until(int64_t target) {
+    int64_t now = now_ns();
+
+    if(target - now > SPIN_NS) {
+        struct timespec ts;
+        int64_t wake = target - SPIN_NS;
+        ts.tv_sec = wake / NSEC_PER_SEC;
+        ts.tv_nsec = wake % NSEC_PER_SEC;
+
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+    }
+
+    while(now_ns() < target);
+}
+
+// called after every emulated frame; when wait is zero (fast forward, or when
+// the audio device paces emulation) the pacer only keeps statistics
+void pacer_frame(int wait) {
+    int64_t now = now_ns();
+
+    if(!wait) {
+        anchor(now);
+    } else {
+        int64_t target = anchor_ns + cycles_to_ns(gb->total_cycles - anchor_cycles);
+
+        if(now - target > cycles_to_ns(FRAME_CYCLES * MAX_LAG_FRAMES)) {
+#ifdef PACER_LOG
+            write_log("[pacer] %.2f ms behind, re-anchoring\n", (double)(now - target) / 1000000);
+#endif
+            anchor(now);
+        } else {
+            sleep_until(target);
+            now = now_ns();
+        }
+    }
+
+    double frame_ms = (double)(now - last_frame_ns) / 1000000;
+    last_frame_ns = now;
+
+    frames++;
+    frame_sum += frame_ms;
+    frame_sum_sq += frame_ms * frame_ms;
+    if(frame_ms < frame_min) frame_min = frame_ms;
+    if(frame_ms > frame_max) frame_max = frame_ms;
+}
+
+// fills in the statistics and starts a new window about once a second;
+// returns zero while the current window is still running
+int pacer_stats(pacer_stats_t *stats) {
+    int64_t now = now_ns();
+    int64_t elapsed = now - window_ns;
+
+    if(elapsed < NSEC_PER_SEC || !frames) return 0;
+
+    double mean = frame_sum / frames;
+    double variance = (frame_sum_sq / frames) - (mean * mean);
+
+    stats->frames = frames;
+    stats->speed = ((double)(gb->total_cycles - window_cycles) * NSEC_PER_SEC * 100) / ((double)GB_CPU_SPEED * elapsed);
+    stats->frame_mean = mean;
+    stats->frame_jitter = variance > 0.0 ? sqrt(variance) : 0.0;
+    stats->frame_min = frame_min;
+    stats->frame_max = frame_max;
+
+#ifdef PACER_LOG
+    write_log("[pacer] %d frames, %.1f%% speed, frame time %.3f ms +/- %.3f ms (%.3f-%.3f)\n", stats->frames, stats->speed,
+        stats->frame_mean, stats->frame_jitter, stats->frame_min, stats->frame_max);
+#endif
+
+    reset_window(now);
+    return 1;
+}
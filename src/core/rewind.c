@@ -0,0 +1,310 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+//#define REWIND_LOG
+
+// Rewind
+
+/*
+
+ Every few frames the machine is saved as a savestate (see savestate.c) and
+ handed to a helper thread, which keeps the newest state whole and turns the
+ one before it into a delta: the XOR of the two states, which is almost all
+ zeros, compressed into alternating runs of zeros and literal bytes. Each
+ run is preceded by its length as a variable length integer.
+
+ The deltas live in a ring of a fixed size. New deltas overwrite the oldest
+ ones, so rewinding can go back as far as the ring holds. Stepping back
+ loads the newest state and XORs the newest delta into it to get the state
+ before; that delta is then dropped from the ring, so the next step goes
+ back further.
+
+ The emulator thread only ever writes a savestate, which is a few memcpy()s;
+ if the helper is still busy with the last one when the next is due, that
+ snapshot is skipped rather than waited for.
+
+ */
+
+typedef struct {
+    size_t offset, size;
+} rewind_entry_t;
+
+// every instance rewinds on its own, with its own helper thread
+typedef struct {
+    int interval_frames, frame_count;
+    int at_newest;              // the machine was just rewound to the newest state
+
+    size_t state_bytes;
+    uint8_t *newest;            // the newest state, whole
+    uint8_t *pending;           // a state waiting for the helper
+    uint8_t *delta;             // compressed delta being built
+
+    uint8_t *ring;
+    size_t ring_size, ring_head;
+    rewind_entry_t *entries;
+    int entry_max, entry_first, entry_count;
+    int have_newest;
+
+    pthread_t helper_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    int pending_ready;
+    int quit;                   // the helper is to stop
+} rewind_t;
+
+static __thread rewind_t *rewinder = NULL;
+
+static inline uint8_t *put_varint(uint8_t *dst, size_t value) {
+    while(value >= 0x80) {
+        *dst++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+
+    *dst++ = value;
+    return dst;
+}
+
+static inline const uint8_t *get_varint(const uint8_t *src, size_t *value) {
+    int shift = 0;
+    *value = 0;
+
+    do {
+        *value |= (size_t)(*src & 0x7F) << shift;
+        shift += 7;
+    } while(*src++ & 0x80);
+
+    return src;
+}
+
+// compresses a XOR b into dst, which must hold at least size * 2 + 32 bytes
+static size_t compress_delta(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t size) {
+    uint8_t *ptr = dst;
+    size_t i = 0;
+
+    while(i < size) {
+        size_t zeros = i;
+        while(i < size && a[i] == b[i]) i++;
+        zeros = i - zeros;
+
+        // a literal run only ends at three equal bytes, so short gaps in
+        // it don't cost two length fields each
+        size_t start = i;
+        while(i < size && !(a[i] == b[i] && (i + 2 >= size || (a[i+1] == b[i+1] && a[i+2] == b[i+2])))) i++;
+
+        ptr = put_varint(ptr, zeros);
+        ptr = put_varint(ptr, i - start);
+        for(size_t j = start; j < i; j++) *ptr++ = a[j] ^ b[j];
+    }
+
+    return ptr - dst;
+}
+
+// XORs a compressed delta into state
+static void apply_delta(uint8_t *state, const uint8_t *src, size_t size) {
+    const uint8_t *end = src + size;
+    size_t pos = 0, zeros, literals;
+
+    while(src < end) {
+        src = get_varint(src, &zeros);
+        src = get_varint(src, &literals);
+        pos += zeros;
+
+        while(literals--) state[pos++] ^= *src++;
+    }
+}
+
+static void push_delta(rewind_t *r, size_t size) {
+    if(size > r->ring_size) return;
+
+    if(r->ring_head + size > r->ring_size) r->ring_head = 0;
+
+    // the oldest delta is always the one right after the newest in the ring
+    while(r->entry_count) {
+        rewind_entry_t *oldest = &r->entries[r->entry_first];
+        if(r->entry_count < r->entry_max && (oldest->offset >= r->ring_head + size || oldest->offset + oldest->size <= r->ring_head)) break;
+
+        r->entry_first = (r->entry_first + 1) % r->entry_max;
+        r->entry_count--;
+    }
+
+    rewind_entry_t *entry = &r->entries[(r->entry_first + r->entry_count) % r->entry_max];
+    entry->offset = r->ring_head;
+    entry->size = size;
+    r->entry_count++;
+
+    memcpy(r->ring + r->ring_head, r->delta, size);
+    r->ring_head += size;
+}
+
+static void *helper_main(void *arg) {
+    rewind_t *r = (rewind_t *)arg;
+
+    pthread_mutex_lock(&r->lock);
+
+    for(;;) {
+        while(!r->pending_ready && !r->quit) pthread_cond_wait(&r->work, &r->lock);
+        if(r->quit) break;
+        pthread_mutex_unlock(&r->lock);
+
+        // only this thread touches the ring while pending_ready is set
+        if(r->have_newest) push_delta(r, compress_delta(r->delta, r->newest, r->pending, r->state_bytes));
+        memcpy(r->newest, r->pending, r->state_bytes);
+        r->have_newest = 1;
+
+#ifdef REWIND_LOG
+        write_log("[rewind] %d deltas, newest is %d bytes\n", r->entry_count, r->entry_count ? (int)r->entries[(r->entry_first + r->entry_count - 1) % r->entry_max].size : 0);
+#endif
+
+        pthread_mutex_lock(&r->lock);
+        r->pending_ready = 0;
+        pthread_cond_signal(&r->done);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static void free_rewinder(rewind_t *r) {
+    free(r->newest);
+    free(r->pending);
+    free(r->delta);
+    free(r->ring);
+    free(r->entries);
+    free(r);
+}
+
+void rewind_start() {
+    if(!config_rewind_buffer) return;
+
+    if(config_link != LINK_NONE) {
+        write_log("[rewind] rewinding doesn't work with the link cable, disabling it\n");
+        return;
+    }
+
+    rewind_t *r = calloc(1, sizeof(rewind_t));
+    if(!r) {
+        write_log("[rewind] unable to allocate memory for rewinding, disabling it\n");
+        return;
+    }
+
+    r->state_bytes = savestate_size();
+    r->ring_size = (size_t)config_rewind_buffer * 1024 * 1024;
+    r->entry_max = (r->ring_size / 64) + 1;     // a delta is never smaller than that in practice
+    r->interval_frames = config_rewind_interval;
+
+    r->newest = malloc(r->state_bytes);
+    r->pending = malloc(r->state_bytes);
+    r->delta = malloc((r->state_bytes * 2) + 32);
+    r->ring = malloc(r->ring_size);
+    r->entries = malloc(r->entry_max * sizeof(rewind_entry_t));
+
+    if(!r->newest || !r->pending || !r->delta || !r->ring || !r->entries) {
+        write_log("[rewind] unable to allocate memory for rewinding, disabling it\n");
+        free_rewinder(r);
+        return;
+    }
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->work, NULL);
+    pthread_cond_init(&r->done, NULL);
+
+    if(pthread_create(&r->helper_thread, NULL, helper_main, r)) {
+        write_log("[rewind] unable to start the helper thread, disabling rewinding\n");
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->work);
+        pthread_cond_destroy(&r->done);
+        free_rewinder(r);
+        return;
+    }
+
+    rewinder = r;
+
+    write_log("[rewind] keeping %d MiB of snapshots, one every %d frame%s\n", config_rewind_buffer, r->interval_frames, r->interval_frames == 1 ? "" : "s");
+}
+
+void rewind_stop() {
+    rewind_t *r = rewinder;
+    if(!r) return;
+
+    rewinder = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    r->quit = 1;
+    pthread_cond_signal(&r->work);
+    pthread_mutex_unlock(&r->lock);
+
+    pthread_join(r->helper_thread, NULL);
+
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->work);
+    pthread_cond_destroy(&r->done);
+    free_rewinder(r);
+}
+
+// called after every frame that was emulated normally
+void rewind_frame() {
+    rewind_t *r = rewinder;
+    if(!r) return;
+
+    r->at_newest = 0;
+    if(++r->frame_count < r->interval_frames) return;
+
+    pthread_mutex_lock(&r->lock);
+
+    if(!r->pending_ready) {
+        // the helper is idle, so it isn't reading pending
+        savestate_write(r->pending);
+        r->pending_ready = 1;
+        r->frame_count = 0;
+        pthread_cond_signal(&r->work);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+}
+
+// emulates one frame of rewinding: goes back one snapshot and shows the
+// frame after it, or stays at the oldest one; returns zero when rewinding
+// isn't possible
+int rewind_step() {
+    rewind_t *r = rewinder;
+    if(!r) return 0;
+
+    pthread_mutex_lock(&r->lock);
+    while(r->pending_ready) pthread_cond_wait(&r->done, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+
+    if(!r->have_newest) return 0;
+
+    // once the oldest state is reached, it stays on screen
+    if(r->at_newest && r->entry_count) {
+        rewind_entry_t *entry = &r->entries[(r->entry_first + r->entry_count - 1) % r->entry_max];
+        apply_delta(r->newest, r->ring + entry->offset, entry->size);
+        r->ring_head = entry->offset;
+        r->entry_count--;
+    }
+
+    if(savestate_read(r->newest, r->state_bytes)) return 0;
+    r->at_newest = 1;
+    r->frame_count = 0;
+
+    // show where we are without sound; the frame is thrown away by the next
+    // step, or becomes the present once the player lets go
+    running_ahead = 1;
+    cpu_run_frame();
+
+    running_ahead = 0;
+    sound_resync();
+
+#ifdef REWIND_LOG
+    write_log("[rewind] stepped back to cycle %llu, %d deltas left\n", (unsigned long long)gb->total_cycles, r->entry_count);
+#endif
+
+    return 1;
+}
@@ -0,0 +1,86 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+#include <stdlib.h>
+
+//#define RUNAHEAD_LOG
+
+// Run-ahead
+
+/*
+
+ Most games only react to a key press a frame or two after reading it, on top
+ of the frame the host needs to show the result. Run-ahead hides that lag by
+ showing the machine a few frames in the future instead of the present:
+
+ 1. the real frame is emulated with sound but without rendering
+ 2. the whole machine state is snapshotted (a memcpy of the arena)
+ 3. N more frames are emulated with the current input, and only the last one
+    is rendered and shown
+ 4. the snapshot is restored, so the next real frame continues from step 1
+
+ The speculative frames in step 3 must not leave any trace outside of the
+ arena: while running_ahead is set, the sound synthesizer, the battery and
+ host input polling are left alone, and cart RAM that is mapped from the
+ save file is swapped for a copy in the arena (see state.c). Run-ahead can't
+ be used with the link cable, because a transfer that was sent to the peer
+ can't be taken back.
+
+ */
+
+__thread int running_ahead = 0;     // the frames being emulated will be thrown away
+__thread int hide_video = 0;        // the frames being emulated are neither rendered nor shown
+
+static __thread void *snapshot = NULL;
+static __thread int frames_ahead = 0;
+
+void runahead_start() {
+    frames_ahead = config_run_ahead;
+    if(!frames_ahead) return;
+
+    if(config_link != LINK_NONE) {
+        write_log("[runahead] run-ahead doesn't work with the link cable, disabling it\n");
+        frames_ahead = 0;
+        return;
+    }
+
+    snapshot = malloc(state_size());
+    if(!snapshot) {
+        write_log("[runahead] unable to allocate memory for snapshots, disabling run-ahead\n");
+        frames_ahead = 0;
+        return;
+    }
+
+    write_log("[runahead] running %d frame%s ahead, %d KiB per snapshot\n", frames_ahead, frames_ahead == 1 ? "" : "s", (int)(state_size()/1024));
+}
+
+// emulates one frame and shows the frame that is frames_ahead in its future
+void runahead_frame() {
+    if(!frames_ahead) {
+        cpu_run_frame();
+        return;
+    }
+
+    hide_video = 1;
+    cpu_run_frame();
+
+    state_snapshot(snapshot);
+    state_unmap_ex_ram();
+    running_ahead = 1;
+
+    for(int i = 0; i < frames_ahead; i++) {
+        hide_video = (i != frames_ahead - 1);
+        cpu_run_frame();
+    }
+
+    state_restore(snapshot);
+    running_ahead = 0;
+    hide_video = 0;
+
+#ifdef RUNAHEAD_LOG
+    write_log("[runahead] back at cycle %llu\n", (unsigned long long)gb->total_cycles);
+#endif
+}
@@ -0,0 +1,397 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+
+//#define SAVESTATE_LOG
+
+// Savestates
+
+/*
+
+ Unlike the snapshots run-ahead takes (see state.c), a savestate has to
+ outlive the process, so it can't be a copy of the arena with its pointers
+ and scratch buffers. It is a header followed by tagged chunks:
+
+ header      magic, format version, hash of the ROM and the emulated model
+ chunk       four character tag, 32-bit size, then that many bytes
+ ...
+ "END "      zero sized, closes the state
+
+ Every chunk holds the fields of one part of the machine, copied straight
+ from gb_t in the order of the table below. Cart RAM is only as large as
+ the header says, and the framebuffers, the rendered SGB border and the
+ bank pointers aren't saved at all because they're derived from the rest.
+
+ A state is checked completely before any of it is applied, so a truncated
+ or mismatched file leaves the running machine alone. Chunks this version
+ doesn't know are skipped, so new parts of the machine can be added as new
+ chunks without bumping the version; changing an existing chunk does need a
+ new version.
+
+ */
+
+#define SAVESTATE_MAGIC     "TGBSTATE"
+#define SAVESTATE_VERSION   1
+#define MAX_FIELDS          8
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t rom_hash;
+    uint32_t model;             // SYSTEM_GB, SYSTEM_SGB2 or SYSTEM_CGB
+    uint32_t reserved;
+} savestate_header_t;
+
+typedef struct {
+    char tag[4];
+    uint32_t size;
+} chunk_header_t;
+
+typedef struct {
+    void *data;
+    size_t size;
+} field_t;
+
+typedef struct {
+    char tag[4];
+    int field_count;
+    field_t fields[MAX_FIELDS];
+} chunk_t;
+
+#define FIELD(f)            { &gb->f, sizeof(gb->f) }
+
+// the SGB registers are all of gb_t from sgb_transferring up to the blocks
+#define SGB_REGS_SIZE       (offsetof(gb_t, sgb_palette_data) - offsetof(gb_t, sgb_transferring))
+
+static __thread int chunk_count;
+static __thread chunk_t chunks[24];
+
+static void add_chunk(const char *tag, int field_count, field_t *fields) {
+    chunk_t *chunk = &chunks[chunk_count++];
+
+    memcpy(chunk->tag, tag, 4);
+    chunk->field_count = field_count;
+    memcpy(chunk->fields, fields, field_count * sizeof(field_t));
+}
+
+// the chunks of the running machine; rebuilt every time because gb is
+// per-thread and the memory blocks depend on the model
+static void build_chunks() {
+    chunk_count = 0;
+
+    add_chunk("CPU ", 6, (field_t[]){ FIELD(cpu), FIELD(io_if), FIELD(io_ie), FIELD(is_double_speed), FIELD(prepare_speed_switch), FIELD(work_ram_bank) });
+    add_chunk("TIME", 4, (field_t[]){ FIELD(timing), FIELD(total_cycles), FIELD(next_event), FIELD(event_time) });
+    add_chunk("DISP", 4, (field_t[]){ FIELD(display), FIELD(display_cycles), FIELD(line_rendered), FIELD(framecount) });
+    add_chunk("TIMR", 1, (field_t[]){ FIELD(timer) });
+    add_chunk("JOYP", 2, (field_t[]){ FIELD(pressed_keys), FIELD(selection) });
+    add_chunk("SERL", 2, (field_t[]){ FIELD(sb), FIELD(sc) });
+    add_chunk("MBC ", 4, (field_t[]){ FIELD(mbc_type), FIELD(mbc1), FIELD(mbc3), FIELD(mbc5) });
+    add_chunk("APU ", 1, (field_t[]){ FIELD(sound) });
+
+    int wram_size = gb->hram - gb->wram;
+    add_chunk("WRAM", 1, (field_t[]){ { gb->wram, wram_size } });
+    add_chunk("HRAM", 1, (field_t[]){ { gb->hram, 128 } });
+    add_chunk("OAM ", 1, (field_t[]){ { gb->oam, OAM_SIZE } });
+    add_chunk("VRAM", 1, (field_t[]){ { gb->vram, gb->vram_size } });
+    if(gb->ex_ram_size) add_chunk("CRAM", 1, (field_t[]){ { gb->ex_ram, gb->ex_ram_size } });
+
+    if(gb->is_sgb) {
+        add_chunk("SGB ", 1, (field_t[]){ { &gb->sgb_transferring, SGB_REGS_SIZE } });
+        add_chunk("SGBM", 3, (field_t[]){ { gb->sgb_palette_data, 4096 }, { gb->sgb_tiles, 8192 }, { gb->sgb_border_map, 4096 } });
+    }
+}
+
+static size_t chunk_size(chunk_t *chunk) {
+    size_t size = 0;
+    for(int i = 0; i < chunk->field_count; i++) size += chunk->fields[i].size;
+    return size;
+}
+
+// hashes every chunk of the running machine on its own, so two runs that
+// part can be told apart by where; returns the number of chunks
+int savestate_hash_chunks(uint64_t *hashes, char (*tags)[4]) {
+    build_chunks();
+
+    // which lines were rendered and the frame skipping count depend on the
+    // frontend, not on what is emulated, so they are hashed as zero
+    int line_rendered = gb->line_rendered, framecount = gb->framecount;
+    gb->line_rendered = gb->framecount = 0;
+
+    for(int i = 0; i < chunk_count; i++) {
+        uint64_t hash = 0;
+        for(int j = 0; j < chunks[i].field_count; j++) {
+            hash = (hash * 0x100000001B3ULL) ^ hash_fast(chunks[i].fields[j].data, chunks[i].fields[j].size);
+        }
+
+        hashes[i] = hash;
+        memcpy(tags[i], chunks[i].tag, 4);
+    }
+
+    gb->line_rendered = line_rendered;
+    gb->framecount = framecount;
+    return chunk_count;
+}
+
+static int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+size_t savestate_size() {
+    build_chunks();
+
+    size_t size = sizeof(savestate_header_t) + sizeof(chunk_header_t);     // "END "
+    for(int i = 0; i < chunk_count; i++) size += sizeof(chunk_header_t) + chunk_size(&chunks[i]);
+
+    return size;
+}
+
+// writes the state of the running machine; dst must hold savestate_size() bytes
+void savestate_write(void *dst) {
+    uint8_t *ptr = (uint8_t *)dst;
+    savestate_header_t header;
+    chunk_header_t chunk_header;
+
+    build_chunks();
+
+    memset(&header, 0, sizeof(savestate_header_t));
+    memcpy(header.magic, SAVESTATE_MAGIC, 8);
+    header.version = SAVESTATE_VERSION;
+    header.header_size = sizeof(savestate_header_t);
+    header.rom_hash = rom_hash();
+    header.model = machine_model();
+
+    memcpy(ptr, &header, sizeof(savestate_header_t));
+    ptr += sizeof(savestate_header_t);
+
+    for(int i = 0; i < chunk_count; i++) {
+        memcpy(chunk_header.tag, chunks[i].tag, 4);
+        chunk_header.size = chunk_size(&chunks[i]);
+        memcpy(ptr, &chunk_header, sizeof(chunk_header_t));
+        ptr += sizeof(chunk_header_t);
+
+        for(int j = 0; j < chunks[i].field_count; j++) {
+            memcpy(ptr, chunks[i].fields[j].data, chunks[i].fields[j].size);
+            ptr += chunks[i].fields[j].size;
+        }
+    }
+
+    memcpy(chunk_header.tag, "END ", 4);
+    chunk_header.size = 0;
+    memcpy(ptr, &chunk_header, sizeof(chunk_header_t));
+}
+
+static int chunk_differs(chunk_t *chunk, const uint8_t *src) {
+    for(int i = 0; i < chunk->field_count; i++) {
+        if(memcmp(chunk->fields[i].data, src, chunk->fields[i].size)) return 1;
+        src += chunk->fields[i].size;
+    }
+
+    return 0;
+}
+
+// copies a saved chunk into the machine, marking cart RAM banks that changed
+// so the battery writes them back
+static void apply_chunk(chunk_t *chunk, const uint8_t *src) {
+    for(int i = 0; i < chunk->field_count; i++) {
+        field_t *field = &chunk->fields[i];
+
+        if(field->data == gb->ex_ram) {
+            for(int offset = 0; offset < field->size; offset += 8192) {
+                int size = field->size - offset;
+                if(size > 8192) size = 8192;
+
+                if(memcmp(gb->ex_ram + offset, src + offset, size)) {
+                    memcpy(gb->ex_ram + offset, src + offset, size);
+                    gb->ex_ram_dirty |= 1 << (offset >> 13);
+                }
+            }
+        } else {
+            memcpy(field->data, src, field->size);
+        }
+
+        src += field->size;
+    }
+}
+
+// replaces the running machine with a saved state; returns zero on success,
+// and leaves the machine untouched otherwise
+int savestate_read(const void *src, size_t size) {
+    const uint8_t *base = (const uint8_t *)src;
+    const uint8_t *found[24];
+    savestate_header_t header;
+    chunk_header_t chunk_header;
+
+    if(config_link != LINK_NONE || movie_mode != MOVIE_NONE || netplay_player) {
+        // neither the peer nor the movie could follow the jump
+        write_log("[savestate] states can't be loaded with the link cable, a movie or netplay\n");
+        return -1;
+    }
+
+    if(size < sizeof(savestate_header_t)) {
+        write_log("[savestate] state is truncated\n");
+        return -1;
+    }
+
+    memcpy(&header, base, sizeof(savestate_header_t));
+    if(memcmp(header.magic, SAVESTATE_MAGIC, 8)) {
+        write_log("[savestate] not a tinygb state\n");
+        return -1;
+    }
+
+    if(header.version != SAVESTATE_VERSION) {
+        write_log("[savestate] state is version %d, only version %d is supported\n", header.version, SAVESTATE_VERSION);
+        return -1;
+    }
+
+    if(header.rom_hash != rom_hash() || header.model != machine_model()) {
+        write_log("[savestate] state was saved with a different ROM or model\n");
+        return -1;
+    }
+
+    build_chunks();
+    memset(found, 0, sizeof(found));
+
+    size_t offset = header.header_size;
+    for(;;) {
+        if(offset > size || size - offset < sizeof(chunk_header_t)) {
+            write_log("[savestate] state is truncated\n");
+            return -1;
+        }
+
+        memcpy(&chunk_header, base + offset, sizeof(chunk_header_t));
+        offset += sizeof(chunk_header_t);
+
+        if(!memcmp(chunk_header.tag, "END ", 4)) break;
+
+        if(chunk_header.size > size - offset) {
+            write_log("[savestate] state is truncated\n");
+            return -1;
+        }
+
+        int i;
+        for(i = 0; i < chunk_count; i++) {
+            if(!memcmp(chunk_header.tag, chunks[i].tag, 4)) break;
+        }
+
+        if(i < chunk_count) {
+            if(chunk_header.size != chunk_size(&chunks[i])) {
+                write_log("[savestate] chunk '%.4s' is %d bytes, expected %d\n", chunk_header.tag, chunk_header.size, (int)chunk_size(&chunks[i]));
+                return -1;
+            }
+
+            found[i] = base + offset;
+        }
+#ifdef SAVESTATE_LOG
+        else {
+            write_log("[savestate] skipping unknown chunk '%.4s'\n", chunk_header.tag);
+        }
+#endif
+
+        offset += chunk_header.size;
+    }
+
+    for(int i = 0; i < chunk_count; i++) {
+        if(!found[i]) {
+            write_log("[savestate] chunk '%.4s' is missing\n", chunks[i].tag);
+            return -1;
+        }
+    }
+
+    // rendering the border is slow, so it's only done when it could look
+    // different; "SGBM" is always the last chunk
+    int had_border = gb->using_sgb_border;
+    int border_changed = gb->is_sgb && chunk_differs(&chunks[chunk_count - 1], found[chunk_count - 1]);
+    uint32_t color_zero = gb->sgb_color_zero;
+    int screen_mask = gb->sgb_screen_mask;
+
+    for(int i = 0; i < chunk_count; i++) apply_chunk(&chunks[i], found[i]);
+
+    if(color_zero != gb->sgb_color_zero || screen_mask != gb->sgb_screen_mask) border_changed = 1;
+
+    // everything derived from the loaded state
+    mbc_update_banks();
+    gb->wram_bank_ptr = gb->wram + (gb->work_ram_bank * 4096);
+    gb->vram_bank_ptr = gb->vram + (gb->display.vbk & 1) * 8192;
+    gb->input_head = gb->input_tail = 0;    // host key changes belong to the old timeline
+
+    sound_resync();
+    pacer_resync();
+    if(gb->is_sgb && (border_changed || !had_border)) sgb_resync(had_border);
+
+    return 0;
+}
+
+int savestate_save(char *filename) {
+    int64_t start = now_us();
+    size_t size = savestate_size();
+
+    uint8_t *data = malloc(size);
+    if(!data) {
+        write_log("[savestate] unable to allocate memory for state\n");
+        return -1;
+    }
+
+    savestate_write(data);
+    int64_t taken = now_us() - start;
+
+    FILE *file = fopen(filename, "wb");
+    if(!file || fwrite(data, size, 1, file) != 1) {
+        write_log("[savestate] unable to write to %s\n", filename);
+        if(file) fclose(file);
+        free(data);
+        return -1;
+    }
+
+    fclose(file);
+    free(data);
+
+    write_log("[savestate] saved %d KiB to %s in %d us\n", (int)(size / 1024), filename, (int)taken);
+    return 0;
+}
+
+int savestate_load(char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if(!file) {
+        write_log("[savestate] unable to open %s\n", filename);
+        return -1;
+    }
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+
+    uint8_t *data = malloc(size > 0 ? size : 1);
+    if(!data) {
+        write_log("[savestate] unable to allocate memory for state\n");
+        fclose(file);
+        return -1;
+    }
+
+    if(size > 0 && fread(data, size, 1, file) != 1) {
+        write_log("[savestate] unable to read from %s\n", filename);
+        fclose(file);
+        free(data);
+        return -1;
+    }
+
+    fclose(file);
+
+    int64_t start = now_us();
+    int status = savestate_read(data, size);
+    int64_t taken = now_us() - start;
+
+    free(data);
+
+    if(!status) write_log("[savestate] loaded %s in %d us\n", filename, (int)taken);
+    return status;
+}
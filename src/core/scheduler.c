@@ -0,0 +1,66 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+
+// Event scheduler
+
+/*
+
+ Hardware that only needs attention at a known point in the future (e.g. the
+ TIMA overflow) registers an event at a master clock cycle instead of being
+ polled after every instruction. count_cycles() only compares the master clock
+ with the earliest pending event.
+
+ The event times live in the state arena so they are part of snapshots; the
+ handlers are fixed and indexed by event number.
+
+ */
+
+static void (*event_handlers[EVENT_COUNT])() = {
+    timer_overflow,     // EVENT_TIMER
+    sound_frame_sequencer,  // EVENT_SOUND
+    serial_complete,    // EVENT_SERIAL
+    serial_link_event,  // EVENT_LINK
+    joypad_event,       // EVENT_JOYPAD
+};
+
+static void update_next_event() {
+    gb->next_event = EVENT_NEVER;
+
+    for(int i = 0; i < EVENT_COUNT; i++) {
+        if(gb->event_time[i] < gb->next_event) gb->next_event = gb->event_time[i];
+    }
+}
+
+void scheduler_start() {
+    for(int i = 0; i < EVENT_COUNT; i++) gb->event_time[i] = EVENT_NEVER;
+    gb->next_event = EVENT_NEVER;
+}
+
+void schedule_event(int event, uint64_t cycle) {
+    gb->event_time[event] = cycle;
+    if(cycle < gb->next_event) gb->next_event = cycle;
+    else update_next_event();
+}
+
+void cancel_event(int event) {
+    gb->event_time[event] = EVENT_NEVER;
+    update_next_event();
+}
+
+void run_events() {
+    while(gb->next_event <= gb->total_cycles) {
+        for(int i = 0; i < EVENT_COUNT; i++) {
+            if(gb->event_time[i] <= gb->total_cycles) {
+                // handlers usually schedule their next occurrence
+                gb->event_time[i] = EVENT_NEVER;
+                event_handlers[i]();
+            }
+        }
+
+        update_next_event();
+    }
+}
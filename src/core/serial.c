@@ -4,17 +4,247 @@
 
 #include <tinygb.h>
 #include <ioports.h>
+#include <state.h>
 
 //#define SERIAL_LOG
 
-uint8_t sb = 0, sc = 0;
+// Serial port and link cable protocol
+
+/*
+
+ A transfer is started by the side using its internal clock (the master) and
+ takes eight serial clocks, after which both sides have swapped SB and raise
+ the serial interrupt. The other side (the slave) has to be waiting with
+ SC = 0x80, or the master receives 0xFF just like with no cable plugged in.
+
+ Both peers count link time in master cycles from the moment they connected.
+ Instead of round-tripping every byte, they exchange cycle-stamped messages:
+
+ LINK_TIME   the sender has reached the given cycle
+ LINK_XFER   the sender started a transfer of the given byte, finishing at
+             the given cycle
+ LINK_REPLY  the byte the sender shifted out for the transfer finishing at
+             the given cycle
+
+ A peer never runs more than the sync window ahead of the last cycle it heard
+ from the other side, and advertises its own time twice per window. As long as
+ the window is no longer than a transfer, a slave always receives LINK_XFER
+ before the transfer is due, so it completes at exactly the same cycle as on
+ the master; the master only ever waits at the end of a transfer, for a reply
+ that the slave usually sent long before. With longer windows or the fast
+ CGB clock, a late transfer completes on the slave as soon as it arrives.
+
+ With netplay, both machines run on one thread and the cable between them
+ never leaves it: when the master's clock finishes a transfer, the slave's
+ side of it completes right away too.
+
+ */
+
+#define SERIAL_BIT_CYCLES       (GB_CPU_SPEED / 8192)
+#define SERIAL_FAST_BIT_CYCLES  (GB_CPU_SPEED / 262144)
+#define LINK_POLL_CYCLES        70224   // how often to look for a peer while unplugged
+
+__thread gb_t *cable_peer = NULL;
+
+static __thread uint64_t link_base;       // master cycle at which the peer connected
+static __thread uint64_t peer_time;       // latest link cycle the peer is known to have reached
+static __thread uint64_t last_advert;     // link cycle of the last message sent
+
+static __thread int incoming_pending;     // a transfer started by the peer is due
+static __thread uint64_t incoming_when;
+static __thread uint8_t incoming_byte;
+
+static __thread int transfer_linked;      // the peer was told about our current transfer
+static __thread int reply_received;
+static __thread uint64_t reply_when;
+static __thread uint8_t reply_byte;
+
+static inline uint64_t link_time() {
+    return gb->total_cycles - link_base;
+}
+
+static void send_message(int type, uint8_t data, uint64_t when) {
+    link_msg_t msg;
+    msg.type = type;
+    msg.data = data;
+    msg.cycle = link_time();
+    msg.when = when;
+
+    last_advert = link_time();     // every message tells the peer how far we are
+    link_send(&msg);
+}
+
+static void complete_incoming() {
+    uint8_t reply = 0xFF;
+
+    if((gb->sc & 0x81) == 0x80) {
+        // waiting for an external clock
+        reply = gb->sb;
+        gb->sb = incoming_byte;
+        gb->sc &= 0x7F;
+        send_interrupt(3);
+    }
+
+#ifdef SERIAL_LOG
+    write_log("[serial] received 0x%02X from peer, sent 0x%02X\n", incoming_byte, reply);
+#endif
+
+    incoming_pending = 0;
+    send_message(LINK_REPLY, reply, incoming_when);
+}
+
+static void handle_message(link_msg_t *msg) {
+    if(msg->cycle > peer_time) peer_time = msg->cycle;
+
+    switch(msg->type) {
+    case LINK_XFER:
+        incoming_pending = 1;
+        incoming_when = msg->when;
+        incoming_byte = msg->data;
+        if(incoming_when <= link_time()) complete_incoming();   // arrived late
+        break;
+    case LINK_REPLY:
+        reply_received = 1;
+        reply_when = msg->when;
+        reply_byte = msg->data;
+        break;
+    default:
+        break;
+    }
+}
+
+// handles everything the peer sent so far, waiting if block is set; returns
+// zero once the peer is gone
+static int receive_messages(int block) {
+    link_msg_t msg;
+    int status;
+
+    while((status = link_recv(&msg, block ? -1 : 0)) > 0) {
+        handle_message(&msg);
+        block = 0;
+    }
+
+    return status >= 0;
+}
+
+static void schedule_link() {
+    if(!link_connected()) {
+        schedule_event(EVENT_LINK, gb->total_cycles + LINK_POLL_CYCLES);
+        return;
+    }
+
+    uint64_t next = peer_time + config_link_window + 1;
+    if(last_advert + (config_link_window / 2) < next) next = last_advert + (config_link_window / 2);
+    if(incoming_pending && incoming_when < next) next = incoming_when;
+    if(next <= link_time()) next = link_time() + 1;
+
+    schedule_event(EVENT_LINK, link_base + next);
+}
+
+// EVENT_LINK: keeps this side within the sync window of the peer
+void serial_link_event() {
+    if(!link_connected()) {
+        if(!link_connect()) {
+            schedule_link();
+            return;
+        }
+
+        link_base = gb->total_cycles;
+        peer_time = last_advert = 0;
+        incoming_pending = reply_received = transfer_linked = 0;
+    }
+
+    receive_messages(0);
+
+    if(incoming_pending && incoming_when <= link_time()) complete_incoming();
+
+    if(link_time() >= last_advert + (config_link_window / 2)) send_message(LINK_TIME, 0, 0);
+
+    while(link_connected() && link_time() > peer_time + config_link_window) {
+        if(last_advert != link_time()) send_message(LINK_TIME, 0, 0);
+        if(!receive_messages(1)) break;
+        if(incoming_pending && incoming_when <= link_time()) complete_incoming();
+    }
+
+    schedule_link();
+}
+
+// the slave's side of a transfer over the cable of a netplay pair
+static uint8_t cable_transfer(uint8_t byte) {
+    gb_t *master = gb;
+    uint8_t reply = 0xFF;
+
+    gb = cable_peer;
+    if((gb->sc & 0x81) == 0x80) {
+        reply = gb->sb;
+        gb->sb = byte;
+        gb->sc &= 0x7F;
+        send_interrupt(3);
+    }
+
+    gb = master;
+    return reply;
+}
+
+// EVENT_SERIAL: a transfer on the internal clock is done
+void serial_complete() {
+    uint8_t byte = 0xFF;    // nothing plugged in
+
+    if(cable_peer) {
+        byte = cable_transfer(gb->sb);
+    } else if(link_connected() && transfer_linked) {
+        uint64_t when = link_time();
+
+        // the only time this side waits for the peer outside of the window
+        send_message(LINK_TIME, 0, 0);
+        while(!(reply_received && reply_when == when)) {
+            if(!receive_messages(1)) break;
+        }
+
+        if(reply_received && reply_when == when) byte = reply_byte;
+        reply_received = transfer_linked = 0;
+    }
+
+#ifdef SERIAL_LOG
+    write_log("[serial] transfer done, sent 0x%02X, received 0x%02X\n", gb->sb, byte);
+#endif
+
+    gb->sb = byte;
+    gb->sc &= 0x7F;
+    send_interrupt(3);
+
+    if(link_connected()) schedule_link();
+}
+
+void serial_start() {
+    gb->sb = 0x00;
+    gb->sc = 0x7E;
+
+    if(config_deterministic && config_link != LINK_NONE) {
+        // the peer's timing would leak into this machine
+        write_log("[serial] the link cable isn't deterministic, leaving it unplugged\n");
+        config_link = LINK_NONE;
+    }
+
+    link_start();
+    if(config_link != LINK_NONE) schedule_event(EVENT_LINK, gb->total_cycles);
+}
+
+uint8_t sb_read() {
+    return gb->sb;
+}
+
+uint8_t sc_read() {
+    // the clock speed bit only exists on the CGB
+    return gb->sc | (gb->is_cgb ? 0x7C : 0x7E);
+}
 
 void sb_write(uint8_t byte) {
 #ifdef SERIAL_LOG
     write_log("[serial] write to SB register value 0x%02X\n", byte);
 #endif
 
-    sb = byte;
+    gb->sb = byte;
 }
 
 void sc_write(uint8_t byte) {
@@ -22,5 +252,18 @@ void sc_write(uint8_t byte) {
     write_log("[serial] write to SC register value 0x%02X\n", byte);
 #endif
 
-    sc = byte;
-}
\ No newline at end of file
+    gb->sc = byte;
+
+    if((byte & 0x81) != 0x81) {
+        cancel_event(EVENT_SERIAL);
+        transfer_linked = 0;
+        return;
+    }
+
+    int bit_cycles = (gb->is_cgb && (byte & 0x02)) ? SERIAL_FAST_BIT_CYCLES : SERIAL_BIT_CYCLES;
+    uint64_t done = gb->total_cycles + ((bit_cycles * 8) >> gb->is_double_speed);
+
+    schedule_event(EVENT_SERIAL, done);
+    transfer_linked = link_connected();
+    if(transfer_linked) send_message(LINK_XFER, gb->sb, done - link_base);
+}
@@ -4,6 +4,7 @@
 
 #include <tinygb.h>
 #include <ioports.h>
+#include <state.h>
 #include <string.h>
 #include <sgb.h>
 
@@ -11,53 +12,22 @@
 
 #define SGB_LOG
 
-int sgb_transferring = 0;   // interfering with writes to 0xFF00
-int sgb_interfere = 0;      // interfering with reads from 0xFF00
-int sgb_current_bit = 0;
-int sgb_command_size;
-int using_sgb_palette = 0;
-int using_sgb_border = 0;
-int gb_x, gb_y;
-int sgb_scaled_h, sgb_scaled_w;
+__thread int gb_x, gb_y;
+__thread int sgb_scaled_h, sgb_scaled_w;
 
-sgb_command_t sgb_command;
-sgb_palette_t sgb_palettes[4];
-sgb_attr_block_t sgb_attr_blocks[18];   // maximum
-
-int sgb_attr_block_count = 0;
-int sgb_screen_mask = 0;
-
-uint8_t sgb_current_joypad = 0x0F;      // 0x0C-0x0F
-int sgb_joypad_count;
-uint8_t sgb_joypad_return;
-
-uint8_t *sgb_palette_data;
-uint8_t *sgb_tiles;
-uint8_t *sgb_border_map;
-
-uint32_t *sgb_border;
-uint32_t *sgb_scaled_border;
-sgb_border_palette_t sgb_border_palettes[4];
-uint32_t sgb_color_zero;
+__thread uint32_t *sgb_scaled_border;
 
 void render_sgb_border();
 
 void sgb_start() {
-    sgb_palette_data = calloc(1, 4096);
-    sgb_tiles = calloc(1, 8192);
-    sgb_border_map = calloc(1, 4096);
-
-    sgb_border = calloc(SGB_WIDTH*SGB_HEIGHT, 4);
-    if(scaling != 1) sgb_scaled_border = calloc(SGB_WIDTH*SGB_HEIGHT, 4*scaling*scaling*4);
-    else sgb_scaled_border = sgb_border;
-
-    if(!sgb_palette_data || !sgb_tiles || !sgb_border_map || !sgb_border || !sgb_scaled_border) {
-        write_log("[sgb] unable to allocate memory\n");
-        die(-1, "");
-    }
-
     sgb_scaled_h = SGB_HEIGHT*scaling;
     sgb_scaled_w = SGB_WIDTH*scaling;
+
+    // the border buffers are never drawn to when borders are disabled
+    if(!config_border) return;
+
+    if(scaling != 1) sgb_scaled_border = state_alloc(sgb_scaled_w*sgb_scaled_h*4, "scaled SGB border");
+    else sgb_scaled_border = gb->sgb_border;
 }
 
 inline uint32_t truecolor(uint16_t color16) {
@@ -96,32 +66,32 @@ void sgb_vram_transfer(uint8_t *dst) {
 }
 
 void create_sgb_palette(int sgb_palette, int system_palette) {
-    uint16_t *data = (uint16_t *)(sgb_palette_data + (system_palette * 8));
+    uint16_t *data = (uint16_t *)(gb->sgb_palette_data + (system_palette * 8));
 
-    sgb_palettes[sgb_palette].colors[0] = truecolor(data[0]);
-    sgb_palettes[sgb_palette].colors[1] = truecolor(data[1]);
-    sgb_palettes[sgb_palette].colors[2] = truecolor(data[2]);
-    sgb_palettes[sgb_palette].colors[3] = truecolor(data[3]);
+    gb->sgb_palettes[sgb_palette].colors[0] = truecolor(data[0]);
+    gb->sgb_palettes[sgb_palette].colors[1] = truecolor(data[1]);
+    gb->sgb_palettes[sgb_palette].colors[2] = truecolor(data[2]);
+    gb->sgb_palettes[sgb_palette].colors[3] = truecolor(data[3]);
 
-    if(sgb_palettes[sgb_palette].colors[0] != sgb_color_zero) {
-        sgb_color_zero = sgb_palettes[sgb_palette].colors[0];
-        if(using_sgb_border) render_sgb_border();
+    if(gb->sgb_palettes[sgb_palette].colors[0] != gb->sgb_color_zero) {
+        gb->sgb_color_zero = gb->sgb_palettes[sgb_palette].colors[0];
+        if(gb->using_sgb_border) render_sgb_border();
     }
 
 #ifdef SGB_LOG
     for(int i = 0; i < 4; i++) {
         int r, g, b; 
-        r = (sgb_palettes[sgb_palette].colors[i] >> 16) & 0xFF;
-        g = (sgb_palettes[sgb_palette].colors[i] >> 8) & 0xFF;
-        b = sgb_palettes[sgb_palette].colors[i] & 0xFF;
+        r = (gb->sgb_palettes[sgb_palette].colors[i] >> 16) & 0xFF;
+        g = (gb->sgb_palettes[sgb_palette].colors[i] >> 8) & 0xFF;
+        b = gb->sgb_palettes[sgb_palette].colors[i] & 0xFF;
 
-        write_log("[sgb]  SGB palette %d color %d = \e[38;2;%d;%d;%dm#%06X\e[0m\n", sgb_palette, i, r, g, b, sgb_palettes[sgb_palette].colors[i]);
+        write_log("[sgb]  SGB palette %d color %d = \e[38;2;%d;%d;%dm#%06X\e[0m\n", sgb_palette, i, r, g, b, gb->sgb_palettes[sgb_palette].colors[i]);
     }
 #endif
 }
 
 void create_sgb_border_palettes() {
-    uint8_t *data = (uint8_t *)(sgb_border_map + 0x800);
+    uint8_t *data = (uint8_t *)(gb->sgb_border_map + 0x800);
     uint16_t color16;
     uint32_t color32;
 
@@ -140,7 +110,7 @@ void create_sgb_border_palettes() {
             write_log("[sgb]  SGB border palette %d color %d = \e[38;2;%d;%d;%dm#%06X\e[0m\n", i, j, r, g, b, color32);
 #endif
 
-            sgb_border_palettes[i].colors[j] = color32;
+            gb->sgb_border_palettes[i].colors[j] = color32;
         }
     }
 
@@ -152,7 +122,7 @@ void plot_sgb_tile(int x, int y, uint8_t tile, int palette, int xflip, int yflip
     int xp = x << 3;
     int yp = y << 3;
 
-    uint8_t *ptr = (uint8_t *)((sgb_tiles) + (tile * 32));
+    uint8_t *ptr = (uint8_t *)((gb->sgb_tiles) + (tile * 32));
 
     uint8_t color_index;
     uint8_t data3, data2, data1, data0;
@@ -175,9 +145,9 @@ void plot_sgb_tile(int x, int y, uint8_t tile, int palette, int xflip, int yflip
 
             //write_log("color index: %d\n", color_index);
 
-            if(color_index) color = sgb_border_palettes[palette].colors[color_index];
-            else color = sgb_color_zero;
-            sgb_border[(yp * 256) + xp] = color;
+            if(color_index) color = gb->sgb_border_palettes[palette].colors[color_index];
+            else color = gb->sgb_color_zero;
+            gb->sgb_border[(yp * 256) + xp] = color;
             xp++;
         }
 
@@ -186,12 +156,12 @@ void plot_sgb_tile(int x, int y, uint8_t tile, int palette, int xflip, int yflip
         ptr += 2;
     }
 
-    if(xflip) hflip_tile(sgb_border, x << 3, y << 3);
-    if(yflip) vflip_tile(sgb_border, x << 3, y << 3);
+    if(xflip) hflip_tile(gb->sgb_border, x << 3, y << 3);
+    if(yflip) vflip_tile(gb->sgb_border, x << 3, y << 3);
 }
 
 void render_sgb_border() {
-    if(sgb_screen_mask) return;
+    if(gb->sgb_screen_mask) return;
 
 #ifdef SGB_LOG
     write_log("[sgb]  SGB border was modified, rendering...\n");
@@ -199,7 +169,7 @@ void render_sgb_border() {
 
     create_sgb_border_palettes();
 
-    uint8_t *map = sgb_border_map;
+    uint8_t *map = gb->sgb_border_map;
 
     uint8_t tile, palette, xflip, yflip;
 
@@ -226,13 +196,26 @@ void render_sgb_border() {
     if(scaling != 1) {
         for(int y = 0; y < sgb_scaled_h; y++) {
             uint32_t *dst = sgb_scaled_border + (y * sgb_scaled_w);
-            uint32_t *src = sgb_border + ((y / scaling) * SGB_WIDTH);
+            uint32_t *src = gb->sgb_border + ((y / scaling) * SGB_WIDTH);
 
             scale_xline(dst, src, sgb_scaled_w);
         }
     }
 
-    update_border(sgb_scaled_border);
+    if(!headless) update_border(sgb_scaled_border);
+}
+
+// redraws the border after a savestate was loaded; the border itself isn't
+// saved because it's rendered from the tiles, map and palettes that are
+void sgb_resync(int had_border) {
+    if(!config_border || !gb->using_sgb_border) return;
+
+    if(!had_border && !headless) resize_sgb_window();
+
+    gb_x = ((SGB_WIDTH / 2) - (GB_WIDTH / 2)) * scaling;
+    gb_y = ((SGB_HEIGHT / 2) - (GB_HEIGHT / 2)) * scaling;
+
+    render_sgb_border();
 }
 
 //
@@ -240,45 +223,45 @@ void render_sgb_border() {
 //
 
 void sgb_mlt_req() {
-    if(sgb_command.data[0] & 0x01) {
-        if(sgb_command.data[0] & 0x02) {
+    if(gb->sgb_command.data[0] & 0x01) {
+        if(gb->sgb_command.data[0] & 0x02) {
             // four players
-            sgb_joypad_count = 4;
+            gb->sgb_joypad_count = 4;
         } else {
-            sgb_joypad_count = 2;
+            gb->sgb_joypad_count = 2;
         }
 
 #ifdef SGB_LOG
-        write_log("[sgb] MLT_REQ: enabled %d multiplayer joypads\n", sgb_joypad_count);
+        write_log("[sgb] MLT_REQ: enabled %d multiplayer joypads\n", gb->sgb_joypad_count);
 #endif
-        sgb_current_joypad = 0x0F;
-        sgb_interfere = 1;
+        gb->sgb_current_joypad = 0x0F;
+        gb->sgb_interfere = 1;
     } else {
 #ifdef SGB_LOG
         write_log("[sgb] MLT_REQ: disabled multiplayer joypads\n");
 #endif
-        sgb_joypad_count = 1;
-        sgb_interfere = 0;
+        gb->sgb_joypad_count = 1;
+        gb->sgb_interfere = 0;
     }
 }
 
 void sgb_mask_en() {
-    sgb_command.data[0] %= 3;
-    sgb_screen_mask = sgb_command.data[0];
+    gb->sgb_command.data[0] %= 3;
+    gb->sgb_screen_mask = gb->sgb_command.data[0];
 
 #ifdef SGB_LOG
-    if(sgb_command.data[0] == 0) {
+    if(gb->sgb_command.data[0] == 0) {
         write_log("[sgb] MASK_EN: cancelling screen mask\n");
-    } else if(sgb_command.data[0] == 1) {
+    } else if(gb->sgb_command.data[0] == 1) {
         write_log("[sgb] MASK_EN: freezing current screen\n");
-    } else if(sgb_command.data[0] == 2) {
+    } else if(gb->sgb_command.data[0] == 2) {
         write_log("[sgb] MASK_EN: freezing screen at black\n");
     } else {
         write_log("[sgb] MASK_EN: freezing screen at color zero\n");
     }
 #endif
 
-    if(using_sgb_border) render_sgb_border();
+    if(gb->using_sgb_border) render_sgb_border();
 }
 
 void sgb_pal_trn() {
@@ -286,11 +269,11 @@ void sgb_pal_trn() {
     write_log("[sgb] PAL_TRN: transferring palette data from VRAM to SNES\n");
 #endif
 
-    sgb_vram_transfer(sgb_palette_data);
+    sgb_vram_transfer(gb->sgb_palette_data);
 }
 
 void sgb_pal_set() {
-    uint16_t *palette_numbers = (uint16_t *)(&sgb_command.data[0]);
+    uint16_t *palette_numbers = (uint16_t *)(&gb->sgb_command.data[0]);
 
     for(int i = 0; i < 4; i++) {
 #ifdef SGB_LOG
@@ -303,43 +286,43 @@ void sgb_pal_set() {
 
 void sgb_attr_blk() {
 #ifdef SGB_LOG
-    write_log("[sgb] ATTR_BLK: setting color attributes with %d datasets\n", sgb_command.data[0]);
+    write_log("[sgb] ATTR_BLK: setting color attributes with %d datasets\n", gb->sgb_command.data[0]);
 #endif
 
-    sgb_attr_block_count = sgb_command.data[0];
+    gb->sgb_attr_block_count = gb->sgb_command.data[0];
 
-    memset(&sgb_attr_blocks, 0, sizeof(sgb_attr_block_t)*18);
+    memset(&gb->sgb_attr_blocks, 0, sizeof(sgb_attr_block_t)*18);
 
-    uint8_t *ptr = &sgb_command.data[1];
-    for(int i = 0; i < sgb_command.data[0]; i++) {
+    uint8_t *ptr = &gb->sgb_command.data[1];
+    for(int i = 0; i < gb->sgb_command.data[0]; i++) {
         //write_log("[sgb] ATTR_BLK entry %d: flags 0x%02X from X/Y %d/%d to %d/%d\n", i, ptr[0], ptr[2], ptr[3], ptr[4], ptr[5]);
-        if(ptr[0] & 0x01) sgb_attr_blocks[i].inside = 1;
-        if(ptr[0] & 0x02) sgb_attr_blocks[i].surrounding = 1;
-        if(ptr[0] & 0x04) sgb_attr_blocks[i].outside = 1;
+        if(ptr[0] & 0x01) gb->sgb_attr_blocks[i].inside = 1;
+        if(ptr[0] & 0x02) gb->sgb_attr_blocks[i].surrounding = 1;
+        if(ptr[0] & 0x04) gb->sgb_attr_blocks[i].outside = 1;
 
-        sgb_attr_blocks[i].palette_inside = ptr[1] & 3;
-        sgb_attr_blocks[i].palette_surrounding = (ptr[1] >> 2) & 3;
-        sgb_attr_blocks[i].palette_outside = (ptr[1] >> 4) & 3;
+        gb->sgb_attr_blocks[i].palette_inside = ptr[1] & 3;
+        gb->sgb_attr_blocks[i].palette_surrounding = (ptr[1] >> 2) & 3;
+        gb->sgb_attr_blocks[i].palette_outside = (ptr[1] >> 4) & 3;
 
-        sgb_attr_blocks[i].x1 = ptr[2] * 8;
-        sgb_attr_blocks[i].y1 = ptr[3] * 8;
-        sgb_attr_blocks[i].x2 = (ptr[4] + 1) * 8;
-        sgb_attr_blocks[i].y2 = (ptr[5] + 1) * 8;
+        gb->sgb_attr_blocks[i].x1 = ptr[2] * 8;
+        gb->sgb_attr_blocks[i].y1 = ptr[3] * 8;
+        gb->sgb_attr_blocks[i].x2 = (ptr[4] + 1) * 8;
+        gb->sgb_attr_blocks[i].y2 = (ptr[5] + 1) * 8;
 
 #ifdef SGB_LOG
-        write_log("[sgb]  %d: flags 0x%02X from X,Y %d,%d to %d,%d", i, ptr[0], sgb_attr_blocks[i].x1, sgb_attr_blocks[i].y1, sgb_attr_blocks[i].x2, sgb_attr_blocks[i].y2);
+        write_log("[sgb]  %d: flags 0x%02X from X,Y %d,%d to %d,%d", i, ptr[0], gb->sgb_attr_blocks[i].x1, gb->sgb_attr_blocks[i].y1, gb->sgb_attr_blocks[i].x2, gb->sgb_attr_blocks[i].y2);
         if(ptr[0]) {
             write_log(", ");
-            if(sgb_attr_blocks[i].inside) {
-                write_log("in = %d ", sgb_attr_blocks[i].palette_inside);
+            if(gb->sgb_attr_blocks[i].inside) {
+                write_log("in = %d ", gb->sgb_attr_blocks[i].palette_inside);
             }
 
-            if(sgb_attr_blocks[i].outside) {
-                write_log("out = %d ", sgb_attr_blocks[i].palette_outside);
+            if(gb->sgb_attr_blocks[i].outside) {
+                write_log("out = %d ", gb->sgb_attr_blocks[i].palette_outside);
             }
 
-            if(sgb_attr_blocks[i].surrounding) {
-                write_log("surround = %d ", sgb_attr_blocks[i].palette_surrounding);
+            if(gb->sgb_attr_blocks[i].surrounding) {
+                write_log("surround = %d ", gb->sgb_attr_blocks[i].palette_surrounding);
             }
         }
 
@@ -349,21 +332,21 @@ void sgb_attr_blk() {
         ptr += 6;
     }
 
-    using_sgb_palette = 1;
+    gb->using_sgb_palette = 1;
 }
 
 void sgb_chr_trn() {
 #ifdef SGB_LOG
-    write_log("[sgb] CHR_TRN: transferring data for tiles %s from VRAM to SNES\n", (sgb_command.data[0] & 1) ? "0x80-0xFF" : "0x00-0x7F");
+    write_log("[sgb] CHR_TRN: transferring data for tiles %s from VRAM to SNES\n", (gb->sgb_command.data[0] & 1) ? "0x80-0xFF" : "0x00-0x7F");
 #endif
 
-    if(sgb_command.data[0] & 1) {
-        sgb_vram_transfer(sgb_tiles+4096);
+    if(gb->sgb_command.data[0] & 1) {
+        sgb_vram_transfer(gb->sgb_tiles+4096);
     } else {
-        sgb_vram_transfer(sgb_tiles);
+        sgb_vram_transfer(gb->sgb_tiles);
     }
 
-    if(using_sgb_border) render_sgb_border();
+    if(gb->using_sgb_border) render_sgb_border();
 }
 
 void sgb_pct_trn() {
@@ -371,14 +354,14 @@ void sgb_pct_trn() {
     write_log("[sgb] PCT_TRN: transferring data for SGB border from VRAM to SNES\n");
 #endif
 
-    sgb_vram_transfer(sgb_border_map);
+    sgb_vram_transfer(gb->sgb_border_map);
 
     if(config_border) {
-        if(!using_sgb_border) {
+        if(!gb->using_sgb_border && !headless) {
             resize_sgb_window();
         }
 
-        using_sgb_border = 1;
+        gb->using_sgb_border = 1;
         gb_x = (SGB_WIDTH / 2) - (GB_WIDTH / 2);
         gb_y = (SGB_HEIGHT / 2) - (GB_HEIGHT / 2);
         gb_x *= scaling;
@@ -390,7 +373,7 @@ void sgb_pct_trn() {
 
 void handle_sgb_command() {
     uint8_t command;
-    command = sgb_command.command_length >> 3;
+    command = gb->sgb_command.command_length >> 3;
 
     switch(command) {
     case SGB_MLT_REQ:
@@ -419,39 +402,39 @@ void sgb_write(uint8_t byte) {
     uint8_t p14 = (byte >> 4) & 1;
     uint8_t p15 = (byte >> 5) & 1;
 
-    if(!sgb_transferring && !p14 && !p15) {
+    if(!gb->sgb_transferring && !p14 && !p15) {
         // reset signal
-        sgb_transferring = 1;
+        gb->sgb_transferring = 1;
 
-        if(sgb_current_bit >= sgb_command_size) {
-            sgb_current_bit = 0;
-            memset(&sgb_command, 0, sizeof(sgb_command_t));
+        if(gb->sgb_current_bit >= gb->sgb_command_size) {
+            gb->sgb_current_bit = 0;
+            memset(&gb->sgb_command, 0, sizeof(sgb_command_t));
         } else {
             // continuing a transfer
-            sgb_command.stopped = 1;
-            sgb_current_bit--;
+            gb->sgb_command.stopped = 1;
+            gb->sgb_current_bit--;
             //write_log("continuing a transfer from bit %d\n", sgb_current_bit);
         }
     }
 
-    if(!sgb_transferring && sgb_interfere) {
+    if(!gb->sgb_transferring && gb->sgb_interfere) {
         // here the program is trying to read SGB state
         if(p14 && p15) {
             // both ones, return current joypad
-            sgb_joypad_return = sgb_current_joypad;
+            gb->sgb_joypad_return = gb->sgb_current_joypad;
 
-            write_log("[sgb] current joypad is 0x%02X\n", sgb_joypad_return);
+            write_log("[sgb] current joypad is 0x%02X\n", gb->sgb_joypad_return);
 
-            sgb_current_joypad--;
-            if(sgb_current_joypad < 0x0C) sgb_current_joypad = 0x0F;    // wrap
+            gb->sgb_current_joypad--;
+            if(gb->sgb_current_joypad < 0x0C) gb->sgb_current_joypad = 0x0F;    // wrap
         } else if(!p14 && p15) {
             // p14 = 0; p15 = 1; read directions
-            if(sgb_joypad_return == 0x0F) sgb_joypad_return = (~(pressed_keys >> 4)) & 0x0F;
-            else sgb_joypad_return = 0x0F;
+            if(gb->sgb_joypad_return == 0x0F) gb->sgb_joypad_return = (~(gb->pressed_keys >> 4)) & 0x0F;
+            else gb->sgb_joypad_return = 0x0F;
         } else if(p14 && !p15) {
             // p14 = 1; p15 = 0; read buttons
-            if(sgb_joypad_return == 0x0F) sgb_joypad_return = (~pressed_keys) & 0x0F;
-            else sgb_joypad_return = 0x0F;
+            if(gb->sgb_joypad_return == 0x0F) gb->sgb_joypad_return = (~gb->pressed_keys) & 0x0F;
+            else gb->sgb_joypad_return = 0x0F;
         } else {
             write_log("[sgb] unhandled unreachable code\n");
             die(-1, "");
@@ -470,52 +453,52 @@ void sgb_write(uint8_t byte) {
     if(!p14) {
         // a zero bit is being transferred
         // check if the PREVIOUS bit was a stop bit
-        if(sgb_command.stopped) {
-            sgb_command.stopped = 0;
+        if(gb->sgb_command.stopped) {
+            gb->sgb_command.stopped = 0;
             goto count;
         } else {
             // previous bit was NOT a stop bit, check if the current one is
-            if((sgb_current_bit >= 128) && !(sgb_current_bit % 128)) {
+            if((gb->sgb_current_bit >= 128) && !(gb->sgb_current_bit % 128)) {
                 // this is a stop bit
-                sgb_command.stopped = 1;
-                sgb_transferring = 0;
+                gb->sgb_command.stopped = 1;
+                gb->sgb_transferring = 0;
 
                 //write_log("[sgb] stop bit at %d\n", sgb_current_bit);
 
-                sgb_command_size = (sgb_command.command_length & 7) * 16 * 8;   // in bits
-                if(sgb_current_bit >= sgb_command_size) {
+                gb->sgb_command_size = (gb->sgb_command.command_length & 7) * 16 * 8;   // in bits
+                if(gb->sgb_current_bit >= gb->sgb_command_size) {
                     handle_sgb_command();
                     return;
                 }
             }
 
             // nope, still not a stop bit
-            sgb_command.stopped = 0;
+            gb->sgb_command.stopped = 0;
             goto count;
         }
     }
 
     if(!p15) {
         // a one bit is being transferred
-        int byte_number = sgb_current_bit / 8;
-        int bit_number = sgb_current_bit % 8;
+        int byte_number = gb->sgb_current_bit / 8;
+        int bit_number = gb->sgb_current_bit % 8;
 
         if(!byte_number) {
             // command/length byte
-            sgb_command.command_length |= (1 << bit_number);
+            gb->sgb_command.command_length |= (1 << bit_number);
         } else {
             // any other byte
-            sgb_command.data[byte_number-1] |= (1 << bit_number);
+            gb->sgb_command.data[byte_number-1] |= (1 << bit_number);
         }
     }
 
 count:
     //write_log("write bit %d\n", sgb_current_bit);
-    sgb_current_bit++;
+    gb->sgb_current_bit++;
 }
 
 inline uint8_t sgb_read() {
-    return sgb_joypad_return;
+    return gb->sgb_joypad_return;
 }
 
 inline int get_index_from_palette(uint32_t color, uint32_t *palette) {
@@ -531,23 +514,23 @@ inline int get_index_from_palette(uint32_t color, uint32_t *palette) {
 inline int get_palette_from_pos(int x, int y) {
     // THESE HAVE TO BE READ IN REVERSE ORDER
     // aka priority is for the one stated later
-    for(int i = sgb_attr_block_count - 1; i >= 0; i--) {
+    for(int i = gb->sgb_attr_block_count - 1; i >= 0; i--) {
         // check if inside or outside, in that order
-        if(sgb_attr_blocks[i].inside) {
-            if(x >= sgb_attr_blocks[i].x1 && x <= sgb_attr_blocks[i].x2 && y >= sgb_attr_blocks[i].y1 && y <= sgb_attr_blocks[i].y2) {
-                return sgb_attr_blocks[i].palette_inside;
+        if(gb->sgb_attr_blocks[i].inside) {
+            if(x >= gb->sgb_attr_blocks[i].x1 && x <= gb->sgb_attr_blocks[i].x2 && y >= gb->sgb_attr_blocks[i].y1 && y <= gb->sgb_attr_blocks[i].y2) {
+                return gb->sgb_attr_blocks[i].palette_inside;
             }
         }
 
-        if(sgb_attr_blocks[i].outside) {
-            if(!(x >= sgb_attr_blocks[i].x1 && x <= sgb_attr_blocks[i].x2 && y >= sgb_attr_blocks[i].y1 && y <= sgb_attr_blocks[i].y2)) {
-                return sgb_attr_blocks[i].palette_outside;
+        if(gb->sgb_attr_blocks[i].outside) {
+            if(!(x >= gb->sgb_attr_blocks[i].x1 && x <= gb->sgb_attr_blocks[i].x2 && y >= gb->sgb_attr_blocks[i].y1 && y <= gb->sgb_attr_blocks[i].y2)) {
+                return gb->sgb_attr_blocks[i].palette_outside;
             }
         }
 
-        if(sgb_attr_blocks[i].surrounding) {
-            if((x >= sgb_attr_blocks[i].x1 && x <= sgb_attr_blocks[i].x2 && y >= sgb_attr_blocks[i].y1 && y <= sgb_attr_blocks[i].y2)) {
-                return sgb_attr_blocks[i].palette_surrounding;
+        if(gb->sgb_attr_blocks[i].surrounding) {
+            if((x >= gb->sgb_attr_blocks[i].x1 && x <= gb->sgb_attr_blocks[i].x2 && y >= gb->sgb_attr_blocks[i].y1 && y <= gb->sgb_attr_blocks[i].y2)) {
+                return gb->sgb_attr_blocks[i].palette_surrounding;
             }
         }
     }
@@ -563,6 +546,6 @@ void sgb_recolor(uint32_t *dst, uint32_t *src, int ly, uint32_t *bw_palette) {
         color_index = get_index_from_palette(src[i], bw_palette);
         sgb_palette = get_palette_from_pos(i, ly);
 
-        dst[i] = sgb_palettes[sgb_palette].colors[color_index];
+        dst[i] = gb->sgb_palettes[sgb_palette].colors[color_index];
     }
 }
\ No newline at end of file
@@ -4,257 +4,644 @@
 
 #include <tinygb.h>
 #include <ioports.h>
+#include <state.h>
 #include <string.h>
+#include <math.h>
+#include <stdatomic.h>
 
 //#define SOUND_LOG
 
-sound_t sound;
+// Audio Processing Unit
+
+/*
+
+ The four channels are not stepped every cycle. Each channel knows the master
+ cycle of its next waveform step, and the channels are only run forward when
+ a sound register is accessed or the frame sequencer fires (a scheduled event
+ every 8192 cycles, i.e. 512 Hz). Every time the output level of a channel
+ changes, the change is added to the output buffer as a band-limited step
+ (BLEP) at its exact fractional sample position, so the output can be
+ rendered directly at the host sample rate without aliasing.
+
+ The output buffer holds band-limited impulses; integrating it gives the
+ band-limited steps, and a DC blocker takes out the offset. Finished samples
+ are moved to a single-producer single-consumer ring on every frame
+ sequencer step, which the platform's audio callback drains with
+ sound_read_samples(). The emulation thread never blocks: if the ring is full
+ the newest samples are dropped.
+
+ With audio pacing, the ring's fill level also steers the number of samples
+ produced per cycle by up to half a percent, so the emulator follows the audio
+ device's clock and the main loop only has to sleep while the ring is full.
+
+ */
+
+#define BLEP_PHASES         32
+#define BLEP_TAPS           16
+#define SYNTH_SIZE          4096    // samples, far more than one frame sequencer step
+#define RING_FRAMES         8192    // stereo frames, must be a power of two
+#define AMPLITUDE           48      // one step of one channel at full volume
+#define FRAME_STEP_CYCLES   8192
+#define MAX_RATE_DELTA      0.005   // dynamic rate control never bends pitch more than 0.5%
+
+static const uint8_t read_masks[] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF,   // NR10-NR14
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF,   // unused, NR21-NR24
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF,   // NR30-NR34
+    0xFF, 0xFF, 0x00, 0x00, 0xBF,   // unused, NR41-NR44
+    0x00, 0x00, 0x70,               // NR50-NR52
+};
+
+static const uint8_t duty_waves[4] = { 0x01, 0x81, 0x87, 0x7E };    // step 0 is bit 7
+static const int noise_divisors[8] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+static const int length_max[4] = { 64, 64, 256, 64 };
+
+// synthesis state; this is the output pipeline, not machine state, but every
+// emulator thread has its own
+static __thread float blep[BLEP_PHASES][BLEP_TAPS];
+static __thread float synth_left[SYNTH_SIZE + BLEP_TAPS], synth_right[SYNTH_SIZE + BLEP_TAPS];
+static __thread uint64_t synth_cycle;        // master cycle of synth_offset
+static __thread uint64_t synth_offset;       // 32.32 fixed point sample position of synth_cycle
+static __thread uint64_t clock_step;         // 32.32 fixed point samples per master cycle
+static __thread double base_step;            // clock_step before dynamic rate control
+static __thread int rate_control_target;     // ring fill to steer towards, zero when disabled
+static __thread float integ_left, integ_right, dc_left, dc_right;
+static __thread int levels[4];               // current digital output of each channel
+static __thread int sample_rate = SOUND_SAMPLE_RATE;
+
+// the ring between the (only non-headless) emulation thread and the audio callback
+static int16_t ring[RING_FRAMES * 2];
+static atomic_uint ring_head, ring_tail;
+
+static void make_blep() {
+    // windowed sinc impulse for every fractional phase, cut off a bit below
+    // the output's nyquist frequency
+    for(int p = 0; p < BLEP_PHASES; p++) {
+        double frac = (double)p / BLEP_PHASES;
+        double sum = 0.0;
+
+        for(int k = 0; k < BLEP_TAPS; k++) {
+            double x = (k - (BLEP_TAPS/2) + 1) - frac;
+            double n = (x + (BLEP_TAPS/2)) / BLEP_TAPS;
+            double sinc = x == 0.0 ? 1.0 : sin(M_PI * x * 0.9) / (M_PI * x * 0.9);
+            double window = 0.42 - 0.5 * cos(2 * M_PI * n) + 0.08 * cos(4 * M_PI * n);
+
+            blep[p][k] = sinc * window;
+            sum += blep[p][k];
+        }
+
+        for(int k = 0; k < BLEP_TAPS; k++) blep[p][k] /= sum;
+    }
+}
+
+void sound_set_rate(int rate) {
+    sample_rate = rate;
+
+    // running faster than 100% makes every cycle worth fewer samples, so the
+    // device still plays them back in real time
+    base_step = ((double)rate * 4294967296.0 * 100) / ((double)GB_CPU_SPEED * target_speed);
+    clock_step = (uint64_t)base_step;
+}
+
+// with audio pacing, the emulator produces samples slightly faster or slower
+// depending on how full the ring is, so it neither underruns nor has to drop
+// samples even though the device's clock doesn't match the host's exactly
+void sound_set_rate_control(int target) {
+    rate_control_target = target;
+    if(!target) clock_step = (uint64_t)base_step;
+}
+
+static void rate_control(unsigned int fill) {
+    double error = (double)((int)rate_control_target - (int)fill) / rate_control_target;
+    if(error > 1.0) error = 1.0;
+    else if(error < -1.0) error = -1.0;
+
+    clock_step = (uint64_t)(base_step * (1.0 + (MAX_RATE_DELTA * error)));
+}
+
+static void add_delta(uint64_t cycle, int left, int right) {
+    if(running_ahead) return;   // nobody will hear it
+    if(cycle < synth_cycle) cycle = synth_cycle;    // the state was rewound
+
+    uint64_t pos = synth_offset + ((cycle - synth_cycle) * clock_step);
+    int i = pos >> 32;
+    if(i >= SYNTH_SIZE) i = SYNTH_SIZE - 1;
+
+    float *kernel = blep[(pos >> 27) & (BLEP_PHASES-1)];
+    for(int k = 0; k < BLEP_TAPS; k++) {
+        synth_left[i+k] += left * kernel[k];
+        synth_right[i+k] += right * kernel[k];
+    }
+}
+
+static inline int left_gain(int ch) {
+    return ((gb->sound.nr51 >> (ch + 4)) & 1) * (((gb->sound.nr50 >> 4) & 7) + 1);
+}
+
+static inline int right_gain(int ch) {
+    return ((gb->sound.nr51 >> ch) & 1) * ((gb->sound.nr50 & 7) + 1);
+}
+
+static void set_level(int ch, int level, uint64_t cycle) {
+    if(running_ahead) return;
+
+    int delta = level - levels[ch];
+    if(!delta) return;
+
+    levels[ch] = level;
+    add_delta(cycle, delta * left_gain(ch), delta * right_gain(ch));
+}
+
+static int channel_level(int ch) {
+    apu_channel_t *channel = &gb->sound.ch[ch];
+    if(!channel->enabled) return 0;
+
+    uint8_t sample;
+    int shift;
+
+    switch(ch) {
+    case 0:
+        return ((duty_waves[gb->sound.nr11 >> 6] << channel->pos) & 0x80) ? channel->volume : 0;
+    case 1:
+        return ((duty_waves[gb->sound.nr21 >> 6] << channel->pos) & 0x80) ? channel->volume : 0;
+    case 2:
+        sample = gb->sound.wav[channel->pos >> 1];
+        sample = (channel->pos & 1) ? (sample & 0x0F) : (sample >> 4);
+        shift = (gb->sound.nr32 >> 5) & 3;
+        return shift ? (sample >> (shift - 1)) : 0;
+    default:
+        return (gb->sound.lfsr & 1) ? 0 : channel->volume;
+    }
+}
+
+static int channel_period(int ch) {
+    switch(ch) {
+    case 0:
+        return (2048 - (((gb->sound.nr14 & 7) << 8) | gb->sound.nr13)) * 4;
+    case 1:
+        return (2048 - (((gb->sound.nr24 & 7) << 8) | gb->sound.nr23)) * 4;
+    case 2:
+        return (2048 - (((gb->sound.nr34 & 7) << 8) | gb->sound.nr33)) * 2;
+    default:
+        return noise_divisors[gb->sound.nr43 & 7] << (gb->sound.nr43 >> 4);
+    }
+}
+
+static void run_channel(int ch, uint64_t cycle) {
+    apu_channel_t *channel = &gb->sound.ch[ch];
+    if(!channel->enabled) return;
+
+    while(channel->next_step <= cycle) {
+        if(ch < 2) {
+            channel->pos = (channel->pos + 1) & 7;
+        } else if(ch == 2) {
+            channel->pos = (channel->pos + 1) & 31;
+        } else {
+            int bit = (gb->sound.lfsr ^ (gb->sound.lfsr >> 1)) & 1;
+            gb->sound.lfsr = (gb->sound.lfsr >> 1) | (bit << 14);
+            if(gb->sound.nr43 & 0x08) gb->sound.lfsr = (gb->sound.lfsr & ~0x40) | (bit << 6);
+        }
+
+        set_level(ch, channel_level(ch), channel->next_step);
+        channel->next_step += channel->period;
+    }
+}
+
+// runs all channels up to the given master cycle
+static void sound_update(uint64_t cycle) {
+    if(cycle <= gb->sound.last_update) return;
+
+    for(int i = 0; i < 4; i++) run_channel(i, cycle);
+    gb->sound.last_update = cycle;
+}
+
+static void disable_channel(int ch) {
+    gb->sound.ch[ch].enabled = 0;
+    set_level(ch, 0, gb->sound.last_update);
+}
+
+static int sweep_frequency() {
+    int delta = gb->sound.sweep_shadow >> (gb->sound.nr10 & 7);
+    if(gb->sound.nr10 & 0x08) return gb->sound.sweep_shadow - delta;
+    else return gb->sound.sweep_shadow + delta;
+}
+
+static void clock_sweep() {
+    if(--gb->sound.sweep_timer > 0) return;
+
+    int period = (gb->sound.nr10 >> 4) & 7;
+    gb->sound.sweep_timer = period ? period : 8;
+
+    if(!gb->sound.sweep_enabled || !period) return;
+
+    int freq = sweep_frequency();
+    if(freq > 2047) {
+        disable_channel(0);
+        return;
+    }
+
+    if(gb->sound.nr10 & 7) {
+        gb->sound.sweep_shadow = freq;
+        gb->sound.nr13 = freq & 0xFF;
+        gb->sound.nr14 = (gb->sound.nr14 & 0xF8) | (freq >> 8);
+        gb->sound.ch[0].period = channel_period(0);
+
+        // the new frequency is checked for overflow again right away
+        if(sweep_frequency() > 2047) disable_channel(0);
+    }
+}
+
+static void clock_envelope(int ch, uint8_t nrx2) {
+    apu_channel_t *channel = &gb->sound.ch[ch];
+    if(!(nrx2 & 7)) return;
+
+    if(--channel->env_timer > 0) return;
+    channel->env_timer = nrx2 & 7;
+
+    if((nrx2 & 0x08) && channel->volume < 15) channel->volume++;
+    else if(!(nrx2 & 0x08) && channel->volume > 0) channel->volume--;
+
+    set_level(ch, channel_level(ch), gb->sound.last_update);
+}
+
+static void clock_length(int ch, uint8_t nrx4) {
+    apu_channel_t *channel = &gb->sound.ch[ch];
+    if(!(nrx4 & 0x40) || !channel->length) return;
+
+    if(!--channel->length) disable_channel(ch);
+}
+
+// moves the finished samples to the ring
+static void flush_samples(uint64_t cycle) {
+    if(running_ahead) return;
+
+    int16_t frames[SYNTH_SIZE * 2];
+    uint64_t pos = synth_offset + ((cycle - synth_cycle) * clock_step);
+    int count = pos >> 32;
+    if(count > SYNTH_SIZE) count = SYNTH_SIZE;
+
+    for(int i = 0; i < count; i++) {
+        integ_left += synth_left[i];
+        integ_right += synth_right[i];
+
+        float left = integ_left - dc_left;
+        float right = integ_right - dc_right;
+        dc_left += left * (1.0f / 1024);
+        dc_right += right * (1.0f / 1024);
+
+        left *= AMPLITUDE;
+        right *= AMPLITUDE;
+        if(left > 32767) left = 32767;
+        else if(left < -32768) left = -32768;
+        if(right > 32767) right = 32767;
+        else if(right < -32768) right = -32768;
+
+        frames[i*2] = (int16_t)left;
+        frames[(i*2)+1] = (int16_t)right;
+    }
+
+    memmove(synth_left, synth_left + count, (SYNTH_SIZE + BLEP_TAPS - count) * sizeof(float));
+    memmove(synth_right, synth_right + count, (SYNTH_SIZE + BLEP_TAPS - count) * sizeof(float));
+    memset(synth_left + SYNTH_SIZE + BLEP_TAPS - count, 0, count * sizeof(float));
+    memset(synth_right + SYNTH_SIZE + BLEP_TAPS - count, 0, count * sizeof(float));
+
+    synth_offset = pos - ((uint64_t)count << 32);
+    synth_cycle = cycle;
+
+    if(headless) return;
+
+    // producer side of the ring
+    unsigned int head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    unsigned int space = RING_FRAMES - (head - tail);
+    if(count > space) count = space;
+
+    for(int i = 0; i < count; i++) {
+        unsigned int slot = (head + i) & (RING_FRAMES - 1);
+        ring[slot*2] = frames[i*2];
+        ring[(slot*2)+1] = frames[(i*2)+1];
+    }
+
+    atomic_store_explicit(&ring_head, head + count, memory_order_release);
+
+    if(rate_control_target) rate_control(head + count - tail);
+}
+
+// number of frames waiting in the ring
+int sound_buffered() {
+    unsigned int head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+    return head - tail;
+}
+
+// consumer side of the ring, called from the platform's audio callback
+int sound_read_samples(int16_t *buffer, int count) {
+    unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    unsigned int available = head - tail;
+    if(count > available) count = available;
+
+    for(int i = 0; i < count; i++) {
+        unsigned int slot = (tail + i) & (RING_FRAMES - 1);
+        buffer[i*2] = ring[slot*2];
+        buffer[(i*2)+1] = ring[(slot*2)+1];
+    }
+
+    atomic_store_explicit(&ring_tail, tail + count, memory_order_release);
+    return count;
+}
+
+// picks up after the machine state was replaced, e.g. by a loaded savestate;
+// the output continues from wherever the loaded channels are
+void sound_resync() {
+    synth_cycle = gb->total_cycles;
+    for(int i = 0; i < 4; i++) set_level(i, channel_level(i), gb->total_cycles);
+}
+
+// the frame sequencer clocks length counters at 256 Hz, the sweep at 128 Hz
+// and envelopes at 64 Hz
+void sound_frame_sequencer() {
+    uint64_t cycle = gb->sound.next_frame_step;
+    sound_update(cycle);
+
+    if(gb->sound.nr52 & 0x80) {
+        if(!(gb->sound.frame_step & 1)) {
+            clock_length(0, gb->sound.nr14);
+            clock_length(1, gb->sound.nr24);
+            clock_length(2, gb->sound.nr34);
+            clock_length(3, gb->sound.nr44);
+        }
+
+        if(gb->sound.frame_step == 2 || gb->sound.frame_step == 6) clock_sweep();
+
+        if(gb->sound.frame_step == 7) {
+            clock_envelope(0, gb->sound.nr12);
+            clock_envelope(1, gb->sound.nr22);
+            clock_envelope(3, gb->sound.nr42);
+        }
+    }
+
+    gb->sound.frame_step = (gb->sound.frame_step + 1) & 7;
+    flush_samples(cycle);
+
+    gb->sound.next_frame_step = cycle + FRAME_STEP_CYCLES;
+    schedule_event(EVENT_SOUND, gb->sound.next_frame_step);
+}
+
+static void trigger(int ch) {
+    apu_channel_t *channel = &gb->sound.ch[ch];
+    uint8_t nrx2;
+
+    if(!channel->length) channel->length = length_max[ch];
+
+    channel->period = channel_period(ch);
+    channel->next_step = gb->sound.last_update + channel->period;
+
+    switch(ch) {
+    case 0:
+        nrx2 = gb->sound.nr12;
+        gb->sound.sweep_shadow = ((gb->sound.nr14 & 7) << 8) | gb->sound.nr13;
+        gb->sound.sweep_timer = (gb->sound.nr10 >> 4) & 7;
+        if(!gb->sound.sweep_timer) gb->sound.sweep_timer = 8;
+        gb->sound.sweep_enabled = (gb->sound.nr10 & 0x77) != 0;
+        break;
+    case 1:
+        nrx2 = gb->sound.nr22;
+        break;
+    case 2:
+        channel->pos = 0;
+        channel->enabled = (gb->sound.nr30 & 0x80) != 0;
+        set_level(ch, channel_level(ch), gb->sound.last_update);
+        return;
+    default:
+        nrx2 = gb->sound.nr42;
+        gb->sound.lfsr = 0x7FFF;
+        break;
+    }
+
+    channel->volume = nrx2 >> 4;
+    channel->env_timer = nrx2 & 7;
+    channel->enabled = (nrx2 & 0xF8) != 0;     // DAC power
+
+    if(ch == 0 && (gb->sound.nr10 & 7) && sweep_frequency() > 2047) channel->enabled = 0;
+
+    set_level(ch, channel_level(ch), gb->sound.last_update);
+}
 
 void sound_start() {
-    memset(&sound, 0, sizeof(sound_t));
-
-    sound.nr10 = 0x80;
-    sound.nr11 = 0xBF;
-    sound.nr12 = 0xF3;
-    sound.nr14 = 0xBF;
-    sound.nr21 = 0x3F;
-    sound.nr22 = 0x00;
-    sound.nr24 = 0xBF;
-    sound.nr30 = 0x7F;
-    sound.nr31 = 0xFF;
-    sound.nr32 = 0x9F;
-    sound.nr33 = 0xBF;
-    sound.nr41 = 0xFF;
-    sound.nr42 = 0x00;
-    sound.nr43 = 0x00;
-    sound.nr44 = 0xBF;
-    sound.nr50 = 0x77;
-    sound.nr51 = 0xF3;
-    sound.nr52 = 0xF1;
+    memset(&gb->sound, 0, sizeof(sound_t));
+
+    gb->sound.nr10 = 0x80;
+    gb->sound.nr11 = 0xBF;
+    gb->sound.nr12 = 0xF3;
+    gb->sound.nr14 = 0xBF;
+    gb->sound.nr21 = 0x3F;
+    gb->sound.nr22 = 0x00;
+    gb->sound.nr24 = 0xBF;
+    gb->sound.nr30 = 0x7F;
+    gb->sound.nr31 = 0xFF;
+    gb->sound.nr32 = 0x9F;
+    gb->sound.nr33 = 0xBF;
+    gb->sound.nr41 = 0xFF;
+    gb->sound.nr42 = 0x00;
+    gb->sound.nr43 = 0x00;
+    gb->sound.nr44 = 0xBF;
+    gb->sound.nr50 = 0x77;
+    gb->sound.nr51 = 0xF3;
+    gb->sound.nr52 = 0xF1;
+
+    gb->sound.lfsr = 0x7FFF;
+    gb->sound.last_update = gb->total_cycles;
+
+    make_blep();
+    sound_set_rate(sample_rate);
+    synth_cycle = gb->total_cycles;
+
+    gb->sound.next_frame_step = gb->total_cycles + FRAME_STEP_CYCLES;
+    schedule_event(EVENT_SOUND, gb->sound.next_frame_step);
 
     write_log("[sound] started sound device\n");
 }
 
 uint8_t sound_read(uint16_t addr) {
+    if(addr >= WAV00 && addr <= WAV15) return gb->sound.wav[addr-WAV00];
+
+    uint8_t value;
+
     switch(addr) {
-    case NR10:
-        return sound.nr10;
-    case NR11:
-        return sound.nr11;
-    case NR12:
-        return sound.nr12;
-    case NR13:
-        return sound.nr13;
-    case NR14:
-        return sound.nr14;
-    case NR21:
-        return sound.nr21;
-    case NR22:
-        return sound.nr22;
-    case NR23:
-        return sound.nr23;
-    case NR24:
-        return sound.nr24;
-    case NR30:
-        return sound.nr30;
-    case NR31:
-        return sound.nr31;
-    case NR32:
-        return sound.nr32;
-    case NR33:
-        return sound.nr33;
-    case NR34:
-        return sound.nr34;
-    case NR41:
-        return sound.nr41;
-    case NR42:
-        return sound.nr42;
-    case NR43:
-        return sound.nr43;
-    case NR44:
-        return sound.nr44;
-    case NR50:
-        return sound.nr50;
-    case NR51:
-        return sound.nr51;
+    case NR10: value = gb->sound.nr10; break;
+    case NR11: value = gb->sound.nr11; break;
+    case NR12: value = gb->sound.nr12; break;
+    case NR13: value = gb->sound.nr13; break;
+    case NR14: value = gb->sound.nr14; break;
+    case NR21: value = gb->sound.nr21; break;
+    case NR22: value = gb->sound.nr22; break;
+    case NR23: value = gb->sound.nr23; break;
+    case NR24: value = gb->sound.nr24; break;
+    case NR30: value = gb->sound.nr30; break;
+    case NR31: value = gb->sound.nr31; break;
+    case NR32: value = gb->sound.nr32; break;
+    case NR33: value = gb->sound.nr33; break;
+    case NR34: value = gb->sound.nr34; break;
+    case NR41: value = gb->sound.nr41; break;
+    case NR42: value = gb->sound.nr42; break;
+    case NR43: value = gb->sound.nr43; break;
+    case NR44: value = gb->sound.nr44; break;
+    case NR50: value = gb->sound.nr50; break;
+    case NR51: value = gb->sound.nr51; break;
     case NR52:
-        return sound.nr52;
-    case WAV00:
-    case WAV01:
-    case WAV02:
-    case WAV03:
-    case WAV04:
-    case WAV05:
-    case WAV06:
-    case WAV07:
-    case WAV08:
-    case WAV09:
-    case WAV10:
-    case WAV11:
-    case WAV12:
-    case WAV13:
-    case WAV14:
-    case WAV15:
-        return sound.wav[addr-WAV00];
+        // the low bits report which channels are playing
+        value = gb->sound.nr52 & 0x80;
+        for(int i = 0; i < 4; i++) {
+            if(gb->sound.ch[i].enabled) value |= (1 << i);
+        }
+        break;
     default:
         write_log("[memory] unimplemented read from I/O port 0x%04X\n", addr);
         die(-1, NULL);
         return 0xFF;
     }
+
+    // write-only bits read as ones
+    return value | read_masks[addr - NR10];
+}
+
+static void set_mix(uint8_t nr50, uint8_t nr51) {
+    int left = 0, right = 0;
+
+    for(int i = 0; i < 4; i++) {
+        left -= levels[i] * left_gain(i);
+        right -= levels[i] * right_gain(i);
+    }
+
+    gb->sound.nr50 = nr50;
+    gb->sound.nr51 = nr51;
+
+    for(int i = 0; i < 4; i++) {
+        left += levels[i] * left_gain(i);
+        right += levels[i] * right_gain(i);
+    }
+
+    if(left || right) add_delta(gb->sound.last_update, left, right);
 }
 
 void sound_write(uint16_t addr, uint8_t byte) {
-    switch(addr) {
-    case NR50:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR50 register value 0x%02X\n", byte);
-#endif
-        sound.nr50 = byte;
-        return;
-    case NR51:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR51 register value 0x%02X\n", byte);
-#endif
-        sound.nr51 = byte;
-        return;
-    case NR52:
 #ifdef SOUND_LOG
-        write_log("[sound] write to NR52 register value 0x%02X, ignoring lower 7 bits\n", byte);
+    write_log("[sound] write to register 0x%04X value 0x%02X\n", addr, byte);
 #endif
-        if(byte & 0x80) sound.nr52 |= 0x80;
-        else sound.nr52 &= 0x7F;
+
+    sound_update(gb->total_cycles);
+
+    if(addr >= WAV00 && addr <= WAV15) {
+        gb->sound.wav[addr-WAV00] = byte;
         return;
+    }
+
+    // while the APU is off, only NR52 can be written
+    if(!(gb->sound.nr52 & 0x80) && addr != NR52) return;
+
+    switch(addr) {
     case NR10:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR10 register value 0x%02X\n", byte);
-#endif
-        sound.nr10 = byte;
+        gb->sound.nr10 = byte;
         return;
     case NR11:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR11 register value 0x%02X\n", byte);
-#endif
-        sound.nr11 = byte;
+        gb->sound.nr11 = byte;
+        gb->sound.ch[0].length = 64 - (byte & 0x3F);
+        set_level(0, channel_level(0), gb->sound.last_update);
         return;
     case NR12:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR12 register value 0x%02X\n", byte);
-#endif
-        sound.nr12 = byte;
+        gb->sound.nr12 = byte;
+        if(!(byte & 0xF8)) disable_channel(0);
         return;
     case NR13:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR13 register value 0x%02X\n", byte);
-#endif
-        sound.nr13 = byte;
+        gb->sound.nr13 = byte;
+        gb->sound.ch[0].period = channel_period(0);
         return;
     case NR14:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR15 register value 0x%02X\n", byte);
-#endif
-        sound.nr14 = byte;
+        gb->sound.nr14 = byte;
+        gb->sound.ch[0].period = channel_period(0);
+        if(byte & 0x80) trigger(0);
         return;
     case NR21:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR21 register value 0x%02X\n", byte);
-#endif
-        sound.nr21 = byte;
+        gb->sound.nr21 = byte;
+        gb->sound.ch[1].length = 64 - (byte & 0x3F);
+        set_level(1, channel_level(1), gb->sound.last_update);
         return;
     case NR22:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR22 register value 0x%02X\n", byte);
-#endif
-        sound.nr22 = byte;
+        gb->sound.nr22 = byte;
+        if(!(byte & 0xF8)) disable_channel(1);
         return;
     case NR23:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR23 register value 0x%02X\n", byte);
-#endif
-        sound.nr23 = byte;
+        gb->sound.nr23 = byte;
+        gb->sound.ch[1].period = channel_period(1);
         return;
     case NR24:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR24 register value 0x%02X\n", byte);
-#endif
-        sound.nr24 = byte;
+        gb->sound.nr24 = byte;
+        gb->sound.ch[1].period = channel_period(1);
+        if(byte & 0x80) trigger(1);
         return;
     case NR30:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR30 register value 0x%02X\n", byte);
-#endif
-        sound.nr30 = byte;
+        gb->sound.nr30 = byte;
+        if(!(byte & 0x80)) disable_channel(2);
         return;
     case NR31:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR31 register value 0x%02X\n", byte);
-#endif
-        sound.nr31 = byte;
+        gb->sound.nr31 = byte;
+        gb->sound.ch[2].length = 256 - byte;
         return;
     case NR32:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR32 register value 0x%02X\n", byte);
-#endif
-        sound.nr32 = byte;
+        gb->sound.nr32 = byte;
+        set_level(2, channel_level(2), gb->sound.last_update);
         return;
     case NR33:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR33 register value 0x%02X\n", byte);
-#endif
-        sound.nr33 = byte;
+        gb->sound.nr33 = byte;
+        gb->sound.ch[2].period = channel_period(2);
         return;
     case NR34:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR34 register value 0x%02X\n", byte);
-#endif
-        sound.nr34 = byte;
-        return;
-    case WAV00:
-    case WAV01:
-    case WAV02:
-    case WAV03:
-    case WAV04:
-    case WAV05:
-    case WAV06:
-    case WAV07:
-    case WAV08:
-    case WAV09:
-    case WAV10:
-    case WAV11:
-    case WAV12:
-    case WAV13:
-    case WAV14:
-    case WAV15:
-#ifdef SOUND_LOG
-        write_log("[sound] write to WAX%02d register value 0x%02X\n", addr-WAV00, byte);
-#endif
-        sound.wav[addr-WAV00] = byte;
+        gb->sound.nr34 = byte;
+        gb->sound.ch[2].period = channel_period(2);
+        if(byte & 0x80) trigger(2);
         return;
     case NR41:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR41 register value 0x%02X\n", byte);
-#endif
-        sound.nr41 = byte;
+        gb->sound.nr41 = byte;
+        gb->sound.ch[3].length = 64 - (byte & 0x3F);
         return;
     case NR42:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR42 register value 0x%02X\n", byte);
-#endif
-        sound.nr42 = byte;
+        gb->sound.nr42 = byte;
+        if(!(byte & 0xF8)) disable_channel(3);
         return;
     case NR43:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR43 register value 0x%02X\n", byte);
-#endif
-        sound.nr43 = byte;
+        gb->sound.nr43 = byte;
+        gb->sound.ch[3].period = channel_period(3);
         return;
     case NR44:
-#ifdef SOUND_LOG
-        write_log("[sound] write to NR44 register value 0x%02X\n", byte);
-#endif
-        sound.nr44 = byte;
+        gb->sound.nr44 = byte;
+        if(byte & 0x80) trigger(3);
+        return;
+    case NR50:
+        set_mix(byte, gb->sound.nr51);
+        return;
+    case NR51:
+        set_mix(gb->sound.nr50, byte);
+        return;
+    case NR52:
+        if(byte & 0x80) {
+            if(!(gb->sound.nr52 & 0x80)) gb->sound.frame_step = 0;
+            gb->sound.nr52 |= 0x80;
+            return;
+        }
+
+        // powering off clears every register except wave RAM
+        for(int i = 0; i < 4; i++) disable_channel(i);
+        set_mix(0, 0);
+
+        gb->sound.nr10 = gb->sound.nr11 = gb->sound.nr12 = gb->sound.nr13 = gb->sound.nr14 = 0;
+        gb->sound.nr21 = gb->sound.nr22 = gb->sound.nr23 = gb->sound.nr24 = 0;
+        gb->sound.nr30 = gb->sound.nr31 = gb->sound.nr32 = gb->sound.nr33 = gb->sound.nr34 = 0;
+        gb->sound.nr41 = gb->sound.nr42 = gb->sound.nr43 = gb->sound.nr44 = 0;
+        gb->sound.nr52 = 0;
         return;
     default:
         write_log("[memory] unimplemented write to I/O port 0x%04X value 0x%02X\n", addr, byte);
         die(-1, NULL);
     }
-}
\ No newline at end of file
+}
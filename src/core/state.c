@@ -0,0 +1,284 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <tinygb.h>
+#include <state.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Emulator state arena
+
+#define CACHE_LINE          64
+#define ARENA_ALIGN(n)      (((n) + CACHE_LINE - 1) & ~(CACHE_LINE - 1))
+
+__thread gb_t *gb = NULL;
+__thread size_t arena_size = 0;
+__thread size_t machine_size = 0;   // the arena up to the frame buffers
+__thread int headless = 0;
+
+static __thread size_t arena_offset;
+
+static void *arena_carve(size_t size) {
+    void *ptr = (uint8_t *)gb + arena_offset;
+    arena_offset += ARENA_ALIGN(size);
+    return ptr;
+}
+
+void arena_start(int cgb, int sgb, int cart_ram_size) {
+    int wram_size = cgb ? 8*4096 : 2*4096;
+    int vram_size = cgb ? 16384 : 8192;    // 8 KB for original gb, 2x8 KB for CGB
+    int ram_size = wram_size + 128 + OAM_SIZE + cart_ram_size;  // +128 because HRAM is exactly 127 bytes long but add one byte for alignment
+    int framebuffer_size = GB_WIDTH*GB_HEIGHT*4;
+
+    // the frame buffers and rendering scratch space go last; they are only
+    // drawn to and never affect emulation, so snapshots leave them out
+    machine_size = ARENA_ALIGN(sizeof(gb_t));
+    machine_size += ARENA_ALIGN(ram_size);
+    machine_size += ARENA_ALIGN(vram_size);
+    if(sgb) machine_size += ARENA_ALIGN(4096) + ARENA_ALIGN(8192) + ARENA_ALIGN(4096);
+
+    arena_size = machine_size;
+    arena_size += ARENA_ALIGN(framebuffer_size) * 2;
+    arena_size += ARENA_ALIGN(256*256*4);
+
+    // the border is never drawn to when borders are disabled
+    if(sgb && config_border) arena_size += ARENA_ALIGN(SGB_WIDTH*SGB_HEIGHT*4);
+
+    gb = aligned_alloc(CACHE_LINE, arena_size);
+    if(!gb) {
+        die(-1, "unable to allocate memory for emulator state\n");
+    }
+
+    memset(gb, 0, arena_size);
+    state_footprint += arena_size;
+
+    arena_offset = ARENA_ALIGN(sizeof(gb_t));
+
+    gb->ram_size = ram_size;
+    gb->ram = arena_carve(ram_size);
+    gb->wram = gb->ram;
+    gb->hram = gb->wram + wram_size;
+    gb->oam = gb->hram + 128;
+
+    gb->ex_ram_size = cart_ram_size;
+    if(cart_ram_size) gb->ex_ram = gb->oam + OAM_SIZE;
+
+    gb->vram_size = vram_size;
+    gb->vram = arena_carve(vram_size);
+
+    if(sgb) {
+        gb->sgb_palette_data = arena_carve(4096);
+        gb->sgb_tiles = arena_carve(8192);
+        gb->sgb_border_map = arena_carve(4096);
+    }
+
+    gb->framebuffer = arena_carve(framebuffer_size);
+    gb->temp_framebuffer = arena_carve(framebuffer_size);
+    gb->background_buffer = arena_carve(256*256*4);
+    if(sgb && config_border) gb->sgb_border = arena_carve(SGB_WIDTH*SGB_HEIGHT*4);
+
+    // default bank mappings
+    gb->work_ram_bank = 1;
+    gb->wram_bank_ptr = gb->wram + 4096;
+    gb->vram_bank_ptr = gb->vram;
+
+    write_log("[memory] allocated %d KiB arena with %d KiB of WRAM and %d KiB of cart RAM\n", (int)(arena_size/1024), wram_size/1024, cart_ram_size/1024);
+}
+
+// SYSTEM_GB, SYSTEM_SGB2 or SYSTEM_CGB, whatever is being emulated
+int machine_model() {
+    if(gb->is_cgb) return SYSTEM_CGB;
+    else if(gb->is_sgb) return SYSTEM_SGB2;
+    else return SYSTEM_GB;
+}
+
+// 64-bit FNV-1a
+uint64_t hash_data(const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for(size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+// a hash for large blocks, after the accumulate loop of XXH3: every 64 byte
+// stripe is eight words, and each of eight lanes adds the product of the two
+// halves of one word (mixed with a key) and the neighbouring word, so there
+// is no dependency between lanes and SSE2 does two of them per instruction
+static const uint64_t stripe_keys[8] = {
+    0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL, 0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL,
+    0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL, 0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL
+};
+
+#ifdef __SSE2__
+
+static void hash_stripes(uint64_t *acc, const uint8_t *bytes, size_t count) {
+    __m128i lanes[4], keys[4];
+
+    for(int i = 0; i < 4; i++) {
+        lanes[i] = _mm_loadu_si128((const __m128i *)acc + i);
+        keys[i] = _mm_loadu_si128((const __m128i *)stripe_keys + i);
+    }
+
+    for(size_t stripe = 0; stripe < count; stripe++) {
+        const __m128i *words = (const __m128i *)(bytes + (stripe * 64));
+
+        for(int i = 0; i < 4; i++) {
+            __m128i data = _mm_loadu_si128(words + i);
+            __m128i mixed = _mm_xor_si128(data, keys[i]);
+            __m128i product = _mm_mul_epu32(mixed, _mm_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+            lanes[i] = _mm_add_epi64(lanes[i], _mm_add_epi64(product, swapped));
+        }
+    }
+
+    for(int i = 0; i < 4; i++) _mm_storeu_si128((__m128i *)acc + i, lanes[i]);
+}
+
+#else
+
+static void hash_stripes(uint64_t *acc, const uint8_t *bytes, size_t count) {
+    for(size_t stripe = 0; stripe < count; stripe++) {
+        uint64_t words[8];
+        memcpy(words, bytes + (stripe * 64), 64);
+
+        for(int i = 0; i < 8; i++) {
+            uint64_t mixed = words[i] ^ stripe_keys[i];
+            acc[i] += words[i ^ 1] + ((mixed & 0xFFFFFFFF) * (mixed >> 32));
+        }
+    }
+}
+
+#endif
+
+uint64_t hash_fast(const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    uint64_t acc[8] = {
+        0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x85EBCA77C2B2AE63ULL,
+        0x27D4EB2F165667C5ULL, 0x9E3779B97F4A7C15ULL, 0xBF58476D1CE4E5B9ULL, 0x94D049BB133111EBULL
+    };
+
+    size_t stripes = size / 64;
+    hash_stripes(acc, bytes, stripes);
+
+    if(size % 64) {
+        uint8_t last[64];
+        memset(last, 0, 64);
+        memcpy(last, bytes + (stripes * 64), size % 64);
+        hash_stripes(acc, last, 1);
+    }
+
+    uint64_t hash = size * 0x9E3779B185EBCA87ULL;
+    for(int i = 0; i < 8; i++) {
+        hash ^= acc[i];
+        hash = ((hash << 31) | (hash >> 33)) * 0xC2B2AE3D27D4EB4FULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// snapshots can only be restored into the same arena they were taken from,
+// because the pointers inside gb_t point back into the arena; when cart RAM is
+// mapped from the save file it lives outside the arena and is appended. The
+// frame buffers aren't part of a snapshot: a restored machine shows whatever
+// was drawn last until it draws over it
+size_t state_size() {
+    return machine_size + (gb->ex_ram_mapped ? gb->ex_ram_size : 0);
+}
+
+void state_snapshot(void *dst) {
+    memcpy(dst, gb, machine_size);
+    if(gb->ex_ram_mapped) memcpy((uint8_t *)dst + machine_size, gb->ex_ram, gb->ex_ram_size);
+}
+
+void state_restore(void *src) {
+    memcpy(gb, src, machine_size);
+    if(!gb->ex_ram_mapped) return;
+
+    // only banks that actually differ have to be written back to the file
+    uint8_t *saved = (uint8_t *)src + machine_size;
+    for(int offset = 0; offset < gb->ex_ram_size; offset += 8192) {
+        int size = gb->ex_ram_size - offset;
+        if(size > 8192) size = 8192;
+
+        if(memcmp(gb->ex_ram + offset, saved + offset, size)) {
+            memcpy(gb->ex_ram + offset, saved + offset, size);
+            gb->ex_ram_dirty |= 1 << (offset >> 13);
+        }
+    }
+}
+
+// frames that will be thrown away mustn't write to the save file, where the
+// battery writer could persist them before the snapshot is restored, so they
+// get a copy of mapped cart RAM in its unused place in the arena instead;
+// restoring a snapshot taken before maps the file back in
+void state_unmap_ex_ram() {
+    if(!gb->ex_ram_mapped) return;
+
+    uint8_t *copy = gb->oam + OAM_SIZE;
+    memcpy(copy, gb->ex_ram, gb->ex_ram_size);
+
+    if(gb->ram_bank_ptr >= gb->ex_ram && gb->ram_bank_ptr < gb->ex_ram + gb->ex_ram_size) {
+        gb->ram_bank_ptr = copy + (gb->ram_bank_ptr - gb->ex_ram);
+    }
+
+    gb->ex_ram = copy;
+    gb->ex_ram_mapped = 0;
+}
+
+// copies a whole machine into another arena of the same size; pointers into
+// the source arena are moved along to the same place in the destination,
+// pointers into the ROM stay as they are
+#define RELOCATE(field) \
+    if((uint8_t *)src->field >= (uint8_t *)src && (uint8_t *)src->field < (uint8_t *)src + arena_size) \
+        dst->field = (void *)((uint8_t *)dst + ((uint8_t *)src->field - (uint8_t *)src))
+
+void state_copy(gb_t *dst, gb_t *src) {
+    memcpy(dst, src, arena_size);
+
+    RELOCATE(rom_bank_ptr);
+    RELOCATE(ram_bank_ptr);
+    RELOCATE(wram_bank_ptr);
+    RELOCATE(vram_bank_ptr);
+    RELOCATE(ram);
+    RELOCATE(wram);
+    RELOCATE(hram);
+    RELOCATE(oam);
+    RELOCATE(ex_ram);
+    RELOCATE(vram);
+    RELOCATE(framebuffer);
+    RELOCATE(temp_framebuffer);
+    RELOCATE(background_buffer);
+    RELOCATE(sgb_palette_data);
+    RELOCATE(sgb_tiles);
+    RELOCATE(sgb_border_map);
+    RELOCATE(sgb_border);
+}
+
+// a second machine identical to the running one, for running many copies
+// of a game on one thread; only possible while all of the state is in the
+// arena, i.e. cart RAM isn't mapped from a file
+gb_t *state_clone() {
+    if(gb->ex_ram_mapped) return NULL;
+
+    gb_t *clone = aligned_alloc(CACHE_LINE, arena_size);
+    if(!clone) return NULL;
+
+    state_copy(clone, gb);
+    state_footprint += arena_size;
+    return clone;
+}
@@ -4,75 +4,135 @@
 
 #include <tinygb.h>
 #include <ioports.h>
+#include <state.h>
 #include <string.h>
-#include <math.h>
 
 //#define TIMER_LOG
 
-timer_regs_t timer;
-int timer_cycles = 0;
-int div_cycles = 0;
+/*
 
-int timer_freqs[4] = {
-    4096, 262144, 65536, 16384  // Hz
+ The timer is modelled the way the hardware does it: a free-running 16-bit
+ system counter that increments every master clock cycle (twice as fast in
+ double speed mode), with DIV being its upper 8 bits. TIMA increments on the
+ falling edge of the counter bit selected by TAC, which happens every
+ timer_periods[n] counts.
+
+ Nothing is done per instruction. The counter is derived from the master
+ clock when it's needed, TIMA is brought up to date on access, and the TIMA
+ overflow is a scheduled event. The counter is kept as an unwrapped 64-bit
+ count so that edges can be counted with a division.
+
+ */
+
+static const uint64_t timer_periods[4] = {
+    1024, 16, 64, 256   // 4096, 262144, 65536 and 16384 Hz
 };
 
-int current_timer_freq;
+static inline uint64_t system_counter() {
+    return gb->timer.counter_base + ((gb->total_cycles - gb->timer.counter_cycles) << gb->is_double_speed);
+}
+
+static inline uint64_t timer_period() {
+    return timer_periods[gb->timer.tac & 3];
+}
+
+static void timer_schedule() {
+    if(!(gb->timer.tac & TAC_START)) {
+        cancel_event(EVENT_TIMER);
+        return;
+    }
+
+    // the edge that will make TIMA overflow, converted back to master cycles
+    uint64_t period = timer_period();
+    uint64_t edge = ((gb->timer.tima_count / period) + (256 - gb->timer.tima)) * period;
+    uint64_t cycles = ((edge - gb->timer.counter_base) + gb->is_double_speed) >> gb->is_double_speed;
+
+    schedule_event(EVENT_TIMER, gb->timer.counter_cycles + cycles);
+}
+
+static void timer_increment(uint64_t count) {
+    // overflows reload TMA and request an interrupt
+    while(gb->timer.tima + count > 255) {
+        count -= 256 - gb->timer.tima;
+        gb->timer.tima = gb->timer.tma;
+        send_interrupt(2);
+    }
 
-void set_timer_freq(uint8_t freq) {
-    freq &= 3;
+    gb->timer.tima += count;
+}
 
-    current_timer_freq = timer_freqs[freq];
+// brings TIMA up to date with the system counter
+static void timer_sync() {
+    uint64_t now = system_counter();
 
-    // values that will be used to track timing
-    double time_per_tick = 1000.0/(double)current_timer_freq;
-    timing.cpu_cycles_timer = (int)((double)timing.cpu_cycles_ms * time_per_tick);
+    if(gb->timer.tac & TAC_START) {
+        uint64_t period = timer_period();
+        timer_increment((now / period) - (gb->timer.tima_count / period));
+    }
 
-    if(is_double_speed) timing.cpu_cycles_timer >>= 1;
+    gb->timer.tima_count = now;
+}
 
-    write_log("[timer] set timer frequency to %d Hz\n", current_timer_freq);
-    write_log("[timer] cpu cycles per tick = %d\n", timing.cpu_cycles_timer);
+// restarts the system counter at the given value from the current cycle
+static void timer_rebase(uint64_t counter) {
+    gb->timer.counter_base = counter;
+    gb->timer.counter_cycles = gb->total_cycles;
+    gb->timer.tima_count = counter;
+}
+
+void timer_overflow() {
+    uint64_t period = timer_period();
+    uint64_t edge = ((gb->timer.tima_count / period) + (256 - gb->timer.tima)) * period;
+
+    gb->timer.tima = gb->timer.tma;
+    gb->timer.tima_count = edge;
+    send_interrupt(2);
+
+#ifdef TIMER_LOG
+    write_log("[timer] TIMA overflow at cycle %llu\n", (unsigned long long)gb->total_cycles);
+#endif
 
-    /*if(timing.cpu_cycles_vline > timing.cpu_cycles_timer) {
-        timing.main_cycles = GB_HEIGHT+10;
-    } else {
-        timing.main_cycles = (int)((double)round(TOTAL_REFRESH_TIME / (double)time_per_tick));
-    }*/
+    timer_schedule();
+}
 
-    //write_log("[timer] main loop will repeat %d times per cycle\n", timing.main_cycles);
+// called by STOP on a speed switch, the counter keeps its value
+void timer_set_speed(int double_speed) {
+    timer_sync();
+    timer_rebase(system_counter());
+    gb->is_double_speed = double_speed;
+    timer_schedule();
 }
 
 void timer_start() {
-    memset(&timer, 0, sizeof(timer_regs_t));
+    memset(&gb->timer, 0, sizeof(timer_regs_t));
+    timer_rebase(0);
 
     write_log("[timer] timer started\n");
-
-    set_timer_freq(0);
-    timing.cpu_cycles_div = 256;    // standard speed
 }
 
 uint8_t timer_read(uint16_t addr) {
     switch(addr) {
     case DIV:
 #ifdef TIMER_LOG
-        write_log("[timer] read value 0x%02X from DIV register\n", timer.div);
+        write_log("[timer] read value 0x%02X from DIV register\n", (uint8_t)(system_counter() >> 8));
 #endif
-        return timer.div;
+        return (system_counter() >> 8) & 0xFF;
     case TIMA:
+        timer_sync();
 #ifdef TIMER_LOG
-        write_log("[timer] read value 0x%02X from TIMA register\n", timer.tima);
+        write_log("[timer] read value 0x%02X from TIMA register\n", gb->timer.tima);
 #endif
-        return timer.tima;
+        return gb->timer.tima;
     case TMA:
 #ifdef TIMER_LOG
-        write_log("[timer] read value 0x%02X from TMA register\n", timer.tma);
+        write_log("[timer] read value 0x%02X from TMA register\n", gb->timer.tma);
 #endif
-        return timer.tma;
+        return gb->timer.tma;
     case TAC:
 #ifdef TIMER_LOG
-        write_log("[timer] read value 0x%02X from TAC register\n", timer.tac);
+        write_log("[timer] read value 0x%02X from TAC register\n", gb->timer.tac);
 #endif
-        return timer.tac;
+        return gb->timer.tac | 0xF8;   // unused bits read as ones
     default:
         write_log("[memory] unimplemented read from I/O port 0x%04X\n", addr);
         die(-1, NULL);
@@ -86,65 +146,51 @@ void timer_write(uint16_t addr, uint8_t byte) {
 #ifdef TIMER_LOG
         write_log("[timer] write to DIV register; clearing to zero\n");
 #endif
-        timer.div = 0;      // writing to DIV clears it to zero
+        // writing to DIV clears the whole counter; if the bit TIMA watches was
+        // set, that's a falling edge and TIMA increments
+        timer_sync();
+        if((gb->timer.tac & TAC_START) && (system_counter() & (timer_period() >> 1))) {
+            timer_increment(1);
+        }
+
+        timer_rebase(0);
+        timer_schedule();
         break;
     case TIMA:
 #ifdef TIMER_LOG
         write_log("[timer] write to TIMA register value 0x%02X\n", byte);
 #endif
-        timer.tima = byte;
+        timer_sync();
+        gb->timer.tima = byte;
+        timer_schedule();
         break;
     case TMA:
 #ifdef TIMER_LOG
         write_log("[timer] write to TMA register value 0x%02X\n", byte);
 #endif
-        timer.tma = byte;
+        gb->timer.tma = byte;
         break;
     case TAC:
 #ifdef TIMER_LOG
         write_log("[timer] write to TAC register value 0x%02X\n", byte);
 #endif
-        timer.tac = byte;
-        set_timer_freq(byte & 3);
-        break;
-    default:
-        write_log("[memory] unimplemented write to I/O port 0x%04X value 0x%02X\n", addr, byte);
-        die(-1, NULL);
-    }
-}
+        timer_sync();
+        {
+            // the edge detector sees (enable AND selected bit), so disabling
+            // the timer or switching to a bit that is clear can be an edge too
+            uint64_t now = system_counter();
+            int old_signal = (gb->timer.tac & TAC_START) && (now & (timer_period() >> 1));
 
-/*void timer_cycle() {
-#ifdef TIMER_LOG
-    //write_log("[timer] timer cycle\n");
-#endif
+            gb->timer.tac = byte & 7;
+            int new_signal = (gb->timer.tac & TAC_START) && (now & (timer_period() >> 1));
 
-    if(timer.tac & TAC_START) {
-        timer.tima++;
-        if(!timer.tima) {
-            timer.tima = timer.tma;
-            //write_log("[timer] timer interrupt\n");
+            if(old_signal && !new_signal) timer_increment(1);
         }
-    }
-}*/
-
-void timer_cycle() {
-    div_cycles += timing.last_instruction_cycles;
-
-    if(div_cycles >= timing.cpu_cycles_div) {
-        div_cycles -= timing.cpu_cycles_div;
-        timer.div++;
-    }
-
-    if(!(timer.tac & TAC_START)) return;
 
-    timer_cycles += timing.last_instruction_cycles;
-    if(timer_cycles >= timing.cpu_cycles_timer) {
-        timer_cycles -= timing.cpu_cycles_timer;
-        timer.tima++;
-        if(!timer.tima) {
-            timer.tima = timer.tma;
-            //write_log("[timer] sending timer interrupt\n");
-            send_interrupt(2);
-        }
+        timer_schedule();
+        break;
+    default:
+        write_log("[memory] unimplemented write to I/O port 0x%04X value 0x%02X\n", addr, byte);
+        die(-1, NULL);
     }
 }
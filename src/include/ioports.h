@@ -108,17 +108,27 @@
 void if_write(uint8_t);
 void ie_write(uint8_t);
 
-extern uint8_t io_if, io_ie;
-
 typedef struct {
     uint8_t lcdc, stat, scy, scx, ly, lyc, dma, bgp, obp0, obp1, wx, wy, vbk, hdma1, hdma2, hdma3, hdma4, hdma5;
     uint8_t bgpi, bgpd[64], obpi, obpd[64];
 } display_t;
 
 typedef struct {
-    uint8_t div, tima, tma, tac;
+    uint8_t tima, tma, tac;
+    uint64_t counter_base;      // system counter (DIV is bits 8-15) at counter_cycles
+    uint64_t counter_cycles;
+    uint64_t tima_count;        // system counter TIMA was last brought up to date at
 } timer_regs_t;
 
+typedef struct {
+    int enabled;
+    int length;                 // length counter, counts down to zero
+    int volume, env_timer;
+    int pos;                    // duty step or wave sample
+    int period;                 // master cycles per waveform step
+    uint64_t next_step;         // master cycle of the next waveform step
+} apu_channel_t;
+
 typedef struct {
     uint8_t nr10, nr11, nr12, nr13, nr14;
     uint8_t nr21, nr22, nr23, nr24;
@@ -126,6 +136,13 @@ typedef struct {
     uint8_t nr41, nr42, nr43, nr44;
     uint8_t nr50, nr51, nr52;
     uint8_t wav[16];
+
+    apu_channel_t ch[4];
+    int sweep_enabled, sweep_timer, sweep_shadow;
+    uint16_t lfsr;
+    int frame_step;             // frame sequencer step, 0-7
+    uint64_t next_frame_step;   // master cycle of the next frame sequencer step
+    uint64_t last_update;       // master cycle the channels have been run up to
 } sound_t;
 
 typedef struct {
@@ -136,9 +153,21 @@ typedef struct {
     int rom_bank, ram_rtc_bank, ram_rtc_enable, ram_rtc_toggle;
     int latch_data, old_latch_data;
 
-    int h, m, s, d, halt;
+    // real-time clock, indexed by RTC register select minus 8
+    int has_rtc;
+    uint8_t rtc[5], rtc_latched[5];
+    uint64_t rtc_last_cycles;   // master clock cycle the live registers were brought up to date at
+    uint32_t rtc_subsecond;     // cycles into the current second
 } mbc3_t;
 
+#define RTC_S               0
+#define RTC_M               1
+#define RTC_H               2
+#define RTC_DL              3
+#define RTC_DH              4
+
+#define RTC_SAVE_SIZE       48  // appended to the .mbc file, same layout as other emulators
+
 typedef struct {
     int rom_bank, ram_bank, ram_enable;
 } mbc5_t;
@@ -0,0 +1,108 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* libtinygb: the emulator core without a window, sound device or SDL.
+
+   An instance belongs to the thread that created it: every gb_*() call for
+   it must come from that thread, and a thread runs at most one instance at a
+   time. Run more instances on more threads; instances that were created from
+   the same ROM buffer share it, and the buffer must outlive them. Called
+   with an instance that isn't the calling thread's, the functions below do
+   nothing and return -1, 0 or NULL.
+
+   The core reports fatal errors through the die callback and then exits the
+   process, unless the callback never returns (e.g. longjmp()s out). */
+
+#if defined(__GNUC__)
+#define GB_API __attribute__((visibility("default")))
+#else
+#define GB_API
+#endif
+
+typedef struct gb_t gb_t;
+
+// gb_set_input() keys, one bit each
+#define GB_KEY_A            0x01
+#define GB_KEY_B            0x02
+#define GB_KEY_SELECT       0x04
+#define GB_KEY_START        0x08
+#define GB_KEY_RIGHT        0x10
+#define GB_KEY_LEFT         0x20
+#define GB_KEY_UP           0x40
+#define GB_KEY_DOWN         0x80
+
+// gb_config_t.system, same as in tinygb.ini
+#define GB_SYSTEM_AUTO      0
+#define GB_SYSTEM_GB        1
+#define GB_SYSTEM_SGB2      2
+#define GB_SYSTEM_CGB       3
+
+typedef struct {
+    int system;                 // GB_SYSTEM_*
+    int prefer_gb;              // with GB_SYSTEM_AUTO, run dual-mode games as GB
+    int border;                 // keep the SGB border buffers
+    int deterministic;          // no wall clock, so runs can be reproduced
+    const char *save_file;      // battery-backed cart RAM, NULL to keep it in memory
+    const char *movie;          // input movie to play back, NULL for none; overrides
+                                // the other settings with the ones it was recorded with
+    const char *record_hashes;  // write a hash of the machine after every frame here
+    const char *check_hashes;   // compare every frame to these hashes, die at the first difference
+} gb_config_t;
+
+// all optional; called on the thread of the instance they're about
+typedef struct {
+    void (*update_window)(uint32_t *framebuffer);
+    void (*update_border)(uint32_t *border);
+    void (*resize_sgb_window)();
+    void (*poll_input)();
+    void (*die)(int status, const char *message);
+    void (*log)(const char *message);
+} gb_callbacks_t;
+
+// many copies of one game, stepped together; see gb_env_create()
+typedef struct gb_env_t gb_env_t;
+
+typedef struct {
+    int count;                  // instances
+    int threads;                // 0 for one per core
+    int downsample;             // average n x n pixels into one; 1, 2, 4, 8 or 16
+    int grayscale;              // one byte of luma per pixel instead of 0xRRGGBB
+} gb_env_config_t;
+
+#define GB_FRAMEBUFFER_WIDTH    160
+#define GB_FRAMEBUFFER_HEIGHT   144
+#define GB_FRAME_RATE           59.7275     // frames per second of a real Game Boy
+
+GB_API void gb_set_callbacks(const gb_callbacks_t *callbacks);
+
+GB_API gb_t *gb_create(const void *rom, size_t size, const gb_config_t *config);
+GB_API void gb_destroy(gb_t *instance);
+
+GB_API int gb_run_frame(gb_t *instance);                   // zero once the movie is over
+GB_API void gb_set_input(gb_t *instance, uint8_t keys);     // ignored while a movie plays
+GB_API const uint32_t *gb_framebuffer(gb_t *instance);     // 0xRRGGBB, 160x144
+
+GB_API size_t gb_state_size(gb_t *instance);
+GB_API int gb_save_state(gb_t *instance, void *buffer, size_t size);
+GB_API int gb_load_state(gb_t *instance, const void *buffer, size_t size);
+GB_API uint64_t gb_state_hash(gb_t *instance);     // same state, same hash, on any host
+
+/* Environments hold many instances of the same ROM and config, which start
+   out identical and are stepped one frame at a time, each with its own keys.
+   The instances are spread over a few threads of their own, so the calling
+   thread may also have an instance of its own. gb_env_step() writes the
+   frames of all instances into one buffer of count * gb_env_frame_size()
+   bytes, instance after instance. Save files, movies and hash files
+   aren't used. */
+
+GB_API gb_env_t *gb_env_create(const void *rom, size_t size, const gb_config_t *config, const gb_env_config_t *env_config);
+GB_API void gb_env_destroy(gb_env_t *env);
+GB_API size_t gb_env_frame_size(gb_env_t *env);
+GB_API void gb_env_step(gb_env_t *env, const uint8_t *keys, void *frames);  // frames may be NULL
+GB_API void gb_env_reset(gb_env_t *env, int index);     // back to power-on before the next step
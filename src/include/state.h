@@ -0,0 +1,103 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#pragma once
+
+#include <tinygb.h>
+#include <ioports.h>
+#include <sgb.h>
+
+/* All mutable machine state lives in a single arena: the gb_t structure
+   below, followed by the memory blocks that its pointers refer to. The
+   fields touched by every instruction come first so that the main loop only
+   has to keep the first two cache lines warm, and taking a snapshot of the
+   whole machine is a single memcpy() of the arena, up to the frame buffers
+   at its end.
+
+   The arena is reached through gb, which is thread-local like the little
+   per-instance state that lives outside of it, so any number of machines can
+   run in one process, one per thread. Instances running the same ROM share
+   a single read-only mapping of it. */
+
+typedef struct gb_t {
+    // hot state -- CPU, interrupts, timing counters and bank pointers
+    cpu_t cpu;
+    uint8_t io_if, io_ie;
+    timing_t timing;
+    uint64_t total_cycles;      // master clock, never wraps
+    uint64_t next_event;        // earliest of event_time[]
+    int display_cycles;
+
+    uint8_t *rom_bank_ptr;      // 0x4000-0x7FFF
+    uint8_t *ram_bank_ptr;      // 0xA000-0xBFFF
+    uint8_t *wram_bank_ptr;     // 0xD000-0xDFFF
+    uint8_t *vram_bank_ptr;     // 0x8000-0x9FFF
+    int ex_ram_mask;            // wraps accesses to cart RAM smaller than 8 KiB
+    int mbc_type;
+    int is_cgb, is_sgb, is_double_speed;
+    timer_regs_t timer;
+    uint64_t event_time[EVENT_COUNT];
+
+    // everything below here is touched much less often
+    display_t display;
+    int line_rendered, framecount;
+    int work_ram_bank, prepare_speed_switch;
+    uint8_t pressed_keys;
+    int selection;
+    input_event_t input_queue[INPUT_QUEUE_SIZE];    // key changes waiting for their cycle
+    int input_head, input_tail;
+    uint8_t sb, sc;
+
+    // memory blocks carved out of the arena
+    uint8_t *ram;               // WRAM, HRAM, OAM and cart RAM in that order
+    uint8_t *wram, *hram, *oam, *ex_ram;
+    uint8_t *vram;
+    uint32_t *framebuffer, *temp_framebuffer, *background_buffer;
+    int ram_size, vram_size, ex_ram_size;
+
+    // memory bank controllers
+    mbc1_t mbc1;
+    mbc3_t mbc3;
+    mbc5_t mbc5;
+    uint32_t ex_ram_dirty;      // one bit per 8 KiB bank of cart RAM
+    int ex_ram_mapped;          // cart RAM is the mmap()ed save file instead of arena memory
+    int ex_ram_size_banks;
+    int rom_size_banks;
+
+    sound_t sound;
+
+    // rendering scratch space
+    uint8_t oam_copy[OAM_SIZE];
+    uint32_t cgb_palette[4];
+
+    // super gameboy
+    int sgb_transferring, sgb_interfere;
+    int sgb_current_bit, sgb_command_size;
+    int using_sgb_palette, using_sgb_border;
+    int sgb_attr_block_count, sgb_screen_mask;
+    uint8_t sgb_current_joypad, sgb_joypad_return;
+    int sgb_joypad_count;
+    uint32_t sgb_color_zero;
+    sgb_command_t sgb_command;
+    sgb_palette_t sgb_palettes[4];
+    sgb_attr_block_t sgb_attr_blocks[18];   // maximum
+    sgb_border_palette_t sgb_border_palettes[4];
+    uint8_t *sgb_palette_data, *sgb_tiles, *sgb_border_map;
+    uint32_t *sgb_border;
+} gb_t;
+
+// every emulator thread runs its own machine
+extern __thread gb_t *gb;
+extern __thread size_t arena_size, machine_size;
+
+// the other machine on this thread's link cable, see netplay.c
+extern __thread gb_t *cable_peer;
+
+void arena_start(int, int, int);
+size_t state_size();
+void state_snapshot(void *);
+void state_restore(void *);
+void state_unmap_ex_ram();
+void state_copy(gb_t *, gb_t *);
+gb_t *state_clone();
@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <libtinygb.h>
 //#include <SDL.h>
 
 #define GB_WIDTH    160
@@ -25,6 +26,18 @@
 #define PREFER_CGB          0
 #define PREFER_GB           1
 
+#define LINK_NONE           0
+#define LINK_SERVER         1
+#define LINK_CLIENT         2
+#define LINK_LOCAL          3   // a second instance on another thread
+
+#define PACING_VIDEO        0   // throttle the CPU to hit the target frame rate
+#define PACING_AUDIO        1   // the audio device's sample clock sets the speed
+
+#define POLL_FRAME          0   // poll host input once per emulated frame
+#define POLL_VBLANK         1   // ... at the start of every vblank
+#define POLL_SCANLINE       2   // ... after every scanline
+
 /* DISPLAY:
 
     Width                       160 px
@@ -52,9 +65,6 @@
 #define VSYNC_PAUSE             1.08769     // ms
 #define OAM_SIZE                160         // bytes
 
-// CPU throttle
-#define THROTTLE_THRESHOLD      18          // ms
-#define SPEED_ALLOWANCE         4           // +/- 4% from the target speed
 
 #define JOYPAD_A                1
 #define JOYPAD_B                2
@@ -66,7 +76,7 @@
 #define JOYPAD_DOWN             8
 
 typedef struct {
-    int cpu_cycles_ms, cpu_cycles_vline, cpu_cycles_timer, cpu_cycles_div;
+    int cpu_cycles_ms, cpu_cycles_vline;
     int current_cycles;
     int main_cycles;    // how many times we should cycle in main()
     int last_instruction_cycles;
@@ -111,8 +121,11 @@ typedef struct {
 
 typedef struct {
     char *a, *b, *start, *select, *up, *down, *left, *right;
-    char *throttle;
+    char *throttle, *save_state, *load_state, *rewind;
     char *speed, *palette, *scaling, *system, *preference, *border;
+    char *pacing, *input_poll, *run_ahead, *deterministic, *rewind_buffer, *rewind_interval;
+    char *link, *link_socket, *link_window, *link_rom;
+    char *boot_cache, *boot_mark;
 } config_file_t;
 
 #define FLAG_ZF     0x80
@@ -120,31 +133,29 @@ typedef struct {
 #define FLAG_H      0x20
 #define FLAG_CY     0x10
 
-extern long rom_size;
-extern void *rom, *ram, *vram;
-extern int is_cgb, is_sgb;
+extern __thread long rom_size;
+extern __thread void *rom;
 
-extern char *rom_filename;
+extern __thread char *rom_filename, *ex_ram_filename;
+extern __thread int headless;  // this instance neither draws nor plays sound
 
-extern int cpu_speed;
+extern __thread int cpu_speed;
 
 extern int scaling, frameskip;
-extern int scaled_w, scaled_h;
-extern int throttle_hi, throttle_lo;
+extern __thread int scaled_w, scaled_h;
 
 //extern SDL_Window *window;
 //extern SDL_Surface *surface;
 
-extern timing_t timing;
-extern int mbc_type;
-
 extern config_file_t config_file;
 extern int target_speed;
+
+// host callbacks, see api.c
+extern gb_callbacks_t callbacks;
 void update_window(uint32_t *);
 void update_border(uint32_t *);
-void destroy_window();
-void delay(int);
 void resize_sgb_window();
+void poll_input();
 
 void open_log();
 void open_config();
@@ -156,24 +167,50 @@ void display_start();
 void timer_start();
 void sound_start();
 
-extern int config_system;
-extern int config_preference;
-extern int config_border;
+// settings that shape a machine are per instance, the rest is per process
+extern __thread int config_system;
+extern __thread int config_preference;
+extern __thread int config_border;
+extern int config_pacing;
+extern __thread int config_input_poll;
+extern __thread int config_run_ahead;
+extern __thread int config_deterministic;   // nothing but the ROM and the input may affect emulation
+extern __thread int config_rewind_buffer, config_rewind_interval;  // MiB, frames
+extern int config_link, config_link_window;
+extern char *config_link_socket, *config_link_rom;
+extern int config_boot_cache;
 
 // cpu
-extern int throttle_enabled, throttle_time, cycles_per_throttle;
+extern int throttle_enabled;
 void cpu_cycle();
+void cpu_run_until(int);
+void cpu_run_frame();
 void cpu_log();
 
 // memory
-extern int work_ram_bank;
+extern __thread size_t state_footprint;
+int machine_model();
+uint64_t hash_data(const void *, size_t);
+uint64_t hash_fast(const void *, size_t);
+void *state_alloc(size_t, const char *);
+void report_footprint();
+int load_rom(char *);
+void unload_rom();
+uint64_t rom_hash();
 uint8_t read_byte(uint16_t);
 uint16_t read_word(uint16_t);
 void write_byte(uint16_t, uint8_t);
 void copy_oam(void *);
-void mbc_start(void *);
+int mbc_ram_size();
+void mbc_start();
+void mbc_update_banks();
 void mbc_write(uint16_t, uint8_t);
 uint8_t mbc_read(uint16_t);
+void rtc_load(uint8_t *);
+void rtc_save(uint8_t *);
+void battery_start();
+void battery_save();
+void battery_stop();
 
 // interrupts
 uint8_t if_read();
@@ -181,7 +218,7 @@ uint8_t ie_read();
 void send_interrupt(int);
 
 // display
-extern int drawn_frames, framecount;
+extern __thread int drawn_frames;
 extern int monochrome_palette;
 void next_palette();
 void prev_palette();
@@ -195,38 +232,160 @@ void vram_write(uint16_t, uint8_t);
 uint8_t vram_read(uint16_t);
 
 // serial
+#define LINK_TIME           0
+#define LINK_XFER           1
+#define LINK_REPLY          2
+
+typedef struct {
+    uint8_t type, data;
+    uint8_t reserved[6];
+    uint64_t cycle;             // link cycle the sender has reached
+    uint64_t when;              // link cycle a transfer finishes at
+} link_msg_t;
+
+void serial_start();
+uint8_t sb_read();
+uint8_t sc_read();
 void sb_write(uint8_t);
 void sc_write(uint8_t);
+void serial_complete();
+void serial_link_event();
+void link_start();
+int link_connect();
+int link_connected();
+void link_send(link_msg_t *);
+int link_recv(link_msg_t *, int);
+void link_stop();
+int link_local_thread();
+void link_local_exit();
 
 // timer
 void timer_write(uint16_t, uint8_t);
 uint8_t timer_read(uint16_t);
-void timer_cycle();
+void timer_overflow();
+void timer_set_speed(int);
+
+// pacer
+typedef struct {
+    int frames;
+    double speed;               // percent of real hardware, from the master clock
+    double frame_mean, frame_jitter, frame_min, frame_max;     // ms
+} pacer_stats_t;
+
+void pacer_start();
+void pacer_frame(int);
+void pacer_resync();
+int pacer_stats(pacer_stats_t *);
+
+// savestates
+size_t savestate_size();
+void savestate_write(void *);
+int savestate_read(const void *, size_t);
+int savestate_save(char *);
+int savestate_load(char *);
+int savestate_hash_chunks(uint64_t *, char (*)[4]);
+
+// rewind
+void rewind_start();
+void rewind_frame();
+int rewind_step();
+void rewind_stop();
+
+// movie
+#define MOVIE_NONE          0
+#define MOVIE_RECORD        1
+#define MOVIE_PLAY          2
+
+extern __thread int movie_mode;
+void movie_open(char *, int);
+void movie_start();
+int movie_frame();
+void movie_stop();
+
+// state hashes
+#define HASHES_NONE         0
+#define HASHES_RECORD       1
+#define HASHES_CHECK        2
+#define MAX_HASH_REGIONS    32
+
+int state_hash_regions(uint64_t *, char (*)[4]);
+uint64_t state_hash();
+void hashes_open(char *, int);
+void hashes_start();
+void hashes_frame();
+void hashes_stop();
+
+// run-ahead
+extern __thread int running_ahead, hide_video;
+void runahead_start();
+void runahead_frame();
+
+// boot cache
+void boot_cache_start();
+void boot_cache_frame();
+void boot_cache_input();
+void boot_cache_mark();
+
+// netplay
+extern __thread int netplay_player;
+void netplay_open(int, int, char *);
+void netplay_start();
+void netplay_frame();
+void netplay_stop();
+
+// scheduler
+#define EVENT_TIMER         0
+#define EVENT_SOUND         1
+#define EVENT_SERIAL        2
+#define EVENT_LINK          3
+#define EVENT_JOYPAD        4
+#define EVENT_COUNT         5
+#define EVENT_NEVER         UINT64_MAX
+
+void scheduler_start();
+void schedule_event(int, uint64_t);
+void cancel_event(int);
+void run_events();
 
 // sound
+#define SOUND_SAMPLE_RATE   48000
+
 void sound_write(uint16_t, uint8_t);
 uint8_t sound_read(uint16_t);
+void sound_frame_sequencer();
+void sound_set_rate(int);
+void sound_set_rate_control(int);
+int sound_buffered();
+int sound_read_samples(int16_t *, int);
+void sound_resync();
 
 // joypad
-extern uint8_t pressed_keys;
+#define INPUT_QUEUE_SIZE    64  // must be a power of two
+
+typedef struct {
+    uint64_t cycle;             // master cycle the change takes effect at
+    uint8_t is_down, key;
+} input_event_t;
+
 void joypad_write(uint16_t, uint8_t);
 uint8_t joypad_read(uint16_t);
 void joypad_handle(int, int);
+void joypad_set(uint8_t);
+void joypad_queue(uint64_t, int, int);
+void joypad_event();
 
 // SGB functions
-extern int sgb_transferring, sgb_interfere, sgb_screen_mask, using_sgb_palette, using_sgb_border;
-extern int gb_x, gb_y;
-extern int sgb_scaled_h, sgb_scaled_w;
+extern __thread int gb_x, gb_y;
+extern __thread int sgb_scaled_h, sgb_scaled_w;
 void sgb_start();
 void sgb_write(uint8_t);
 uint8_t sgb_read();
+void sgb_resync(int);
 void sgb_recolor(uint32_t *, uint32_t *, int, uint32_t *);
 uint32_t truecolor(uint16_t);
 
 // CGB functions
 //#define CGB_DEBUG
-extern int is_double_speed;
-extern int prepare_speed_switch;
 void cgb_write(uint16_t, uint8_t);
 uint8_t cgb_read(uint16_t);
 void cgb_dump_bgpd();
@@ -3,11 +3,12 @@
    (c) 2022 by jewel */
 
 #include <tinygb.h>
+#include <state.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 
-char log_buffer[1000];
+__thread char log_buffer[1000];
 
 FILE *log_file;
 
@@ -20,7 +21,9 @@ void write_log(const char *text, ...) {
     if(log_file) {
         fprintf(log_file, "%s", log_buffer);
     }
-    fprintf(stdout, "%s", log_buffer);
+
+    if(callbacks.log) callbacks.log(log_buffer);
+    else fprintf(stdout, "%s", log_buffer);
 
     va_end(args);
 }
@@ -34,11 +37,31 @@ void open_log() {
 }
 
 void die(int status, const char *msg, ...) {
-    destroy_window();
+    if(link_local_thread()) {
+        // the second instance of a local link session only takes itself down
+        if(msg) {
+            char message[1000];
+            va_list args;
+            va_start(args, msg);
+            vsnprintf(message, sizeof(message), msg, args);
+            va_end(args);
+
+            write_log("[link] local instance quit with exit code %d: %s", status, message);
+        }
+
+        link_local_exit();
+    }
+
+    battery_stop();
+    rewind_stop();
+    link_stop();
+    movie_stop();
+    hashes_stop();
+    netplay_stop();
 
-    if(ram) {
+    if(gb) {
 #ifdef CGB_DEBUG
-        if(is_cgb) {
+        if(gb->is_cgb) {
             cgb_dump_bgpd();
             cgb_dump_obpd();
         }
@@ -46,35 +69,37 @@ void die(int status, const char *msg, ...) {
 
         cpu_log();
 
-        FILE *memdump = fopen("memory.bin", "wb");
-        if(!memdump) {
-            write_log("failed to open memory.bin for writing\n");
-        } else {
-            fwrite(ram, 1024, 1058, memdump);
-            fflush(memdump);
-            fclose(memdump);
+        // headless instances, which includes everything gb_create() starts,
+        // share the working directory with other instances and programs
+        if(!headless) {
+            FILE *memdump = fopen("memory.bin", "wb");
+            if(!memdump) {
+                write_log("failed to open memory.bin for writing\n");
+            } else {
+                fwrite(gb->ram, 1, gb->ram_size, memdump);
+                fflush(memdump);
+                fclose(memdump);
+            }
+
+            FILE *vramdump = fopen("vram.bin", "wb");
+            if(!vramdump) {
+                write_log("failed to open vram.bin for writing\n");
+            } else {
+                fwrite(gb->vram, 1, gb->vram_size, vramdump);
+                fflush(vramdump);
+                fclose(vramdump);
+            }
         }
 
-        free(ram);
+        free(gb);
+        gb = NULL;
     }
 
-    if(vram) {
-        FILE *vramdump = fopen("vram.bin", "wb");
-        if(!vramdump) {
-            write_log("failed to open vram.bin for writing\n");
-        } else {
-            fwrite(vram, 1, 16384, vramdump);
-            fflush(vramdump);
-            fclose(vramdump);
-        }
-
-        free(vram);
-    }
-
-    free(rom);
+    unload_rom();
 
     if(!status || !msg) {
         if(log_file) fclose(log_file);
+        if(callbacks.die) callbacks.die(status, "");
         exit(status);
     }
 
@@ -88,9 +113,14 @@ void die(int status, const char *msg, ...) {
         fflush(log_file);
         fclose(log_file);
     }
-    fprintf(stdout, "quitting with exit code: %d: %s", status, log_buffer);
+
+    char message[1100];
+    snprintf(message, sizeof(message), "quitting with exit code: %d: %s", status, log_buffer);
+    if(callbacks.log) callbacks.log(message);
+    else fprintf(stdout, "%s", message);
 
     va_end(args);
 
+    if(callbacks.die) callbacks.die(status, log_buffer);
     exit(status);
 }
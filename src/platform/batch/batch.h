@@ -0,0 +1,15 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#pragma once
+
+#include <libtinygb.h>
+#include <time.h>
+
+double seconds_now(clockid_t);
+void *read_file(char *, size_t *);
+int parse_option(gb_config_t *, char *);
+int write_ppm(char *, const uint32_t *);
+
+int fork_server(char *, char *, gb_config_t *, long, char *, int);
@@ -0,0 +1,272 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <libtinygb.h>
+#include "batch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Fork server
+
+/*
+
+ Every job that starts from the same point of a game pays for booting it
+ and getting through its intro. The fork server does that once: it starts
+ the ROM, loads a savestate if it was given one and runs a number of frames,
+ then waits for jobs on a Unix domain socket. Each connection is one job,
+ run by a fork()ed child from the warm machine while the server goes back
+ to waiting. The child shares all of the server's memory copy-on-write, so
+ it starts right away and only copies the pages that the machine writes to.
+
+ A job is one line of options:
+
+    frames=600 keys=input.bin dump=last.ppm state=last.state
+
+ frames is how many frames to run. keys is a file with the keys of every
+ frame, one byte each like the body of a movie, and no keys are pressed
+ once it runs out; frames defaults to its length. dump writes the last frame
+ as a PPM image and state writes the final savestate. The child answers
+ with one line and closes the connection:
+
+    ok <frames> <seconds> <state hash>
+    error <message>
+
+ */
+
+static int client_fd = -1;
+static int server_verbose = 0;
+static volatile sig_atomic_t quitting = 0;
+
+static void reply(const char *format, ...) {
+    char message[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    send(client_fd, message, strlen(message), MSG_NOSIGNAL);
+}
+
+// a child that dies answers its job instead of taking the server down
+static void fork_die(int status, const char *message) {
+    if(client_fd < 0) return;
+
+    char error[256];
+    snprintf(error, sizeof(error), "%s", message);
+    error[strcspn(error, "\n")] = 0;
+
+    reply("error %s\n", error);
+    fflush(stdout);
+    _exit(1);
+}
+
+static void fork_log(const char *message) {
+    if(!server_verbose) return;
+
+    if(client_fd >= 0) printf("[job %d] %s", (int)getpid(), message);
+    else printf("%s", message);
+}
+
+static const gb_callbacks_t fork_callbacks = {
+    .die = fork_die,
+    .log = fork_log,
+};
+
+static void stop_server(int signal) {
+    quitting = 1;
+}
+
+// runs in the child
+static void serve_job(gb_t *instance) {
+    char request[1024];
+    size_t length = 0;
+
+    while(length < sizeof(request) - 1) {
+        ssize_t count = recv(client_fd, request + length, sizeof(request) - 1 - length, 0);
+        if(count <= 0) break;
+
+        length += count;
+        if(memchr(request + length - count, '\n', count)) break;
+    }
+
+    request[length] = 0;
+
+    long frames = -1;
+    char *keys_filename = NULL, *dump_filename = NULL, *state_filename = NULL;
+    char *option;
+
+    for(option = strtok(request, " \t\r\n"); option; option = strtok(NULL, " \t\r\n")) {
+        if(!strncmp(option, "frames=", 7)) frames = atol(option + 7);
+        else if(!strncmp(option, "keys=", 5)) keys_filename = option + 5;
+        else if(!strncmp(option, "dump=", 5)) dump_filename = option + 5;
+        else if(!strncmp(option, "state=", 6)) state_filename = option + 6;
+        else {
+            reply("error unknown option %s\n", option);
+            return;
+        }
+    }
+
+    uint8_t *keys = NULL;
+    size_t key_count = 0;
+
+    if(keys_filename) {
+        keys = read_file(keys_filename, &key_count);
+        if(!keys) {
+            reply("error unable to read %s\n", keys_filename);
+            return;
+        }
+
+        if(frames < 0) frames = key_count;
+    }
+
+    if(frames < 0) {
+        reply("error a job needs frames or keys\n");
+        return;
+    }
+
+    double start = seconds_now(CLOCK_MONOTONIC);
+
+    for(long i = 0; i < frames; i++) {
+        gb_set_input(instance, i < key_count ? keys[i] : 0);
+        gb_run_frame(instance);
+    }
+
+    double seconds = seconds_now(CLOCK_MONOTONIC) - start;
+
+    if(dump_filename && write_ppm(dump_filename, gb_framebuffer(instance))) {
+        reply("error unable to write %s\n", dump_filename);
+        return;
+    }
+
+    if(state_filename) {
+        size_t size = gb_state_size(instance);
+        void *state = malloc(size);
+        FILE *file = fopen(state_filename, "wb");
+
+        if(!state || !file || gb_save_state(instance, state, size) || fwrite(state, 1, size, file) != size) {
+            if(file) fclose(file);
+            reply("error unable to write %s\n", state_filename);
+            return;
+        }
+
+        fclose(file);
+    }
+
+    reply("ok %ld %.6f %016llx\n", frames, seconds, (unsigned long long)gb_state_hash(instance));
+}
+
+int fork_server(char *socket_path, char *rom_filename, gb_config_t *config, long boot_frames, char *boot_state, int verbose) {
+    server_verbose = verbose;
+    gb_set_callbacks(&fork_callbacks);
+
+    size_t size;
+    void *rom = read_file(rom_filename, &size);
+    if(!rom) {
+        fprintf(stderr, "unable to read %s\n", rom_filename);
+        return -1;
+    }
+
+    double start = seconds_now(CLOCK_MONOTONIC);
+
+    gb_t *instance = gb_create(rom, size, config);
+    if(!instance) {
+        fprintf(stderr, "unable to start %s\n", rom_filename);
+        return -1;
+    }
+
+    if(boot_state) {
+        size_t state_size;
+        void *state = read_file(boot_state, &state_size);
+        if(!state || gb_load_state(instance, state, state_size)) {
+            fprintf(stderr, "unable to load %s\n", boot_state);
+            return -1;
+        }
+
+        free(state);
+    }
+
+    for(long i = 0; i < boot_frames; i++) {
+        gb_run_frame(instance);
+    }
+
+    double seconds = seconds_now(CLOCK_MONOTONIC) - start;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(struct sockaddr_un));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0) {
+        fprintf(stderr, "unable to create socket\n");
+        return -1;
+    }
+
+    unlink(socket_path);    // left behind by an earlier server
+    if(bind(listen_fd, (struct sockaddr *)&address, sizeof(struct sockaddr_un)) || listen(listen_fd, 64)) {
+        fprintf(stderr, "unable to listen on %s\n", socket_path);
+        close(listen_fd);
+        return -1;
+    }
+
+    // accept() has to be interrupted, so no SA_RESTART
+    struct sigaction action;
+    memset(&action, 0, sizeof(struct sigaction));
+    action.sa_handler = stop_server;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGCHLD, SIG_IGN);   // children are never waited for
+
+    printf("booted %s to frame %ld in %.3f s, serving jobs on %s\n", rom_filename, boot_frames, seconds, socket_path);
+    fflush(stdout);
+
+    long served = 0;
+
+    while(!quitting) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if(fd < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr, "unable to accept connections on %s\n", socket_path);
+            break;
+        }
+
+        // the child inherits whatever is still buffered
+        fflush(stdout);
+
+        pid_t pid = fork();
+        if(!pid) {
+            close(listen_fd);
+            client_fd = fd;
+            serve_job(instance);
+            fflush(stdout);
+            _exit(0);
+        }
+
+        if(pid < 0) {
+            client_fd = fd;
+            reply("error unable to fork\n");
+            client_fd = -1;
+        } else {
+            served++;
+        }
+
+        close(fd);
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+
+    printf("served %ld jobs\n", served);
+
+    gb_destroy(instance);
+    free(rom);
+    return 0;
+}
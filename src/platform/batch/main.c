@@ -0,0 +1,487 @@
+
+/* tinygb - a tiny gameboy emulator
+   (c) 2022 by jewel */
+
+#include <libtinygb.h>
+#include "batch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Batch runner
+
+/*
+
+ tinygb-batch runs many jobs headless in one process, one instance per
+ thread, with no window and no SDL. A job is a line of the manifest:
+
+    # rom                 frames or movie     options
+    roms/tetris.gb        3600
+    roms/crystal.gbc      movies/intro.mov
+    roms/zelda.gb         600                 system=sgb2 border=1
+
+ The second column is either a number of frames to run without input or an
+ input movie to play back to its end. The options are system=auto|gb|sgb2|
+ cgb, prefer=cgb|gb, border=0|1, deterministic=1|0, and record_hashes=
+ file or check_hashes=file to record or check the state after every frame
+ (see hashes.c). Jobs are deterministic unless told otherwise, so their
+ results can be compared from run to run. A movie brings its own settings.
+ Paths are relative to the current directory.
+
+ For every job it prints the hash of the final state of the machine and how
+ long the frames took, and writes the last frame as a PPM image into the
+ output directory, named after the manifest line and the ROM.
+
+ Every thread owns a queue of jobs and works through it from the front.
+ A thread that runs out takes the last job from another thread's queue, so
+ a few long jobs at the end of the manifest don't leave the other threads
+ idle. ROMs are read once, however many jobs use them.
+
+ A job that dies, e.g. because its movie was recorded on another ROM, is
+ reported as failed and the thread goes on with the next one.
+
+ */
+
+typedef struct rom_file_t {
+    char *filename;
+    void *data;
+    size_t size;
+    struct rom_file_t *next;
+} rom_file_t;
+
+typedef struct {
+    int line;
+    char *rom_filename, *movie_filename;
+    rom_file_t *rom;
+    long frames;                // zero with a movie: until it's over
+    gb_config_t config;
+
+    int failed;
+    char error[256];
+    long frames_run;
+    double seconds, cpu_seconds;
+    uint64_t state_hash;
+} job_t;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int *queue;                 // job indices
+    int first, last;            // the owner takes from first, thieves from last
+    int steals;
+} worker_t;
+
+static job_t *jobs;
+static int job_count;
+static rom_file_t *roms;
+
+static worker_t *workers;
+static int worker_count;
+
+static char *output_dir = ".";
+static int verbose = 0;
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread job_t *current_job;
+static __thread jmp_buf job_exit;
+
+static void usage(char *name) {
+    fprintf(stderr, "usage: %s [-j threads] [-o output_dir] [-v] manifest\n", name);
+    fprintf(stderr, "       %s --fork-server socket [--boot-frames count | --boot-state file] [-v] rom [options]\n", name);
+    exit(-1);
+}
+
+double seconds_now(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec + (now.tv_nsec / 1000000000.0);
+}
+
+// reads a whole file into memory
+void *read_file(char *filename, size_t *size) {
+    FILE *file = fopen(filename, "rb");
+    if(!file) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+
+    void *data = length > 0 ? malloc(length) : NULL;
+    if(!data || fread(data, 1, length, file) != length) {
+        fclose(file);
+        free(data);
+        return NULL;
+    }
+
+    fclose(file);
+    *size = length;
+    return data;
+}
+
+// reads a ROM once, however many jobs use it
+static rom_file_t *open_rom(char *filename) {
+    for(rom_file_t *rom = roms; rom; rom = rom->next) {
+        if(!strcmp(rom->filename, filename)) return rom;
+    }
+
+    size_t size;
+    void *data = read_file(filename, &size);
+    if(!data) return NULL;
+
+    rom_file_t *rom = calloc(1, sizeof(rom_file_t));
+    if(!rom) {
+        free(data);
+        return NULL;
+    }
+
+    rom->filename = filename;
+    rom->data = data;
+    rom->size = size;
+    rom->next = roms;
+    roms = rom;
+    return rom;
+}
+
+int parse_option(gb_config_t *config, char *option) {
+    char *value = strchr(option, '=');
+    if(!value) return -1;
+    *value++ = 0;
+
+    if(!strcmp(option, "system")) {
+        if(!strcmp(value, "auto")) config->system = GB_SYSTEM_AUTO;
+        else if(!strcmp(value, "gb")) config->system = GB_SYSTEM_GB;
+        else if(!strcmp(value, "sgb2")) config->system = GB_SYSTEM_SGB2;
+        else if(!strcmp(value, "cgb")) config->system = GB_SYSTEM_CGB;
+        else return -1;
+    } else if(!strcmp(option, "prefer")) {
+        if(!strcmp(value, "gb")) config->prefer_gb = 1;
+        else if(!strcmp(value, "cgb")) config->prefer_gb = 0;
+        else return -1;
+    } else if(!strcmp(option, "border")) {
+        config->border = atoi(value);
+    } else if(!strcmp(option, "deterministic")) {
+        config->deterministic = atoi(value);
+    } else if(!strcmp(option, "record_hashes")) {
+        config->record_hashes = strdup(value);
+    } else if(!strcmp(option, "check_hashes")) {
+        config->check_hashes = strdup(value);
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void read_manifest(char *filename) {
+    FILE *file = fopen(filename, "r");
+    if(!file) {
+        fprintf(stderr, "unable to open %s for reading\n", filename);
+        exit(-1);
+    }
+
+    char text[1024];
+    int line = 0, job_max = 0;
+
+    while(fgets(text, sizeof(text), file)) {
+        line++;
+
+        char *comment = strchr(text, '#');
+        if(comment) *comment = 0;
+
+        char *rom_filename = strtok(text, " \t\r\n");
+        if(!rom_filename) continue;
+
+        char *run = strtok(NULL, " \t\r\n");
+        if(!run) {
+            fprintf(stderr, "%s:%d: a job needs a ROM and a frame count or a movie\n", filename, line);
+            exit(-1);
+        }
+
+        if(job_count == job_max) {
+            job_max = job_max ? job_max * 2 : 64;
+            jobs = realloc(jobs, job_max * sizeof(job_t));
+            if(!jobs) {
+                fprintf(stderr, "unable to allocate memory for jobs\n");
+                exit(-1);
+            }
+        }
+
+        job_t *job = &jobs[job_count++];
+        memset(job, 0, sizeof(job_t));
+        job->line = line;
+        job->rom_filename = strdup(rom_filename);
+        job->config.deterministic = 1;
+
+        char *end;
+        job->frames = strtol(run, &end, 10);
+        if(*end || end == run) {
+            job->frames = 0;
+            job->movie_filename = strdup(run);
+            job->config.movie = job->movie_filename;
+        } else if(job->frames <= 0) {
+            fprintf(stderr, "%s:%d: %s isn't a frame count\n", filename, line, run);
+            exit(-1);
+        }
+
+        char *option;
+        while((option = strtok(NULL, " \t\r\n"))) {
+            if(parse_option(&job->config, option)) {
+                fprintf(stderr, "%s:%d: unknown option %s\n", filename, line, option);
+                exit(-1);
+            }
+        }
+
+        job->rom = open_rom(job->rom_filename);
+        if(!job->rom) {
+            fprintf(stderr, "%s:%d: unable to read %s\n", filename, line, job->rom_filename);
+            exit(-1);
+        }
+    }
+
+    fclose(file);
+
+    if(!job_count) {
+        fprintf(stderr, "%s has no jobs\n", filename);
+        exit(-1);
+    }
+}
+
+// writes the framebuffer as a binary PPM image
+int write_ppm(char *filename, const uint32_t *framebuffer) {
+    FILE *file = fopen(filename, "wb");
+    if(!file) return -1;
+
+    uint8_t row[GB_FRAMEBUFFER_WIDTH * 3];
+    fprintf(file, "P6\n%d %d\n255\n", GB_FRAMEBUFFER_WIDTH, GB_FRAMEBUFFER_HEIGHT);
+
+    for(int y = 0; y < GB_FRAMEBUFFER_HEIGHT; y++) {
+        for(int x = 0; x < GB_FRAMEBUFFER_WIDTH; x++) {
+            uint32_t color = framebuffer[(y * GB_FRAMEBUFFER_WIDTH) + x];
+            row[(x * 3)] = (color >> 16) & 0xFF;
+            row[(x * 3) + 1] = (color >> 8) & 0xFF;
+            row[(x * 3) + 2] = color & 0xFF;
+        }
+
+        fwrite(row, 1, sizeof(row), file);
+    }
+
+    fclose(file);
+    return 0;
+}
+
+static void dump_framebuffer(job_t *job, const uint32_t *framebuffer) {
+    char filename[1024];
+    const char *name = strrchr(job->rom_filename, '/');
+    name = name ? name + 1 : job->rom_filename;
+
+    snprintf(filename, sizeof(filename), "%s/%d-%s.ppm", output_dir, job->line, name);
+    if(write_ppm(filename, framebuffer)) fprintf(stderr, "unable to open %s for writing\n", filename);
+}
+
+// the core calls this instead of exiting the process; the instance is
+// already gone by then, so the thread can go on with its next job
+static void batch_die(int status, const char *message) {
+    if(!current_job) return;
+
+    current_job->failed = 1;
+    snprintf(current_job->error, sizeof(current_job->error), "%s", message);
+
+    // the core's messages end in a new line, the report adds its own
+    size_t length = strlen(current_job->error);
+    while(length && isspace((unsigned char)current_job->error[length - 1])) current_job->error[--length] = 0;
+
+    longjmp(job_exit, 1);
+}
+
+static void batch_log(const char *message) {
+    if(!verbose) return;
+
+    if(current_job) printf("[job %d] %s", current_job->line, message);
+    else printf("%s", message);
+}
+
+static void run_job(job_t *job) {
+    current_job = job;
+
+    if(setjmp(job_exit)) {
+        current_job = NULL;
+        return;
+    }
+
+    gb_t *instance = gb_create(job->rom->data, job->rom->size, &job->config);
+    if(!instance) {
+        job->failed = 1;
+        snprintf(job->error, sizeof(job->error), "unable to create an instance");
+        current_job = NULL;
+        return;
+    }
+
+    double start = seconds_now(CLOCK_MONOTONIC);
+    double cpu_start = seconds_now(CLOCK_THREAD_CPUTIME_ID);
+
+    while(!job->frames || job->frames_run < job->frames) {
+        if(gb_run_frame(instance) <= 0) break;
+        job->frames_run++;
+    }
+
+    job->seconds = seconds_now(CLOCK_MONOTONIC) - start;
+    job->cpu_seconds = seconds_now(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+    job->state_hash = gb_state_hash(instance);
+    dump_framebuffer(job, gb_framebuffer(instance));
+
+    gb_destroy(instance);
+    current_job = NULL;
+}
+
+static void report_job(job_t *job) {
+    pthread_mutex_lock(&report_lock);
+
+    if(job->failed) {
+        printf("line %d: %s failed: %s\n", job->line, job->rom_filename, job->error);
+    } else {
+        printf("line %d: %s: %ld frames in %.3f s (%.3f s cpu), %.1f fps, %.1f%% speed, state %016llx\n",
+            job->line, job->rom_filename, job->frames_run, job->seconds, job->cpu_seconds,
+            job->frames_run / job->seconds, (job->frames_run * 100) / (job->seconds * GB_FRAME_RATE),
+            (unsigned long long)job->state_hash);
+    }
+
+    fflush(stdout);
+    pthread_mutex_unlock(&report_lock);
+}
+
+// the next job from the thread's own queue, or one taken from another
+// thread's; -1 when there's nothing left anywhere
+static int next_job(worker_t *self) {
+    int job = -1;
+
+    pthread_mutex_lock(&self->lock);
+    if(self->first < self->last) job = self->queue[self->first++];
+    pthread_mutex_unlock(&self->lock);
+
+    if(job >= 0) return job;
+
+    int index = self - workers;
+    for(int i = 1; i < worker_count && job < 0; i++) {
+        worker_t *victim = &workers[(index + i) % worker_count];
+
+        pthread_mutex_lock(&victim->lock);
+        if(victim->first < victim->last) job = victim->queue[--victim->last];
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    if(job >= 0) self->steals++;
+    return job;
+}
+
+static void *worker_main(void *arg) {
+    worker_t *self = (worker_t *)arg;
+    int job;
+
+    while((job = next_job(self)) >= 0) {
+        run_job(&jobs[job]);
+        report_job(&jobs[job]);
+    }
+
+    return NULL;
+}
+
+static const gb_callbacks_t batch_callbacks = {
+    .die = batch_die,
+    .log = batch_log,
+};
+
+int main(int argc, char **argv) {
+    char *manifest = NULL;      // or the ROM of a fork server
+    char *fork_socket = NULL, *boot_state = NULL;
+    long boot_frames = 0;
+    gb_config_t fork_config = { .deterministic = 1 };
+    worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "-j") && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+            if(worker_count <= 0) usage(argv[0]);
+        } else if(!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output_dir = argv[++i];
+        } else if(!strcmp(argv[i], "-v")) {
+            verbose = 1;
+        } else if(!strcmp(argv[i], "--fork-server") && i + 1 < argc) {
+            fork_socket = argv[++i];
+        } else if(!strcmp(argv[i], "--boot-frames") && i + 1 < argc) {
+            boot_frames = atol(argv[++i]);
+        } else if(!strcmp(argv[i], "--boot-state") && i + 1 < argc) {
+            boot_state = argv[++i];
+        } else if(argv[i][0] == '-') {
+            usage(argv[0]);
+        } else if(!manifest) {
+            manifest = argv[i];
+        } else if(!fork_socket || parse_option(&fork_config, argv[i])) {
+            usage(argv[0]);
+        }
+    }
+
+    if(!manifest) usage(argv[0]);
+    if(fork_socket) return fork_server(fork_socket, manifest, &fork_config, boot_frames, boot_state, verbose);
+
+    gb_set_callbacks(&batch_callbacks);
+    read_manifest(manifest);
+
+    if(worker_count <= 0) worker_count = 1;
+    if(worker_count > job_count) worker_count = job_count;
+
+    // deal the jobs out round-robin, stealing evens out the rest
+    workers = calloc(worker_count, sizeof(worker_t));
+    if(!workers) {
+        fprintf(stderr, "unable to allocate memory for threads\n");
+        return -1;
+    }
+
+    for(int i = 0; i < worker_count; i++) {
+        workers[i].queue = malloc(((job_count / worker_count) + 1) * sizeof(int));
+        if(!workers[i].queue) {
+            fprintf(stderr, "unable to allocate memory for threads\n");
+            return -1;
+        }
+
+        pthread_mutex_init(&workers[i].lock, NULL);
+    }
+
+    for(int i = 0; i < job_count; i++) {
+        worker_t *worker = &workers[i % worker_count];
+        worker->queue[worker->last++] = i;
+    }
+
+    double start = seconds_now(CLOCK_MONOTONIC);
+
+    for(int i = 0; i < worker_count; i++) {
+        if(pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+            fprintf(stderr, "unable to start thread %d\n", i);
+            return -1;
+        }
+    }
+
+    int steals = 0;
+    for(int i = 0; i < worker_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        steals += workers[i].steals;
+    }
+
+    double seconds = seconds_now(CLOCK_MONOTONIC) - start;
+
+    long frames = 0;
+    int failed = 0;
+    for(int i = 0; i < job_count; i++) {
+        frames += jobs[i].frames_run;
+        if(jobs[i].failed) failed++;
+    }
+
+    printf("%d jobs, %d failed, %ld frames in %.3f s on %d thread%s (%d jobs stolen), %.1f fps overall\n",
+        job_count, failed, frames, seconds, worker_count, worker_count == 1 ? "" : "s", steals, frames / seconds);
+
+    return failed ? 1 : 0;
+}
@@ -3,22 +3,19 @@
    (c) 2022 by jewel */
 
 #include <tinygb.h>
+#include <state.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <SDL.h>
-#include <time.h>
 #include "tinyfiledialogs.h"
 
 // SDL specific code
 
-long rom_size;
-int scaling = 4;
-int frameskip = 0;  // no skip
-
 SDL_Window *window;
 SDL_Surface *surface;
-timing_t timing;
-char *rom_filename;
+SDL_AudioDeviceID audio_device;
+int audio_target;   // frames to keep buffered with audio pacing
+int audio_frame;    // frames the device plays per emulated frame
 
 // SDL Config
 SDL_Keycode key_a;
@@ -30,6 +27,13 @@ SDL_Keycode key_down;
 SDL_Keycode key_left;
 SDL_Keycode key_right;
 SDL_Keycode key_throttle;
+SDL_Keycode key_save_state;
+SDL_Keycode key_load_state;
+SDL_Keycode key_rewind;
+SDL_Keycode key_boot_mark;
+
+static int save_state_pending, load_state_pending, boot_mark_pending;
+static int rewinding;
 
 SDL_Keycode sdl_get_key(char *keyname) {
     if(!keyname) return SDLK_UNKNOWN;
@@ -70,6 +74,18 @@ SDL_Keycode sdl_get_key(char *keyname) {
     else if(!strcmp("7", keyname)) return SDLK_7;
     else if(!strcmp("8", keyname)) return SDLK_8;
     else if(!strcmp("9", keyname)) return SDLK_9;
+    else if(!strcmp("f1", keyname)) return SDLK_F1;
+    else if(!strcmp("f2", keyname)) return SDLK_F2;
+    else if(!strcmp("f3", keyname)) return SDLK_F3;
+    else if(!strcmp("f4", keyname)) return SDLK_F4;
+    else if(!strcmp("f5", keyname)) return SDLK_F5;
+    else if(!strcmp("f6", keyname)) return SDLK_F6;
+    else if(!strcmp("f7", keyname)) return SDLK_F7;
+    else if(!strcmp("f8", keyname)) return SDLK_F8;
+    else if(!strcmp("f9", keyname)) return SDLK_F9;
+    else if(!strcmp("f10", keyname)) return SDLK_F10;
+    else if(!strcmp("f11", keyname)) return SDLK_F11;
+    else if(!strcmp("f12", keyname)) return SDLK_F12;
     else if(!strcmp("space", keyname)) return SDLK_SPACE;
     else if(!strcmp("rshift", keyname)) return SDLK_RSHIFT;
     else if(!strcmp("lshift", keyname)) return SDLK_LSHIFT;
@@ -118,18 +134,75 @@ static void set_sdl_keys() {
 
     key_throttle = sdl_get_key(config_file.throttle);
     if(key_throttle == SDLK_UNKNOWN) key_throttle = SDLK_SPACE;
+
+    key_save_state = sdl_get_key(config_file.save_state);
+    if(key_save_state == SDLK_UNKNOWN) key_save_state = SDLK_F5;
+
+    key_load_state = sdl_get_key(config_file.load_state);
+    if(key_load_state == SDLK_UNKNOWN) key_load_state = SDLK_F9;
+
+    key_rewind = sdl_get_key(config_file.rewind);
+    if(key_rewind == SDLK_UNKNOWN) key_rewind = SDLK_BACKSPACE;
+
+    key_boot_mark = sdl_get_key(config_file.boot_mark);
+    if(key_boot_mark == SDLK_UNKNOWN) key_boot_mark = SDLK_F6;
 }
 
-inline void delay(int ms) {
+static inline void delay(int ms) {
     SDL_Delay(ms);
 }
 
-void destroy_window() {
-    SDL_DestroyWindow(window);
+// runs on SDL's audio thread; only touches the sample ring
+static void audio_callback(void *userdata, Uint8 *stream, int len) {
+    int16_t *buffer = (int16_t *)stream;
+    int frames = len / 4;
+    int count = sound_read_samples(buffer, frames);
+
+    // underrun, play silence rather than stale data
+    if(count < frames) memset(buffer + (count * 2), 0, (frames - count) * 4);
+}
+
+static void open_audio() {
+    SDL_AudioSpec want, have;
+
+    memset(&want, 0, sizeof(SDL_AudioSpec));
+    want.freq = SOUND_SAMPLE_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 2;
+    want.samples = 512;
+    want.callback = audio_callback;
+
+    audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if(!audio_device) {
+        write_log("couldn't open SDL audio device, continuing without sound: %s\n", SDL_GetError());
+        if(config_pacing == PACING_AUDIO) {
+            write_log("falling back to video pacing\n");
+            config_pacing = PACING_VIDEO;
+        }
+        return;
+    }
+
+    write_log("SDL audio: %d Hz, %d channels, %d samples per buffer\n", have.freq, have.channels, have.samples);
+
+    if(have.freq != SOUND_SAMPLE_RATE) sound_set_rate(have.freq);
+
+    // four device buffers leave room for the callback to run a bit late
+    if(config_pacing == PACING_AUDIO) {
+        audio_target = have.samples * 4;
+        audio_frame = (int)(((int64_t)gb->timing.main_cycles * have.freq) / GB_CPU_SPEED);
+        sound_set_rate_control(audio_target);
+        write_log("pacing emulation to the audio device, keeping %d samples buffered\n", audio_target);
+    }
+    SDL_PauseAudioDevice(audio_device, 0);
+}
+
+static void destroy_window(int status, const char *message) {
+    if(window) SDL_DestroyWindow(window);
+    window = NULL;
     SDL_Quit();
 }
 
-void update_window(uint32_t *framebuffer) {
+static void sdl_update_window(uint32_t *framebuffer) {
     void *src, *dst;
 
     if(surface->format->BytesPerPixel == 4) {
@@ -137,7 +210,7 @@ void update_window(uint32_t *framebuffer) {
         for(int i = 0; i < scaled_h; i++) {
             src = (void *)(framebuffer + (i * scaled_w));
 
-            if(!using_sgb_border) {
+            if(!gb->using_sgb_border) {
                 dst = (void *)(surface->pixels + (i * surface->pitch));
             } else {
                 dst = (void *)(surface->pixels + ((i + gb_y) * surface->pitch) + (gb_x * 4));
@@ -149,14 +222,14 @@ void update_window(uint32_t *framebuffer) {
     }
 
     //framecount++;
-    if(framecount > frameskip) {
+    if(gb->framecount > frameskip) {
         SDL_UpdateWindowSurface(window);
-        framecount = 0;
+        gb->framecount = 0;
         drawn_frames++;
     }
 }
 
-void update_border(uint32_t *framebuffer) {
+static void sdl_update_border(uint32_t *framebuffer) {
     void *src, *dst;
 
     if(surface->format->BytesPerPixel == 4) {
@@ -174,22 +247,211 @@ void update_border(uint32_t *framebuffer) {
     //SDL_UpdateWindowSurface(window);
 }
 
-void resize_sgb_window() {
+static void sdl_resize_sgb_window() {
     SDL_SetWindowSize(window, SGB_WIDTH*scaling, SGB_HEIGHT*scaling);
     SDL_SetWindowPosition(window, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED);
     surface = SDL_GetWindowSurface(window);
 }
 
+// converts the wall time of a host event into a master cycle; the first event
+// of a batch takes effect right away and the rest follow as far apart as they
+// were in real time, so input lags by at most one polling interval, i.e. a
+// frame, a vblank period or a scanline depending on input_poll
+static uint64_t event_cycle(Uint32 timestamp, Uint32 *first, uint64_t cycles) {
+    // movies and deterministic runs only change keys between frames
+    if(movie_mode == MOVIE_RECORD || config_deterministic) return cycles;
+
+    if(!*first || timestamp < *first) *first = timestamp;
+
+    uint64_t offset = timestamp - *first;   // ms
+    return cycles + (offset * (GB_CPU_SPEED / 1000) * target_speed / 100);
+}
+
+// called once per frame and, depending on input_poll, at every vblank or
+// scanline; never from a headless instance
+static void sdl_poll_input() {
+    SDL_Event e;
+    int key, is_down;
+    Uint32 first = 0;
+    uint64_t cycles = gb->total_cycles;
+
+    while(SDL_PollEvent(&e)) {
+        switch(e.type) {
+        case SDL_QUIT:
+            die(0, "");
+        case SDL_KEYDOWN:
+        case SDL_KEYUP:
+            is_down = (e.type == SDL_KEYDOWN);
+
+            key = 0;
+
+            // convert SDL keys to internal keys
+            // TODO: read these keys from a config file
+            /*switch(e.key.keysym.sym) {
+            case key_left:
+                key = JOYPAD_LEFT;
+                break;
+            case key_right:
+                key = JOYPAD_RIGHT;
+                break;
+            case key_up:
+                key = JOYPAD_UP;
+                break;
+            case key_down:
+                key = JOYPAD_DOWN;
+                break;
+            case key_a:
+                key = JOYPAD_A;
+                break;
+            case key_b:
+                key = JOYPAD_B;
+                break;
+            case key_start:
+                key = JOYPAD_START;
+                break;
+            case key_select:
+                key = JOYPAD_SELECT;
+                break;
+            case key_throttle:
+                if(is_down) throttle_enabled = 0;
+                else throttle_enabled = 1;
+            default:
+                key = 0;
+                break;
+            }*/
+
+            if(e.key.keysym.sym == key_left) key = JOYPAD_LEFT;
+            else if(e.key.keysym.sym == key_right) key = JOYPAD_RIGHT;
+            else if(e.key.keysym.sym == key_up) key = JOYPAD_UP;
+            else if(e.key.keysym.sym == key_down) key = JOYPAD_DOWN;
+            else if(e.key.keysym.sym == key_a) key = JOYPAD_A;
+            else if(e.key.keysym.sym == key_b) key = JOYPAD_B;
+            else if(e.key.keysym.sym == key_start) key = JOYPAD_START;
+            else if(e.key.keysym.sym == key_select) key = JOYPAD_SELECT;
+            else if(e.key.keysym.sym == key_throttle && !config_deterministic) {
+                if(is_down) {
+                    //write_log("disabling throttle\n");
+                    throttle_enabled = 0;
+                } else {
+                    //write_log("enabling throttle\n");
+                    throttle_enabled = 1;
+                }
+            } else if(e.key.keysym.sym == key_save_state && is_down && !e.key.repeat) save_state_pending = 1;
+            else if(e.key.keysym.sym == key_load_state && is_down && !e.key.repeat) load_state_pending = 1;
+            else if(e.key.keysym.sym == key_rewind) rewinding = is_down;
+            else if(e.key.keysym.sym == key_boot_mark && is_down && !e.key.repeat) boot_mark_pending = 1;
+            else if((e.key.keysym.sym == SDLK_PLUS || e.key.keysym.sym == SDLK_EQUALS) && is_down) next_palette();
+            else if(e.key.keysym.sym == SDLK_MINUS && is_down) prev_palette();
+            else key = 0;
+
+            // key repeat doesn't change what the game sees, and neither
+            // does anything the player does while a movie is playing
+            if(key && !e.key.repeat && movie_mode != MOVIE_PLAY) {
+                if(is_down) boot_cache_input();
+                joypad_queue(event_cycle(e.key.timestamp, &first, cycles), is_down, key);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// savestates are only taken and loaded between frames, even when input is
+// polled in the middle of one
+static void handle_savestates() {
+    if(boot_mark_pending) boot_cache_mark();
+    boot_mark_pending = 0;
+
+    if(!save_state_pending && !load_state_pending) return;
+
+    char *filename = calloc(strlen(rom_filename) + 7, 1);
+    if(!filename) die(-1, "unable to allocate memory for filename\n");
+
+    strcpy(filename, rom_filename);
+    strcat(filename, ".state");
+
+    if(save_state_pending) savestate_save(filename);
+    if(load_state_pending) savestate_load(filename);
+
+    save_state_pending = load_state_pending = 0;
+    free(filename);
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "usage: %s [--headless] [--deterministic] [--frames count] [--record movie | --play movie] [--record-hashes file | --check-hashes file] [--netplay player port host:port] [rom_name]\n", name);
+    exit(-1);
+}
+
+// runs flat out without a window, sound or host input, e.g. to benchmark a
+// movie, and reports how long it took
+static void run_headless(long frame_limit) {
+    Uint64 start = SDL_GetPerformanceCounter();
+    uint64_t start_cycles = gb->total_cycles;
+    long frames = 0;
+
+    while(!frame_limit || frames < frame_limit) {
+        if(!movie_frame()) break;
+        if(netplay_player) netplay_frame();
+        else runahead_frame();
+        hashes_frame();
+        frames++;
+    }
+
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    write_log("%ld frames in %.3f seconds, %.1f fps, %.1f%% speed\n", frames, seconds, frames / seconds,
+        ((double)(gb->total_cycles - start_cycles) * 100) / (GB_CPU_SPEED * seconds));
+
+    die(0, "");
+}
+
+static const gb_callbacks_t sdl_callbacks = {
+    .update_window = sdl_update_window,
+    .update_border = sdl_update_border,
+    .resize_sgb_window = sdl_resize_sgb_window,
+    .poll_input = sdl_poll_input,
+    .die = destroy_window,
+};
+
 int main(int argc, char **argv) {
     const char *extensions[3] = { "*.gb", "*.gbc", "*.dmg" };
+    char *movie_filename = NULL, *hashes_filename = NULL, *netplay_peer = NULL;
+    int movie = MOVIE_NONE, hashes = HASHES_NONE, deterministic = 0;
+    int netplay = 0, netplay_port = 0;
+    long frame_limit = 0, frames = 0;
+
+    gb_set_callbacks(&sdl_callbacks);
+
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--headless")) {
+            headless = 1;
+        } else if(!strcmp(argv[i], "--deterministic")) {
+            deterministic = 1;
+        } else if(!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            frame_limit = atol(argv[++i]);
+        } else if((!strcmp(argv[i], "--record") || !strcmp(argv[i], "--play")) && i + 1 < argc && !movie) {
+            movie = !strcmp(argv[i], "--record") ? MOVIE_RECORD : MOVIE_PLAY;
+            movie_filename = argv[++i];
+        } else if((!strcmp(argv[i], "--record-hashes") || !strcmp(argv[i], "--check-hashes")) && i + 1 < argc && !hashes) {
+            hashes = !strcmp(argv[i], "--record-hashes") ? HASHES_RECORD : HASHES_CHECK;
+            hashes_filename = argv[++i];
+        } else if(!strcmp(argv[i], "--netplay") && i + 3 < argc && !netplay) {
+            netplay = atoi(argv[++i]);
+            netplay_port = atoi(argv[++i]);
+            netplay_peer = argv[++i];
+            if(netplay != 1 && netplay != 2) usage(argv[0]);
+        } else if(argv[i][0] == '-' || rom_filename) {
+            usage(argv[0]);
+        } else {
+            rom_filename = argv[i];
+        }
+    }
+
+    if(!rom_filename) {
+        if(headless) usage(argv[0]);
 
-    if(argc != 2) {
-        //fprintf(stdout, "usage: %s rom_name\n", argv[0]);
-        //return -1;
         rom_filename = tinyfd_openFileDialog("Open ROM file", NULL, 3, extensions, "Game Boy ROM files", 0);
         if(!rom_filename) return -1;
-    } else {
-        rom_filename = argv[1];
     }
 
     open_log();
@@ -197,45 +459,45 @@ int main(int argc, char **argv) {
     set_sdl_keys();
 
     // open the rom
-    FILE *rom_file = fopen(rom_filename, "r");
-    if(!rom_file) {
-        write_log("unable to open %s for reading\n", argv[1]);
-        return -1;
-    }
-
-    fseek(rom_file, 0L, SEEK_END);
-    rom_size = ftell(rom_file);
-    fseek(rom_file, 0L, SEEK_SET);
-
-    write_log("loading rom from file %s, %d KiB\n", argv[1], rom_size/1024);
-
-    rom = malloc(rom_size);
-    if(!rom) {
-        write_log("unable to allocate memory\n");
-        fclose(rom_file);
-        return -1;
+    if(load_rom(rom_filename)) return -1;
+    if(movie) movie_open(movie_filename, movie);
+    if(hashes) hashes_open(hashes_filename, hashes);
+    if(netplay) netplay_open(netplay, netplay_port, netplay_peer);
+
+    if(deterministic) config_deterministic = 1;
+    if(config_deterministic) {
+        write_log("running in deterministic mode, emulation is not throttled\n");
+        config_input_poll = POLL_FRAME;
+        throttle_enabled = 0;
     }
 
-    if(!fread(rom, 1, rom_size, rom_file)) {
-        write_log("an error occured while reading from rom file\n");
-        fclose(rom_file);
-        free(rom);
-        return -1;
+    if(headless) {
+        memory_start();
+        cpu_start();
+        display_start();
+        timer_start();
+        sound_start();
+        serial_start();
+        runahead_start();
+        movie_start();
+        hashes_start();
+        netplay_start();
+        report_footprint();
+
+        run_headless(frame_limit);
     }
 
-    fclose(rom_file);
-
     // make the main window
-    if(SDL_Init(SDL_INIT_VIDEO) < 0) {
+    if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
         write_log("failed to init SDL: %s\n", SDL_GetError());
-        free(rom);
+        unload_rom();
         return -1;
     }
 
     window = SDL_CreateWindow("tinygb", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, GB_WIDTH*scaling, GB_HEIGHT*scaling, SDL_WINDOW_SHOWN);
     if(!window) {
         write_log("couldn't create SDL window: %s\n", SDL_GetError());
-        free(rom);
+        unload_rom();
         SDL_Quit();
         return -1;
     }
@@ -264,159 +526,50 @@ int main(int argc, char **argv) {
     display_start();
     timer_start();
     sound_start();
+    serial_start();
+    open_audio();
+    runahead_start();
+    rewind_start();
+    movie_start();
+    hashes_start();
+    netplay_start();
+    boot_cache_start();
+    report_footprint();
 
-    SDL_Event e;
-    int key, is_down;
-    time_t rawtime;
-    struct tm *timeinfo;
-    int sec = 500;  // any invalid number
     char new_title[256];
-    int percentage;
-    int throttle_underflow = 0;
-    int throttle_target = throttle_lo + SPEED_ALLOWANCE;
-
-    while(1) {
-        key = 0;
-        is_down = 0;
-
-        while(SDL_PollEvent(&e)) {
-            switch(e.type) {
-            case SDL_QUIT:
-                SDL_DestroyWindow(window);
-                SDL_Quit();
-                die(0, "");
-            case SDL_KEYDOWN:
-            case SDL_KEYUP:
-                is_down = (e.type == SDL_KEYDOWN);
+    pacer_stats_t stats;
 
-                key = 0;
+    pacer_start();
 
-                // convert SDL keys to internal keys
-                // TODO: read these keys from a config file
-                /*switch(e.key.keysym.sym) {
-                case key_left:
-                    key = JOYPAD_LEFT;
-                    break;
-                case key_right:
-                    key = JOYPAD_RIGHT;
-                    break;
-                case key_up:
-                    key = JOYPAD_UP;
-                    break;
-                case key_down:
-                    key = JOYPAD_DOWN;
-                    break;
-                case key_a:
-                    key = JOYPAD_A;
-                    break;
-                case key_b:
-                    key = JOYPAD_B;
-                    break;
-                case key_start:
-                    key = JOYPAD_START;
-                    break;
-                case key_select:
-                    key = JOYPAD_SELECT;
-                    break;
-                case key_throttle:
-                    if(is_down) throttle_enabled = 0;
-                    else throttle_enabled = 1;
-                default:
-                    key = 0;
-                    break;
-                }*/
-
-                if(e.key.keysym.sym == key_left) key = JOYPAD_LEFT;
-                else if(e.key.keysym.sym == key_right) key = JOYPAD_RIGHT;
-                else if(e.key.keysym.sym == key_up) key = JOYPAD_UP;
-                else if(e.key.keysym.sym == key_down) key = JOYPAD_DOWN;
-                else if(e.key.keysym.sym == key_a) key = JOYPAD_A;
-                else if(e.key.keysym.sym == key_b) key = JOYPAD_B;
-                else if(e.key.keysym.sym == key_start) key = JOYPAD_START;
-                else if(e.key.keysym.sym == key_select) key = JOYPAD_SELECT;
-                else if(e.key.keysym.sym == key_throttle) {
-                    if(is_down) {
-                        //write_log("disabling throttle\n");
-                        throttle_enabled = 0;
-                    } else {
-                        //write_log("enabling throttle\n");
-                        throttle_enabled = 1;
-                    }
-                } else if((e.key.keysym.sym == SDLK_PLUS || e.key.keysym.sym == SDLK_EQUALS) && is_down) next_palette();
-                else if(e.key.keysym.sym == SDLK_MINUS && is_down) prev_palette();
-                else key = 0;
+    while(!frame_limit || frames++ < frame_limit) {
+        boot_cache_frame();
+        sdl_poll_input();
+        handle_savestates();
 
-                break;
-            default:
-                break;
-            }
+        if(!movie_frame()) {
+            // the player takes over once the movie is done
+            movie_stop();
         }
 
-        if(key) joypad_handle(is_down, key);
-
-        for(timing.current_cycles = 0; timing.current_cycles < timing.main_cycles; ) {
-            cpu_cycle();
-            display_cycle();
-            timer_cycle();
+        if(!rewinding || !rewind_step()) {
+            if(netplay_player) netplay_frame();
+            else runahead_frame();
+            hashes_frame();
+            rewind_frame();
         }
 
+        // the audio device drains the ring in real time, so only sleep once
+        // it holds comfortably more than it needs
+        if(config_pacing == PACING_AUDIO && throttle_enabled) {
+            while(sound_buffered() > audio_target + audio_frame) delay(1);
+        }
 
-        time(&rawtime);
-        timeinfo = localtime(&rawtime);
+        pacer_frame(throttle_enabled && config_pacing == PACING_VIDEO);
 
-        if(sec != timeinfo->tm_sec) {
-            sec = timeinfo->tm_sec;
-            percentage = (drawn_frames * 1000) / 597;
-            sprintf(new_title, "tinygb (%d fps - %d%%)", drawn_frames, percentage);
+        if(pacer_stats(&stats)) {
+            sprintf(new_title, "tinygb (%d fps - %d%% - jitter %.2f ms)", drawn_frames, (int)(stats.speed + 0.5), stats.frame_jitter);
             SDL_SetWindowTitle(window, new_title);
 
-            // adjust cpu throttle according to acceptable fps (98%-102%)
-            if(throttle_enabled) {
-                if(percentage < throttle_lo) {
-                    // emulation is too slow
-                    if(!throttle_time) {
-                        // throttle_time--;
-
-                        if(!throttle_underflow) {
-                            throttle_underflow = 1;
-                            write_log("WARNING: CPU throttle interval has underflown, emulation may be too slow\n");
-                        }
-                    } else {
-                        //write_log("too slow; decreasing throttle time: %d\n", throttle_time);
-
-                        // this will speed up the speed adjustments for a more natural feel
-                        if(percentage < (throttle_target/3)) throttle_time /= 3;
-                        else if(percentage < (throttle_target/2)) throttle_time /= 2;
-                        else throttle_time--;
-                    }
-
-                    // prevent this from going too low
-                    if(throttle_time <= (THROTTLE_THRESHOLD/3)) {
-                        cycles_per_throttle += (cycles_per_throttle/5);     // delay 20% less often
-                        throttle_time = (THROTTLE_THRESHOLD/3);
-                    }
-                } else if(percentage > throttle_hi) {
-                    // emulation is too fast
-                    //write_log("too fast; increasing throttle time: %d\n", throttle_time);
-
-                    if(throttle_time) {
-                        // to make sure we're not multiplying zero
-                        if(percentage > (throttle_target*3)) throttle_time *= 3;
-                        else if(percentage > (throttle_target*2)) throttle_time *= 2;
-                        else throttle_time++;
-                    }
-                    else {
-                        throttle_time++;
-                    }
-
-                    // prevent unnecessary lag
-                    if(throttle_time > THROTTLE_THRESHOLD) {
-                        cycles_per_throttle -= (cycles_per_throttle/5);     // delay 20% more often
-                        throttle_time = THROTTLE_THRESHOLD;
-                    }
-                }
-            }
-
             drawn_frames = 0;
         }
     }